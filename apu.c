@@ -0,0 +1,705 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+#include "apu.h"
+#include "audio.h"
+
+// https://wiki.nesdev.com/w/index.php/APU
+
+#define PULSE1 0
+#define PULSE2 1
+#define TRIANGLE 2
+#define NOISE 3
+#define DMC 4
+
+static const uint8_t lengthTable[32] = {
+  10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+  12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t dutyTable[4][8] = {
+  { 0, 1, 0, 0, 0, 0, 0, 0 },
+  { 0, 1, 1, 0, 0, 0, 0, 0 },
+  { 0, 1, 1, 1, 1, 0, 0, 0 },
+  { 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+
+static const uint8_t triangleSequence[32] = {
+  15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+// NTSC, in CPU cycles
+static const uint16_t noisePeriods[16] = { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
+static const uint16_t dmcPeriods[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
+
+// how long the DMC's DMA holds the CPU up for each byte; really 1 to 4 depending on what the CPU was doing
+#define DMC_FETCH_STALL_CYCLES 4
+
+// How long the APU can go without being run when there's no IRQ or fetch coming. Listening, it's often enough for
+// runApu to keep audio frames under APU_MAX_OUTPUT_FRAME_CYCLES; not listening, it only has to keep cycle counts from
+// getting far enough apart to wrap.
+#define IDLE_CYCLES_LISTENING (APU_MAX_OUTPUT_FRAME_CYCLES / 2)
+#define IDLE_CYCLES_NOT_LISTENING (1 << 24)
+
+// when each step of the four and five step sequences happens, in CPU cycles from the start of the sequence
+static const unsigned int frameStepCycles[2][5] = {
+  { 7457, 14913, 22371, 29829, 0 },
+  { 7457, 14913, 22371, 29829, 37281 }
+};
+static const unsigned int frameSequenceLengths[2] = { 29830, 37282 };
+static const uint8_t frameSequenceSteps[2] = { 4, 5 };
+
+// The mixer's linear approximation (pulse 0.00752 per step, triangle 0.00851, noise 0.00494, DMC 0.00335), scaled so
+// every channel flat out comes to about half of what a 16 bit sample can hold.
+static const int channelWeights[APU_NUM_CHANNELS] = { 143, 143, 162, 94, 64 };
+
+static int envelopeVolume(const struct Envelope *envelope)
+{
+  return envelope->constantVolume ? envelope->volume : envelope->decay;
+}
+
+static void clockEnvelope(struct Envelope *envelope)
+{
+  if (envelope->start) {
+    envelope->start = false;
+    envelope->decay = 15;
+    envelope->divider = envelope->volume;
+  } else if (envelope->divider == 0) {
+    envelope->divider = envelope->volume;
+    if (envelope->decay > 0) {
+      envelope->decay--;
+    } else if (envelope->loop) {
+      envelope->decay = 15;
+    }
+  } else {
+    envelope->divider--;
+  }
+}
+
+static int sweepTarget(const struct PulseChannel *pulse, int channel)
+{
+  int change = pulse->timerPeriod >> pulse->sweepShift;
+  if (pulse->sweepNegate) {
+    // pulse 1 negates with ones' complement, pulse 2 with two's complement
+    return pulse->timerPeriod - change - (channel == PULSE1 ? 1 : 0);
+  }
+  return pulse->timerPeriod + change;
+}
+
+static bool isSweepMuting(const struct PulseChannel *pulse, int channel)
+{
+  return pulse->timerPeriod < 8 || sweepTarget(pulse, channel) > 0x7FF;
+}
+
+static bool isPulseMuted(const struct PulseChannel *pulse, int channel)
+{
+  return pulse->lengthCounter == 0 || isSweepMuting(pulse, channel);
+}
+
+static int pulseLevel(const struct PulseChannel *pulse, int channel)
+{
+  if (isPulseMuted(pulse, channel) || !dutyTable[pulse->duty][pulse->dutyStep]) {
+    return 0;
+  }
+  return envelopeVolume(&pulse->envelope);
+}
+
+static int triangleLevel(const struct TriangleChannel *triangle)
+{
+  // ultrasonic periods come out as a blur, so hold the middle rather than alias
+  return triangle->timerPeriod < 2 ? 7 : triangleSequence[triangle->step];
+}
+
+static int noiseLevel(const struct NoiseChannel *noise)
+{
+  if (noise->lengthCounter == 0 || (noise->shiftRegister & 0x01)) {
+    return 0;
+  }
+  return envelopeVolume(&noise->envelope);
+}
+
+// cycle has to be between apu->cycle and wherever the current catch up is running to
+static void setChannelLevel(struct APU *apu, int channel, int level, unsigned int cycle)
+{
+  int delta = level - apu->output.levels[channel];
+  if (delta != 0) {
+    addAudioDelta(apu->output.buffer, apu->output.cycles + (cycle - apu->cycle), delta * channelWeights[channel]);
+    apu->output.levels[channel] = level;
+  }
+}
+
+static void updateLevels(struct APU *apu)
+{
+  if (!apu->output.buffer) {
+    return;
+  }
+  setChannelLevel(apu, PULSE1, pulseLevel(&apu->pulse[0], PULSE1), apu->cycle);
+  setChannelLevel(apu, PULSE2, pulseLevel(&apu->pulse[1], PULSE2), apu->cycle);
+  setChannelLevel(apu, TRIANGLE, triangleLevel(&apu->triangle), apu->cycle);
+  setChannelLevel(apu, NOISE, noiseLevel(&apu->noise), apu->cycle);
+  setChannelLevel(apu, DMC, apu->dmc.outputLevel, apu->cycle);
+}
+
+static void updateIrqLine(struct APU *apu, struct Computer *state)
+{
+  // the APU is the only thing that raises IRQs, so once it has nothing to say the line is clear
+  if (!apu->frameInterrupt && !apu->dmcInterrupt) {
+    state->irqPending = false;
+  }
+}
+
+/*
+ * The run functions take a channel from apu->cycle to apu->cycle + elapsed. A timer clocks when its count of cycles
+ * left runs out, so it's always left at 1 or more.
+ */
+
+// how many times a timer with timerLeft cycles left clocks in the next elapsed cycles, leaving timerLeft updated
+static unsigned int skipTimer(unsigned int *timerLeft, unsigned int period, unsigned int elapsed)
+{
+  if (*timerLeft > elapsed) {
+    *timerLeft -= elapsed;
+    return 0;
+  }
+  unsigned int clocks = (elapsed - *timerLeft) / period + 1;
+  *timerLeft = *timerLeft + clocks * period - elapsed;
+  return clocks;
+}
+
+static void runPulse(struct APU *apu, int channel, unsigned int elapsed)
+{
+  struct PulseChannel *pulse = &apu->pulse[channel];
+  unsigned int period = (pulse->timerPeriod + 1) * 2;
+
+  if (!apu->output.buffer || isPulseMuted(pulse, channel) || envelopeVolume(&pulse->envelope) == 0) {
+    unsigned int clocks = skipTimer(&pulse->timer, period, elapsed);
+    pulse->dutyStep = (pulse->dutyStep + clocks) & 0x07;
+    return;
+  }
+
+  unsigned int time = pulse->timer;
+  for (; time <= elapsed; time += period) {
+    pulse->dutyStep = (pulse->dutyStep + 1) & 0x07;
+    setChannelLevel(apu, channel, pulseLevel(pulse, channel), apu->cycle + time);
+  }
+  pulse->timer = time - elapsed;
+}
+
+static void runTriangle(struct APU *apu, unsigned int elapsed)
+{
+  struct TriangleChannel *triangle = &apu->triangle;
+  unsigned int period = triangle->timerPeriod + 1;
+
+  if (triangle->linearCounter == 0 || triangle->lengthCounter == 0) {
+    skipTimer(&triangle->timer, period, elapsed);
+    return;
+  }
+  if (!apu->output.buffer || triangle->timerPeriod < 2) {
+    unsigned int clocks = skipTimer(&triangle->timer, period, elapsed);
+    triangle->step = (triangle->step + clocks) & 0x1F;
+    return;
+  }
+
+  unsigned int time = triangle->timer;
+  for (; time <= elapsed; time += period) {
+    triangle->step = (triangle->step + 1) & 0x1F;
+    setChannelLevel(apu, TRIANGLE, triangleSequence[triangle->step], apu->cycle + time);
+  }
+  triangle->timer = time - elapsed;
+}
+
+static void runNoise(struct APU *apu, unsigned int elapsed)
+{
+  struct NoiseChannel *noise = &apu->noise;
+
+  // nothing can tell where the shift register is, so it only moves while someone can hear it
+  if (!apu->output.buffer || noise->lengthCounter == 0 || envelopeVolume(&noise->envelope) == 0) {
+    skipTimer(&noise->timer, noise->timerPeriod, elapsed);
+    return;
+  }
+
+  int tap = noise->mode ? 6 : 1;
+  unsigned int time = noise->timer;
+  for (; time <= elapsed; time += noise->timerPeriod) {
+    uint16_t feedback = (noise->shiftRegister ^ (noise->shiftRegister >> tap)) & 0x01;
+    noise->shiftRegister = (noise->shiftRegister >> 1) | (feedback << 14);
+    setChannelLevel(apu, NOISE, noiseLevel(noise), apu->cycle + time);
+  }
+  noise->timer = time - elapsed;
+}
+
+static void restartDmcSample(struct DmcChannel *dmc)
+{
+  dmc->currentAddress = dmc->sampleAddress;
+  dmc->bytesRemaining = dmc->sampleLength;
+}
+
+// Fills the sample buffer if it's empty and there's more sample to play. This is the DMC's DMA; the CPU pays for it
+// once the instruction it's in the middle of is done (see apu->stallCycles).
+static void fetchDmcSample(struct APU *apu, struct Computer *state)
+{
+  struct DmcChannel *dmc = &apu->dmc;
+  if (!dmc->sampleBufferEmpty || dmc->bytesRemaining == 0) {
+    return;
+  }
+
+  dmc->sampleBuffer = readMemory(dmc->currentAddress, state);
+  dmc->sampleBufferEmpty = false;
+  apu->stallCycles += DMC_FETCH_STALL_CYCLES;
+  dmc->currentAddress = dmc->currentAddress == 0xFFFF ? 0x8000 : dmc->currentAddress + 1;
+  dmc->bytesRemaining--;
+
+  if (dmc->bytesRemaining == 0) {
+    if (dmc->loop) {
+      restartDmcSample(dmc);
+    } else if (dmc->irqEnabled) {
+      apu->dmcInterrupt = true;
+      triggerIrqInterrupt(state);
+    }
+  }
+}
+
+// The output unit has played all 8 bits of a byte: on to the one in the sample buffer, if there is one.
+static void startDmcOutputCycle(struct APU *apu, struct Computer *state)
+{
+  struct DmcChannel *dmc = &apu->dmc;
+  dmc->bitsRemaining = 8;
+  if (dmc->sampleBufferEmpty) {
+    dmc->silence = true;
+  } else {
+    dmc->silence = false;
+    dmc->shiftRegister = dmc->sampleBuffer;
+    dmc->sampleBufferEmpty = true;
+    fetchDmcSample(apu, state);
+  }
+}
+
+static void clockDmc(struct APU *apu, struct Computer *state, unsigned int cycle)
+{
+  struct DmcChannel *dmc = &apu->dmc;
+
+  if (!dmc->silence) {
+    if (dmc->shiftRegister & 0x01) {
+      if (dmc->outputLevel <= 125) {
+        dmc->outputLevel += 2;
+      }
+    } else if (dmc->outputLevel >= 2) {
+      dmc->outputLevel -= 2;
+    }
+    if (apu->output.buffer) {
+      setChannelLevel(apu, DMC, dmc->outputLevel, cycle);
+    }
+  }
+  dmc->shiftRegister >>= 1;
+
+  dmc->bitsRemaining--;
+  if (dmc->bitsRemaining == 0) {
+    startDmcOutputCycle(apu, state);
+  }
+}
+
+static void runDmc(struct APU *apu, struct Computer *state, unsigned int elapsed)
+{
+  struct DmcChannel *dmc = &apu->dmc;
+
+  // with no sample playing, all that moves is the count of bits until the next output cycle
+  if (dmc->silence && dmc->sampleBufferEmpty && dmc->bytesRemaining == 0) {
+    unsigned int clocks = skipTimer(&dmc->timer, dmc->timerPeriod, elapsed);
+    dmc->bitsRemaining = (uint8_t) ((dmc->bitsRemaining + 7 - clocks % 8) % 8 + 1);
+    return;
+  }
+
+  // Not listening, all the CPU can tell is when bytes get fetched, so go a byte at a time rather than a bit at a time.
+  // The output level stays where it is, like the noise channel's shift register.
+  if (!apu->output.buffer) {
+    unsigned int clocks = skipTimer(&dmc->timer, dmc->timerPeriod, elapsed);
+    while (clocks >= dmc->bitsRemaining) {
+      clocks -= dmc->bitsRemaining;
+      startDmcOutputCycle(apu, state);
+      if (dmc->silence && dmc->sampleBufferEmpty) {
+        clocks %= 8;  // the sample has run out, and every output cycle from here on is the same silent one
+      }
+    }
+    dmc->bitsRemaining = (uint8_t) (dmc->bitsRemaining - clocks);
+    return;
+  }
+
+  unsigned int time = dmc->timer;
+  for (; time <= elapsed; time += dmc->timerPeriod) {
+    clockDmc(apu, state, apu->cycle + time);
+  }
+  dmc->timer = time - elapsed;
+}
+
+static void runChannels(struct APU *apu, struct Computer *state, unsigned int end)
+{
+  unsigned int elapsed = end - apu->cycle;
+  runPulse(apu, PULSE1, elapsed);
+  runPulse(apu, PULSE2, elapsed);
+  runTriangle(apu, elapsed);
+  runNoise(apu, elapsed);
+  runDmc(apu, state, elapsed);
+
+  apu->output.cycles += elapsed;
+  apu->cycle = end;
+}
+
+static void clockQuarterFrame(struct APU *apu)
+{
+  clockEnvelope(&apu->pulse[0].envelope);
+  clockEnvelope(&apu->pulse[1].envelope);
+  clockEnvelope(&apu->noise.envelope);
+
+  struct TriangleChannel *triangle = &apu->triangle;
+  if (triangle->linearCounterReloadFlag) {
+    triangle->linearCounter = triangle->linearCounterReload;
+  } else if (triangle->linearCounter > 0) {
+    triangle->linearCounter--;
+  }
+  if (!triangle->control) {
+    triangle->linearCounterReloadFlag = false;
+  }
+}
+
+static void clockLengthCounter(uint8_t *lengthCounter, bool halt)
+{
+  if (*lengthCounter > 0 && !halt) {
+    (*lengthCounter)--;
+  }
+}
+
+static void clockSweep(struct PulseChannel *pulse, int channel)
+{
+  if (pulse->sweepDivider == 0 && pulse->sweepEnabled && pulse->sweepShift > 0 && !isSweepMuting(pulse, channel)) {
+    pulse->timerPeriod = (uint16_t) sweepTarget(pulse, channel);
+  }
+  if (pulse->sweepDivider == 0 || pulse->sweepReload) {
+    pulse->sweepDivider = pulse->sweepPeriod;
+    pulse->sweepReload = false;
+  } else {
+    pulse->sweepDivider--;
+  }
+}
+
+static void clockHalfFrame(struct APU *apu)
+{
+  clockLengthCounter(&apu->pulse[0].lengthCounter, apu->pulse[0].envelope.loop);
+  clockLengthCounter(&apu->pulse[1].lengthCounter, apu->pulse[1].envelope.loop);
+  clockLengthCounter(&apu->triangle.lengthCounter, apu->triangle.control);
+  clockLengthCounter(&apu->noise.lengthCounter, apu->noise.envelope.loop);
+  clockSweep(&apu->pulse[0], PULSE1);
+  clockSweep(&apu->pulse[1], PULSE2);
+}
+
+static void clockFrameCounter(struct APU *apu, struct Computer *state)
+{
+  int step = apu->frameStep;
+  if (apu->fiveStepMode) {
+    if (step != 3) {
+      clockQuarterFrame(apu);
+    }
+    if (step == 1 || step == 4) {
+      clockHalfFrame(apu);
+    }
+  } else {
+    clockQuarterFrame(apu);
+    if (step == 1 || step == 3) {
+      clockHalfFrame(apu);
+    }
+    if (step == 3 && !apu->irqInhibit) {
+      apu->frameInterrupt = true;
+      triggerIrqInterrupt(state);
+    }
+  }
+
+  apu->frameStep++;
+  if (apu->frameStep == frameSequenceSteps[apu->fiveStepMode]) {
+    apu->frameStep = 0;
+    apu->frameSequenceStart += frameSequenceLengths[apu->fiveStepMode];
+  }
+
+  updateLevels(apu);
+}
+
+static unsigned int nextFrameStepCycle(const struct APU *apu)
+{
+  return apu->frameSequenceStart + frameStepCycles[apu->fiveStepMode][apu->frameStep];
+}
+
+/*
+ * The CPU only has to hear from the APU for frame IRQs and DMC fetches (which can raise an IRQ, and hold the CPU up
+ * either way). Everything else it can see, the length counters and the interrupt flags in $4015, is worked out when it
+ * next touches a register, however long that is.
+ */
+static void scheduleNextEvent(struct APU *apu)
+{
+  if (apu->stallCycles > 0) {
+    apu->nextEventCycle = apu->cycle;
+    return;
+  }
+
+  unsigned int next = apu->cycle + (apu->output.buffer ? IDLE_CYCLES_LISTENING : IDLE_CYCLES_NOT_LISTENING);
+
+  if (!apu->fiveStepMode && !apu->irqInhibit) {
+    unsigned int frameInterrupt = apu->frameSequenceStart + frameStepCycles[0][3];
+    if ((int) (frameInterrupt - next) < 0) {
+      next = frameInterrupt;
+    }
+  }
+
+  const struct DmcChannel *dmc = &apu->dmc;
+  if (dmc->bytesRemaining > 0) {
+    // the next fetch happens when the output unit next empties the sample buffer
+    unsigned int fetch = apu->cycle + dmc->timer + (dmc->bitsRemaining - 1) * dmc->timerPeriod;
+    if ((int) (fetch - next) < 0) {
+      next = fetch;
+    }
+  }
+
+  apu->nextEventCycle = next;
+}
+
+// Catches the APU up to the CPU.
+void runApu(struct APU *apu, struct Computer *state)
+{
+  unsigned int target = state->totalCyclesCompleted;
+
+  while ((int) (target - apu->cycle) > 0) {
+    unsigned int frameStepCycle = nextFrameStepCycle(apu);
+    if ((int) (frameStepCycle - target) <= 0) {
+      runChannels(apu, state, frameStepCycle);
+      clockFrameCounter(apu, state);
+    } else {
+      runChannels(apu, state, target);
+    }
+  }
+
+  scheduleNextEvent(apu);
+
+  if (apu->output.buffer && apu->output.cycles > APU_MAX_OUTPUT_FRAME_CYCLES) {
+    endAudioFrame(apu->output.buffer, apu->output.cycles);
+    apu->output.cycles = 0;
+  }
+}
+
+static void startFrameSequence(struct APU *apu)
+{
+  apu->frameSequenceStart = apu->cycle;
+  apu->frameStep = 0;
+  if (apu->fiveStepMode) {
+    clockQuarterFrame(apu);
+    clockHalfFrame(apu);
+  }
+}
+
+// Everything but where the sound goes starts out as it is when the console is switched on.
+void powerOnApu(struct APU *apu, unsigned int cycle)
+{
+  struct ApuOutput output = apu->output;
+  memset(apu, 0, sizeof(struct APU));
+  apu->output = output;
+
+  apu->noise.timerPeriod = noisePeriods[0];
+  apu->noise.shiftRegister = 1;
+  apu->dmc.timerPeriod = dmcPeriods[0];
+  apu->dmc.sampleBufferEmpty = true;
+  apu->dmc.silence = true;
+  apu->dmc.bitsRemaining = 8;
+
+  apu->cycle = cycle;
+  startFrameSequence(apu);
+  scheduleNextEvent(apu);
+}
+
+// What the reset button does: as if $4015 was written with 0 and $4017 rewritten with what it last had.
+void resetApu(struct APU *apu, unsigned int cycle)
+{
+  apu->cycle = cycle;
+  apu->pulse[0].enabled = false;
+  apu->pulse[0].lengthCounter = 0;
+  apu->pulse[1].enabled = false;
+  apu->pulse[1].lengthCounter = 0;
+  apu->triangle.enabled = false;
+  apu->triangle.lengthCounter = 0;
+  apu->triangle.step = 0;
+  apu->noise.enabled = false;
+  apu->noise.lengthCounter = 0;
+  apu->dmc.bytesRemaining = 0;
+  apu->dmc.outputLevel &= 0x01;
+  apu->frameInterrupt = false;
+  apu->dmcInterrupt = false;
+  apu->stallCycles = 0;
+
+  startFrameSequence(apu);
+  updateLevels(apu);
+  scheduleNextEvent(apu);
+}
+
+static void writePulseRegister(struct PulseChannel *pulse, int reg, uint8_t value)
+{
+  switch (reg) {
+    case 0:
+      pulse->duty = value >> 6;
+      pulse->envelope.loop = value & 0x20;
+      pulse->envelope.constantVolume = value & 0x10;
+      pulse->envelope.volume = value & 0x0F;
+      break;
+    case 1:
+      pulse->sweepEnabled = value & 0x80;
+      pulse->sweepPeriod = (value >> 4) & 0x07;
+      pulse->sweepNegate = value & 0x08;
+      pulse->sweepShift = value & 0x07;
+      pulse->sweepReload = true;
+      break;
+    case 2:
+      pulse->timerPeriod = (pulse->timerPeriod & 0x0700) | value;
+      break;
+    case 3:
+      pulse->timerPeriod = (pulse->timerPeriod & 0x00FF) | ((value & 0x07) << 8);
+      if (pulse->enabled) {
+        pulse->lengthCounter = lengthTable[value >> 3];
+      }
+      pulse->dutyStep = 0;
+      pulse->envelope.start = true;
+      break;
+  }
+}
+
+// $4000-$4013, $4015 and $4017
+void writeApuRegister(struct APU *apu, unsigned int memoryAddress, uint8_t value, struct Computer *state)
+{
+  runApu(apu, state);
+
+  struct TriangleChannel *triangle = &apu->triangle;
+  struct NoiseChannel *noise = &apu->noise;
+  struct DmcChannel *dmc = &apu->dmc;
+
+  if (memoryAddress < 0x4008) {
+    writePulseRegister(&apu->pulse[(memoryAddress - 0x4000) / 4], memoryAddress % 4, value);
+  } else {
+    switch (memoryAddress) {
+      case 0x4008:
+        triangle->control = value & 0x80;
+        triangle->linearCounterReload = value & 0x7F;
+        break;
+      case 0x400A:
+        triangle->timerPeriod = (triangle->timerPeriod & 0x0700) | value;
+        break;
+      case 0x400B:
+        triangle->timerPeriod = (triangle->timerPeriod & 0x00FF) | ((value & 0x07) << 8);
+        if (triangle->enabled) {
+          triangle->lengthCounter = lengthTable[value >> 3];
+        }
+        triangle->linearCounterReloadFlag = true;
+        break;
+      case 0x400C:
+        noise->envelope.loop = value & 0x20;
+        noise->envelope.constantVolume = value & 0x10;
+        noise->envelope.volume = value & 0x0F;
+        break;
+      case 0x400E:
+        noise->mode = value & 0x80;
+        noise->timerPeriod = noisePeriods[value & 0x0F];
+        break;
+      case 0x400F:
+        if (noise->enabled) {
+          noise->lengthCounter = lengthTable[value >> 3];
+        }
+        noise->envelope.start = true;
+        break;
+      case 0x4010:
+        dmc->irqEnabled = value & 0x80;
+        dmc->loop = value & 0x40;
+        dmc->timerPeriod = dmcPeriods[value & 0x0F];
+        if (!dmc->irqEnabled) {
+          apu->dmcInterrupt = false;
+          updateIrqLine(apu, state);
+        }
+        break;
+      case 0x4011:
+        dmc->outputLevel = value & 0x7F;
+        break;
+      case 0x4012:
+        dmc->sampleAddress = 0xC000 | (value << 6);
+        break;
+      case 0x4013:
+        dmc->sampleLength = (value << 4) | 1;
+        break;
+      case 0x4015:
+        apu->pulse[0].enabled = value & 0x01;
+        apu->pulse[1].enabled = value & 0x02;
+        triangle->enabled = value & 0x04;
+        noise->enabled = value & 0x08;
+        if (!apu->pulse[0].enabled) {
+          apu->pulse[0].lengthCounter = 0;
+        }
+        if (!apu->pulse[1].enabled) {
+          apu->pulse[1].lengthCounter = 0;
+        }
+        if (!triangle->enabled) {
+          triangle->lengthCounter = 0;
+        }
+        if (!noise->enabled) {
+          noise->lengthCounter = 0;
+        }
+
+        if (value & 0x10) {
+          if (dmc->bytesRemaining == 0) {
+            restartDmcSample(dmc);
+            fetchDmcSample(apu, state);
+          }
+        } else {
+          dmc->bytesRemaining = 0;
+        }
+        apu->dmcInterrupt = false;
+        updateIrqLine(apu, state);
+        break;
+      case 0x4017:
+        apu->fiveStepMode = value & 0x80;
+        apu->irqInhibit = value & 0x40;
+        if (apu->irqInhibit) {
+          apu->frameInterrupt = false;
+          updateIrqLine(apu, state);
+        }
+        startFrameSequence(apu);
+        break;
+    }
+  }
+
+  updateLevels(apu);
+  scheduleNextEvent(apu);
+}
+
+// $4015. Reading it acknowledges the frame interrupt.
+uint8_t readApuStatus(struct APU *apu, struct Computer *state)
+{
+  runApu(apu, state);
+
+  uint8_t status = (apu->pulse[0].lengthCounter > 0) | ((apu->pulse[1].lengthCounter > 0) << 1) |
+    ((apu->triangle.lengthCounter > 0) << 2) | ((apu->noise.lengthCounter > 0) << 3) |
+    ((apu->dmc.bytesRemaining > 0) << 4) | (apu->frameInterrupt << 6) | (apu->dmcInterrupt << 7);
+
+  apu->frameInterrupt = false;
+  updateIrqLine(apu, state);
+  return status;
+}
+
+// From now on, sound goes into buffer (or nowhere, if it's null).
+void setApuOutput(struct APU *apu, struct AudioBuffer *buffer)
+{
+  apu->output.buffer = buffer;
+  memset(apu->output.levels, 0, sizeof(apu->output.levels));
+  apu->output.cycles = 0;
+  updateLevels(apu);
+}
+
+// Call once a frame: catches up and makes everything up to now available from the output buffer.
+void endApuFrame(struct APU *apu, struct Computer *state)
+{
+  runApu(apu, state);
+  if (apu->output.buffer) {
+    endAudioFrame(apu->output.buffer, apu->output.cycles);
+    apu->output.cycles = 0;
+  }
+}
@@ -0,0 +1,138 @@
+#ifndef FILE_APU_H_SEEN
+#define FILE_APU_H_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define APU_CLOCK_RATE 1789773
+#define APU_NUM_CHANNELS 5
+
+// how long an audio frame can get before the APU ends one itself, for when nobody is calling endApuFrame
+#define APU_MAX_OUTPUT_FRAME_CYCLES 60000
+
+struct Computer;
+struct AudioBuffer;
+
+struct Envelope
+{
+  bool start;
+  bool loop;  // also halts the length counter
+  bool constantVolume;
+  uint8_t volume;  // or the divider period, when the volume isn't constant
+  uint8_t divider;
+  uint8_t decay;
+};
+
+struct PulseChannel
+{
+  bool enabled;
+  struct Envelope envelope;
+  uint8_t duty;
+  uint8_t dutyStep;
+  uint16_t timerPeriod;
+  unsigned int timer;  // CPU cycles until the timer next clocks
+  uint8_t lengthCounter;
+
+  bool sweepEnabled;
+  bool sweepNegate;
+  bool sweepReload;
+  uint8_t sweepPeriod;
+  uint8_t sweepShift;
+  uint8_t sweepDivider;
+};
+
+struct TriangleChannel
+{
+  bool enabled;
+  bool control;  // also halts the length counter
+  bool linearCounterReloadFlag;
+  uint8_t linearCounterReload;
+  uint8_t linearCounter;
+  uint16_t timerPeriod;
+  unsigned int timer;
+  uint8_t step;
+  uint8_t lengthCounter;
+};
+
+struct NoiseChannel
+{
+  bool enabled;
+  struct Envelope envelope;
+  bool mode;
+  uint16_t timerPeriod;  // in CPU cycles, straight from the period table
+  unsigned int timer;
+  uint16_t shiftRegister;
+  uint8_t lengthCounter;
+};
+
+struct DmcChannel
+{
+  bool irqEnabled;
+  bool loop;
+  uint16_t timerPeriod;  // in CPU cycles
+  unsigned int timer;
+  uint8_t outputLevel;
+
+  uint16_t sampleAddress;
+  uint16_t sampleLength;
+  uint16_t currentAddress;
+  uint16_t bytesRemaining;
+  uint8_t sampleBuffer;
+  bool sampleBufferEmpty;
+
+  uint8_t shiftRegister;
+  uint8_t bitsRemaining;
+  bool silence;
+};
+
+// Where the sound goes. None of this is part of the emulated state: forks and save states leave it alone.
+struct ApuOutput
+{
+  struct AudioBuffer *buffer;  // null when nobody is listening
+  int levels[APU_NUM_CHANNELS];  // what the buffer has been told each channel is at
+  unsigned int cycles;  // CPU cycles into the current audio frame
+};
+
+/*
+ * The APU is run lazily. Nothing happens per CPU cycle: it catches up to the CPU when a register is touched, when the
+ * frame counter or the DMC is due to do something the CPU could notice (an IRQ, a sample fetch), and at the end of each
+ * frame. Catching up runs each channel from one timer clock to the next rather than cycle by cycle, and when there's
+ * an output buffer, every change in a channel's level goes in as a delta at the cycle it happened (see audio.h).
+ * Channels that can't be heard, or aren't being listened to, skip straight to where their timers would end up.
+ *
+ * With no output buffer, what's left is only what the CPU can see: the length counters and interrupt flags it reads
+ * from $4015, when IRQs happen, and when DMC fetches hold it up. A game that leaves the frame IRQ off and plays no
+ * samples only runs the APU when it touches a register.
+ *
+ * Cycle counts are state->totalCyclesCompleted values, which wrap, so they're only ever compared by subtracting.
+ */
+struct APU
+{
+  struct PulseChannel pulse[2];
+  struct TriangleChannel triangle;
+  struct NoiseChannel noise;
+  struct DmcChannel dmc;
+
+  bool fiveStepMode;
+  bool irqInhibit;
+  bool frameInterrupt;
+  bool dmcInterrupt;
+  uint8_t frameStep;
+  unsigned int frameSequenceStart;
+
+  unsigned int cycle;           // the CPU cycle the APU has caught up to
+  unsigned int nextEventCycle;  // when runApu next has to run even if nothing touches a register
+  unsigned int stallCycles;     // what DMC fetches have cost the CPU that it hasn't paid yet; 0 between instructions
+
+  struct ApuOutput output;
+};
+
+void powerOnApu(struct APU *apu, unsigned int cycle);
+void resetApu(struct APU *apu, unsigned int cycle);
+void runApu(struct APU *apu, struct Computer *state);
+void writeApuRegister(struct APU *apu, unsigned int memoryAddress, uint8_t value, struct Computer *state);
+uint8_t readApuStatus(struct APU *apu, struct Computer *state);
+void setApuOutput(struct APU *apu, struct AudioBuffer *buffer);
+void endApuFrame(struct APU *apu, struct Computer *state);
+
+#endif /* !FILE_APU_H_SEEN */
@@ -0,0 +1,193 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "audio.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define AUDIO_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// how quickly the running sum forgets DC offset: a high-pass at about sampleRate / (2 pi 2^BASS_SHIFT), 15 Hz at 48 kHz
+#define BASS_SHIFT 9
+
+#define PI 3.14159265358979323846
+
+/*
+ * cutoff is a fraction of the output's Nyquist frequency. A narrower kernel has a wider transition band, so the
+ * fast one cuts off lower to keep what it lets through from folding back down into what can be heard.
+ */
+static const struct
+{
+  int width;
+  double cutoff;
+} qualities[AUDIO_NUM_QUALITIES] = {
+  { 8, 0.6 },
+  { 16, 0.9 },
+  { 32, 0.9 }
+};
+
+/*
+ * Row p is the band-limited step for a change landing p/AUDIO_KERNEL_PHASES of the way between two samples: a
+ * Blackman-windowed sinc, centred width / 2 samples later. Each row adds up to exactly 1 << AUDIO_KERNEL_BITS so that
+ * steps always settle at exactly the size of the change.
+ */
+static void buildKernel(struct AudioBuffer *buffer, int width, double cutoff)
+{
+  const double halfWidth = width / 2;
+
+  for (int phase = 0; phase < AUDIO_KERNEL_PHASES; phase++) {
+    double taps[AUDIO_MAX_KERNEL_WIDTH];
+    double sum = 0;
+    for (int i = 0; i < width; i++) {
+      double x = i - halfWidth - (double) phase / AUDIO_KERNEL_PHASES;
+      double sinc = x == 0 ? 1 : sin(PI * cutoff * x) / (PI * cutoff * x);
+      double window = 0.42 + 0.5 * cos(PI * x / halfWidth) + 0.08 * cos(2 * PI * x / halfWidth);
+      taps[i] = sinc * window;
+      sum += taps[i];
+    }
+
+    int total = 0;
+    for (int i = 0; i < width; i++) {
+      buffer->kernel[phase][i] = (int16_t) lround(taps[i] / sum * (1 << AUDIO_KERNEL_BITS));
+      total += buffer->kernel[phase][i];
+    }
+    buffer->kernel[phase][width / 2] += (int16_t) ((1 << AUDIO_KERNEL_BITS) - total);
+  }
+}
+
+/**
+ *
+ * quality is one of the AUDIO_QUALITY_* values.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: Unknown quality.
+ *
+ */
+int createAudioBuffer(struct AudioBuffer **buffer, int sampleRate, int clockRate, int capacity, int quality)
+{
+  if (quality < 0 || quality >= AUDIO_NUM_QUALITIES) {
+    return 2;
+  }
+
+  struct AudioBuffer *newBuffer = (struct AudioBuffer *) calloc(1, sizeof(struct AudioBuffer));
+  if (!newBuffer) {
+    return 1;
+  }
+
+  newBuffer->kernelWidth = qualities[quality].width;
+  newBuffer->deltas = (int32_t *) calloc(2 * capacity + newBuffer->kernelWidth, sizeof(int32_t));
+  if (!newBuffer->deltas) {
+    free(newBuffer);
+    return 1;
+  }
+
+  newBuffer->nominalSamplesPerClock = ((uint64_t) sampleRate << 32) / clockRate;
+  newBuffer->samplesPerClock = newBuffer->nominalSamplesPerClock;
+  newBuffer->capacity = capacity;
+  buildKernel(newBuffer, newBuffer->kernelWidth, qualities[quality].cutoff);
+
+  *buffer = newBuffer;
+  return 0;
+}
+
+// delta is in the same units as the samples that come out
+void addAudioDelta(struct AudioBuffer *buffer, unsigned int clockTime, int delta)
+{
+  uint64_t position = buffer->frameStart + clockTime * buffer->samplesPerClock;
+  size_t index = (size_t) (position >> 32);
+  if (index >= (size_t) (2 * buffer->capacity)) {
+    return;  // the frame ran on for longer than there's room for
+  }
+
+  const int16_t *kernel = buffer->kernel[(position >> (32 - AUDIO_KERNEL_PHASE_BITS)) & (AUDIO_KERNEL_PHASES - 1)];
+  int32_t *deltas = buffer->deltas + index;
+  const int width = buffer->kernelWidth;
+  if ((int) index + width > buffer->used) {
+    buffer->used = (int) index + width;
+  }
+
+#ifdef AUDIO_SSE2
+  // 8 taps at a time: SSE2 has no 32 bit multiply, but the low and high halves of 16 x 16 bit products interleave
+  // into exactly the 32 bit ones
+  if (delta >= INT16_MIN && delta <= INT16_MAX) {
+    const __m128i multiplier = _mm_set1_epi16((int16_t) delta);
+    for (int i = 0; i < width; i += 8) {
+      __m128i taps = _mm_loadu_si128((const __m128i *) (kernel + i));
+      __m128i low = _mm_mullo_epi16(taps, multiplier);
+      __m128i high = _mm_mulhi_epi16(taps, multiplier);
+      __m128i *out = (__m128i *) (deltas + i);
+      _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(low, high)));
+      _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(low, high)));
+    }
+    return;
+  }
+#endif
+
+  for (int i = 0; i < width; i++) {
+    deltas[i] += kernel[i] * delta;
+  }
+}
+
+void endAudioFrame(struct AudioBuffer *buffer, unsigned int clocks)
+{
+  buffer->frameStart += clocks * buffer->samplesPerClock;
+
+  int excess = audioSamplesAvailable(buffer) - buffer->capacity;
+  if (excess > 0) {
+    readAudioSamples(buffer, NULL, excess);
+  }
+}
+
+/*
+ * Makes slightly more (positive) or fewer (negative) samples per clock than the sample rate asked for, for keeping a
+ * sound card that runs at its own pace fed (see audioring.h). Only call it between frames.
+ */
+void setAudioRateAdjustment(struct AudioBuffer *buffer, int partsPerMillion)
+{
+  int64_t adjustment = (int64_t) buffer->nominalSamplesPerClock / 1000000 * partsPerMillion;
+  buffer->samplesPerClock = (uint64_t) ((int64_t) buffer->nominalSamplesPerClock + adjustment);
+}
+
+int audioSamplesAvailable(const struct AudioBuffer *buffer)
+{
+  return (int) (buffer->frameStart >> 32);
+}
+
+// Returns how many samples were read. samples can be null to throw them away.
+int readAudioSamples(struct AudioBuffer *buffer, int16_t *samples, int maxSamples)
+{
+  int count = audioSamplesAvailable(buffer);
+  if (count > maxSamples) {
+    count = maxSamples;
+  }
+
+  int32_t integrator = buffer->integrator;
+  for (int i = 0; i < count; i++) {
+    int32_t sample = integrator >> AUDIO_KERNEL_BITS;
+    integrator += buffer->deltas[i];
+    integrator -= sample * (1 << (AUDIO_KERNEL_BITS - BASS_SHIFT));
+
+    if (samples) {
+      samples[i] = (int16_t) (sample < INT16_MIN ? INT16_MIN : (sample > INT16_MAX ? INT16_MAX : sample));
+    }
+  }
+  buffer->integrator = integrator;
+
+  // what's left includes anything already added for the frame in progress; past used there's nothing to move
+  int kept = buffer->used > count ? buffer->used - count : 0;
+  memmove(buffer->deltas, buffer->deltas + count, kept * sizeof(int32_t));
+  memset(buffer->deltas + kept, 0, (buffer->used - kept) * sizeof(int32_t));
+  buffer->used = kept;
+  buffer->frameStart -= (uint64_t) count << 32;
+
+  return count;
+}
+
+void freeAudioBuffer(struct AudioBuffer *buffer)
+{
+  free(buffer->deltas);
+  free(buffer);
+}
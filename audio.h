@@ -0,0 +1,54 @@
+#ifndef FILE_AUDIO_H_SEEN
+#define FILE_AUDIO_H_SEEN
+
+#include <stdint.h>
+
+#define AUDIO_KERNEL_PHASE_BITS 5
+#define AUDIO_KERNEL_PHASES (1 << AUDIO_KERNEL_PHASE_BITS)
+#define AUDIO_MAX_KERNEL_WIDTH 32
+#define AUDIO_KERNEL_BITS 14
+
+// how many samples each change is spread over: 8, 16 or 32. Wider is a sharper filter with less aliasing, and slower.
+#define AUDIO_QUALITY_FAST 0
+#define AUDIO_QUALITY_GOOD 1
+#define AUDIO_QUALITY_BEST 2
+#define AUDIO_NUM_QUALITIES 3
+
+/*
+ * Band-limited resampling from a fast clock (the CPU's) down to a sample rate, done the way blargg's blip_buf does it.
+ * Instead of producing the signal one clock at a time, whoever is making the sound adds the amount it changes by at
+ * the clock it changes on (addAudioDelta). Each change is added into the buffer as a band-limited step: a windowed
+ * sinc picked for where between two samples the change lands. Turning the buffer into samples is then a running sum.
+ *
+ * Work is proportional to how many times the signal changes, not to how many clocks go by, and there's no aliasing
+ * from square waves being sampled at a rate they don't divide into. Each change costs one row of the kernel (8 to 32
+ * multiply-adds depending on the quality, done 8 at a time with SSE2 on x86-64); each sample out costs one step of the
+ * running sum. audio_benchmark.c times both.
+ *
+ * Clock times are relative to the start of the current frame; endAudioFrame says how long that frame was, which makes
+ * that many clocks worth of samples available to readAudioSamples. A frame can't be longer than capacity samples.
+ * Samples nobody reads pile up to capacity and then the oldest are thrown away.
+ */
+struct AudioBuffer
+{
+  uint64_t nominalSamplesPerClock;  // 32.32 fixed point
+  uint64_t samplesPerClock;         // the nominal rate nudged by setAudioRateAdjustment
+  uint64_t frameStart;              // where clock 0 of the current frame lands, in samples, 32.32 fixed point
+  int capacity;                     // samples that can be waiting to be read
+  int32_t *deltas;                  // 2 * capacity + kernelWidth of them
+  int used;                         // deltas from here on are all still zero
+  int32_t integrator;
+
+  int kernelWidth;
+  int16_t kernel[AUDIO_KERNEL_PHASES][AUDIO_MAX_KERNEL_WIDTH];  // only the first kernelWidth of each row are used
+};
+
+int createAudioBuffer(struct AudioBuffer **buffer, int sampleRate, int clockRate, int capacity, int quality);
+void addAudioDelta(struct AudioBuffer *buffer, unsigned int clockTime, int delta);
+void endAudioFrame(struct AudioBuffer *buffer, unsigned int clocks);
+void setAudioRateAdjustment(struct AudioBuffer *buffer, int partsPerMillion);
+int audioSamplesAvailable(const struct AudioBuffer *buffer);
+int readAudioSamples(struct AudioBuffer *buffer, int16_t *samples, int maxSamples);
+void freeAudioBuffer(struct AudioBuffer *buffer);
+
+#endif /* !FILE_AUDIO_H_SEEN */
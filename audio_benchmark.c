@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "apu.h"
+#include "audio.h"
+#include "platform.h"
+
+/*
+ * Times turning the APU's level changes into samples, at each quality, without the rest of the emulator.
+ *
+ *   audio_benchmark [sample rate] [seconds of sound]
+ *
+ * Defaults to 48000 Hz and 60 seconds. The changes are a busy piece of music: two pulse channels, the triangle at
+ * the top of its range and noise at its fastest, which is far more changes than most games make. Reports ns per
+ * sample out, ns per change in, and how many times faster than real time that is.
+ */
+
+#define FRAME_CYCLES 29781
+#define FRAME_SAMPLES 4096
+
+struct BenchmarkChannel
+{
+  unsigned int period;  // CPU cycles between changes
+  int level;
+  unsigned int next;
+};
+
+int main(int argc, char **argv)
+{
+  int sampleRate = argc > 1 ? atoi(argv[1]) : 48000;
+  int seconds = argc > 2 ? atoi(argv[2]) : 60;
+  if (sampleRate <= 0 || seconds <= 0) {
+    printf("usage: audio_benchmark [sample rate] [seconds of sound]\n");
+    return 1;
+  }
+  int numFrames = (int) ((int64_t) seconds * APU_CLOCK_RATE / FRAME_CYCLES);
+
+  const char *qualityNames[AUDIO_NUM_QUALITIES] = { "fast", "good", "best" };
+  int16_t *samples = (int16_t *) malloc(FRAME_SAMPLES * sizeof(int16_t));
+  if (!samples) {
+    printf("Could not allocate memory\n");
+    return 1;
+  }
+
+  for (int quality = 0; quality < AUDIO_NUM_QUALITIES; quality++) {
+    struct AudioBuffer *buffer;
+    int error = createAudioBuffer(&buffer, sampleRate, APU_CLOCK_RATE, FRAME_SAMPLES, quality);
+    if (error) {
+      printf("Error creating the audio buffer: %d\n", error);
+      return 1;
+    }
+
+    // periods are in CPU cycles; levels are roughly what the mixer makes of a channel at full volume
+    struct BenchmarkChannel channels[] = {
+      { 2034, 2145, 0 },  // A4 square
+      { 1357, 2145, 0 },  // E5 square
+      { 127, 1500, 0 },   // A4 triangle, one of its 32 steps at a time
+      { 8, 960, 0 }       // noise at its fastest, which changes about every other clock of its timer
+    };
+    const int numChannels = sizeof(channels) / sizeof(channels[0]);
+
+    int64_t numDeltas = 0;
+    int64_t numSamples = 0;
+    int32_t checksum = 0;
+    uint64_t startTime = getTimeInNanoseconds();
+    for (int frame = 0; frame < numFrames; frame++) {
+      for (int i = 0; i < numChannels; i++) {
+        struct BenchmarkChannel *channel = &channels[i];
+        while (channel->next < FRAME_CYCLES) {
+          addAudioDelta(buffer, channel->next, -2 * channel->level);
+          channel->level = -channel->level;
+          channel->next += channel->period;
+          numDeltas++;
+        }
+        channel->next -= FRAME_CYCLES;
+      }
+      endAudioFrame(buffer, FRAME_CYCLES);
+      int count = readAudioSamples(buffer, samples, FRAME_SAMPLES);
+      checksum += samples[count / 2];
+      numSamples += count;
+    }
+    uint64_t elapsed = getTimeInNanoseconds() - startTime;
+
+    double realTime = (double) numFrames * FRAME_CYCLES / APU_CLOCK_RATE * 1000000000.0;
+    printf("%-4s %2d taps: %6.2f ns/sample, %5.2f ns/change, %6.0fx real time (%.1f changes/sample, checksum %d)\n",
+        qualityNames[quality], buffer->kernelWidth, (double) elapsed / numSamples, (double) elapsed / numDeltas,
+        realTime / elapsed, (double) numDeltas / numSamples, checksum);
+
+    freeAudioBuffer(buffer);
+  }
+
+  free(samples);
+  return 0;
+}
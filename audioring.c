@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "audioring.h"
+
+/**
+ *
+ * capacity is in samples.
+ *
+ * Returns error code:
+ *  1: capacity isn't a power of two.
+ *  2: Could not allocate memory.
+ *
+ */
+int createAudioRing(struct AudioRing **ring, int capacity)
+{
+  if (capacity <= 0 || (capacity & (capacity - 1)) != 0) {
+    return 1;
+  }
+
+  struct AudioRing *newRing = (struct AudioRing *) calloc(1, sizeof(struct AudioRing));
+  if (!newRing) {
+    return 2;
+  }
+
+  newRing->samples = (int16_t *) calloc(capacity, sizeof(int16_t));
+  if (!newRing->samples) {
+    free(newRing);
+    return 2;
+  }
+  newRing->capacity = capacity;
+
+  *ring = newRing;
+  return 0;
+}
+
+// Only the producer calls this. Returns how many samples fit.
+int writeAudioRing(struct AudioRing *ring, const int16_t *samples, int numSamples)
+{
+  uint32_t written = (uint32_t) ring->written;
+  uint32_t read = (uint32_t) atomicLoad32(&ring->read);
+  int space = ring->capacity - (int) (written - read);
+  if (numSamples > space) {
+    numSamples = space;
+  }
+
+  int start = (int) (written & (uint32_t) (ring->capacity - 1));
+  int firstPart = ring->capacity - start;
+  if (firstPart > numSamples) {
+    firstPart = numSamples;
+  }
+  memcpy(ring->samples + start, samples, firstPart * sizeof(int16_t));
+  memcpy(ring->samples, samples + firstPart, (numSamples - firstPart) * sizeof(int16_t));
+
+  atomicStore32(&ring->written, (int32_t) (written + numSamples));
+  return numSamples;
+}
+
+// Only the consumer calls this. Returns how many samples there were.
+int readAudioRing(struct AudioRing *ring, int16_t *samples, int maxSamples)
+{
+  uint32_t read = (uint32_t) ring->read;
+  uint32_t written = (uint32_t) atomicLoad32(&ring->written);
+  int available = (int) (written - read);
+  if (maxSamples > available) {
+    maxSamples = available;
+  }
+
+  int start = (int) (read & (uint32_t) (ring->capacity - 1));
+  int firstPart = ring->capacity - start;
+  if (firstPart > maxSamples) {
+    firstPart = maxSamples;
+  }
+  memcpy(samples, ring->samples + start, firstPart * sizeof(int16_t));
+  memcpy(samples + firstPart, ring->samples, (maxSamples - firstPart) * sizeof(int16_t));
+
+  atomicStore32(&ring->read, (int32_t) (read + maxSamples));
+  return maxSamples;
+}
+
+// Either side can ask. It's only a snapshot: the other side may have moved on by the time it's used.
+int audioRingFill(struct AudioRing *ring)
+{
+  uint32_t read = (uint32_t) atomicLoad32(&ring->read);
+  uint32_t written = (uint32_t) atomicLoad32(&ring->written);
+  return (int) (written - read);
+}
+
+void freeAudioRing(struct AudioRing *ring)
+{
+  free(ring->samples);
+  free(ring);
+}
@@ -0,0 +1,37 @@
+#ifndef FILE_AUDIORING_H_SEEN
+#define FILE_AUDIORING_H_SEEN
+
+#include <stdint.h>
+
+/*
+ * Samples on their way from the emulator to the sound card: a ring with exactly one thread writing into it and one
+ * thread reading out of it, and no locks. Each side only ever moves its own count (with a release store, after the
+ * samples are in or out) and only looks at the other's (with an acquire load), so neither can see a sample before
+ * it's really there or overwrite one before it's really gone.
+ *
+ * The counts are totals that wrap; capacity is a power of two so that they can be turned into indexes with a mask, and
+ * the amount queued is always just written - read. They're kept on different cache lines so the two threads don't
+ * keep taking the same line away from each other.
+ *
+ * Neither side ever waits. A write that doesn't fit is cut short and a read of more than is there comes back short;
+ * both say how many samples they actually moved.
+ */
+struct AudioRing
+{
+  int16_t *samples;
+  int32_t capacity;
+
+  uint8_t writerLine[64];
+  volatile int32_t written;
+  uint8_t readerLine[64];
+  volatile int32_t read;
+  uint8_t endLine[64];
+};
+
+int createAudioRing(struct AudioRing **ring, int capacity);
+int writeAudioRing(struct AudioRing *ring, const int16_t *samples, int numSamples);
+int readAudioRing(struct AudioRing *ring, int16_t *samples, int maxSamples);
+int audioRingFill(struct AudioRing *ring);
+void freeAudioRing(struct AudioRing *ring);
+
+#endif /* !FILE_AUDIORING_H_SEEN */
@@ -0,0 +1,314 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "castleface.h"
+#include "platform.h"
+#include "observation.h"
+#include "batch.h"
+
+#define FRAMEBUFFER_PIXELS (EMULATOR_FRAMEBUFFER_WIDTH * EMULATOR_FRAMEBUFFER_HEIGHT)
+
+// trace is the buffer of the worker doing the stepping, which isn't always the one the emulator started out with
+static void stepEmulator(struct EmulatorBatch *batch, int index, struct TraceBuffer *trace)
+{
+  uint64_t traceStart = trace ? getTimeInNanoseconds() : 0;
+  struct Emulator *emulator = batch->emulators[index];
+  setEmulatorTrace(emulator, trace);
+  setEmulatorInput(emulator, batch->inputs[index]);
+  stepEmulatorFrame(emulator);
+  memcpy(batch->ram + (size_t) index * EMULATOR_RAM_SIZE, getEmulatorRam(emulator), EMULATOR_RAM_SIZE);
+
+  if (batch->pipelines) {
+    struct ObservationPipeline *pipeline = batch->pipelines[index];
+    observeFrame(pipeline, getEmulatorFramebuffer(emulator));
+    memcpy(batch->observations + index * batch->observationSize, pipeline->stack, batch->observationSize);
+  }
+
+  if (trace) {
+    addTraceSpanWithArg(trace, "step", traceStart, "emulator", index);
+  }
+}
+
+// Returns false once the worker has nothing left to give.
+static bool stepNextEmulatorOf(struct EmulatorBatch *batch, struct BatchWorker *worker, struct TraceBuffer *trace)
+{
+  int32_t index = atomicFetchAdd32(&worker->nextEmulator, 1);
+  if (index >= worker->endEmulator) {
+    return false;
+  }
+  stepEmulator(batch, index, trace);
+  return true;
+}
+
+static void batchWorker(void *argument)
+{
+  struct BatchWorker *worker = (struct BatchWorker *) argument;
+  struct EmulatorBatch *batch = worker->batch;
+  int generationDone = 0;
+
+  for (;;) {
+    lockMutex(&batch->mutex);
+    while (batch->generation == generationDone && !batch->stopping) {
+      waitConditionVariable(&batch->workReady, &batch->mutex);
+    }
+    if (batch->stopping) {
+      unlockMutex(&batch->mutex);
+      return;
+    }
+    generationDone = batch->generation;
+    unlockMutex(&batch->mutex);
+
+    while (stepNextEmulatorOf(batch, worker, worker->trace));
+
+    for (int i = 1; i < batch->numWorkers; i++) {
+      struct BatchWorker *victim = &batch->workers[(worker->index + i) % batch->numWorkers];
+      while (stepNextEmulatorOf(batch, victim, worker->trace));
+    }
+
+    lockMutex(&batch->mutex);
+    batch->numWorkersFinished++;
+    if (batch->numWorkersFinished == batch->numWorkers) {
+      signalConditionVariable(&batch->workDone);
+    }
+    unlockMutex(&batch->mutex);
+  }
+}
+
+/**
+ *
+ * romData is an iNES file in memory. numThreads of 0 means one per processor. Every emulator starts from power on.
+ *
+ * Returns error code:
+ *  1: Could not create an emulator from romData (see createEmulator).
+ *  2: Could not allocate memory.
+ *  3: Could not start a worker thread.
+ *  4: numEmulators is less than 1.
+ *
+ */
+int createEmulatorBatch(struct EmulatorBatch **batch, const uint8_t *romData, size_t romSize, int numEmulators, int numThreads, bool render)
+{
+  if (numEmulators < 1) {
+    return 4;
+  }
+  if (numThreads <= 0) {
+    numThreads = getProcessorCount();
+  }
+  if (numThreads > numEmulators) {
+    numThreads = numEmulators;
+  }
+
+  struct EmulatorBatch *newBatch = (struct EmulatorBatch *) calloc(1, sizeof(struct EmulatorBatch));
+  if (!newBatch) {
+    return 2;
+  }
+  initMutex(&newBatch->mutex);
+  initConditionVariable(&newBatch->workReady);
+  initConditionVariable(&newBatch->workDone);
+
+  newBatch->emulators = (struct Emulator **) calloc(numEmulators, sizeof(struct Emulator *));
+  newBatch->inputs = (uint8_t *) calloc(numEmulators, 1);
+  newBatch->ownRam = (uint8_t *) calloc((size_t) numEmulators, EMULATOR_RAM_SIZE);
+  newBatch->workers = (struct BatchWorker *) calloc(numThreads, sizeof(struct BatchWorker));
+  if (render) {
+    newBatch->ownFramebuffers = (uint32_t *) calloc((size_t) numEmulators, FRAMEBUFFER_PIXELS * sizeof(uint32_t));
+  }
+  newBatch->ram = newBatch->ownRam;
+  newBatch->framebuffers = newBatch->ownFramebuffers;
+  if (!newBatch->emulators || !newBatch->inputs || !newBatch->ram || !newBatch->workers || (render && !newBatch->framebuffers)) {
+    freeEmulatorBatch(newBatch);
+    return 2;
+  }
+
+  // the first emulator owns the ROM and the rest are clones of it, so all of them share one copy
+  for (int i = 0; i < numEmulators; i++) {
+    int error = i == 0 ? createEmulator(&newBatch->emulators[0], romData, romSize) : cloneEmulator(&newBatch->emulators[i], newBatch->emulators[0]);
+    if (error) {
+      freeEmulatorBatch(newBatch);
+      return i == 0 && error != 2 ? 1 : 2;
+    }
+    newBatch->numEmulators = i + 1;
+    setEmulatorFramebuffer(newBatch->emulators[i], render ? newBatch->framebuffers + (size_t) i * FRAMEBUFFER_PIXELS : NULL);
+  }
+
+  if (cloneEmulator(&newBatch->startingPoint, newBatch->emulators[0])) {
+    freeEmulatorBatch(newBatch);
+    return 2;
+  }
+
+  int numProcessors = getProcessorCount();
+  for (int i = 0; i < numThreads; i++) {
+    struct BatchWorker *worker = &newBatch->workers[i];
+    worker->batch = newBatch;
+    worker->index = i;
+    if (createThread(&worker->thread, batchWorker, worker)) {
+      freeEmulatorBatch(newBatch);
+      return 3;
+    }
+    newBatch->numWorkers = i + 1;
+    if (numThreads <= numProcessors) {
+      pinThreadToProcessor(&worker->thread, i);
+    }
+  }
+
+  *batch = newBatch;
+  return 0;
+}
+
+// Runs every emulator for one frame with its input from batch->inputs, and returns once they've all finished.
+void stepEmulatorBatch(struct EmulatorBatch *batch)
+{
+  lockMutex(&batch->mutex);
+
+  for (int i = 0; i < batch->numWorkers; i++) {
+    struct BatchWorker *worker = &batch->workers[i];
+    worker->nextEmulator = (int32_t) ((int64_t) batch->numEmulators * i / batch->numWorkers);
+    worker->endEmulator = (int32_t) ((int64_t) batch->numEmulators * (i + 1) / batch->numWorkers);
+  }
+
+  batch->numWorkersFinished = 0;
+  batch->generation++;
+  broadcastConditionVariable(&batch->workReady);
+
+  while (batch->numWorkersFinished < batch->numWorkers) {
+    waitConditionVariable(&batch->workDone, &batch->mutex);
+  }
+
+  unlockMutex(&batch->mutex);
+}
+
+// Sends one emulator back to power on. Call between steps.
+void restartBatchEmulator(struct EmulatorBatch *batch, int index)
+{
+  copyEmulatorState(batch->emulators[index], batch->startingPoint);
+  if (batch->pipelines) {
+    clearObservation(batch->pipelines[index]);
+  }
+}
+
+/**
+ *
+ * Has every step from now on also make an observation of each emulator's frame (see observation.h) into
+ * batch->observations. Call between steps.
+ *
+ * Returns error code:
+ *  1: The format doesn't make sense (see createObservationPipeline).
+ *  2: Could not allocate memory.
+ *  3: The batch was created without rendering, so there are no frames to observe.
+ *
+ */
+int observeEmulatorBatch(struct EmulatorBatch *batch, const struct ObservationFormat *format)
+{
+  if (!batch->ownFramebuffers) {
+    return 3;
+  }
+
+  struct ObservationPipeline **pipelines = (struct ObservationPipeline **) calloc(batch->numEmulators, sizeof(struct ObservationPipeline *));
+  if (!pipelines) {
+    return 2;
+  }
+
+  int error = 0;
+  for (int i = 0; i < batch->numEmulators && !error; i++) {
+    error = createObservationPipeline(&pipelines[i], format);
+  }
+
+  uint8_t *observations = NULL;
+  if (!error) {
+    observations = (uint8_t *) calloc(batch->numEmulators, observationSize(pipelines[0]));
+    error = observations ? 0 : 2;
+  }
+  if (error) {
+    for (int i = 0; i < batch->numEmulators; i++) {
+      if (pipelines[i]) {
+        freeObservationPipeline(pipelines[i]);
+      }
+    }
+    free(pipelines);
+    return error;
+  }
+
+  batch->pipelines = pipelines;
+  batch->observationSize = observationSize(pipelines[0]);
+  batch->observations = observations;
+  batch->ownObservations = observations;
+  return 0;
+}
+
+/*
+ * From the next step on, draw into framebuffers and copy RAM and observations into ram and observations (laid out the
+ * same as the batch's own arrays) instead of into the batch's own arrays. Null for any of them goes back to the
+ * batch's own. Call between steps.
+ */
+void setEmulatorBatchOutputs(struct EmulatorBatch *batch, uint32_t *framebuffers, uint8_t *ram, uint8_t *observations)
+{
+  batch->framebuffers = framebuffers ? framebuffers : batch->ownFramebuffers;
+  batch->ram = ram ? ram : batch->ownRam;
+  batch->observations = observations ? observations : batch->ownObservations;
+
+  for (int i = 0; i < batch->numEmulators; i++) {
+    setEmulatorFramebuffer(batch->emulators[i], batch->framebuffers ? batch->framebuffers + (size_t) i * FRAMEBUFFER_PIXELS : NULL);
+  }
+}
+
+/**
+ *
+ * Gives each worker a buffer in tracer's timeline (see trace.h) and from the next step on adds a span for every
+ * emulator each one steps, with the emulator's own frame, scanline and DMA spans inside. Call between steps, and only
+ * once. tracer has to outlive the batch.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: The tracer has no room for that many more threads.
+ *
+ */
+int traceEmulatorBatch(struct EmulatorBatch *batch, struct Tracer *tracer)
+{
+  for (int i = 0; i < batch->numWorkers; i++) {
+    // the workers are all waiting for the next step, which the batch's mutex hands this over with
+    int error = createTraceBuffer(&batch->workers[i].trace, tracer, "batch worker");
+    if (error) {
+      return error;
+    }
+  }
+  return 0;
+}
+
+void freeEmulatorBatch(struct EmulatorBatch *batch)
+{
+  if (batch->numWorkers > 0) {
+    lockMutex(&batch->mutex);
+    batch->stopping = true;
+    broadcastConditionVariable(&batch->workReady);
+    unlockMutex(&batch->mutex);
+
+    for (int i = 0; i < batch->numWorkers; i++) {
+      joinThread(&batch->workers[i].thread);
+    }
+  }
+  destroyConditionVariable(&batch->workDone);
+  destroyConditionVariable(&batch->workReady);
+  destroyMutex(&batch->mutex);
+
+  // clones share the first emulator's ROM, so it goes last
+  if (batch->startingPoint) {
+    destroyEmulator(batch->startingPoint);
+  }
+  for (int i = batch->numEmulators - 1; i >= 0; i--) {
+    destroyEmulator(batch->emulators[i]);
+  }
+
+  free(batch->emulators);
+  free(batch->inputs);
+  if (batch->pipelines) {
+    for (int i = 0; i < batch->numEmulators; i++) {
+      freeObservationPipeline(batch->pipelines[i]);
+    }
+    free(batch->pipelines);
+  }
+  free(batch->ownObservations);
+  free(batch->ownRam);
+  free(batch->ownFramebuffers);
+  free(batch->workers);
+  free(batch);
+}
@@ -0,0 +1,83 @@
+#ifndef FILE_BATCH_H_SEEN
+#define FILE_BATCH_H_SEEN
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "castleface.h"
+#include "observation.h"
+#include "platform.h"
+#include "trace.h"
+
+struct EmulatorBatch;
+
+struct BatchWorker
+{
+  struct Thread thread;
+  struct EmulatorBatch *batch;
+  int index;
+
+  // the emulators this worker starts out responsible for; other workers steal from the same counter once theirs run out
+  volatile int32_t nextEmulator;
+  int32_t endEmulator;
+
+  struct TraceBuffer *trace;  // null unless the batch is being traced
+};
+
+/*
+ * Lots of independent emulators of the same game, all advanced a frame at a time by a pool of threads (one per core,
+ * pinned to it where the platform allows).
+ *
+ * Each worker owns a contiguous slice of the emulators, so normally they each stay on their own core's cache. A worker
+ * that finishes its slice early steals what's left of the others', one emulator at a time, so a step takes as long as
+ * the slowest emulator rather than the slowest slice.
+ *
+ * Inputs and outputs are plain arrays indexed by emulator:
+ *   inputs        one byte per emulator (EMULATOR_BUTTON_* flags); fill in before each step
+ *   framebuffers  EMULATOR_FRAMEBUFFER_WIDTH * EMULATOR_FRAMEBUFFER_HEIGHT pixels per emulator, back to back, drawn
+ *                 into directly (null if the batch was created without rendering)
+ *   ram           EMULATOR_RAM_SIZE bytes per emulator, copied out at the end of every step
+ *   observations  observationSize bytes per emulator, a small greyscale stack of recent frames made from each frame
+ *                 right after it's drawn, on the same thread (null unless observeEmulatorBatch was called)
+ *
+ * setEmulatorBatchOutputs points framebuffers, ram and observations somewhere else, e.g. shared memory, so the results of a step
+ * land where they're wanted without another copy.
+ */
+struct EmulatorBatch
+{
+  int numEmulators;
+  struct Emulator **emulators;
+
+  uint8_t *inputs;
+  uint32_t *framebuffers;
+  uint8_t *ram;
+  uint32_t *ownFramebuffers;
+  uint8_t *ownRam;
+
+  struct ObservationPipeline **pipelines;  // one per emulator, or null
+  size_t observationSize;
+  uint8_t *observations;
+  uint8_t *ownObservations;
+
+  struct Emulator *startingPoint;  // a clone of the emulators as they were at power on, for restartBatchEmulator
+
+  int numWorkers;
+  struct BatchWorker *workers;
+
+  struct Mutex mutex;
+  struct ConditionVariable workReady;
+  struct ConditionVariable workDone;
+  int generation;
+  int numWorkersFinished;
+  bool stopping;
+};
+
+int createEmulatorBatch(struct EmulatorBatch **batch, const uint8_t *romData, size_t romSize, int numEmulators, int numThreads, bool render);
+void stepEmulatorBatch(struct EmulatorBatch *batch);
+void restartBatchEmulator(struct EmulatorBatch *batch, int index);
+int observeEmulatorBatch(struct EmulatorBatch *batch, const struct ObservationFormat *format);
+void setEmulatorBatchOutputs(struct EmulatorBatch *batch, uint32_t *framebuffers, uint8_t *ram, uint8_t *observations);
+int traceEmulatorBatch(struct EmulatorBatch *batch, struct Tracer *tracer);
+void freeEmulatorBatch(struct EmulatorBatch *batch);
+
+#endif /* !FILE_BATCH_H_SEEN */
@@ -0,0 +1,204 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debug.h"
+#include "battery.h"
+
+// Returns how many bytes that was.
+static int writeStagedPages(FILE *saveFile, const uint8_t *pages, uint32_t pagesToWrite)
+{
+  // coalesce neighbouring dirty pages into one write
+  int bytesWritten = 0;
+  int page = 0;
+  while (page < PRG_RAM_NUM_PAGES) {
+    if (!(pagesToWrite & (1u << page))) {
+      page++;
+      continue;
+    }
+
+    int firstPage = page;
+    while (page < PRG_RAM_NUM_PAGES && (pagesToWrite & (1u << page))) {
+      page++;
+    }
+
+    int offset = firstPage * PRG_RAM_PAGE_SIZE;
+    fseek(saveFile, offset, SEEK_SET);
+    fwrite(pages + offset, 1, (page - firstPage) * PRG_RAM_PAGE_SIZE, saveFile);
+    bytesWritten += (page - firstPage) * PRG_RAM_PAGE_SIZE;
+  }
+
+  fflush(saveFile);
+  return bytesWritten;
+}
+
+static void flushThreadMain(void *argument)
+{
+  struct BatteryRam *batteryRam = (struct BatteryRam *) argument;
+  uint8_t pages[PRG_RAM_SIZE];
+
+  lockMutex(&batteryRam->mutex);
+  for (;;) {
+    if (!batteryRam->stopping) {
+      waitConditionVariableTimeout(&batteryRam->wakeUp, &batteryRam->mutex, BATTERY_RAM_FLUSH_INTERVAL_MILLISECONDS);
+    }
+
+    uint32_t pagesToWrite = batteryRam->stagedPages;
+    bool stopping = batteryRam->stopping;
+    struct Tracer *tracer = batteryRam->tracer;
+    if (pagesToWrite) {
+      memcpy(pages, batteryRam->staging, PRG_RAM_SIZE);
+      batteryRam->stagedPages = 0;
+    }
+
+    // don't hold the lock while we're waiting on the disk
+    unlockMutex(&batteryRam->mutex);
+    if (tracer && !batteryRam->trace && createTraceBuffer(&batteryRam->trace, tracer, "save file")) {
+      batteryRam->trace = NULL;
+    }
+    if (pagesToWrite) {
+      uint64_t traceStart = getTimeInNanoseconds();
+      int bytesWritten = writeStagedPages(batteryRam->saveFile, pages, pagesToWrite);
+      if (batteryRam->trace) {
+        addTraceSpanWithArg(batteryRam->trace, "flush save file", traceStart, "bytes", bytesWritten);
+      }
+    }
+    lockMutex(&batteryRam->mutex);
+
+    if (stopping && !batteryRam->stagedPages) {
+      break;
+    }
+  }
+  unlockMutex(&batteryRam->mutex);
+}
+
+/**
+ *
+ * Loads the save file into prgRam (creating the save file if needed) and starts the flush thread.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: Error opening or creating the save file.
+ *  3: Could not start the flush thread.
+ *
+ */
+int createBatteryRam(struct BatteryRam **batteryRam, const char *saveFilename, uint8_t *prgRam)
+{
+  struct BatteryRam *newBatteryRam = (struct BatteryRam *) calloc(1, sizeof(struct BatteryRam));
+  if (!newBatteryRam) {
+    return 1;
+  }
+
+  FILE *saveFile;
+  if (fopen_s(&saveFile, saveFilename, "r+b") == 0) {
+    size_t bytesRead = fread(prgRam, 1, PRG_RAM_SIZE, saveFile);
+    print("Loaded %d bytes of PRG RAM from %s\n", (int) bytesRead, saveFilename);
+    if (bytesRead < PRG_RAM_SIZE) {
+      memset(prgRam + bytesRead, 0, PRG_RAM_SIZE - bytesRead);
+    }
+  } else if (fopen_s(&saveFile, saveFilename, "w+b") == 0) {
+    memset(prgRam, 0, PRG_RAM_SIZE);
+  } else {
+    print("Error opening save file %s\n", saveFilename);
+    free(newBatteryRam);
+    return 2;
+  }
+
+  // make sure the file is full size up front so later writes can just seek to the page they need
+  fseek(saveFile, 0, SEEK_SET);
+  fwrite(prgRam, 1, PRG_RAM_SIZE, saveFile);
+  fflush(saveFile);
+
+  newBatteryRam->saveFile = saveFile;
+  initMutex(&newBatteryRam->mutex);
+  initConditionVariable(&newBatteryRam->wakeUp);
+
+  if (createThread(&newBatteryRam->flushThread, flushThreadMain, newBatteryRam)) {
+    fclose(saveFile);
+    destroyConditionVariable(&newBatteryRam->wakeUp);
+    destroyMutex(&newBatteryRam->mutex);
+    free(newBatteryRam);
+    return 3;
+  }
+
+  *batteryRam = newBatteryRam;
+  return 0;
+}
+
+void markBatteryRamWrite(struct BatteryRam *batteryRam, unsigned int memoryAddress)
+{
+  batteryRam->dirtyPages |= 1u << ((memoryAddress - PRG_RAM_START) / PRG_RAM_PAGE_SIZE);
+}
+
+// Call once a frame from the emulation thread. Never blocks: if the flush thread happens to be holding the lock, the
+// dirty pages just wait for next frame.
+void syncBatteryRam(struct BatteryRam *batteryRam, const uint8_t *prgRam)
+{
+  if (!batteryRam->dirtyPages || !tryLockMutex(&batteryRam->mutex)) {
+    return;
+  }
+
+  uint32_t dirtyPages = batteryRam->dirtyPages;
+  for (int page = 0; page < PRG_RAM_NUM_PAGES; page++) {
+    if (dirtyPages & (1u << page)) {
+      memcpy(batteryRam->staging + page * PRG_RAM_PAGE_SIZE, prgRam + page * PRG_RAM_PAGE_SIZE, PRG_RAM_PAGE_SIZE);
+    }
+  }
+  batteryRam->stagedPages |= dirtyPages;
+  batteryRam->dirtyPages = 0;
+
+  unlockMutex(&batteryRam->mutex);
+}
+
+// From then on each write to the save file is a span in tracer's timeline, which has to outlive batteryRam.
+void traceBatteryRam(struct BatteryRam *batteryRam, struct Tracer *tracer)
+{
+  lockMutex(&batteryRam->mutex);
+  batteryRam->tracer = tracer;
+  unlockMutex(&batteryRam->mutex);
+}
+
+// Writes out anything still pending, then stops the flush thread and closes the save file.
+void destroyBatteryRam(struct BatteryRam *batteryRam, const uint8_t *prgRam)
+{
+  lockMutex(&batteryRam->mutex);
+  if (batteryRam->dirtyPages) {
+    memcpy(batteryRam->staging, prgRam, PRG_RAM_SIZE);
+    batteryRam->stagedPages |= batteryRam->dirtyPages;
+    batteryRam->dirtyPages = 0;
+  }
+  batteryRam->stopping = true;
+  signalConditionVariable(&batteryRam->wakeUp);
+  unlockMutex(&batteryRam->mutex);
+
+  joinThread(&batteryRam->flushThread);
+
+  fclose(batteryRam->saveFile);
+  destroyConditionVariable(&batteryRam->wakeUp);
+  destroyMutex(&batteryRam->mutex);
+  free(batteryRam);
+}
+
+// ("games/MegaMan2.nes", ".cfm") -> "games/MegaMan2.cfm"
+void filenameForRom(char *filename, size_t filenameSize, const char *romFilename, const char *newExtension)
+{
+  snprintf(filename, filenameSize, "%s", romFilename);
+
+  char *extension = strrchr(filename, '.');
+  char *lastSlash = strrchr(filename, '/');
+  char *lastBackslash = strrchr(filename, '\\');
+  if (!extension || (lastSlash && extension < lastSlash) || (lastBackslash && extension < lastBackslash)) {
+    extension = filename + strlen(filename);
+  }
+
+  size_t extensionOffset = extension - filename;
+  if (extensionOffset + strlen(newExtension) + 1 <= filenameSize) {
+    memcpy(extension, newExtension, strlen(newExtension) + 1);
+  }
+}
+
+// "games/MegaMan2.nes" -> "games/MegaMan2.sav"
+void saveFilenameForRom(char *saveFilename, size_t saveFilenameSize, const char *romFilename)
+{
+  filenameForRom(saveFilename, saveFilenameSize, romFilename, ".sav");
+}
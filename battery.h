@@ -0,0 +1,51 @@
+#ifndef FILE_BATTERY_H_SEEN
+#define FILE_BATTERY_H_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "platform.h"
+#include "trace.h"
+
+// Battery-backed PRG RAM lives at $6000-$7FFF
+#define PRG_RAM_START 0x6000
+#define PRG_RAM_SIZE 0x2000
+#define PRG_RAM_PAGE_SIZE 0x100
+#define PRG_RAM_NUM_PAGES (PRG_RAM_SIZE / PRG_RAM_PAGE_SIZE)
+
+#define BATTERY_RAM_FLUSH_INTERVAL_MILLISECONDS 1000
+
+/*
+ * Keeps the save file in sync with PRG RAM without the emulator ever touching the disk.
+ *
+ * Writes to $6000-$7FFF only set a bit for the 256 byte page they hit. Once a frame the dirty pages get copied into a
+ * staging area, and a background thread writes whatever is staged out to the save file every second or so. A game that
+ * rewrites its save data every frame therefore costs one OR per write and one small memcpy per frame.
+ */
+struct BatteryRam
+{
+  uint32_t dirtyPages;  // only touched by the emulation thread
+
+  struct Mutex mutex;  // protects everything below
+  struct ConditionVariable wakeUp;
+  uint8_t staging[PRG_RAM_SIZE];
+  uint32_t stagedPages;
+  bool stopping;
+  struct Tracer *tracer;  // null unless the flushes should show up in a timeline (see trace.h)
+
+  // only touched by the flush thread once it's running
+  FILE *saveFile;
+  struct TraceBuffer *trace;
+  struct Thread flushThread;
+};
+
+int createBatteryRam(struct BatteryRam **batteryRam, const char *saveFilename, uint8_t *prgRam);
+void markBatteryRamWrite(struct BatteryRam *batteryRam, unsigned int memoryAddress);
+void syncBatteryRam(struct BatteryRam *batteryRam, const uint8_t *prgRam);
+void destroyBatteryRam(struct BatteryRam *batteryRam, const uint8_t *prgRam);
+void traceBatteryRam(struct BatteryRam *batteryRam, struct Tracer *tracer);
+void filenameForRom(char *filename, size_t filenameSize, const char *romFilename, const char *newExtension);
+void saveFilenameForRom(char *saveFilename, size_t saveFilenameSize, const char *romFilename);
+
+#endif /* !FILE_BATTERY_H_SEEN */
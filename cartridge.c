@@ -6,34 +6,120 @@
 #include "debug.h"
 #include "cartridge.h"
 
+// -1 if it's more than CARTRIDGE_MAX_ROM_SIZE
+static int nes20RomSize(uint8_t lsb, uint8_t msbNybble, int unitSize)
+{
+  uint64_t size;
+  if (msbNybble == 0x0F) {
+    // exponent-multiplier notation: EEEEEEMM means 2^E * (MM*2+1) bytes
+    int exponent = lsb >> 2;
+    uint64_t multiplier = (lsb & 0x03) * 2 + 1;
+    if (exponent > 32) {
+      return -1;  // way over the cap, and 2^63 * 7 wouldn't even fit in 64 bits
+    }
+    size = ((uint64_t) 1 << exponent) * multiplier;
+  } else {
+    size = (uint64_t) ((msbNybble << 8) | lsb) * (uint64_t) unitSize;
+  }
+
+  return size > CARTRIDGE_MAX_ROM_SIZE ? -1 : (int) size;
+}
+
 /**
  *
  * Returns error code:
- *  1: Error opening game file.
- *  2: Could not allocate memory for prgRom.
- *  3: Could not allocate memory for chrRom.
+ *  1: Not an iNES file.
+ *  2: ROM sizes can't be represented.
  *
  */
-int loadCartridge(struct Cartridge **cartridge, const char *filename) {
-  uint8_t header[16];
-  FILE *file;
+int parseCartridgeHeader(struct CartridgeHeader *cartridgeHeader, const uint8_t header[16])
+{
+  if (header[0] != 'N' || header[1] != 'E' || header[2] != 'S' || header[3] != 0x1A) {
+    return 1;
+  }
 
-  int gameFileOpenError = fopen_s(&file, filename, "rb");
-  if (gameFileOpenError) {
-    print("Error opening game file %s\n", filename);
-    return(1);
+  bool isNes20 = ((header[7] >> 2) & 3) == 2;
+
+  // header[6] bits 4-7 are lower nybble
+  // header[7] bits 4-7 are upper nybble
+  int mapperNumber = (header[7] & 0xF0) | (header[6] >> 4);
+
+  int sizeOfPrgRomInBytes;
+  int sizeOfChrRomInBytes;
+  if (isNes20) {
+    mapperNumber = mapperNumber | ((header[8] & 0x0F) << 8);
+    sizeOfPrgRomInBytes = nes20RomSize(header[4], header[9] & 0x0F, 16 * 1024);
+    sizeOfChrRomInBytes = nes20RomSize(header[5], header[9] >> 4, 8 * 1024);
+  } else {
+    // Old dumps sometimes have junk like "DiskDude!" in bytes 7-15, in which case the upper nybble is garbage.
+    if (header[12] != 0 || header[13] != 0 || header[14] != 0 || header[15] != 0) {
+      mapperNumber = header[6] >> 4;
+    }
+    sizeOfPrgRomInBytes = 16 * 1024 * header[4];
+    sizeOfChrRomInBytes = 8 * 1024 * header[5];
+  }
+
+  if (sizeOfPrgRomInBytes < 0 || sizeOfChrRomInBytes < 0) {
+    return 2;
   }
 
-  fread(header, sizeof(header), 1, file);
+  cartridgeHeader->mapperNumber = mapperNumber;
+  cartridgeHeader->sizeOfPrgRomInBytes = sizeOfPrgRomInBytes;
+  cartridgeHeader->sizeOfChrRomInBytes = sizeOfChrRomInBytes;
+  cartridgeHeader->isNes20 = isNes20;
+  cartridgeHeader->verticalMirroring = header[6] & 1;
+  cartridgeHeader->hasBattery = (header[6] >> 1) & 1;
+  cartridgeHeader->hasTrainer = (header[6] >> 2) & 1;
+  cartridgeHeader->fourScreenVram = (header[6] >> 3) & 1;
+
+  return 0;
+}
+
+// Mappers that the bank switching code in emu.c knows about.
+bool isMapperSupported(int mapperNumber)
+{
+  return mapperNumber == 0 || mapperNumber == 1;
+}
+
+// Whether that bank switching can reach all of a PRG ROM this size, and only it: NROM is 16 or 32 kB, and MMC1 picks
+// one of up to 16 banks of 16 kB.
+bool isPrgRomSizeSupported(int mapperNumber, int sizeOfPrgRomInBytes)
+{
+  if (mapperNumber == 0) {
+    return sizeOfPrgRomInBytes == 0x4000 || sizeOfPrgRomInBytes == 0x8000;
+  } else if (mapperNumber == 1) {
+    return sizeOfPrgRomInBytes >= 0x4000 && sizeOfPrgRomInBytes <= 16 * 0x4000 && sizeOfPrgRomInBytes % 0x4000 == 0;
+  }
+  return false;
+}
+
+/**
+ *
+ * Loads a cartridge from an iNES file that's already in memory. romData is copied, so it can be freed afterwards.
+ *
+ * Returns error code:
+ *  2: Could not allocate memory for prgRom.
+ *  3: Could not allocate memory for chrRom.
+ *  4: Not a valid iNES file.
+ *  5: File is shorter than its header says.
+ *
+ */
+int loadCartridgeFromMemory(struct Cartridge **cartridge, const uint8_t *romData, size_t romSize) {
+  struct CartridgeHeader cartridgeHeader;
+  if (romSize < 16 || parseCartridgeHeader(&cartridgeHeader, romData)) {
+    print("Not a valid iNES file\n");
+    return(4);
+  }
+  const uint8_t *header = romData;
 
-  uint8_t numPrgRomUnits = header[4];
-  int sizeOfPrgRomInBytes = 16 * 1024 * numPrgRomUnits;
+  int sizeOfPrgRomInBytes = cartridgeHeader.sizeOfPrgRomInBytes;
+  int numPrgRomUnits = sizeOfPrgRomInBytes / (16 * 1024);
   print("Size of PRG ROM in 16kb units: %d (and in bytes: %d)\n", numPrgRomUnits, sizeOfPrgRomInBytes);
 
-  int sizeOfChrRomInBytes = 8 * 1024 * header[5];
-  print("Size of CHR ROM in 8 KB units (Value 0 means the board uses CHR RAM): %d (and in bytes: %d)\n", header[5], sizeOfChrRomInBytes);
+  int sizeOfChrRomInBytes = cartridgeHeader.sizeOfChrRomInBytes;
+  print("Size of CHR ROM in 8 KB units (Value 0 means the board uses CHR RAM): %d (and in bytes: %d)\n", sizeOfChrRomInBytes / (8 * 1024), sizeOfChrRomInBytes);
 
-  if ((header[7] >> 2) & 3) {
+  if (cartridgeHeader.isNes20) {
     print("NES 2.0 format\n");
   } else {
     print("Not NES 2.0 format\n");
@@ -45,14 +131,16 @@ int loadCartridge(struct Cartridge **cartridge, const char *filename) {
     print("Horizontal mirroring\n");
   }
 
-  if ((header[6] >> 1) & 1) {
+  if (cartridgeHeader.hasBattery) {
     print("Cartridge contains battery-backed PRG RAM ($6000-7FFF) or other persistent memory\n");
   } else {
     print("Cartridge does not contain battery-packed PRG RAM\n");
   }
 
-  if ((header[6] >> 2) & 1) {
+  size_t prgRomOffset = 16;
+  if (cartridgeHeader.hasTrainer) {
     print("512-byte trainer at $7000-$71FF (stored before PRG data)\n");
+    prgRomOffset += 512;
   } else {
     print("No 512-byte trainer at $7000-$71FF (stored before PRG data)\n");
   }
@@ -63,15 +151,17 @@ int loadCartridge(struct Cartridge **cartridge, const char *filename) {
     print("Do not ignore mirroring control or above mirroring bit\n");
   }
 
-  // header[6] bits 4-7 are lower nybble
-  // header[7] bits 4-7 are upper nybble
-  int mapperNumber = (header[7] & 0xF0) | (header[6] >> 4);
+  int mapperNumber = cartridgeHeader.mapperNumber;
   print("mapper number: %d\n", mapperNumber);
 
+  if (romSize < prgRomOffset + (size_t) sizeOfPrgRomInBytes + (size_t) sizeOfChrRomInBytes) {
+    print("File is shorter than its header says\n");
+    return(5);
+  }
+
   uint8_t *prgRom = (uint8_t *) malloc(sizeOfPrgRomInBytes);
   if (prgRom == 0) {
     print("Could not allocate memory for prgRom.");
-    fclose(file);
     return(2);
   }
 
@@ -79,14 +169,12 @@ int loadCartridge(struct Cartridge **cartridge, const char *filename) {
   if (chrRom == 0) {
     print("Could not allocate memory for chrRom.");
     free(prgRom);
-    fclose(file);
     return(3);
   }
 
   print("about to read into prgRom, num of bytes: %d\n", sizeOfPrgRomInBytes);
-  fread(prgRom, sizeOfPrgRomInBytes, 1, file);
-  fread(chrRom, sizeOfChrRomInBytes, 1, file);
-  fclose(file);
+  memcpy(prgRom, romData + prgRomOffset, sizeOfPrgRomInBytes);
+  memcpy(chrRom, romData + prgRomOffset + sizeOfPrgRomInBytes, sizeOfChrRomInBytes);
 
   // *cartridge is the pointer to the cartridge (cartridge is pointer to the pointer)
   *cartridge = (struct Cartridge *) malloc(sizeof(struct Cartridge));
@@ -97,8 +185,53 @@ int loadCartridge(struct Cartridge **cartridge, const char *filename) {
   (**cartridge).sizeOfPrgRomInBytes = sizeOfPrgRomInBytes;
   (**cartridge).sizeOfChrRomInBytes = sizeOfChrRomInBytes;
   (**cartridge).numPrgRomUnits = numPrgRomUnits;
+  (**cartridge).hasBattery = cartridgeHeader.hasBattery;
 
   return 0;
 }
 
+/**
+ *
+ * Returns error code:
+ *  1: Error opening game file.
+ *  2: Could not allocate memory for prgRom.
+ *  3: Could not allocate memory for chrRom.
+ *  4: Not a valid iNES file.
+ *  5: File is shorter than its header says.
+ *
+ */
+int loadCartridge(struct Cartridge **cartridge, const char *filename) {
+  FILE *file;
 
+  int gameFileOpenError = fopen_s(&file, filename, "rb");
+  if (gameFileOpenError) {
+    print("Error opening game file %s\n", filename);
+    return(1);
+  }
+
+  fseek(file, 0, SEEK_END);
+  long fileSize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (fileSize < 0) {
+    print("Error opening game file %s\n", filename);
+    fclose(file);
+    return(1);
+  }
+
+  uint8_t *romData = (uint8_t *) malloc(fileSize > 0 ? fileSize : 1);
+  if (!romData) {
+    print("Could not allocate memory for game file %s\n", filename);
+    fclose(file);
+    return(2);
+  }
+
+  size_t romSize = fread(romData, 1, fileSize, file);
+  fclose(file);
+
+  int error = loadCartridgeFromMemory(cartridge, romData, romSize);
+  if (error == 4) {
+    print("Not a valid iNES file %s\n", filename);
+  }
+  free(romData);
+  return error;
+}
@@ -1,8 +1,12 @@
 #ifndef FILE_CARTRIDGE_H_SEEN
 #define FILE_CARTRIDGE_H_SEEN
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#define CARTRIDGE_MAX_ROM_SIZE (64 * 1024 * 1024)  // each of PRG and CHR; NES 2.0 headers can claim far more
+
 struct Cartridge {
   uint8_t rawHeader[16];
   int mapperNumber;
@@ -10,9 +14,27 @@ struct Cartridge {
   uint8_t *chrRom;
   int sizeOfPrgRomInBytes;
   int sizeOfChrRomInBytes;
-  uint8_t numPrgRomUnits;
+  int numPrgRomUnits;
+  bool hasBattery;
+};
+
+// What we can learn about a game from its 16 byte iNES / NES 2.0 header, without reading the rest of the file.
+// https://wiki.nesdev.com/w/index.php/INES and https://wiki.nesdev.com/w/index.php/NES_2.0
+struct CartridgeHeader {
+  int mapperNumber;
+  int sizeOfPrgRomInBytes;
+  int sizeOfChrRomInBytes;
+  bool isNes20;
+  bool verticalMirroring;
+  bool fourScreenVram;
+  bool hasBattery;
+  bool hasTrainer;
 };
 
 int loadCartridge(struct Cartridge **cartridge, const char *filename);
+int loadCartridgeFromMemory(struct Cartridge **cartridge, const uint8_t *romData, size_t romSize);
+int parseCartridgeHeader(struct CartridgeHeader *cartridgeHeader, const uint8_t header[16]);
+bool isMapperSupported(int mapperNumber);
+bool isPrgRomSizeSupported(int mapperNumber, int sizeOfPrgRomInBytes);
 
 #endif /* !FILE_CARTRIDGE_H_SEEN */
@@ -0,0 +1,331 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "emu.h"
+#include "controller.h"
+#include "cartridge.h"
+#include "movie.h"
+#include "ramwatch.h"
+#include "timing.h"
+#include "castleface.h"
+
+struct Emulator
+{
+  struct Cartridge *cartridge;
+  bool ownsCartridge;  // clones use the cartridge (and PRG ROM) of the emulator they were cloned from
+  struct Computer state;
+  struct PPU *ppu;
+  struct PPUClosure ppuClosure;
+  struct KeyboardInput keyboardInput;
+  struct Color palette[64];
+  uint32_t *framebuffer;  // ownFramebuffer unless setEmulatorFramebuffer was called
+  uint32_t ownFramebuffer[EMULATOR_FRAMEBUFFER_WIDTH * EMULATOR_FRAMEBUFFER_HEIGHT];
+};
+
+static void freeCartridge(struct Cartridge *cartridge)
+{
+  free(cartridge->prgRom);
+  free(cartridge->chrRom);
+  free(cartridge);
+}
+
+/**
+ *
+ * romData is the contents of an iNES file. It's copied, so it can be freed as soon as this returns.
+ *
+ * Returns error code:
+ *  1: Not a valid iNES file.
+ *  2: Could not allocate memory.
+ *  3: The game's mapper isn't supported, or it has more PRG or CHR ROM than we can bank switch.
+ *
+ */
+int createEmulator(struct Emulator **emulator, const uint8_t *romData, size_t romSize)
+{
+  struct Emulator *newEmulator = (struct Emulator *) calloc(1, sizeof(struct Emulator));
+  if (!newEmulator) {
+    return 2;
+  }
+
+  int loadCartridgeError = loadCartridgeFromMemory(&newEmulator->cartridge, romData, romSize);
+  if (loadCartridgeError) {
+    free(newEmulator);
+    return loadCartridgeError == 2 || loadCartridgeError == 3 ? 2 : 1;
+  }
+
+  int createPPUError = createPPU(&newEmulator->ppu, newEmulator->cartridge);
+  if (createPPUError) {
+    freeCartridge(newEmulator->cartridge);
+    free(newEmulator);
+    return createPPUError >= 3 ? 3 : 2;
+  }
+
+  newEmulator->ownsCartridge = true;
+  newEmulator->framebuffer = newEmulator->ownFramebuffer;
+  buildPPUClosure(&newEmulator->ppuClosure, newEmulator->ppu);
+  loadPalette(newEmulator->palette);
+  newEmulator->state.keyboardInput = &newEmulator->keyboardInput;
+  newEmulator->state.ppuClosure = &newEmulator->ppuClosure;
+
+  int powerOnError = powerOnComputer(&newEmulator->state, newEmulator->cartridge);
+  if (powerOnError) {
+    newEmulator->state.memory = NULL;
+    destroyEmulator(newEmulator);
+    return powerOnError == 2 ? 3 : 2;
+  }
+
+  *emulator = newEmulator;
+  return 0;
+}
+
+/**
+ *
+ * Makes an independent copy of an emulator as it is right now, much more cheaply than createEmulator. The copy shares
+ * the original's ROM, so the original has to be destroyed last.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *
+ */
+int cloneEmulator(struct Emulator **clone, const struct Emulator *original)
+{
+  struct Emulator *newEmulator = (struct Emulator *) malloc(sizeof(struct Emulator));
+  if (!newEmulator) {
+    return 1;
+  }
+
+  uint8_t *memory = (uint8_t *) malloc(0x8000);
+  struct PPU *ppu = (struct PPU *) malloc(sizeof(struct PPU));
+  uint8_t *ppuMemory = (uint8_t *) malloc(0x3FFF);
+  uint8_t *oam = (uint8_t *) malloc(256);
+  if (!memory || !ppu || !ppuMemory || !oam) {
+    free(memory);
+    free(ppu);
+    free(ppuMemory);
+    free(oam);
+    free(newEmulator);
+    return 1;
+  }
+
+  memcpy(newEmulator, original, sizeof(struct Emulator));
+  newEmulator->ownsCartridge = false;
+  newEmulator->state.ramWatch = NULL;
+  newEmulator->state.profiler = NULL;
+  newEmulator->state.cpuTrace = NULL;
+  newEmulator->state.stageTimer = NULL;
+  newEmulator->state.trace = NULL;
+  newEmulator->state.apu.output.buffer = NULL;
+  newEmulator->framebuffer = original->framebuffer == original->ownFramebuffer ? newEmulator->ownFramebuffer : original->framebuffer;
+
+  // PRG ROM isn't behind CPU memory for clones; the copied prgRom and prgRomBlock pointers point at the original's
+  newEmulator->state.memory = memory;
+  ppu->memory = ppuMemory;
+  ppu->oam = oam;
+  newEmulator->ppu = ppu;
+  buildPPUClosure(&newEmulator->ppuClosure, ppu);
+  copyEmulatorState(newEmulator, original);
+
+  *clone = newEmulator;
+  return 0;
+}
+
+/*
+ * Puts destination in exactly the state source is in, without allocating anything, e.g. to send an emulator back to
+ * a starting point kept aside as a clone. Both have to be running the same ROM: one cloned from the other, or both
+ * cloned from the same emulator. Where destination draws stays as it was.
+ */
+void copyEmulatorState(struct Emulator *destination, const struct Emulator *source)
+{
+  uint8_t *memory = destination->state.memory;
+  struct RamWatch *ramWatch = destination->state.ramWatch;
+  struct CpuProfiler *profiler = destination->state.profiler;
+  struct CpuTrace *cpuTrace = destination->state.cpuTrace;
+  struct StageTimer *stageTimer = destination->state.stageTimer;
+  struct TraceBuffer *trace = destination->state.trace;
+  uint64_t traceFrameStart = destination->state.traceFrameStart;
+  uint64_t traceScanlinesStart = destination->state.traceScanlinesStart;
+  struct ApuOutput apuOutput = destination->state.apu.output;
+  memcpy(memory, source->state.memory, 0x8000);
+  destination->state = source->state;
+  destination->state.memory = memory;
+  destination->state.ramWatch = ramWatch;
+  destination->state.profiler = profiler;
+  destination->state.cpuTrace = cpuTrace;
+  destination->state.stageTimer = stageTimer;
+  destination->state.trace = trace;
+  destination->state.traceFrameStart = traceFrameStart;
+  destination->state.traceScanlinesStart = traceScanlinesStart;
+  destination->state.apu.output = apuOutput;
+  if (ramWatch) {
+    markAllRamWritten(ramWatch);
+  }
+  destination->state.keyboardInput = &destination->keyboardInput;
+  destination->state.ppuClosure = &destination->ppuClosure;
+  destination->keyboardInput = source->keyboardInput;
+
+  struct PPU *ppu = destination->ppu;
+  uint8_t *ppuMemory = ppu->memory;
+  uint8_t *oam = ppu->oam;
+  bool spritesAreSprites0 = source->ppu->sprites == source->ppu->sprites0;
+  *ppu = *source->ppu;
+  memcpy(ppuMemory, source->ppu->memory, 0x3FFF);
+  memcpy(oam, source->ppu->oam, 256);
+  ppu->memory = ppuMemory;
+  ppu->oam = oam;
+  ppu->sprites = spritesAreSprites0 ? ppu->sprites0 : ppu->sprites1;
+  ppu->followingSprites = spritesAreSprites0 ? ppu->sprites1 : ppu->sprites0;
+}
+
+void resetEmulator(struct Emulator *emulator)
+{
+  resetComputer(&emulator->state, emulator->ppu, emulator->cartridge);
+}
+
+// Runs until the next vblank starts, at which point the framebuffer holds a complete picture.
+void stepEmulatorFrame(struct Emulator *emulator)
+{
+  while (!executeEmulatorCycle(&emulator->state, emulator->ppu, emulator->framebuffer, emulator->palette));
+
+  if (emulator->state.ramWatch) {
+    collectRamChanges(emulator->state.ramWatch, emulator->state.memory);
+  }
+  if (emulator->state.stageTimer) {
+    endTimedFrame(emulator->state.stageTimer);
+  }
+}
+
+// Takes effect the next time the game reads the controller.
+void setEmulatorInput(struct Emulator *emulator, uint8_t buttons)
+{
+  unpackKeyboardInput(&emulator->keyboardInput, buttons);
+}
+
+// 0x00RRGGBB pixels, EMULATOR_FRAMEBUFFER_WIDTH per row. It's the buffer the emulator draws into, so it changes as
+// frames run.
+const uint32_t *getEmulatorFramebuffer(const struct Emulator *emulator)
+{
+  return emulator->framebuffer;
+}
+
+/*
+ * Draw into the caller's buffer (EMULATOR_FRAMEBUFFER_WIDTH * EMULATOR_FRAMEBUFFER_HEIGHT pixels) from now on instead
+ * of the emulator's own one. Null turns drawing off altogether, which makes frames cheaper when nobody is looking.
+ */
+void setEmulatorFramebuffer(struct Emulator *emulator, uint32_t *framebuffer)
+{
+  emulator->framebuffer = framebuffer;
+}
+
+// The console's 2 kB of work RAM, which is where games keep their state (EMULATOR_RAM_SIZE bytes). It's the memory
+// the emulator runs on, not a copy, so the pointer stays the same for as long as the emulator exists.
+const uint8_t *getEmulatorRam(const struct Emulator *emulator)
+{
+  return emulator->state.memory;
+}
+
+// The cartridge's 8 kB of PRG RAM at $6000-$7FFF (EMULATOR_PRG_RAM_SIZE bytes), which some games use for more state
+// or saves. Like getEmulatorRam, it's the real thing and never moves. Games without any just leave it as zeros.
+const uint8_t *getEmulatorPrgRam(const struct Emulator *emulator)
+{
+  return emulator->state.memory + 0x6000;
+}
+
+/**
+ *
+ * Starts keeping track of which bytes of RAM (and PRG RAM too if includePrgRam) change each frame, for
+ * getEmulatorRamChanges. It costs a little on every write to RAM, so it's off until this is called.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *
+ */
+int watchEmulatorRam(struct Emulator *emulator, bool includePrgRam)
+{
+  if (emulator->state.ramWatch) {
+    freeRamWatch(emulator->state.ramWatch);
+    emulator->state.ramWatch = NULL;
+  }
+  return createRamWatch(&emulator->state.ramWatch, emulator->state.memory, includePrgRam);
+}
+
+/*
+ * The bytes that changed during the last stepEmulatorFrame: addresses ($0000-$07FF for RAM, $6000-$7FFF for PRG RAM)
+ * and their new values, in no particular order. Returns how many there are. The arrays belong to the emulator and
+ * are replaced by the next step. Returns 0 if watchEmulatorRam hasn't been called.
+ */
+int getEmulatorRamChanges(const struct Emulator *emulator, const uint16_t **addresses, const uint8_t **values)
+{
+  struct RamWatch *ramWatch = emulator->state.ramWatch;
+  if (!ramWatch) {
+    return 0;
+  }
+
+  *addresses = ramWatch->changedAddresses;
+  *values = ramWatch->changedValues;
+  return ramWatch->numChanges;
+}
+
+/**
+ *
+ * Starts timing where each frame's time goes, for getEmulatorFrameTimings. It slows emulation down by about a tenth,
+ * so it's off until this is called. Calling it again starts over.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *
+ */
+int timeEmulatorFrames(struct Emulator *emulator)
+{
+  if (emulator->state.stageTimer) {
+    freeStageTimer(emulator->state.stageTimer);
+    emulator->state.stageTimer = NULL;
+  }
+  return createStageTimer(&emulator->state.stageTimer);
+}
+
+/*
+ * How long the last few frames took on average, in nanoseconds: nanoseconds gets EMULATOR_TIMING_NUM_STAGES of them,
+ * one for each EMULATOR_TIMING_* stage, and total gets the whole frame, from one stepEmulatorFrame ending to the next.
+ * Returns how many frames that's over, which is 0 if timeEmulatorFrames hasn't been called.
+ */
+int getEmulatorFrameTimings(const struct Emulator *emulator, uint64_t *nanoseconds, uint64_t *total)
+{
+  if (!emulator->state.stageTimer) {
+    return 0;
+  }
+
+  struct FrameTimings average;
+  int numFrames = getRollingFrameTimings(emulator->state.stageTimer, &average);
+  memcpy(nanoseconds, average.nanoseconds, sizeof(average.nanoseconds));
+  *total = average.total;
+  return numFrames;
+}
+
+/*
+ * Adds spans for each frame, batch of scanlines, OAM DMA and save state to trace (see trace.h), which has to belong to
+ * the thread that steps the emulator from now on. Null stops. Setting it again, even to the same buffer, starts the
+ * current frame's span over, for when the same thread has been busy with something else in between.
+ */
+void setEmulatorTrace(struct Emulator *emulator, struct TraceBuffer *trace)
+{
+  traceEmulator(&emulator->state, trace);
+}
+
+void destroyEmulator(struct Emulator *emulator)
+{
+  if (emulator->state.ramWatch) {
+    freeRamWatch(emulator->state.ramWatch);
+  }
+  if (emulator->state.stageTimer) {
+    freeStageTimer(emulator->state.stageTimer);
+  }
+  free(emulator->state.memory);
+  free(emulator->ppu->memory);
+  free(emulator->ppu->oam);
+  free(emulator->ppu);
+  if (emulator->ownsCartridge) {
+    freeCartridge(emulator->cartridge);
+  }
+  free(emulator);
+}
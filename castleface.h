@@ -0,0 +1,70 @@
+#ifndef FILE_CASTLEFACE_H_SEEN
+#define FILE_CASTLEFACE_H_SEEN
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The emulator as a library, for embedding in other programs.
+ *
+ * Everything belonging to a console lives behind its struct Emulator and there is no global state, so a process can
+ * have as many as it likes on as many threads as it likes. A single emulator mustn't be used from two threads at once.
+ *
+ *   struct Emulator *emulator;
+ *   if (createEmulator(&emulator, romData, romSize) == 0) {
+ *     setEmulatorInput(emulator, EMULATOR_BUTTON_START);
+ *     stepEmulatorFrame(emulator);
+ *     const uint32_t *pixels = getEmulatorFramebuffer(emulator);
+ *     destroyEmulator(emulator);
+ *   }
+ */
+
+// buttons for setEmulatorInput, laid out like the controller's shift register (and like movie input)
+#define EMULATOR_BUTTON_A 0x01
+#define EMULATOR_BUTTON_B 0x02
+#define EMULATOR_BUTTON_SELECT 0x04
+#define EMULATOR_BUTTON_START 0x08
+#define EMULATOR_BUTTON_UP 0x10
+#define EMULATOR_BUTTON_DOWN 0x20
+#define EMULATOR_BUTTON_LEFT 0x40
+#define EMULATOR_BUTTON_RIGHT 0x80
+
+#define EMULATOR_FRAMEBUFFER_WIDTH 256
+#define EMULATOR_FRAMEBUFFER_HEIGHT 240
+#define EMULATOR_RAM_SIZE 0x800
+#define EMULATOR_PRG_RAM_SIZE 0x2000
+
+// where frame time goes, for getEmulatorFrameTimings (the same stages as timing.h). Time spent between calls to
+// stepEmulatorFrame is OTHER; PRESENT and WAIT are for frontends and stay at zero here.
+#define EMULATOR_TIMING_CPU 0
+#define EMULATOR_TIMING_PPU 1
+#define EMULATOR_TIMING_SPRITE_EVALUATION 2
+#define EMULATOR_TIMING_MAPPER 3
+#define EMULATOR_TIMING_APU 4
+#define EMULATOR_TIMING_PRESENT 5
+#define EMULATOR_TIMING_WAIT 6
+#define EMULATOR_TIMING_OTHER 7
+#define EMULATOR_TIMING_NUM_STAGES 8
+
+struct Emulator;
+struct TraceBuffer;
+
+int createEmulator(struct Emulator **emulator, const uint8_t *romData, size_t romSize);
+int cloneEmulator(struct Emulator **clone, const struct Emulator *original);
+void copyEmulatorState(struct Emulator *destination, const struct Emulator *source);
+void resetEmulator(struct Emulator *emulator);
+void stepEmulatorFrame(struct Emulator *emulator);
+void setEmulatorInput(struct Emulator *emulator, uint8_t buttons);
+const uint32_t *getEmulatorFramebuffer(const struct Emulator *emulator);
+void setEmulatorFramebuffer(struct Emulator *emulator, uint32_t *framebuffer);
+const uint8_t *getEmulatorRam(const struct Emulator *emulator);
+const uint8_t *getEmulatorPrgRam(const struct Emulator *emulator);
+int watchEmulatorRam(struct Emulator *emulator, bool includePrgRam);
+int getEmulatorRamChanges(const struct Emulator *emulator, const uint16_t **addresses, const uint8_t **values);
+int timeEmulatorFrames(struct Emulator *emulator);
+int getEmulatorFrameTimings(const struct Emulator *emulator, uint64_t *nanoseconds, uint64_t *total);
+void setEmulatorTrace(struct Emulator *emulator, struct TraceBuffer *trace);
+void destroyEmulator(struct Emulator *emulator);
+
+#endif /* !FILE_CASTLEFACE_H_SEEN */
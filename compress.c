@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <string.h>
+#include "compress.h"
+
+/*
+ * Each sequence is:
+ *
+ *   token: high nybble is the literal count, low nybble is the match length minus 4 (15 in either means more length
+ *          bytes follow, each adding up to 255, ending at the first byte that isn't 255)
+ *   literals
+ *   match offset (2 bytes, little endian, 1 to 65535 bytes back)
+ *
+ * The last sequence is only a token and literals. Matches can overlap their own output, so a long run of zeros
+ * compresses to a literal zero followed by an offset 1 match.
+ */
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET 0xFFFF
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+  uint64_t value;
+  memcpy(&value, p, 8);
+  return value;
+}
+
+static uint32_t hashPosition(const uint8_t *p)
+{
+  return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *writeLength(uint8_t *out, size_t length)
+{
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = (uint8_t) length;
+  return out;
+}
+
+size_t lzCompressBound(size_t sourceSize)
+{
+  return sourceSize + sourceSize / 255 + 16;
+}
+
+// Returns the compressed size, or 0 if it didn't fit in destinationCapacity.
+size_t lzCompress(const uint8_t *source, size_t sourceSize, uint8_t *destination, size_t destinationCapacity)
+{
+  uint32_t table[1 << HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  const uint8_t *in = source;
+  const uint8_t *end = source + sourceSize;
+  const uint8_t *matchLimit = sourceSize > MIN_MATCH ? end - MIN_MATCH : source;
+  const uint8_t *literalStart = source;
+  uint8_t *out = destination;
+  uint8_t *outEnd = destination + destinationCapacity;
+  int misses = 0;
+
+  while (in < matchLimit) {
+    uint32_t hash = hashPosition(in);
+    const uint8_t *candidate = source + table[hash];
+    table[hash] = (uint32_t) (in - source);
+
+    if (candidate >= in || in - candidate > MAX_OFFSET || read32(candidate) != read32(in)) {
+      // skip ahead faster the longer we go without finding anything, like LZ4 does
+      in += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+
+    const uint8_t *matchEnd = in + MIN_MATCH;
+    const uint8_t *candidateEnd = candidate + MIN_MATCH;
+    while (matchEnd + 8 <= end && read64(matchEnd) == read64(candidateEnd)) {
+      matchEnd += 8;
+      candidateEnd += 8;
+    }
+    while (matchEnd < end && *matchEnd == *candidateEnd) {
+      matchEnd++;
+      candidateEnd++;
+    }
+
+    size_t literalLength = in - literalStart;
+    size_t matchLength = matchEnd - in - MIN_MATCH;
+    if (out + 1 + literalLength + literalLength / 255 + 1 + 2 + matchLength / 255 + 1 > outEnd) {
+      return 0;
+    }
+
+    uint8_t *token = out++;
+    *token = (uint8_t) (((literalLength < 15 ? literalLength : 15) << 4) | (matchLength < 15 ? matchLength : 15));
+    if (literalLength >= 15) {
+      out = writeLength(out, literalLength - 15);
+    }
+    memcpy(out, literalStart, literalLength);
+    out += literalLength;
+
+    uint16_t offset = (uint16_t) (in - candidate);
+    *out++ = (uint8_t) offset;
+    *out++ = (uint8_t) (offset >> 8);
+    if (matchLength >= 15) {
+      out = writeLength(out, matchLength - 15);
+    }
+
+    in = matchEnd;
+    literalStart = in;
+  }
+
+  size_t literalLength = end - literalStart;
+  if (out + 1 + literalLength + literalLength / 255 + 1 > outEnd) {
+    return 0;
+  }
+  *out++ = (uint8_t) ((literalLength < 15 ? literalLength : 15) << 4);
+  if (literalLength >= 15) {
+    out = writeLength(out, literalLength - 15);
+  }
+  memcpy(out, literalStart, literalLength);
+  out += literalLength;
+
+  return out - destination;
+}
+
+/**
+ *
+ * destinationSize has to be exactly the size that was compressed.
+ *
+ * Returns error code:
+ *  1: Compressed data is corrupt.
+ *
+ */
+int lzDecompress(const uint8_t *source, size_t sourceSize, uint8_t *destination, size_t destinationSize)
+{
+  const uint8_t *in = source;
+  const uint8_t *inEnd = source + sourceSize;
+  uint8_t *out = destination;
+  uint8_t *outEnd = destination + destinationSize;
+
+  while (in < inEnd) {
+    uint8_t token = *in++;
+
+    size_t literalLength = token >> 4;
+    if (literalLength == 15) {
+      uint8_t more;
+      do {
+        if (in >= inEnd) {
+          return 1;
+        }
+        more = *in++;
+        literalLength += more;
+      } while (more == 255);
+    }
+
+    if ((size_t) (inEnd - in) < literalLength || (size_t) (outEnd - out) < literalLength) {
+      return 1;
+    }
+    memcpy(out, in, literalLength);
+    in += literalLength;
+    out += literalLength;
+
+    if (in == inEnd) {
+      break;  // the last sequence has no match
+    }
+
+    if (inEnd - in < 2) {
+      return 1;
+    }
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+
+    size_t matchLength = token & 0x0F;
+    if (matchLength == 15) {
+      uint8_t more;
+      do {
+        if (in >= inEnd) {
+          return 1;
+        }
+        more = *in++;
+        matchLength += more;
+      } while (more == 255);
+    }
+    matchLength += MIN_MATCH;
+
+    if (offset == 0 || offset > (size_t) (out - destination) || (size_t) (outEnd - out) < matchLength) {
+      return 1;
+    }
+
+    // The match may overlap what it's writing, which repeats the last offset bytes. Copying in chunks that double in
+    // size each time keeps every memcpy non-overlapping while preserving the repetition.
+    const uint8_t *match = out - offset;
+    size_t copied = 0;
+    while (copied < matchLength) {
+      size_t chunk = offset + copied;
+      if (chunk > matchLength - copied) {
+        chunk = matchLength - copied;
+      }
+      memcpy(out + copied, match, chunk);
+      copied += chunk;
+    }
+    out += matchLength;
+  }
+
+  return out == outEnd ? 0 : 1;
+}
@@ -0,0 +1,17 @@
+#ifndef FILE_COMPRESS_H_SEEN
+#define FILE_COMPRESS_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A small LZ77 codec in the style of LZ4: byte-aligned sequences of literals followed by a match, no entropy coding.
+ * It's there for squeezing save states (which are mostly zeros once they've been XORed against another state), so it
+ * favours speed over ratio.
+ */
+
+size_t lzCompressBound(size_t sourceSize);
+size_t lzCompress(const uint8_t *source, size_t sourceSize, uint8_t *destination, size_t destinationCapacity);
+int lzDecompress(const uint8_t *source, size_t sourceSize, uint8_t *destination, size_t destinationSize);
+
+#endif /* !FILE_COMPRESS_H_SEEN */
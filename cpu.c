@@ -4,6 +4,9 @@
 #include "cpu.h"
 #include "ppu.h"
 #include "debug.h"
+#include "ramwatch.h"
+#include "profiler.h"
+#include "cputrace.h"
 
 // the 6502 has 256 byte pages
 
@@ -81,6 +84,24 @@ void printState(struct Computer *state)
 #endif
 }
 
+// see ramwatch.h
+static void markRamWrite(struct RamWatch *ramWatch, unsigned int memoryAddress)
+{
+  int index;
+  if (memoryAddress < RAM_WATCH_RAM_SIZE) {
+    index = (int) memoryAddress;
+  } else if (ramWatch->includePrgRam && memoryAddress >= RAM_WATCH_PRG_RAM_START && memoryAddress < RAM_WATCH_PRG_RAM_START + RAM_WATCH_PRG_RAM_SIZE) {
+    index = (int) (memoryAddress - RAM_WATCH_PRG_RAM_START) + RAM_WATCH_RAM_SIZE;
+  } else {
+    return;
+  }
+
+  if (!ramWatch->written[index]) {
+    ramWatch->written[index] = 1;
+    ramWatch->writtenIndices[ramWatch->numWritten++] = (uint16_t) index;
+  }
+}
+
 void writeMemory(unsigned int memoryAddress, unsigned char value, struct Computer *state)
 {
   bool shouldWriteMemory = true;
@@ -89,6 +110,9 @@ void writeMemory(unsigned int memoryAddress, unsigned char value, struct Compute
   }
   if (shouldWriteMemory) {
     state->memory[memoryAddress] = value;
+    if (state->ramWatch) {
+      markRamWrite(state->ramWatch, memoryAddress);
+    }
   }
 }
 
@@ -117,13 +141,17 @@ void setZeroFlag(unsigned char val, unsigned char *zeroFlag)
   *zeroFlag = (val == 0);
 }
 
-void pushToStack(unsigned char val, unsigned char *memory, unsigned char *stackRegister)
+// takes the whole state (unlike popFromStack) so the write can be seen by a RAM watch
+void pushToStack(unsigned char val, struct Computer *state)
 {
 #ifdef PRINT_PUSH_TO_STACK
-  printf("Push %02x to stack at position %02x\n", val, *stackRegister);
+  printf("Push %02x to stack at position %02x\n", val, state->stackRegister);
 #endif
-  memory[0x0100 + *stackRegister] = val;
-  *stackRegister = *stackRegister - 1;
+  state->memory[0x0100 + state->stackRegister] = val;
+  if (state->ramWatch) {
+    markRamWrite(state->ramWatch, 0x0100 + state->stackRegister);
+  }
+  state->stackRegister = state->stackRegister - 1;
 }
 
 unsigned char popFromStack(unsigned char *memory, unsigned char *stackRegister)
@@ -254,7 +282,7 @@ void printInstruction(unsigned char instr, int length, struct Computer *state)
 
     for (int i = 1; i <= length; i++)
     {
-      sprintf(str, " %02x", state->memory[state->pc + i]);
+      sprintf(str, " %02x", readMemory(state->pc + i, state));
       print(str);
     }
     print("\n");
@@ -333,8 +361,8 @@ int brk6502(unsigned char instr, enum AddressingMode addressingMode, struct Comp
 {
   state->pc++;
   unsigned int pcToPushToStack = state->pc + 1;
-  pushToStack(pcToPushToStack >> 8, state->memory, &state->stackRegister);
-  pushToStack(pcToPushToStack, state->memory, &state->stackRegister);
+  pushToStack(pcToPushToStack >> 8, state);
+  pushToStack(pcToPushToStack, state);
 
   // NV1BDIZC
   // extract into function?
@@ -342,7 +370,7 @@ int brk6502(unsigned char instr, enum AddressingMode addressingMode, struct Comp
     | (state->decimalFlag << 3) | (state->interruptDisable << 2) | (state->zeroFlag << 1) | (state->carryFlag);
 
   /*processorStatus = processorStatus | 0x10;  // set break command flag*/
-  pushToStack(processorStatus, state->memory, &state->stackRegister);
+  pushToStack(processorStatus, state);
 
   state->interruptDisable = 1;
 
@@ -350,8 +378,8 @@ int brk6502(unsigned char instr, enum AddressingMode addressingMode, struct Comp
   printInstruction(instr, length, state);
   printInstructionDescription(state, "BRK", addressingMode, "force interrupt");
 
-  unsigned char lowNibble = (state->memory)[0xFFFE];
-  unsigned char highNibble = (state->memory)[0xFFFF];
+  unsigned char lowNibble = readMemory(0xFFFE, state);
+  unsigned char highNibble = readMemory(0xFFFF, state);
 
   state->pc = (highNibble << 8) | lowNibble;
   return cycleCount(instr, false);
@@ -1034,7 +1062,7 @@ int php(unsigned char instr, enum AddressingMode addressingMode, struct Computer
   printInstruction(instr, length, state);
   printInstructionDescription(state, "PHP", addressingMode, "push status flags %02x to stack", value);
 
-  pushToStack(value, state->memory, &state->stackRegister);
+  pushToStack(value, state);
 
   state->pc += (1 + length);
   return cycleCount(instr, false);
@@ -1078,7 +1106,7 @@ int pha(unsigned char instr, enum AddressingMode addressingMode, struct Computer
   printInstruction(instr, length, state);
   printInstructionDescription(state, "PHA", addressingMode, "push acc value %02x to stack at position %02x", state->acc, state->stackRegister);
 
-  pushToStack(state->acc, state->memory, &state->stackRegister);
+  pushToStack(state->acc, state);
 
   state->pc += (1 + length);
   return cycleCount(instr, false);
@@ -1181,8 +1209,8 @@ int jsr(unsigned char instr, enum AddressingMode addressingMode, struct Computer
   int length = getMemoryAddressWithNoPageBoundaryConsiderations(&memoryAddress, addressingMode, state);
 
   unsigned int pcToPutInStack = (state->pc + 3) - 1;
-  pushToStack(pcToPutInStack >> 8, state->memory, &state->stackRegister);
-  pushToStack(pcToPutInStack, state->memory, &state->stackRegister);
+  pushToStack(pcToPutInStack >> 8, state);
+  pushToStack(pcToPutInStack, state);
 
   printInstruction(instr, length, state);
   printInstructionDescription(state, "JSR", addressingMode, "jump to subroutine: %x", memoryAddress);
@@ -1294,14 +1322,17 @@ void fireIrqInterrupt(struct Computer *state) {
   state->irqPending = false;
 
   unsigned int pcToPushToStack = state->pc;
-  pushToStack(pcToPushToStack >> 8, state->memory, &state->stackRegister);
-  pushToStack(pcToPushToStack, state->memory, &state->stackRegister);
+  pushToStack(pcToPushToStack >> 8, state);
+  pushToStack(pcToPushToStack, state);
 
   // Note that the break flag is not set to 1 here, unlike when using BRK. https://www.pagetable.com/?p=410
   unsigned char processorStatus = (state->negativeFlag << 7) | (state->overflowFlag << 6) | (1 << 5) | (0 << 4)
     | (state->decimalFlag << 3) | (state->interruptDisable << 2) | (state->zeroFlag << 1) | (state->carryFlag);
 
-  pushToStack(processorStatus, state->memory, &state->stackRegister);
+  pushToStack(processorStatus, state);
+  if (state->profiler) {
+    state->profiler->onInterrupt(state->profiler, PROFILER_KEY_IRQ, state);
+  }
 
   state->interruptDisable = 1;
   state->pc = (readMemory(0xffff, state) << 8) | readMemory(0xfffe, state);
@@ -1312,14 +1343,17 @@ void fireNmiInterrupt(struct Computer *state) {
   state->nmiPending = false;
 
   unsigned int pcToPushToStack = state->pc;
-  pushToStack(pcToPushToStack >> 8, state->memory, &state->stackRegister);
-  pushToStack(pcToPushToStack, state->memory, &state->stackRegister);
+  pushToStack(pcToPushToStack >> 8, state);
+  pushToStack(pcToPushToStack, state);
 
   // Note that the break flag is not set to 1 here, unlike when using BRK. https://www.pagetable.com/?p=410
   unsigned char processorStatus = (state->negativeFlag << 7) | (state->overflowFlag << 6) | (1 << 5) | (0 << 4)
     | (state->decimalFlag << 3) | (state->interruptDisable << 2) | (state->zeroFlag << 1) | (state->carryFlag);
 
-  pushToStack(processorStatus, state->memory, &state->stackRegister);
+  pushToStack(processorStatus, state);
+  if (state->profiler) {
+    state->profiler->onInterrupt(state->profiler, PROFILER_KEY_NMI, state);
+  }
 
   state->interruptDisable = 1;
   
@@ -1368,19 +1402,15 @@ enum AddressingMode addressingModes[256] = {
   Relative,        IndirectIndexed, 0,               0,               0,               ZeroPageX,       ZeroPageX,       0,               Implicit,        AbsoluteY,       0,               0,               0,               AbsoluteX,       AbsoluteX,       0  // F
 };
 
-int executeInstruction(unsigned char instr, struct Computer *state)
+// pc is where instr was
+static void finishInstruction(unsigned char instr, unsigned int pc, int numCycles, struct Computer *state)
 {
-#ifdef PRINT_PC
-if (state->debuggingOn) {
-  char str[20];
-  sprintf(str, "PC: %04x\n", state->pc);
-  print(str);
-}
-#endif
-
-  int numCycles = instructions[instr](instr, addressingModes[instr], state);
   state->totalCyclesCompleted += numCycles;
 
+  if (state->profiler) {
+    state->profiler->onInstruction(state->profiler, pc, instr, numCycles, state);
+  }
+
   if (state->nmiPending) {
     fireNmiInterrupt(state);
   } else if (state->irqPending) {
@@ -1396,8 +1426,44 @@ if (state->debuggingOn) {
   printf("\n\n");
 #endif
 }
+}
+
+int executeInstruction(unsigned char instr, struct Computer *state)
+{
+#ifdef PRINT_PC
+if (state->debuggingOn) {
+  char str[20];
+  sprintf(str, "PC: %04x\n", state->pc);
+  print(str);
+}
+#endif
+
+  if (state->cpuTrace) {
+    state->cpuTrace->onInstruction(state->cpuTrace, instr, state);
+  }
+
+  unsigned int pc = state->pc;
+  int numCycles = instructions[instr](instr, addressingModes[instr], state);
+  finishInstruction(instr, pc, numCycles, state);
 
   return numCycles;
 }
 
+// Runs the same instruction on several CPUs (that are all at the same pc), looking up how to run it only once.
+// cycles gets how many cycles it took on each of them.
+void executeInstructionOnLanes(unsigned char instr, struct Computer **states, int numStates, int *cycles)
+{
+  int (*instruction)(unsigned char, enum AddressingMode, struct Computer *) = instructions[instr];
+  enum AddressingMode addressingMode = addressingModes[instr];
+
+  for (int i = 0; i < numStates; i++) {
+    if (states[i]->cpuTrace) {
+      states[i]->cpuTrace->onInstruction(states[i]->cpuTrace, instr, states[i]);
+    }
+    unsigned int pc = states[i]->pc;
+    cycles[i] = instruction(instr, addressingMode, states[i]);
+    finishInstruction(instr, pc, cycles[i], states[i]);
+  }
+}
+
 
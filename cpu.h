@@ -3,8 +3,14 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "apu.h"
 
 struct PPUClosure;
+struct BatteryRam;
+struct RamWatch;
+struct CpuProfiler;
+struct CpuTrace;
+struct StageTimer;
 struct KeyboardInput;
 
 struct Computer 
@@ -18,6 +24,10 @@ struct Computer
   uint8_t *prgRomBlock3;
   uint8_t *prgRomBlock4;
 
+  // start of PRG ROM, which the blocks above point into (forks share their parent's)
+  uint8_t *prgRom;
+  unsigned int sizeOfPrgRomInBytes;
+
   unsigned int pc;
 
   unsigned char acc;
@@ -47,6 +57,28 @@ struct Computer
 
   struct KeyboardInput *keyboardInput;
 
+  // null unless the cartridge has battery-backed PRG RAM
+  struct BatteryRam *batteryRam;
+
+  // null unless something wants to know which bytes of RAM change (see ramwatch.h)
+  struct RamWatch *ramWatch;
+
+  // null unless profiling (see profiler.h)
+  struct CpuProfiler *profiler;
+
+  // null unless recording every instruction (see cputrace.h)
+  struct CpuTrace *cpuTrace;
+
+  // null unless timing where each frame's time goes (see timing.h)
+  struct StageTimer *stageTimer;
+
+  // null unless writing a timeline of frames, scanlines and so on (see trace.h); set with traceEmulator
+  struct TraceBuffer *trace;
+  uint64_t traceFrameStart;
+  uint64_t traceScanlinesStart;
+
+  struct APU apu;
+
   // TODO: do we actually need pollController? Can we move these elsewhere?
   bool pollController;
   uint8_t currentButtonBit;
@@ -56,6 +88,7 @@ struct Computer
 };
 
 int executeInstruction(unsigned char instr, struct Computer *state);
+void executeInstructionOnLanes(unsigned char instr, struct Computer **states, int numStates, int *cycles);
 void triggerIrqInterrupt(struct Computer *state);
 void fireIrqInterrupt(struct Computer *state);
 void triggerNmiInterrupt(struct Computer *state);
@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "cputrace.h"
+#include "platform.h"
+#include "ppu.h"
+
+// Reading $2000 to $5FFF can clear the vblank flag, move the VRAM address, acknowledge the APU's interrupts or shift
+// the controller, so operand bytes are only looked at in RAM, PRG RAM and PRG ROM.
+static uint8_t peekOperand(unsigned int address, struct Computer *state)
+{
+  address &= 0xFFFF;
+  return (address < 0x2000 || address >= 0x6000) ? readMemory(address, state) : 0;
+}
+
+static void recordInstruction(struct CpuTrace *trace, uint8_t opcode, struct Computer *state)
+{
+  uint32_t added = trace->added;
+  if (added - trace->readSeen >= CPU_TRACE_RING_RECORDS) {
+    atomicStore32(&trace->written, (int32_t) added);
+    trace->readSeen = (uint32_t) atomicLoad32(&trace->read);
+    while (added - trace->readSeen >= CPU_TRACE_RING_RECORDS) {
+      trace->stalls++;
+      sleepNanoseconds(CPU_TRACE_FULL_SLEEP_NANOSECONDS);
+      trace->readSeen = (uint32_t) atomicLoad32(&trace->read);
+    }
+  }
+
+  struct CpuTraceRecord *record = &trace->records[added & (CPU_TRACE_RING_RECORDS - 1)];
+  record->cycle = (uint32_t) state->totalCyclesCompleted;
+  record->pc = (uint16_t) state->pc;
+  if (state->ppuClosure) {
+    record->scanline = (int16_t) state->ppuClosure->ppu->scanline;
+    record->dot = (uint16_t) state->ppuClosure->ppu->scanlineClockCycle;
+  } else {
+    record->scanline = 0;
+    record->dot = 0;
+  }
+  record->opcode = opcode;
+  record->operands[0] = peekOperand(state->pc + 1, state);
+  record->operands[1] = peekOperand(state->pc + 2, state);
+  record->a = state->acc;
+  record->x = state->xRegister;
+  record->y = state->yRegister;
+  record->p = (uint8_t) ((state->negativeFlag << 7) | (state->overflowFlag << 6) | (1 << 5) | (state->decimalFlag << 3)
+      | (state->interruptDisable << 2) | (state->zeroFlag << 1) | state->carryFlag);
+  record->s = state->stackRegister;
+  record->unused[0] = 0;
+  record->unused[1] = 0;
+
+  trace->added = ++added;
+  if ((added & (CPU_TRACE_PUBLISH_RECORDS - 1)) == 0) {
+    atomicStore32(&trace->written, (int32_t) added);
+  }
+}
+
+// Writes out everything the CPU has published. Only the writer thread calls this.
+static void writeRecords(struct CpuTrace *trace)
+{
+  uint32_t read = (uint32_t) trace->read;
+  uint32_t written = (uint32_t) atomicLoad32(&trace->written);
+  while (read != written) {
+    // in at most two pieces, either side of the end of the ring
+    uint32_t start = read & (CPU_TRACE_RING_RECORDS - 1);
+    uint32_t count = written - read;
+    if (count > CPU_TRACE_RING_RECORDS - start) {
+      count = CPU_TRACE_RING_RECORDS - start;
+    }
+    if (!trace->failed && fwrite(&trace->records[start], sizeof(struct CpuTraceRecord), count, trace->file) != count) {
+      trace->failed = true;
+    }
+    read += count;
+    atomicStore32(&trace->read, (int32_t) read);
+  }
+}
+
+static void writerThreadMain(void *argument)
+{
+  struct CpuTrace *trace = (struct CpuTrace *) argument;
+  for (;;) {
+    // stopping is set after the last records are published, so this round gets all of them
+    bool stopping = atomicLoad32(&trace->stopping) != 0;
+    writeRecords(trace);
+    if (stopping) {
+      break;
+    }
+    sleepNanoseconds(CPU_TRACE_WRITER_SLEEP_NANOSECONDS);
+  }
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: Could not create the file.
+ *  3: Could not start the writer thread.
+ *
+ */
+int createCpuTrace(struct CpuTrace **trace, const char *filename)
+{
+  struct CpuTrace *newTrace = (struct CpuTrace *) calloc(1, sizeof(struct CpuTrace));
+  if (!newTrace) {
+    return 1;
+  }
+  newTrace->onInstruction = recordInstruction;
+
+  newTrace->file = fopen(filename, "wb");
+  if (!newTrace->file) {
+    free(newTrace);
+    return 2;
+  }
+  struct CpuTraceHeader header;
+  memcpy(header.magic, CPU_TRACE_MAGIC, sizeof(header.magic));
+  header.version = CPU_TRACE_VERSION;
+  header.recordSize = sizeof(struct CpuTraceRecord);
+  if (fwrite(&header, sizeof(header), 1, newTrace->file) != 1) {
+    newTrace->failed = true;
+  }
+
+  if (createThread(&newTrace->writerThread, writerThreadMain, newTrace)) {
+    fclose(newTrace->file);
+    free(newTrace);
+    return 3;
+  }
+
+  *trace = newTrace;
+  return 0;
+}
+
+/**
+ *
+ * Detach it from the CPU first.
+ *
+ * Returns error code:
+ *  1: Could not write the file.
+ *
+ */
+int destroyCpuTrace(struct CpuTrace *trace)
+{
+  atomicStore32(&trace->written, (int32_t) trace->added);
+  atomicStore32(&trace->stopping, 1);
+  joinThread(&trace->writerThread);
+
+  bool failed = trace->failed || ferror(trace->file);
+  if (fclose(trace->file) != 0) {
+    failed = true;
+  }
+  free(trace);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+#ifndef FILE_CPUTRACE_H_SEEN
+#define FILE_CPUTRACE_H_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "platform.h"
+
+struct Computer;
+
+#define CPU_TRACE_MAGIC "CFCT"
+#define CPU_TRACE_VERSION 1
+#define CPU_TRACE_RING_RECORDS (1 << 16)     // a power of two
+#define CPU_TRACE_PUBLISH_RECORDS 256        // how many records the CPU adds before telling the writer about them
+#define CPU_TRACE_WRITER_SLEEP_NANOSECONDS 1000000
+#define CPU_TRACE_FULL_SLEEP_NANOSECONDS 100000
+
+/*
+ * One instruction, with everything as it was just before it ran, which is how nestest.log and the logs people compare
+ * against it are laid out. 20 bytes, in the byte order of the machine that wrote it.
+ */
+struct CpuTraceRecord
+{
+  uint32_t cycle;     // totalCyclesCompleted, which wraps after a couple of hours of NES time
+  uint16_t pc;
+  int16_t scanline;   // where the PPU was: -1 to 260, 0 without a PPU
+  uint16_t dot;       // 0 to 340
+  uint8_t opcode;
+  uint8_t operands[2];  // the two bytes after the opcode whether it uses them or not; 0 when reading them could
+                        // change something (the PPU and APU registers)
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t p;   // the status flags as PHP would push them, without the break flag
+  uint8_t s;
+  uint8_t unused[2];
+};
+
+struct CpuTraceHeader
+{
+  char magic[4];  // CPU_TRACE_MAGIC
+  uint16_t version;
+  uint16_t recordSize;
+};
+
+/*
+ * Every instruction the CPU runs, as fixed size binary records (above) after a header, for comparing against another
+ * emulator's log or finding where a game went wrong. dump_cpu_trace turns the file into nestest style text.
+ *
+ * The CPU calls onInstruction before every instruction through a pointer, like the profiler, so cpu.c still builds on
+ * its own for the functional tests and costs one never-taken branch when nothing's attached (state->cpuTrace null).
+ * Recording an instruction is filling in 20 bytes of a ring; every CPU_TRACE_PUBLISH_RECORDS of them the CPU tells a
+ * writer thread, which wakes up every CPU_TRACE_WRITER_SLEEP_NANOSECONDS and writes out whatever is there in big
+ * chunks. The ring has the same one writer, one reader arrangement as audioring.h. Nothing is ever dropped: if the disk
+ * can't keep up and the ring fills, the CPU waits for room and the wait is counted in stalls.
+ *
+ * destroyCpuTrace writes out the rest of the records, so it's the thread running the CPU that has to call it.
+ */
+struct CpuTrace
+{
+  void (*onInstruction)(struct CpuTrace *trace, uint8_t opcode, struct Computer *state);
+
+  struct CpuTraceRecord records[CPU_TRACE_RING_RECORDS];
+
+  // only the CPU's thread touches these
+  uint32_t added;
+  uint32_t readSeen;  // the last read count we loaded, so a ring with room doesn't need an atomic load each time
+  uint64_t stalls;
+
+  uint8_t writerLine[64];
+  volatile int32_t written;  // published by the CPU's thread
+  volatile int32_t stopping;
+  uint8_t readerLine[64];
+  volatile int32_t read;     // published by the writer thread
+  uint8_t endLine[64];
+
+  FILE *file;
+  struct Thread writerThread;
+  uint64_t recordsWritten;  // only the writer thread touches these while it's running
+  bool failed;
+};
+
+int createCpuTrace(struct CpuTrace **trace, const char *filename);
+int destroyCpuTrace(struct CpuTrace *trace);
+
+#endif /* !FILE_CPUTRACE_H_SEEN */
@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "cputrace.h"
+#include "cputracetext.h"
+
+#define MODE_IMPLICIT 0
+#define MODE_ACCUMULATOR 1
+#define MODE_IMMEDIATE 2
+#define MODE_ZERO_PAGE 3
+#define MODE_ZERO_PAGE_X 4
+#define MODE_ZERO_PAGE_Y 5
+#define MODE_RELATIVE 6
+#define MODE_ABSOLUTE 7
+#define MODE_ABSOLUTE_X 8
+#define MODE_ABSOLUTE_Y 9
+#define MODE_INDIRECT 10
+#define MODE_INDEXED_INDIRECT 11
+#define MODE_INDIRECT_INDEXED 12
+
+struct Opcode
+{
+  const char *name;  // null for the ones cpu.c doesn't run
+  int mode;
+};
+
+static const struct Opcode opcodes[256] = {
+  [0x00] = { "BRK", MODE_IMPLICIT },       [0x01] = { "ORA", MODE_INDEXED_INDIRECT }, [0x05] = { "ORA", MODE_ZERO_PAGE },
+  [0x06] = { "ASL", MODE_ZERO_PAGE },      [0x08] = { "PHP", MODE_IMPLICIT },         [0x09] = { "ORA", MODE_IMMEDIATE },
+  [0x0A] = { "ASL", MODE_ACCUMULATOR },    [0x0D] = { "ORA", MODE_ABSOLUTE },         [0x0E] = { "ASL", MODE_ABSOLUTE },
+  [0x10] = { "BPL", MODE_RELATIVE },       [0x11] = { "ORA", MODE_INDIRECT_INDEXED }, [0x15] = { "ORA", MODE_ZERO_PAGE_X },
+  [0x16] = { "ASL", MODE_ZERO_PAGE_X },    [0x18] = { "CLC", MODE_IMPLICIT },         [0x19] = { "ORA", MODE_ABSOLUTE_Y },
+  [0x1D] = { "ORA", MODE_ABSOLUTE_X },     [0x1E] = { "ASL", MODE_ABSOLUTE_X },
+  [0x20] = { "JSR", MODE_ABSOLUTE },       [0x21] = { "AND", MODE_INDEXED_INDIRECT }, [0x24] = { "BIT", MODE_ZERO_PAGE },
+  [0x25] = { "AND", MODE_ZERO_PAGE },      [0x26] = { "ROL", MODE_ZERO_PAGE },        [0x28] = { "PLP", MODE_IMPLICIT },
+  [0x29] = { "AND", MODE_IMMEDIATE },      [0x2A] = { "ROL", MODE_ACCUMULATOR },      [0x2C] = { "BIT", MODE_ABSOLUTE },
+  [0x2D] = { "AND", MODE_ABSOLUTE },       [0x2E] = { "ROL", MODE_ABSOLUTE },
+  [0x30] = { "BMI", MODE_RELATIVE },       [0x31] = { "AND", MODE_INDIRECT_INDEXED }, [0x35] = { "AND", MODE_ZERO_PAGE_X },
+  [0x36] = { "ROL", MODE_ZERO_PAGE_X },    [0x38] = { "SEC", MODE_IMPLICIT },         [0x39] = { "AND", MODE_ABSOLUTE_Y },
+  [0x3D] = { "AND", MODE_ABSOLUTE_X },     [0x3E] = { "ROL", MODE_ABSOLUTE_X },
+  [0x40] = { "RTI", MODE_IMPLICIT },       [0x41] = { "EOR", MODE_INDEXED_INDIRECT }, [0x45] = { "EOR", MODE_ZERO_PAGE },
+  [0x46] = { "LSR", MODE_ZERO_PAGE },      [0x48] = { "PHA", MODE_IMPLICIT },         [0x49] = { "EOR", MODE_IMMEDIATE },
+  [0x4A] = { "LSR", MODE_ACCUMULATOR },    [0x4C] = { "JMP", MODE_ABSOLUTE },         [0x4D] = { "EOR", MODE_ABSOLUTE },
+  [0x4E] = { "LSR", MODE_ABSOLUTE },
+  [0x50] = { "BVC", MODE_RELATIVE },       [0x51] = { "EOR", MODE_INDIRECT_INDEXED }, [0x55] = { "EOR", MODE_ZERO_PAGE_X },
+  [0x56] = { "LSR", MODE_ZERO_PAGE_X },    [0x58] = { "CLI", MODE_IMPLICIT },         [0x59] = { "EOR", MODE_ABSOLUTE_Y },
+  [0x5D] = { "EOR", MODE_ABSOLUTE_X },     [0x5E] = { "LSR", MODE_ABSOLUTE_X },
+  [0x60] = { "RTS", MODE_IMPLICIT },       [0x61] = { "ADC", MODE_INDEXED_INDIRECT }, [0x65] = { "ADC", MODE_ZERO_PAGE },
+  [0x66] = { "ROR", MODE_ZERO_PAGE },      [0x68] = { "PLA", MODE_IMPLICIT },         [0x69] = { "ADC", MODE_IMMEDIATE },
+  [0x6A] = { "ROR", MODE_ACCUMULATOR },    [0x6C] = { "JMP", MODE_INDIRECT },         [0x6D] = { "ADC", MODE_ABSOLUTE },
+  [0x6E] = { "ROR", MODE_ABSOLUTE },
+  [0x70] = { "BVS", MODE_RELATIVE },       [0x71] = { "ADC", MODE_INDIRECT_INDEXED }, [0x75] = { "ADC", MODE_ZERO_PAGE_X },
+  [0x76] = { "ROR", MODE_ZERO_PAGE_X },    [0x78] = { "SEI", MODE_IMPLICIT },         [0x79] = { "ADC", MODE_ABSOLUTE_Y },
+  [0x7D] = { "ADC", MODE_ABSOLUTE_X },     [0x7E] = { "ROR", MODE_ABSOLUTE_X },
+  [0x81] = { "STA", MODE_INDEXED_INDIRECT }, [0x84] = { "STY", MODE_ZERO_PAGE },      [0x85] = { "STA", MODE_ZERO_PAGE },
+  [0x86] = { "STX", MODE_ZERO_PAGE },      [0x88] = { "DEY", MODE_IMPLICIT },         [0x8A] = { "TXA", MODE_IMPLICIT },
+  [0x8C] = { "STY", MODE_ABSOLUTE },       [0x8D] = { "STA", MODE_ABSOLUTE },         [0x8E] = { "STX", MODE_ABSOLUTE },
+  [0x90] = { "BCC", MODE_RELATIVE },       [0x91] = { "STA", MODE_INDIRECT_INDEXED }, [0x94] = { "STY", MODE_ZERO_PAGE_X },
+  [0x95] = { "STA", MODE_ZERO_PAGE_X },    [0x96] = { "STX", MODE_ZERO_PAGE_Y },      [0x98] = { "TYA", MODE_IMPLICIT },
+  [0x99] = { "STA", MODE_ABSOLUTE_Y },     [0x9A] = { "TXS", MODE_IMPLICIT },         [0x9D] = { "STA", MODE_ABSOLUTE_X },
+  [0xA0] = { "LDY", MODE_IMMEDIATE },      [0xA1] = { "LDA", MODE_INDEXED_INDIRECT }, [0xA2] = { "LDX", MODE_IMMEDIATE },
+  [0xA4] = { "LDY", MODE_ZERO_PAGE },      [0xA5] = { "LDA", MODE_ZERO_PAGE },        [0xA6] = { "LDX", MODE_ZERO_PAGE },
+  [0xA8] = { "TAY", MODE_IMPLICIT },       [0xA9] = { "LDA", MODE_IMMEDIATE },        [0xAA] = { "TAX", MODE_IMPLICIT },
+  [0xAC] = { "LDY", MODE_ABSOLUTE },       [0xAD] = { "LDA", MODE_ABSOLUTE },         [0xAE] = { "LDX", MODE_ABSOLUTE },
+  [0xB0] = { "BCS", MODE_RELATIVE },       [0xB1] = { "LDA", MODE_INDIRECT_INDEXED }, [0xB4] = { "LDY", MODE_ZERO_PAGE_X },
+  [0xB5] = { "LDA", MODE_ZERO_PAGE_X },    [0xB6] = { "LDX", MODE_ZERO_PAGE_Y },      [0xB8] = { "CLV", MODE_IMPLICIT },
+  [0xB9] = { "LDA", MODE_ABSOLUTE_Y },     [0xBA] = { "TSX", MODE_IMPLICIT },         [0xBC] = { "LDY", MODE_ABSOLUTE_X },
+  [0xBD] = { "LDA", MODE_ABSOLUTE_X },     [0xBE] = { "LDX", MODE_ABSOLUTE_Y },
+  [0xC0] = { "CPY", MODE_IMMEDIATE },      [0xC1] = { "CMP", MODE_INDEXED_INDIRECT }, [0xC4] = { "CPY", MODE_ZERO_PAGE },
+  [0xC5] = { "CMP", MODE_ZERO_PAGE },      [0xC6] = { "DEC", MODE_ZERO_PAGE },        [0xC8] = { "INY", MODE_IMPLICIT },
+  [0xC9] = { "CMP", MODE_IMMEDIATE },      [0xCA] = { "DEX", MODE_IMPLICIT },         [0xCC] = { "CPY", MODE_ABSOLUTE },
+  [0xCD] = { "CMP", MODE_ABSOLUTE },       [0xCE] = { "DEC", MODE_ABSOLUTE },
+  [0xD0] = { "BNE", MODE_RELATIVE },       [0xD1] = { "CMP", MODE_INDIRECT_INDEXED }, [0xD5] = { "CMP", MODE_ZERO_PAGE_X },
+  [0xD6] = { "DEC", MODE_ZERO_PAGE_X },    [0xD8] = { "CLD", MODE_IMPLICIT },         [0xD9] = { "CMP", MODE_ABSOLUTE_Y },
+  [0xDD] = { "CMP", MODE_ABSOLUTE_X },     [0xDE] = { "DEC", MODE_ABSOLUTE_X },
+  [0xE0] = { "CPX", MODE_IMMEDIATE },      [0xE1] = { "SBC", MODE_INDEXED_INDIRECT }, [0xE4] = { "CPX", MODE_ZERO_PAGE },
+  [0xE5] = { "SBC", MODE_ZERO_PAGE },      [0xE6] = { "INC", MODE_ZERO_PAGE },        [0xE8] = { "INX", MODE_IMPLICIT },
+  [0xE9] = { "SBC", MODE_IMMEDIATE },      [0xEA] = { "NOP", MODE_IMPLICIT },         [0xEC] = { "CPX", MODE_ABSOLUTE },
+  [0xED] = { "SBC", MODE_ABSOLUTE },       [0xEE] = { "INC", MODE_ABSOLUTE },
+  [0xF0] = { "BEQ", MODE_RELATIVE },       [0xF1] = { "SBC", MODE_INDIRECT_INDEXED }, [0xF5] = { "SBC", MODE_ZERO_PAGE_X },
+  [0xF6] = { "INC", MODE_ZERO_PAGE_X },    [0xF8] = { "SED", MODE_IMPLICIT },         [0xF9] = { "SBC", MODE_ABSOLUTE_Y },
+  [0xFD] = { "SBC", MODE_ABSOLUTE_X },     [0xFE] = { "INC", MODE_ABSOLUTE_X }
+};
+
+// how many bytes after the opcode each mode takes
+static const int modeOperandSizes[] = { 0, 0, 1, 1, 1, 1, 1, 2, 2, 2, 2, 1, 1 };
+
+/**
+ *
+ * Returns error code:
+ *  1: It isn't a CPU trace.
+ *  2: It's a different version, or has a different size of record, than this reads.
+ *
+ */
+int checkCpuTraceHeader(const struct CpuTraceHeader *header)
+{
+  if (memcmp(header->magic, CPU_TRACE_MAGIC, sizeof(header->magic)) != 0) {
+    return 1;
+  }
+  if (header->version != CPU_TRACE_VERSION || header->recordSize != sizeof(struct CpuTraceRecord)) {
+    return 2;
+  }
+  return 0;
+}
+
+// 1 to 3, counting the opcode
+int cpuTraceInstructionSize(uint8_t opcode)
+{
+  return 1 + (opcodes[opcode].name ? modeOperandSizes[opcodes[opcode].mode] : 0);
+}
+
+// As a line of nestest.log, without the newline.
+void formatCpuTraceRecord(char *str, size_t size, const struct CpuTraceRecord *record)
+{
+  const struct Opcode *opcode = &opcodes[record->opcode];
+  int mode = opcode->name ? opcode->mode : MODE_IMPLICIT;
+  int numOperands = modeOperandSizes[mode];
+  unsigned int operand = record->operands[0] | (numOperands == 2 ? record->operands[1] << 8 : 0);
+
+  char bytes[16];
+  if (numOperands == 0) {
+    sprintf(bytes, "%02X", record->opcode);
+  } else if (numOperands == 1) {
+    sprintf(bytes, "%02X %02X", record->opcode, record->operands[0]);
+  } else {
+    sprintf(bytes, "%02X %02X %02X", record->opcode, record->operands[0], record->operands[1]);
+  }
+
+  char text[32];
+  const char *name = opcode->name ? opcode->name : "???";
+  switch (mode) {
+    case MODE_ACCUMULATOR: sprintf(text, "%s A", name); break;
+    case MODE_IMMEDIATE: sprintf(text, "%s #$%02X", name, operand); break;
+    case MODE_ZERO_PAGE: sprintf(text, "%s $%02X", name, operand); break;
+    case MODE_ZERO_PAGE_X: sprintf(text, "%s $%02X,X", name, operand); break;
+    case MODE_ZERO_PAGE_Y: sprintf(text, "%s $%02X,Y", name, operand); break;
+    case MODE_RELATIVE: sprintf(text, "%s $%04X", name, (record->pc + 2 + (int8_t) operand) & 0xFFFF); break;
+    case MODE_ABSOLUTE: sprintf(text, "%s $%04X", name, operand); break;
+    case MODE_ABSOLUTE_X: sprintf(text, "%s $%04X,X", name, operand); break;
+    case MODE_ABSOLUTE_Y: sprintf(text, "%s $%04X,Y", name, operand); break;
+    case MODE_INDIRECT: sprintf(text, "%s ($%04X)", name, operand); break;
+    case MODE_INDEXED_INDIRECT: sprintf(text, "%s ($%02X,X)", name, operand); break;
+    case MODE_INDIRECT_INDEXED: sprintf(text, "%s ($%02X),Y", name, operand); break;
+    default: sprintf(text, "%s", name); break;
+  }
+
+  snprintf(str, size, "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%u", record->pc, bytes, text,
+      record->a, record->x, record->y, record->p, record->s, record->scanline, record->dot, record->cycle);
+}
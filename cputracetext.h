@@ -0,0 +1,15 @@
+#ifndef FILE_CPUTRACETEXT_H_SEEN
+#define FILE_CPUTRACETEXT_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cputrace.h"
+
+#define CPU_TRACE_LINE_SIZE 128
+
+// For the tools that read CPU traces (see cputrace.h) rather than the emulator, which doesn't need any of this.
+int checkCpuTraceHeader(const struct CpuTraceHeader *header);
+int cpuTraceInstructionSize(uint8_t opcode);
+void formatCpuTraceRecord(char *str, size_t size, const struct CpuTraceRecord *record);
+
+#endif /* !FILE_CPUTRACETEXT_H_SEEN */
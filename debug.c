@@ -8,8 +8,9 @@
 #ifdef _WIN32
 void OutputDebugStringA(LPCSTR);
 #else
+// debug output goes to stderr so it doesn't get mixed up with what command line tools print
 void OutputDebugStringA(char *str) {
-  printf("%s", str);
+  fputs(str, stderr);
 }
 
 int fopen_s(FILE **f, const char *name, const char *mode) {
@@ -0,0 +1,654 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cputrace.h"
+#include "cputracetext.h"
+#include "platform.h"
+
+/*
+ * Finds where two CPU traces first go different ways, e.g. ours against nestest.log or another emulator's log, and
+ * prints the instructions around it from both.
+ *
+ *   diff_cpu_trace <trace or log> <trace or log> [--context <instructions>] [--start <hex pc>] [--ignore <fields>]
+ *
+ * Each side can be a binary trace from headless --cpu-trace (see cputrace.h), told apart by its header, or a text log
+ * with one instruction a line. Lines in a log are read the way most emulators write them: the PC first (with or
+ * without a $ and a colon after it), then the instruction's bytes in hex if they're there, then anything, with the
+ * registers and so on as KEY:VALUE fields:
+ *
+ *   A X Y     hex
+ *   P         hex, or as flag letters (nvubdizc) with the set ones in capitals
+ *   SP or S   hex
+ *   CYC       CPU cycles, or the PPU dot when the line also has SL (the old nestest.log layout)
+ *   Cycle     CPU cycles
+ *   PPU       scanline,dot
+ *   SL, V     scanline
+ *   H         dot
+ *
+ * Lines without a PC are skipped. Only what both sides have is compared, after evening out how emulators differ:
+ * P without the break and unused bits, the scanline before the frame as -1 or 261, and cycles counted from each side's
+ * first instruction (and only the low 32 bits, which is all a binary trace keeps).
+ *
+ * --context  how many instructions to print before and after the difference (DEFAULT_CONTEXT_LINES)
+ * --start    skip each side up to the first instruction at this address, e.g. C000 for nestest's automated mode
+ * --ignore   fields not to compare, separated by commas: bytes, a, x, y, p, sp, cycles, ppu
+ *
+ * Both files are memory mapped and read straight through, so the OS reads ahead and nothing is copied. Two binary
+ * traces are compared a block at a time with memcmp until a block differs. Exits with 0 when everything that's in
+ * both matches (one side stopping early is reported but isn't a difference), 1 when something doesn't and 2 on errors.
+ */
+
+#define DEFAULT_CONTEXT_LINES 5
+#define MAX_CONTEXT_LINES 64
+#define FAST_COMPARE_RECORDS 4096
+#define SCANLINES_PER_FRAME 262
+
+#define FIELD_BYTES 0x01
+#define FIELD_A 0x02
+#define FIELD_X 0x04
+#define FIELD_Y 0x08
+#define FIELD_P 0x10
+#define FIELD_SP 0x20
+#define FIELD_CYCLES 0x40
+#define FIELD_PPU 0x80
+
+#define P_COMPARED_BITS 0xCF  // not the break flag (bit 4) or the unused bit 5
+
+static const struct
+{
+  const char *name;
+  int field;
+} fieldNames[] = {
+  { "bytes", FIELD_BYTES }, { "a", FIELD_A }, { "x", FIELD_X }, { "y", FIELD_Y }, { "p", FIELD_P }, { "sp", FIELD_SP },
+  { "cycles", FIELD_CYCLES }, { "ppu", FIELD_PPU }
+};
+
+// One instruction from either kind of file. Registers are -1 when a log doesn't have them.
+struct TraceLine
+{
+  uint64_t number;  // the line in a log or the record in a trace, from 1
+  const char *text;  // the line in a log, not terminated; null for a record
+  size_t textLength;
+  const struct CpuTraceRecord *record;  // null for a line of a log
+
+  uint16_t pc;
+  int numBytes;  // counting the opcode; 0 when a log doesn't have them
+  uint8_t bytes[3];
+  int a;
+  int x;
+  int y;
+  int p;
+  int s;
+  bool hasCycle;
+  uint32_t cycle;  // from the side's first instruction
+  bool hasPpu;
+  int scanline;  // 0 to 261
+  int dot;
+};
+
+struct TraceReader
+{
+  const char *filename;
+  struct MappedFile file;
+  bool binary;
+  const uint8_t *position;  // the next line or record
+  const uint8_t *end;
+  uint64_t number;          // of the last line or record read
+  bool sawCycle;
+  uint64_t firstCycle;
+
+  // the last few instructions read, for showing what led up to a difference
+  struct TraceLine history[MAX_CONTEXT_LINES];
+  uint64_t numRead;
+};
+
+static int hexDigit(uint8_t c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// numDigits hex digits, exactly, at text
+static int parseHex(const uint8_t *text, const uint8_t *end, int numDigits)
+{
+  if (end - text < numDigits) {
+    return -1;
+  }
+  int value = 0;
+  for (int i = 0; i < numDigits; i++) {
+    int digit = hexDigit(text[i]);
+    if (digit < 0) {
+      return -1;
+    }
+    value = (value << 4) | digit;
+  }
+  return value;
+}
+
+// after any spaces; *text ends up after the digits
+static bool parseDecimal(const uint8_t **text, const uint8_t *end, int64_t *value)
+{
+  const uint8_t *c = *text;
+  while (c < end && *c == ' ') {
+    c++;
+  }
+  bool negative = c < end && *c == '-';
+  if (negative) {
+    c++;
+  }
+  if (c == end || *c < '0' || *c > '9') {
+    return false;
+  }
+  int64_t number = 0;
+  for (; c < end && *c >= '0' && *c <= '9'; c++) {
+    number = number * 10 + (*c - '0');
+  }
+  *value = negative ? -number : number;
+  *text = c;
+  return true;
+}
+
+// P as eight flag letters, NVUBDIZC from bit 7 down, capital when set
+static int parseFlagLetters(const uint8_t *text, const uint8_t *end)
+{
+  if (end - text < 8) {
+    return -1;
+  }
+  int value = 0;
+  for (int i = 0; i < 8; i++) {
+    uint8_t c = text[i];
+    if (c >= 'A' && c <= 'Z') {
+      value |= 0x80 >> i;
+    } else if (c < 'a' || c > 'z') {
+      return -1;
+    }
+  }
+  return value;
+}
+
+static bool keyIs(const uint8_t *key, size_t keyLength, const char *name)
+{
+  return keyLength == strlen(name) && memcmp(key, name, keyLength) == 0;
+}
+
+// false for lines that aren't an instruction (headers, blank lines)
+static bool parseTextLine(const uint8_t *start, const uint8_t *end, struct TraceLine *line)
+{
+  const uint8_t *c = start;
+  while (c < end && (*c == ' ' || *c == '\t')) {
+    c++;
+  }
+  if (c < end && *c == '$') {
+    c++;
+  }
+  int pc = parseHex(c, end, 4);
+  if (pc < 0 || (c + 4 < end && c[4] != ' ' && c[4] != ':' && c[4] != '\t')) {
+    return false;
+  }
+  line->pc = (uint16_t) pc;
+  c += 4;
+  if (c < end && *c == ':') {
+    c++;
+  }
+
+  // the bytes are two hex digits each, on their own; a mnemonic never is
+  line->numBytes = 0;
+  while (line->numBytes < 3) {
+    const uint8_t *byteStart = c;
+    while (byteStart < end && *byteStart == ' ') {
+      byteStart++;
+    }
+    if (byteStart < end && *byteStart == '$') {
+      byteStart++;
+    }
+    int byte = parseHex(byteStart, end, 2);
+    if (byte < 0 || (byteStart + 2 < end && byteStart[2] != ' ')) {
+      break;
+    }
+    line->bytes[line->numBytes++] = (uint8_t) byte;
+    c = byteStart + 2;
+  }
+
+  line->a = line->x = line->y = line->p = line->s = -1;
+  line->hasCycle = false;
+  line->hasPpu = false;
+  int64_t cycle = 0;
+  bool hasScanline = false;
+  bool hasDot = false;
+  int64_t scanline = 0;
+  int64_t dot = 0;
+
+  const uint8_t *colon = c;
+  while ((colon = (const uint8_t *) memchr(colon, ':', end - colon)) != NULL) {
+    const uint8_t *key = colon;
+    while (key > c && ((key[-1] >= 'A' && key[-1] <= 'Z') || (key[-1] >= 'a' && key[-1] <= 'z'))) {
+      key--;
+    }
+    size_t keyLength = colon - key;
+    const uint8_t *value = colon + 1;
+    colon++;
+    if (keyLength == 0 || (key > start && key[-1] != ' ' && key[-1] != '\t')) {
+      continue;
+    }
+
+    if (keyIs(key, keyLength, "A")) {
+      line->a = parseHex(value, end, 2);
+    } else if (keyIs(key, keyLength, "X")) {
+      line->x = parseHex(value, end, 2);
+    } else if (keyIs(key, keyLength, "Y")) {
+      line->y = parseHex(value, end, 2);
+    } else if (keyIs(key, keyLength, "P")) {
+      line->p = (end - value >= 3 && value[2] != ' ') ? parseFlagLetters(value, end) : parseHex(value, end, 2);
+    } else if (keyIs(key, keyLength, "SP") || keyIs(key, keyLength, "S")) {
+      line->s = parseHex(value, end, 2);
+    } else if (keyIs(key, keyLength, "CYC") || keyIs(key, keyLength, "Cycle")) {
+      line->hasCycle = parseDecimal(&value, end, &cycle);
+    } else if (keyIs(key, keyLength, "PPU")) {
+      hasScanline = parseDecimal(&value, end, &scanline);
+      while (value < end && (*value == ' ' || *value == ',')) {
+        value++;
+      }
+      hasDot = hasScanline && parseDecimal(&value, end, &dot);
+    } else if (keyIs(key, keyLength, "SL") || keyIs(key, keyLength, "V")) {
+      hasScanline = parseDecimal(&value, end, &scanline);
+    } else if (keyIs(key, keyLength, "H")) {
+      hasDot = parseDecimal(&value, end, &dot);
+    }
+  }
+
+  // the old nestest.log: "CYC:  0 SL:241", where CYC is the PPU dot
+  if (hasScanline && !hasDot && line->hasCycle) {
+    dot = cycle;
+    hasDot = true;
+    line->hasCycle = false;
+  }
+  if (hasScanline && hasDot) {
+    line->hasPpu = true;
+    line->scanline = (int) (((scanline % SCANLINES_PER_FRAME) + SCANLINES_PER_FRAME) % SCANLINES_PER_FRAME);
+    line->dot = (int) dot;
+  }
+  line->cycle = (uint32_t) cycle;
+  return true;
+}
+
+static void recordToLine(const struct CpuTraceRecord *record, struct TraceLine *line)
+{
+  line->text = NULL;
+  line->textLength = 0;
+  line->record = record;
+  line->pc = record->pc;
+  line->numBytes = cpuTraceInstructionSize(record->opcode);
+  line->bytes[0] = record->opcode;
+  line->bytes[1] = record->operands[0];
+  line->bytes[2] = record->operands[1];
+  line->a = record->a;
+  line->x = record->x;
+  line->y = record->y;
+  line->p = record->p;
+  line->s = record->s;
+  line->hasCycle = true;
+  line->cycle = record->cycle;
+  line->hasPpu = true;
+  line->scanline = (record->scanline + SCANLINES_PER_FRAME) % SCANLINES_PER_FRAME;
+  line->dot = record->dot;
+}
+
+// false at the end of the file
+static bool readTraceLine(struct TraceReader *reader, struct TraceLine *line)
+{
+  if (reader->binary) {
+    if ((size_t) (reader->end - reader->position) < sizeof(struct CpuTraceRecord)) {
+      return false;
+    }
+    recordToLine((const struct CpuTraceRecord *) reader->position, line);
+    reader->position += sizeof(struct CpuTraceRecord);
+    line->number = ++reader->number;
+  } else {
+    for (;;) {
+      if (reader->position >= reader->end) {
+        return false;
+      }
+      const uint8_t *start = reader->position;
+      const uint8_t *newline = (const uint8_t *) memchr(start, '\n', reader->end - start);
+      const uint8_t *end = newline ? newline : reader->end;
+      reader->position = newline ? newline + 1 : reader->end;
+      reader->number++;
+      if (end > start && end[-1] == '\r') {
+        end--;
+      }
+      if (parseTextLine(start, end, line)) {
+        line->number = reader->number;
+        line->text = (const char *) start;
+        line->textLength = end - start;
+        line->record = NULL;
+        break;
+      }
+    }
+  }
+
+  if (line->hasCycle) {
+    if (!reader->sawCycle) {
+      reader->sawCycle = true;
+      reader->firstCycle = line->cycle;
+    }
+    line->cycle = (uint32_t) (line->cycle - reader->firstCycle);
+  }
+  reader->history[reader->numRead++ % MAX_CONTEXT_LINES] = *line;
+  return true;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not open the file.
+ *  2: Could not map the file.
+ *  3: It's a binary trace from a different version.
+ *
+ */
+static int openTraceReader(struct TraceReader *reader, const char *filename)
+{
+  memset(reader, 0, sizeof(struct TraceReader));
+  reader->filename = filename;
+  int mapError = mapFile(&reader->file, filename);
+  if (mapError) {
+    return mapError;
+  }
+  reader->position = reader->file.data;
+  reader->end = reader->file.data + reader->file.size;
+
+  if (reader->file.size >= sizeof(struct CpuTraceHeader)
+      && memcmp(reader->file.data, CPU_TRACE_MAGIC, strlen(CPU_TRACE_MAGIC)) == 0) {
+    struct CpuTraceHeader header;
+    memcpy(&header, reader->file.data, sizeof(header));
+    if (checkCpuTraceHeader(&header)) {
+      unmapFile(&reader->file);
+      return 3;
+    }
+    reader->binary = true;
+    reader->position += sizeof(header);
+  }
+  return 0;
+}
+
+// Skips to the first instruction at pc. false if there isn't one.
+static bool skipToPc(struct TraceReader *reader, uint16_t pc)
+{
+  struct TraceLine line;
+  const uint8_t *position;
+  uint64_t number;
+  do {
+    position = reader->position;
+    number = reader->number;
+    if (!readTraceLine(reader, &line)) {
+      return false;
+    }
+  } while (line.pc != pc);
+
+  // read it again as the first instruction, so the cycles count from there
+  reader->position = position;
+  reader->number = number;
+  reader->sawCycle = false;
+  reader->numRead = 0;
+  return true;
+}
+
+// Two binary traces: skip whole blocks that are byte for byte the same, stopping the context's length short of the
+// first one that isn't so there's something to show before the difference.
+static void skipMatchingRecords(struct TraceReader *a, struct TraceReader *b, int numContextLines)
+{
+  const struct CpuTraceRecord *recordsA = (const struct CpuTraceRecord *) a->position;
+  const struct CpuTraceRecord *recordsB = (const struct CpuTraceRecord *) b->position;
+  size_t numRecordsA = (a->end - a->position) / sizeof(struct CpuTraceRecord);
+  size_t numRecordsB = (b->end - b->position) / sizeof(struct CpuTraceRecord);
+  size_t numRecords = numRecordsA < numRecordsB ? numRecordsA : numRecordsB;
+  // same raw cycles only mean the same cycles counted from the start if both start at the same one
+  if (numRecords == 0 || recordsA[0].cycle != recordsB[0].cycle) {
+    return;
+  }
+
+  size_t same = 0;
+  while (same + FAST_COMPARE_RECORDS <= numRecords
+      && memcmp(&recordsA[same], &recordsB[same], FAST_COMPARE_RECORDS * sizeof(struct CpuTraceRecord)) == 0) {
+    same += FAST_COMPARE_RECORDS;
+  }
+  size_t skip = same > (size_t) numContextLines ? same - numContextLines : 0;
+  if (skip == 0) {
+    return;
+  }
+
+  a->sawCycle = b->sawCycle = true;
+  a->firstCycle = b->firstCycle = recordsA[0].cycle;
+  a->position += skip * sizeof(struct CpuTraceRecord);
+  b->position += skip * sizeof(struct CpuTraceRecord);
+  a->number += skip;
+  b->number += skip;
+}
+
+// the first field that's different, e.g. "A:12 vs A:13", or null
+static const char *compareLines(const struct TraceLine *a, const struct TraceLine *b, int ignore, char *str, size_t size)
+{
+  if (a->pc != b->pc) {
+    snprintf(str, size, "PC %04X vs %04X", a->pc, b->pc);
+    return str;
+  }
+  int numBytes = a->numBytes < b->numBytes ? a->numBytes : b->numBytes;
+  if (!(ignore & FIELD_BYTES) && numBytes > 0 && memcmp(a->bytes, b->bytes, numBytes) != 0) {
+    for (int i = 0; i < numBytes; i++) {
+      if (a->bytes[i] != b->bytes[i]) {
+        snprintf(str, size, "byte %d %02X vs %02X", i, a->bytes[i], b->bytes[i]);
+        return str;
+      }
+    }
+  }
+
+  static const struct
+  {
+    const char *name;
+    int field;
+    size_t offset;
+  } registers[] = {
+    { "A", FIELD_A, offsetof(struct TraceLine, a) },
+    { "X", FIELD_X, offsetof(struct TraceLine, x) },
+    { "Y", FIELD_Y, offsetof(struct TraceLine, y) },
+    { "P", FIELD_P, offsetof(struct TraceLine, p) },
+    { "SP", FIELD_SP, offsetof(struct TraceLine, s) }
+  };
+  for (size_t i = 0; i < sizeof(registers) / sizeof(registers[0]); i++) {
+    int valueA = *(const int *) ((const uint8_t *) a + registers[i].offset);
+    int valueB = *(const int *) ((const uint8_t *) b + registers[i].offset);
+    if ((ignore & registers[i].field) || valueA < 0 || valueB < 0) {
+      continue;
+    }
+    int mask = registers[i].field == FIELD_P ? P_COMPARED_BITS : 0xFF;
+    if ((valueA & mask) != (valueB & mask)) {
+      snprintf(str, size, "%s:%02X vs %s:%02X", registers[i].name, valueA, registers[i].name, valueB);
+      return str;
+    }
+  }
+
+  if (!(ignore & FIELD_CYCLES) && a->hasCycle && b->hasCycle && a->cycle != b->cycle) {
+    snprintf(str, size, "%u cycles in vs %u", a->cycle, b->cycle);
+    return str;
+  }
+  if (!(ignore & FIELD_PPU) && a->hasPpu && b->hasPpu && (a->scanline != b->scanline || a->dot != b->dot)) {
+    snprintf(str, size, "PPU %d,%d vs %d,%d", a->scanline, a->dot, b->scanline, b->dot);
+    return str;
+  }
+  return NULL;
+}
+
+static void printLine(char marker, char side, const struct TraceLine *line)
+{
+  if (line->record) {
+    char text[CPU_TRACE_LINE_SIZE];
+    formatCpuTraceRecord(text, sizeof(text), line->record);
+    printf("%c %c %10llu  %s\n", marker, side, (unsigned long long) line->number, text);
+  } else {
+    printf("%c %c %10llu  %.*s\n", marker, side, (unsigned long long) line->number, (int) line->textLength, line->text);
+  }
+}
+
+static void printUsage(void)
+{
+  printf("usage: diff_cpu_trace <trace or log> <trace or log> [--context <instructions>] [--start <hex pc>]\n"
+         "                      [--ignore <bytes,a,x,y,p,sp,cycles,ppu>]\n");
+}
+
+// 0 if it's not one
+static int parseIgnoredFields(const char *list)
+{
+  int fields = 0;
+  while (*list) {
+    size_t length = strcspn(list, ",");
+    int field = 0;
+    for (size_t i = 0; i < sizeof(fieldNames) / sizeof(fieldNames[0]); i++) {
+      if (strlen(fieldNames[i].name) == length && strncmp(fieldNames[i].name, list, length) == 0) {
+        field = fieldNames[i].field;
+      }
+    }
+    if (!field) {
+      return 0;
+    }
+    fields |= field;
+    list += length;
+    if (*list == ',') {
+      list++;
+    }
+  }
+  return fields;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    printUsage();
+    return 2;
+  }
+
+  int numContextLines = DEFAULT_CONTEXT_LINES;
+  int startPc = -1;
+  int ignore = 0;
+  for (int i = 3; i < argc; i++) {
+    if (i + 1 >= argc) {
+      printUsage();
+      return 2;
+    }
+    if (strcmp(argv[i], "--context") == 0) {
+      numContextLines = atoi(argv[++i]);
+      if (numContextLines < 0 || numContextLines >= MAX_CONTEXT_LINES) {
+        printf("--context takes 0 to %d instructions\n", MAX_CONTEXT_LINES - 1);
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--start") == 0) {
+      const char *pc = argv[++i];
+      startPc = strlen(pc) == 4 ? parseHex((const uint8_t *) pc, (const uint8_t *) pc + 4, 4) : -1;
+      if (startPc < 0) {
+        printf("--start takes an address as 4 hex digits\n");
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--ignore") == 0) {
+      ignore = parseIgnoredFields(argv[++i]);
+      if (!ignore) {
+        printf("--ignore takes fields separated by commas: bytes, a, x, y, p, sp, cycles, ppu\n");
+        return 2;
+      }
+    } else {
+      printUsage();
+      return 2;
+    }
+  }
+
+  static struct TraceReader readers[2];
+  for (int i = 0; i < 2; i++) {
+    int openError = openTraceReader(&readers[i], argv[1 + i]);
+    if (openError) {
+      printf("Error reading %s: %d\n", argv[1 + i], openError);
+      return 2;
+    }
+    if (startPc >= 0 && !skipToPc(&readers[i], (uint16_t) startPc)) {
+      printf("%s never gets to %04X\n", argv[1 + i], startPc);
+      return 2;
+    }
+  }
+  struct TraceReader *a = &readers[0];
+  struct TraceReader *b = &readers[1];
+
+  uint64_t startTime = getTimeInNanoseconds();
+  if (a->binary && b->binary) {
+    skipMatchingRecords(a, b, numContextLines);
+  }
+
+  struct TraceLine lineA;
+  struct TraceLine lineB;
+  const char *difference = NULL;
+  char differenceStr[64];
+  bool haveA;
+  bool haveB;
+  for (;;) {
+    haveA = readTraceLine(a, &lineA);
+    haveB = readTraceLine(b, &lineB);
+    if (!haveA || !haveB) {
+      break;
+    }
+    difference = compareLines(&lineA, &lineB, ignore, differenceStr, sizeof(differenceStr));
+    if (difference) {
+      break;
+    }
+  }
+  uint64_t elapsed = getTimeInNanoseconds() - startTime;
+
+  int result = 0;
+  if (difference) {
+    printf("first difference at %s %s %llu and %s %s %llu: %s\n\n", a->filename, a->binary ? "record" : "line",
+        (unsigned long long) lineA.number, b->filename, b->binary ? "record" : "line", (unsigned long long) lineB.number,
+        difference);
+
+    // history has the differing pair as its last entry
+    uint64_t numBefore = a->numRead < b->numRead ? a->numRead : b->numRead;
+    numBefore = numBefore - 1 < (uint64_t) numContextLines ? numBefore - 1 : (uint64_t) numContextLines;
+    for (uint64_t i = numBefore; i > 0; i--) {
+      printLine(' ', 'a', &a->history[(a->numRead - 1 - i) % MAX_CONTEXT_LINES]);
+      printLine(' ', 'b', &b->history[(b->numRead - 1 - i) % MAX_CONTEXT_LINES]);
+    }
+    printLine('>', 'a', &lineA);
+    printLine('>', 'b', &lineB);
+    for (int i = 0; i < numContextLines; i++) {
+      struct TraceLine after;
+      bool more = false;
+      if (readTraceLine(a, &after)) {
+        printLine(' ', 'a', &after);
+        more = true;
+      }
+      if (readTraceLine(b, &after)) {
+        printLine(' ', 'b', &after);
+        more = true;
+      }
+      if (!more) {
+        break;
+      }
+    }
+    result = 1;
+  } else if (haveA || haveB) {
+    printf("%s ends first, after %llu %s; everything up to there is the same\n", haveA ? b->filename : a->filename,
+        (unsigned long long) (haveA ? b->number : a->number), (haveA ? b->binary : a->binary) ? "records" : "lines");
+  } else {
+    printf("the same all the way through\n");
+  }
+
+  double seconds = (double) elapsed / 1000000000.0;
+  double megabytes = (double) ((a->position - a->file.data) + (b->position - b->file.data)) / (1024.0 * 1024.0);
+  fprintf(stderr, "read %.1f MB in %.3f s (%.0f MB/s)\n", megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+
+  unmapFile(&a->file);
+  unmapFile(&b->file);
+  return result;
+}
@@ -0,0 +1,79 @@
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64  // so fseeko reaches past 2 GB on 32 bit systems too
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "cputrace.h"
+#include "cputracetext.h"
+
+/*
+ * Turns a CPU trace from headless --cpu-trace (see cputrace.h) into text laid out like nestest.log, one instruction a
+ * line, for reading or for diffing against a log from another emulator (diff_cpu_trace compares them directly):
+ *
+ *   C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+ *
+ *   dump_cpu_trace <trace file> [first instruction] [number of instructions]
+ *
+ * The trace doesn't have the memory the instructions read, so nestest's "@ 0200 = 00" and "= 00" notes aren't there;
+ * cut them out of the other log (sed 's/ [@=] [^A]*A:/ A:/') before diffing. The scanline is -1 before the frame where
+ * nestest's is 261, and opcodes the emulator doesn't run show up as "???".
+ */
+
+#define RECORDS_PER_READ 4096
+
+// whole-game traces run to gigabytes, further than fseek's long reaches on Windows
+static int seekFile(FILE *file, unsigned long long offset)
+{
+#ifdef _WIN32
+  return _fseeki64(file, (__int64) offset, SEEK_SET);
+#else
+  return fseeko(file, (off_t) offset, SEEK_SET);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc > 4) {
+    printf("usage: dump_cpu_trace <trace file> [first instruction] [number of instructions]\n");
+    return 1;
+  }
+  unsigned long long first = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+  unsigned long long count = argc > 3 ? strtoull(argv[3], NULL, 10) : ~0ULL;
+
+  FILE *file = fopen(argv[1], "rb");
+  if (!file) {
+    printf("Could not open %s\n", argv[1]);
+    return 1;
+  }
+
+  struct CpuTraceHeader header;
+  int headerError = fread(&header, sizeof(header), 1, file) == 1 ? checkCpuTraceHeader(&header) : 1;
+  if (headerError) {
+    printf(headerError == 1 ? "%s isn't a CPU trace\n" : "%s is from a different version\n", argv[1]);
+    fclose(file);
+    return 1;
+  }
+
+  // records are all the same size, so the first one wanted is found without reading the ones before it
+  if (first > (~0ULL - sizeof(header)) / sizeof(struct CpuTraceRecord)
+      || seekFile(file, sizeof(header) + first * sizeof(struct CpuTraceRecord))) {
+    fclose(file);
+    return 0;
+  }
+
+  static struct CpuTraceRecord records[RECORDS_PER_READ];
+  char line[CPU_TRACE_LINE_SIZE];
+  size_t numRecords;
+  while (count > 0 && (numRecords = fread(records, sizeof(struct CpuTraceRecord), RECORDS_PER_READ, file)) > 0) {
+    for (size_t i = 0; i < numRecords && count > 0; i++) {
+      formatCpuTraceRecord(line, sizeof(line), &records[i]);
+      printf("%s\n", line);
+      count--;
+    }
+  }
+
+  fclose(file);
+  return 0;
+}
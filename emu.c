@@ -3,8 +3,15 @@
 #include "cpu.h"
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 #include "controller.h"
+#include "cartridge.h"
+#include "battery.h"
+#include "apu.h"
 #include "debug.h"
+#include "timing.h"
+#include "trace.h"
+#include "platform.h"
 
 static void setPPUData(unsigned char value, struct PPU *ppu, uint8_t inc) 
 {
@@ -20,7 +27,7 @@ static void setPPUData(unsigned char value, struct PPU *ppu, uint8_t inc)
     }
   }
 
-  ppu->vRegister = ppu->vRegister + inc;
+  ppu->vRegister = (ppu->vRegister + inc) & 0x7FFF;  // v is 15 bits
 }
 
 void setButton(struct Computer *state, bool isButtonPressed, uint8_t position) {
@@ -117,12 +124,32 @@ bool onCPUMemoryWrite(unsigned int memoryAddress, unsigned char value, struct Co
     // oamdata write
     shouldWriteMemory = false;
   } else if (memoryAddress == 0x4014) {
+    uint64_t traceStart = state->trace ? getTimeInNanoseconds() : 0;
     int cpuAddr = value << 8;
     int numBytes = 256 - ppu->oamAddr;
     /*print("[OAM] OAMDMA write. Will get data from CPU memory page %02x (addr: %04x). Oam addr is %02x. Num bytes: %d\n", value, cpuAddr, ppu->oamAddr, numBytes);*/
     // TODO: I should probably write a getMemoryAddress method that translates the cpuAddr to the mapped address
-    memcpy(&ppu->oam[ppu->oamAddr], &state->memory[cpuAddr], numBytes);
+    if (cpuAddr < 0x8000) {
+      memcpy(&ppu->oam[ppu->oamAddr], &state->memory[cpuAddr], numBytes);
+    } else {
+      // PRG ROM isn't necessarily behind state->memory (see prgRom in cpu.h)
+      for (int i = 0; i < numBytes; i++) {
+        ppu->oam[ppu->oamAddr + i] = readMemory(cpuAddr + i, state);
+      }
+    }
     /*dumpOam(1, ppu->oam);*/
+    if (state->trace) {
+      addTraceSpanWithArg(state->trace, "oam dma", traceStart, "page", value);
+    }
+    shouldWriteMemory = false;
+  } else if ((memoryAddress >= 0x4000 && memoryAddress <= 0x4013) || memoryAddress == 0x4015 || memoryAddress == 0x4017) {
+    if (state->stageTimer) {
+      beginStage(state->stageTimer, TIMING_APU);
+    }
+    writeApuRegister(&state->apu, memoryAddress, value, state);
+    if (state->stageTimer) {
+      endStage(state->stageTimer);
+    }
     shouldWriteMemory = false;
   } else if (memoryAddress == 0x4016) {
     /*print("************ write to 0x4016: %02x\n", value);*/
@@ -141,8 +168,15 @@ bool onCPUMemoryWrite(unsigned int memoryAddress, unsigned char value, struct Co
     }
     state->currentButtonBit = 0;  // is this right?
     shouldWriteMemory = false;
+  } else if (memoryAddress >= PRG_RAM_START && memoryAddress < PRG_RAM_START + PRG_RAM_SIZE) {
+    if (state->batteryRam) {
+      markBatteryRamWrite(state->batteryRam, memoryAddress);
+    }
   } else if (memoryAddress >= 0x8000 && memoryAddress <= 0xFFFF) {
     shouldWriteMemory = false;
+    if (state->stageTimer) {
+      beginStage(state->stageTimer, TIMING_MAPPER);
+    }
     if (ppu->mapperNumber == 1) {
       if (value >= 0x80) {
         print("clear the shift register\n");
@@ -169,13 +203,13 @@ bool onCPUMemoryWrite(unsigned int memoryAddress, unsigned char value, struct Co
             /*print("%04x, storing %02x into the prg bank thing\n", memoryAddress, state->mmc1ShiftRegister);*/
             state->mmc1PrgRomBank = state->mmc1ShiftRegister;
 
-            // four lowest bits determine prg bank
-            uint8_t prgBank = state->mmc1PrgRomBank & 0x0F;
+            // four lowest bits determine prg bank, wrapped around to the banks the ROM actually has
+            uint8_t prgBank = (state->mmc1PrgRomBank & 0x0F) % (state->sizeOfPrgRomInBytes / 0x4000);
             /*print("choosing prg bank %d\n", prgBank);*/
 
-            int addressOfSelectedBank = 0x8000 + (prgBank * 0x4000); 
-            state->prgRomBlock1 = &state->memory[addressOfSelectedBank];
-            state->prgRomBlock2 = &state->memory[addressOfSelectedBank + 0x2000];
+            int offsetOfSelectedBank = prgBank * 0x4000;
+            state->prgRomBlock1 = &state->prgRom[offsetOfSelectedBank];
+            state->prgRomBlock2 = &state->prgRom[offsetOfSelectedBank + 0x2000];
           } else {
             print(">>>>> trying to change a different thing %04x\n", memoryAddress);
           }
@@ -184,6 +218,9 @@ bool onCPUMemoryWrite(unsigned int memoryAddress, unsigned char value, struct Co
     } else {
       print("uih oh\n");
     }
+    if (state->stageTimer) {
+      endStage(state->stageTimer);
+    }
   }
 
   return shouldWriteMemory;
@@ -204,7 +241,16 @@ unsigned char onCPUMemoryRead(unsigned int memoryAddress, struct Computer *state
   } else if (memoryAddress == 0x2007) {
     struct PPU *ppu = state->ppuClosure->ppu;
     /*print("READING 0x2007 *************************\n\n");*/
-    ppu->vRegister = ppu->vRegister + vramIncrement(ppu);
+    ppu->vRegister = (ppu->vRegister + vramIncrement(ppu)) & 0x7FFF;
+  } else if (memoryAddress == 0x4015) {
+    *shouldOverride = true;
+    if (!state->stageTimer) {
+      return readApuStatus(&state->apu, state);
+    }
+    beginStage(state->stageTimer, TIMING_APU);
+    uint8_t status = readApuStatus(&state->apu, state);
+    endStage(state->stageTimer);
+    return status;
   } else if (memoryAddress == 0x4016) {
     /*print("*********** read from 0x4016 (val is %02x)\n", state->memory[0x4016]);*/
     *shouldOverride = true;
@@ -316,9 +362,6 @@ static void renderSpritePixel(struct PPU *ppu, struct Color *palette, uint8_t ba
       int addressOfSprite = spritePatternTableAddress + (tileIndex * 16);
       uint8_t *spriteData = &ppu->memory[addressOfSprite];
 
-      uint32_t *videoBufferRow = (uint32_t *)videoBuffer;
-      videoBufferRow += (pixelY * VIDEO_BUFFER_WIDTH) + pixelX;
-
       {
         // find out which row of the 8x8 sprite is relevant for us
         int rowOfSprite = pixelY - 1 - sprite.yPosition;
@@ -334,8 +377,6 @@ static void renderSpritePixel(struct PPU *ppu, struct Color *palette, uint8_t ba
         uint8_t lowByte = spriteData[rowOfSprite];
         uint8_t highByte = spriteData[rowOfSprite+8];
 
-        uint32_t *pixel = videoBufferRow;
-
         int bitNumber = 7 - colOfSprite;
         uint8_t bit1 = (highByte >> bitNumber) & 0x01;
         uint8_t bit0 = (lowByte >> bitNumber) & 0x01;
@@ -360,10 +401,15 @@ static void renderSpritePixel(struct PPU *ppu, struct Color *palette, uint8_t ba
             return;
           }
 
-          int paletteNumber = (attributes & 0x03) + 4;
-          uint8_t colorIndex = ppu->memory[0x3F00 + 4*paletteNumber + val];
-          struct Color color = palette[colorIndex];
-          *pixel = ((color.red << 16) | (color.green << 8) | color.blue);
+          if (videoBuffer) {
+            uint32_t *pixel = (uint32_t *)videoBuffer;
+            pixel += (pixelY * VIDEO_BUFFER_WIDTH) + pixelX;
+
+            int paletteNumber = (attributes & 0x03) + 4;
+            uint8_t colorIndex = ppu->memory[0x3F00 + 4*paletteNumber + val];
+            struct Color color = palette[colorIndex];
+            *pixel = ((color.red << 16) | (color.green << 8) | color.blue);
+          }
 
           // only draw the first sprite we find 
           return;
@@ -399,15 +445,20 @@ static uint8_t renderBackgroundPixel2(struct PPU *ppu, struct Color *palette, vo
   ppu->patternTableShiftRegisterHigh = ppu->patternTableShiftRegisterHigh << 1;
   */
 
+  // TODO: rename val
+  int val = bit1 << 1 | bit0;
+
+  // no video buffer means nobody is going to look at this frame, but the sprite zero hit still needs val
+  if (!videoBuffer) {
+    return val;
+  }
+
   uint8_t *videoBufferRow = (uint8_t *)videoBuffer;
   videoBufferRow = videoBufferRow + (y * VIDEO_BUFFER_WIDTH * 4);
 
   uint32_t *pixel = (uint32_t *)(videoBufferRow);
   pixel += (x - STARTING_PIXEL);
 
-  // TODO: rename val
-  int val = bit1 << 1 | bit0;
-
 
   /*$3F00 	Universal background color*/
   /*$3F01-$3F03 	Background palette 0*/
@@ -676,7 +727,13 @@ void ppuTick(struct PPU *ppu, struct Computer *state, struct Color *palette, voi
     }
 
     if (ppu->scanlineClockCycle == 65) {
+      if (state->stageTimer) {
+        beginStage(state->stageTimer, TIMING_SPRITE_EVALUATION);
+      }
       spriteEvaluation(ppu);
+      if (state->stageTimer) {
+        endStage(state->stageTimer);
+      }
     }
   }
 
@@ -690,23 +747,208 @@ void ppuTick(struct PPU *ppu, struct Computer *state, struct Color *palette, voi
   }
 }
 
+static void mapStartingPrgRomBanks(struct Computer *state, struct Cartridge *cartridge)
+{
+  uint8_t *prgRom = state->prgRom;
+
+  if (cartridge->mapperNumber == 0) {
+    state->prgRomBlock1 = &prgRom[0x0000];
+    state->prgRomBlock2 = &prgRom[0x2000];
+    if (cartridge->sizeOfPrgRomInBytes == 0x8000) {
+      // NROM-256
+      state->prgRomBlock3 = &prgRom[0x4000];
+      state->prgRomBlock4 = &prgRom[0x6000];
+    } else {
+      // for NROM-128 the second 16 kB is a mirror of the first 16 kB
+      state->prgRomBlock3 = &prgRom[0x0000];
+      state->prgRomBlock4 = &prgRom[0x2000];
+    }
+  } else if (cartridge->mapperNumber == 1) {
+    // For mapper 1 it seems to be important to start off with the last 16 kB bank in 0xC000 - 0xFFFF
+    state->prgRomBlock1 = &prgRom[0x0000];
+    state->prgRomBlock2 = &prgRom[0x2000];
+    int offsetOfLastBank = (cartridge->numPrgRomUnits - 1) * 0x4000;
+    state->prgRomBlock3 = &prgRom[offsetOfLastBank];
+    state->prgRomBlock4 = &prgRom[offsetOfLastBank + 0x2000];
+  }
+}
+
+/**
+ *
+ * Allocates CPU memory for the cartridge, maps its PRG ROM and points pc at the reset vector. Set state->ppuClosure
+ * first, since reading the reset vector goes through it. state->memory is yours to free afterwards.
+ *
+ * Memory starts out zeroed rather than random so that two runs of the same game with the same input are identical.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: Mapper isn't supported, or can't address a PRG ROM that size.
+ *
+ */
+int powerOnComputer(struct Computer *state, struct Cartridge *cartridge)
+{
+  if (!isMapperSupported(cartridge->mapperNumber)
+      || !isPrgRomSizeSupported(cartridge->mapperNumber, cartridge->sizeOfPrgRomInBytes)) {
+    return 2;
+  }
+
+  uint8_t *memory = (uint8_t *) calloc(1, 0x8000 + cartridge->sizeOfPrgRomInBytes);
+  if (!memory) {
+    return 1;
+  }
+
+  // copy prgRom starting at 0x8000, even if it's bigger than 32 kB. We will intercept reads
+  // from this memory and do the right thing based on MMC.
+  memcpy(&memory[0x8000], cartridge->prgRom, cartridge->sizeOfPrgRomInBytes);
+
+  state->memory = memory;
+  state->prgRom = &memory[0x8000];
+  state->sizeOfPrgRomInBytes = cartridge->sizeOfPrgRomInBytes;
+
+  mapStartingPrgRomBanks(state, cartridge);
+
+  powerOnApu(&state->apu, state->totalCyclesCompleted);
+
+  state->pc = (readMemory(0xFFFD, state) << 8) | readMemory(0xFFFC, state);
+  return 0;
+}
+
+/*
+ * What the console's reset button does: RAM, VRAM and OAM are kept, the CPU jumps through the reset vector with
+ * interrupts disabled, the PPU registers and mapper go back to how they start out, and the APU goes quiet.
+ */
+void resetComputer(struct Computer *state, struct PPU *ppu, struct Cartridge *cartridge)
+{
+  state->mmc1ShiftRegister = 0;
+  state->mmc1ShiftCounter = 0;
+  state->mmc1PrgRomBank = 0;
+  mapStartingPrgRomBanks(state, cartridge);
+
+  state->stackRegister = state->stackRegister - 3;
+  state->interruptDisable = 1;
+  state->irqPending = false;
+  state->nmiPending = false;
+  state->pollController = false;
+  state->currentButtonBit = 0;
+
+  ppu->control = 0;
+  ppu->mask = 0;
+  ppu->tRegister = 0;
+  ppu->xRegister = 0;
+  ppu->wRegister = false;
+  ppu->scanline = -1;
+  ppu->scanlineClockCycle = 0;
+
+  resetApu(&state->apu, state->totalCyclesCompleted);
+
+  state->pc = (readMemory(0xFFFD, state) << 8) | readMemory(0xFFFC, state);
+}
+
 void buildPPUClosure(struct PPUClosure *ppuClosure, struct PPU *ppu)
 {
   *ppuClosure = (struct PPUClosure) { .ppu = ppu, .onMemoryWrite = &onCPUMemoryWrite, .onMemoryRead = &onCPUMemoryRead };
 }
 
-bool executeEmulatorCycle(struct Computer *state, struct PPU *ppu, void *videoBuffer, struct Color *palette) 
+static void catchUpApu(struct Computer *state)
 {
-  uint8_t ppuStatusBefore = ppu->status;
+  if (state->stageTimer) {
+    beginStage(state->stageTimer, TIMING_APU);
+  }
+  runApu(&state->apu, state);
+  if (state->stageTimer) {
+    endStage(state->stageTimer);
+  }
+}
 
-  unsigned char instr = readMemory(state->pc, state);
-  int cycles = executeInstruction(instr, state);
+// Spans from now on go to trace (or nowhere if it's null), starting with a frame and a batch of scanlines that start now.
+void traceEmulator(struct Computer *state, struct TraceBuffer *trace)
+{
+  state->trace = trace;
+  state->traceFrameStart = getTimeInNanoseconds();
+  state->traceScanlinesStart = state->traceFrameStart;
+}
+
+// scanlines since vblank started, in batches of TRACE_SCANLINES_PER_SPAN
+static int scanlineBatch(int scanline)
+{
+  return ((scanline - 241 + 262) % 262) / TRACE_SCANLINES_PER_SPAN;
+}
 
+// Frames go from one vblank to the next, and the batches of scanlines in them are counted from vblank too, so they
+// nest inside the frames.
+static void traceScanlines(struct Computer *state, int scanlineBefore, int scanlineAfter, bool vblankStarted)
+{
+  int batch = scanlineBatch(scanlineBefore);
+  if (!vblankStarted && batch == scanlineBatch(scanlineAfter)) {
+    return;
+  }
+
+  int firstScanline = 241 + batch * TRACE_SCANLINES_PER_SPAN;
+  addTraceSpanWithArg(state->trace, "scanlines", state->traceScanlinesStart, "first", firstScanline >= 261 ? firstScanline - 262 : firstScanline);
+  if (vblankStarted) {
+    addTraceSpan(state->trace, "frame", state->traceFrameStart);
+    state->traceFrameStart = getTimeInNanoseconds();
+  }
+  state->traceScanlinesStart = getTimeInNanoseconds();
+}
+
+// The rest of executeEmulatorCycle once the CPU has run an instruction, for when something else ran it (see lockstep.c).
+// ppuStatusBefore is ppu->status from before the instruction.
+bool runPPUAfterInstruction(struct Computer *state, struct PPU *ppu, int cycles, uint8_t ppuStatusBefore, void *videoBuffer, struct Color *palette)
+{
+  int scanlineBefore = ppu->scanline;
   for (int i = 0; i < cycles*3; i++) {
     ppuTick(ppu, state, palette, videoBuffer);
   }
 
+  // the APU only needs to hear about cycles going by when it has an IRQ or a sample fetch due
+  if ((int) (state->totalCyclesCompleted - state->apu.nextEventCycle) >= 0) {
+    catchUpApu(state);
+
+    // DMC fetches take the bus from the CPU, so the cycles they cost go by before the next instruction. Another fetch
+    // can fall due while that happens.
+    while (state->apu.stallCycles > 0) {
+      int stallCycles = (int) state->apu.stallCycles;
+      state->apu.stallCycles = 0;
+      state->totalCyclesCompleted += stallCycles;
+      for (int i = 0; i < stallCycles*3; i++) {
+        ppuTick(ppu, state, palette, videoBuffer);
+      }
+      catchUpApu(state);
+    }
+  }
+
   uint8_t ppuStatusAfter = ppu->status;
 
-  return (ppuStatusBefore & 0x80) == 0 && (ppuStatusAfter & 0x80) == 0x80;
+  bool vblankStarted = (ppuStatusBefore & 0x80) == 0 && (ppuStatusAfter & 0x80) == 0x80;
+  if (vblankStarted && state->batteryRam) {
+    syncBatteryRam(state->batteryRam, &state->memory[PRG_RAM_START]);
+  }
+  if (state->trace) {
+    traceScanlines(state, scanlineBefore, ppu->scanline, vblankStarted);
+  }
+
+  return vblankStarted;
+}
+
+// videoBuffer can be null to emulate without drawing anything
+bool executeEmulatorCycle(struct Computer *state, struct PPU *ppu, void *videoBuffer, struct Color *palette) 
+{
+  uint8_t ppuStatusBefore = ppu->status;
+
+  // only some instructions are timed (see timing.h)
+  struct StageTimer *timer = state->stageTimer;
+  bool timed = timer && beginTimedInstruction(timer);
+
+  unsigned char instr = readMemory(state->pc, state);
+  int cycles = executeInstruction(instr, state);
+
+  if (timed) {
+    switchStage(timer, TIMING_PPU);
+  }
+  bool vblankStarted = runPPUAfterInstruction(state, ppu, cycles, ppuStatusBefore, videoBuffer, palette);
+  if (timed || (timer && vblankStarted)) {
+    endTimedInstruction(timer, vblankStarted);
+  }
+  return vblankStarted;
 }
@@ -6,6 +6,10 @@
 #include "ppu.h"
 
 bool executeEmulatorCycle(struct Computer *state, struct PPU *ppu, void *videoBuffer, struct Color *palette);
+bool runPPUAfterInstruction(struct Computer *state, struct PPU *ppu, int cycles, uint8_t ppuStatusBefore, void *videoBuffer, struct Color *palette);
 void buildPPUClosure(struct PPUClosure *ppuClosure, struct PPU *ppu);
+void traceEmulator(struct Computer *state, struct TraceBuffer *trace);
+int powerOnComputer(struct Computer *state, struct Cartridge *cartridge);
+void resetComputer(struct Computer *state, struct PPU *ppu, struct Cartridge *cartridge);
 
 #endif /* !FILE_EMU_H_SEEN */
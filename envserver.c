@@ -0,0 +1,448 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "castleface.h"
+#include "batch.h"
+#include "observation.h"
+#include "platform.h"
+#include "trace.h"
+
+/*
+ * Serves a batch of emulators of one game to another process (say a Python training loop) as a reinforcement
+ * learning environment. Linux/POSIX only.
+ *
+ *   envserver <rom> --socket <path> [--emulators <number>] [--threads <number>] [--slots <number>] [--no-render]
+ *                   [--reward <address>[:<bytes>]] [--observe <width>x<height>[x<stack size>]]
+ *                   [--crop <top>,<bottom>,<left>,<right>] [--trace <json file>]
+ *
+ * Control messages go over a Unix domain socket (SOCK_SEQPACKET, one message per packet). Bulk data never does: the
+ * actions, observations, RAM and rewards all live in a POSIX shared memory object the client maps.
+ *
+ * On connecting, the client gets a struct EnvHello saying where everything is. The shared memory is:
+ *
+ *   actions       numEmulators bytes (EMULATOR_BUTTON_* flags), written by the client before each step
+ *   restarts      numEmulators bytes; nonzero sends that emulator back to power on before the step (the server
+ *                 zeroes them once done)
+ *   slots         numSlots of these, back to back, each slotSize bytes:
+ *                   frames        numEmulators frames of 256x240 0x00RRGGBB pixels (absent with --no-render or
+ *                                 --observe)
+ *                   observations  numEmulators greyscale stacks of stack size frames of width x height bytes, oldest
+ *                                 first (only with --observe; see observation.h, --crop trims the frame first)
+ *                   ram           numEmulators * 2 kB
+ *                   rewards       numEmulators int32s
+ *
+ * Each struct EnvRequest gets a struct EnvReply back once the step is done. Steps go round the slots in turn and the
+ * emulators draw straight into the slot, so nothing is copied for the frames; a slot's contents stay put until
+ * numSlots more steps have run, which is how long the client has to read them.
+ *
+ * ENV_REQUEST_RESET restarts every emulator and runs one frame with no buttons pressed, ENV_REQUEST_STEP restarts
+ * whichever emulators are flagged and then runs a frame with the actions. The reward is how much the number at
+ * --reward (little endian, 1 to 4 bytes of RAM) went up over the frame, or 0 without --reward or after a restart.
+ *
+ * Everything is in the host's byte order.
+ *
+ * --trace streams a timeline of every step to a file as it goes (see trace.h): the server's steps, each worker's
+ * emulators and the frames, scanlines and DMA inside them.
+ */
+
+#define ENV_MAGIC "CFEV"
+#define ENV_VERSION 2
+#define ENV_SHM_NAME_SIZE 64
+
+#define ENV_REQUEST_RESET 1
+#define ENV_REQUEST_STEP 2
+
+#define DEFAULT_NUM_EMULATORS 16
+#define DEFAULT_NUM_SLOTS 2
+
+#define FRAMEBUFFER_BYTES (EMULATOR_FRAMEBUFFER_WIDTH * EMULATOR_FRAMEBUFFER_HEIGHT * sizeof(uint32_t))
+
+struct EnvHello
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t numEmulators;
+  uint32_t numSlots;
+  uint32_t framebufferWidth;   // 0 without frames
+  uint32_t framebufferHeight;
+  uint32_t observationWidth;   // 0 without observations
+  uint32_t observationHeight;
+  uint32_t observationStackSize;
+  uint32_t ramSize;
+  uint32_t actionsOffset;      // all offsets are from the start of the shared memory
+  uint32_t restartsOffset;
+  uint32_t firstSlotOffset;
+  uint32_t slotSize;
+  uint32_t framesOffset;       // offsets within a slot
+  uint32_t observationsOffset;
+  uint32_t ramOffset;
+  uint32_t rewardsOffset;
+  uint64_t sharedMemorySize;
+  char sharedMemoryName[ENV_SHM_NAME_SIZE];
+};
+
+struct EnvRequest
+{
+  uint32_t type;
+  uint32_t unused;
+};
+
+struct EnvReply
+{
+  uint32_t error;  // 0, or 1 for a request the server didn't understand
+  uint32_t slot;   // where this step's results are
+  uint64_t frame;  // steps run since the server started
+  uint64_t emulationNanoseconds;  // how long the step itself took, to tell emulation from overhead
+};
+
+struct EnvServer
+{
+  struct EmulatorBatch *batch;
+  struct EnvHello hello;
+  uint8_t *sharedMemory;
+  uint64_t frame;
+
+  int rewardAddress;  // -1 for no rewards
+  int rewardBytes;
+  uint32_t *rewardValues;  // the number at rewardAddress as of the last step, per emulator
+
+  struct Tracer *tracer;  // null without --trace
+  struct TraceBuffer *trace;
+};
+
+static uint32_t readRewardValue(const struct EnvServer *server, const uint8_t *ram)
+{
+  uint32_t value = 0;
+  for (int i = server->rewardBytes - 1; i >= 0; i--) {
+    value = (value << 8) | ram[server->rewardAddress + i];
+  }
+  return value;
+}
+
+static void runStep(struct EnvServer *server, bool restartAll, struct EnvReply *reply)
+{
+  uint64_t traceStart = server->trace ? getTimeInNanoseconds() : 0;
+  struct EmulatorBatch *batch = server->batch;
+  struct EnvHello *hello = &server->hello;
+  uint8_t *actions = server->sharedMemory + hello->actionsOffset;
+  uint8_t *restarts = server->sharedMemory + hello->restartsOffset;
+  uint32_t slot = (uint32_t) (server->frame % hello->numSlots);
+  uint8_t *slotMemory = server->sharedMemory + hello->firstSlotOffset + (size_t) slot * hello->slotSize;
+
+  for (int i = 0; i < batch->numEmulators; i++) {
+    if (restartAll || restarts[i]) {
+      restartBatchEmulator(batch, i);
+      restarts[i] = 1;  // so its reward comes out as 0 below, where it's cleared
+    }
+    batch->inputs[i] = restartAll ? 0 : actions[i];
+  }
+
+  uint32_t *framebuffers = hello->framebufferWidth ? (uint32_t *) (slotMemory + hello->framesOffset) : NULL;
+  uint8_t *observations = hello->observationWidth ? slotMemory + hello->observationsOffset : NULL;
+  uint8_t *ram = slotMemory + hello->ramOffset;
+  setEmulatorBatchOutputs(batch, framebuffers, ram, observations);
+
+  uint64_t startTime = getTimeInNanoseconds();
+  stepEmulatorBatch(batch);
+  uint64_t emulationTime = getTimeInNanoseconds() - startTime;
+
+  int32_t *rewards = (int32_t *) (slotMemory + hello->rewardsOffset);
+  for (int i = 0; i < batch->numEmulators; i++) {
+    int32_t reward = 0;
+    if (server->rewardAddress >= 0) {
+      uint32_t value = readRewardValue(server, ram + (size_t) i * EMULATOR_RAM_SIZE);
+      reward = restarts[i] ? 0 : (int32_t) (value - server->rewardValues[i]);
+      server->rewardValues[i] = value;
+    }
+    rewards[i] = reward;
+    restarts[i] = 0;
+  }
+
+  reply->error = 0;
+  reply->slot = slot;
+  reply->frame = server->frame++;
+  reply->emulationNanoseconds = emulationTime;
+
+  if (server->trace) {
+    addTraceSpanWithArg(server->trace, restartAll ? "reset" : "step", traceStart, "frame", (int64_t) reply->frame);
+  }
+}
+
+// Returns when the client hangs up, including part way through a reply (send fails with EPIPE, since SIGPIPE is
+// ignored), so the server can go back to waiting for the next one.
+static void serveClient(struct EnvServer *server, int connection)
+{
+  if (send(connection, &server->hello, sizeof(server->hello), 0) != sizeof(server->hello)) {
+    return;
+  }
+
+  for (;;) {
+    struct EnvRequest request;
+    ssize_t received = recv(connection, &request, sizeof(request), 0);
+    if (received <= 0) {
+      return;
+    }
+
+    struct EnvReply reply = { .error = 1 };
+    if (received == sizeof(request) && request.type == ENV_REQUEST_RESET) {
+      runStep(server, true, &reply);
+    } else if (received == sizeof(request) && request.type == ENV_REQUEST_STEP) {
+      runStep(server, false, &reply);
+    }
+
+    if (send(connection, &reply, sizeof(reply), 0) != sizeof(reply)) {
+      return;
+    }
+  }
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not create the shared memory.
+ *
+ */
+static int createSharedMemory(struct EnvServer *server, bool sendFrames, const struct ObservationFormat *observationFormat)
+{
+  struct EnvHello *hello = &server->hello;
+  uint32_t numEmulators = hello->numEmulators;
+
+  hello->framebufferWidth = sendFrames ? EMULATOR_FRAMEBUFFER_WIDTH : 0;
+  hello->framebufferHeight = sendFrames ? EMULATOR_FRAMEBUFFER_HEIGHT : 0;
+  hello->observationWidth = observationFormat ? observationFormat->width : 0;
+  hello->observationHeight = observationFormat ? observationFormat->height : 0;
+  hello->observationStackSize = observationFormat ? observationFormat->stackSize : 0;
+  hello->ramSize = EMULATOR_RAM_SIZE;
+
+  // everything that's written a frame at a time starts on its own 64 byte cache line
+  hello->actionsOffset = 0;
+  hello->restartsOffset = (numEmulators + 63) & ~63u;
+  hello->firstSlotOffset = hello->restartsOffset + ((numEmulators + 63) & ~63u);
+  hello->framesOffset = 0;
+  hello->observationsOffset = sendFrames ? (uint32_t) (numEmulators * FRAMEBUFFER_BYTES) : 0;
+  size_t observationsSize = observationFormat ? numEmulators * server->batch->observationSize : 0;
+  hello->ramOffset = hello->observationsOffset + (uint32_t) ((observationsSize + 63) & ~(size_t) 63);
+  hello->rewardsOffset = hello->ramOffset + numEmulators * EMULATOR_RAM_SIZE;
+  hello->slotSize = (hello->rewardsOffset + numEmulators * sizeof(int32_t) + 63) & ~63u;
+  hello->sharedMemorySize = hello->firstSlotOffset + (uint64_t) hello->slotSize * hello->numSlots;
+
+  snprintf(hello->sharedMemoryName, ENV_SHM_NAME_SIZE, "/castleface-env-%d", (int) getpid());
+  shm_unlink(hello->sharedMemoryName);
+  int fd = shm_open(hello->sharedMemoryName, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    return 1;
+  }
+  if (ftruncate(fd, (off_t) hello->sharedMemorySize) != 0) {
+    close(fd);
+    shm_unlink(hello->sharedMemoryName);
+    return 1;
+  }
+
+  void *sharedMemory = mmap(NULL, hello->sharedMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (sharedMemory == MAP_FAILED) {
+    shm_unlink(hello->sharedMemoryName);
+    return 1;
+  }
+
+  server->sharedMemory = (uint8_t *) sharedMemory;
+  return 0;
+}
+
+static uint8_t *readFile(const char *filename, size_t *size)
+{
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long fileSize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  uint8_t *data = fileSize > 0 ? (uint8_t *) malloc(fileSize) : NULL;
+  if (data && fread(data, 1, fileSize, file) != (size_t) fileSize) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+
+  *size = (size_t) fileSize;
+  return data;
+}
+
+static void printUsage(void)
+{
+  printf("usage: envserver <rom> --socket <path> [--emulators <number>] [--threads <number>] [--slots <number>]\n"
+         "                       [--no-render] [--reward <address>[:<bytes>]] [--observe <width>x<height>[x<stack size>]]\n"
+         "                       [--crop <top>,<bottom>,<left>,<right>] [--trace <json file>]\n");
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    printUsage();
+    return 1;
+  }
+
+  const char *romFilename = argv[1];
+  const char *socketPath = NULL;
+  int numEmulators = DEFAULT_NUM_EMULATORS;
+  int numThreads = 0;
+  int numSlots = DEFAULT_NUM_SLOTS;
+  bool render = true;
+  struct EnvServer server = { .rewardAddress = -1, .rewardBytes = 1 };
+  bool observe = false;
+  struct ObservationFormat observationFormat = { .stackSize = 1 };
+  const char *traceFilename = NULL;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--no-render") == 0) {
+      render = false;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      printUsage();
+      return 1;
+    }
+    if (strcmp(argv[i], "--socket") == 0) {
+      socketPath = argv[++i];
+    } else if (strcmp(argv[i], "--emulators") == 0) {
+      numEmulators = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      numThreads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--slots") == 0) {
+      numSlots = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--reward") == 0) {
+      char *end;
+      long rewardAddress = strtol(argv[++i], &end, 0);
+      // -1 means no rewards inside the server, so it can't come from here
+      if (end == argv[i] || rewardAddress < 0 || rewardAddress >= EMULATOR_RAM_SIZE) {
+        printUsage();
+        return 1;
+      }
+      server.rewardAddress = (int) rewardAddress;
+      if (*end == ':') {
+        server.rewardBytes = atoi(end + 1);
+      }
+    } else if (strcmp(argv[i], "--observe") == 0) {
+      observe = sscanf(argv[++i], "%dx%dx%d", &observationFormat.width, &observationFormat.height, &observationFormat.stackSize) >= 2;
+    } else if (strcmp(argv[i], "--crop") == 0) {
+      sscanf(argv[++i], "%d,%d,%d,%d", &observationFormat.cropTop, &observationFormat.cropBottom, &observationFormat.cropLeft, &observationFormat.cropRight);
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      traceFilename = argv[++i];
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+
+  if (!socketPath || numEmulators < 1 || numSlots < 1 || server.rewardBytes < 1 || server.rewardBytes > 4 ||
+      server.rewardAddress + server.rewardBytes > EMULATOR_RAM_SIZE) {
+    printUsage();
+    return 1;
+  }
+
+  size_t romSize;
+  uint8_t *romData = readFile(romFilename, &romSize);
+  if (!romData) {
+    printf("Could not read %s\n", romFilename);
+    return 1;
+  }
+
+  // without observations the batch draws straight into the shared memory slots, so it doesn't need framebuffers of its
+  // own; with them, it draws into its own and only the observations are shared
+  int createBatchError = createEmulatorBatch(&server.batch, romData, romSize, numEmulators, numThreads, observe);
+  free(romData);
+  if (createBatchError) {
+    printf("Could not start %s: %d\n", romFilename, createBatchError);
+    return 1;
+  }
+
+  if (observe) {
+    int observeError = observeEmulatorBatch(server.batch, &observationFormat);
+    if (observeError) {
+      printf(observeError == 1 ? "--observe and --crop don't fit in the frame\n" : "Could not allocate memory\n");
+      return 1;
+    }
+  }
+
+  if (traceFilename) {
+    if (createTracer(&server.tracer, traceFilename) || createTraceBuffer(&server.trace, server.tracer, "server") ||
+        traceEmulatorBatch(server.batch, server.tracer)) {
+      printf("Could not set up writing a trace to %s\n", traceFilename);
+      return 1;
+    }
+  }
+
+  server.rewardValues = (uint32_t *) calloc(numEmulators, sizeof(uint32_t));
+  if (!server.rewardValues) {
+    printf("Could not allocate memory\n");
+    return 1;
+  }
+
+  memcpy(server.hello.magic, ENV_MAGIC, 4);
+  server.hello.version = ENV_VERSION;
+  server.hello.numEmulators = (uint32_t) numEmulators;
+  server.hello.numSlots = (uint32_t) numSlots;
+  if (createSharedMemory(&server, render && !observe, observe ? &observationFormat : NULL)) {
+    printf("Could not create shared memory: %s\n", strerror(errno));
+    return 1;
+  }
+
+  int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (listener < 0 || strlen(socketPath) >= sizeof(address.sun_path)) {
+    printf("Could not create the socket\n");
+    shm_unlink(server.hello.sharedMemoryName);
+    return 1;
+  }
+  strcpy(address.sun_path, socketPath);
+  unlink(socketPath);
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+    printf("Could not listen on %s: %s\n", socketPath, strerror(errno));
+    shm_unlink(server.hello.sharedMemoryName);
+    return 1;
+  }
+
+  // a client that goes away before reading a reply would otherwise kill the server, leaving the shared memory behind
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("Serving %d emulators of %s on %s\n", numEmulators, romFilename, socketPath);
+  fflush(stdout);
+
+  // one client at a time; each one picks up the emulators wherever the last left them (and will usually reset them)
+  for (;;) {
+    int connection = accept(listener, NULL, NULL);
+    if (connection < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    serveClient(&server, connection);
+    close(connection);
+  }
+
+  close(listener);
+  unlink(socketPath);
+  shm_unlink(server.hello.sharedMemoryName);
+  munmap(server.sharedMemory, server.hello.sharedMemorySize);
+  free(server.rewardValues);
+  freeEmulatorBatch(server.batch);
+  if (server.tracer) {
+    destroyTracer(server.tracer);
+  }
+
+  return 0;
+}
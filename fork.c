@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <string.h>
+#include "emu.h"
+#include "fork.h"
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not allocate memory for the fork.
+ *
+ */
+int forkEmulator(struct EmulatorFork **fork, const struct Computer *state, const struct PPU *ppu)
+{
+  struct EmulatorFork *newFork = (struct EmulatorFork *) malloc(sizeof(struct EmulatorFork));
+  if (!newFork) {
+    return 1;
+  }
+
+  reforkEmulator(newFork, state, ppu);
+
+  *fork = newFork;
+  return 0;
+}
+
+// Overwrites an existing fork with the given state without allocating, so a search can keep reusing the same forks.
+void reforkEmulator(struct EmulatorFork *fork, const struct Computer *state, const struct PPU *ppu)
+{
+  memcpy(fork->memory, state->memory, FORK_CPU_MEMORY_SIZE);
+  memcpy(fork->ppuMemory, ppu->memory, FORK_PPU_MEMORY_SIZE);
+  memcpy(fork->oam, ppu->oam, sizeof(fork->oam));
+
+  // the copied prgRom and prgRomBlock pointers stay pointing at the parent's PRG ROM, which is what we want
+  fork->state = *state;
+  fork->state.memory = fork->memory;
+  fork->state.batteryRam = NULL;
+  fork->state.ramWatch = NULL;
+  fork->state.profiler = NULL;
+  fork->state.cpuTrace = NULL;
+  fork->state.stageTimer = NULL;
+  fork->state.trace = NULL;
+  fork->state.apu.output.buffer = NULL;
+  fork->state.keyboardInput = &fork->keyboardInput;
+  fork->state.ppuClosure = &fork->ppuClosure;
+  fork->keyboardInput = *state->keyboardInput;
+
+  bool spritesAreSprites0 = ppu->sprites == ppu->sprites0;
+  fork->ppu = *ppu;
+  fork->ppu.memory = fork->ppuMemory;
+  fork->ppu.oam = fork->oam;
+  fork->ppu.sprites = spritesAreSprites0 ? fork->ppu.sprites0 : fork->ppu.sprites1;
+  fork->ppu.followingSprites = spritesAreSprites0 ? fork->ppu.sprites1 : fork->ppu.sprites0;
+
+  buildPPUClosure(&fork->ppuClosure, &fork->ppu);
+}
+
+/*
+ * Run-ahead: call at the start of a frame, once its input is in state->keyboardInput. This draws what the screen will
+ * look like numFrames frames from now if the input stays the same, which hides that many frames of the game's own
+ * input lag. The frames before the last one aren't drawn.
+ *
+ * The real state isn't touched, so it should be run with a null video buffer to avoid drawing every frame twice.
+ */
+void runAhead(struct EmulatorFork *fork, int numFrames, const struct Computer *state, const struct PPU *ppu, void *videoBuffer, struct Color *palette)
+{
+  reforkEmulator(fork, state, ppu);
+
+  for (int i = 1; i <= numFrames; i++) {
+    void *frameVideoBuffer = i == numFrames ? videoBuffer : NULL;
+    while (!executeEmulatorCycle(&fork->state, &fork->ppu, frameVideoBuffer, palette));
+  }
+}
+
+void freeEmulatorFork(struct EmulatorFork *fork)
+{
+  free(fork);
+}
@@ -0,0 +1,40 @@
+#ifndef FILE_FORK_H_SEEN
+#define FILE_FORK_H_SEEN
+
+#include <stdint.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "controller.h"
+
+#define FORK_CPU_MEMORY_SIZE 0x8000
+#define FORK_PPU_MEMORY_SIZE 0x3FFF
+
+/*
+ * A copy of a running emulator that can be stepped independently of the one it was forked from, e.g. to try out
+ * different inputs from the same point in a game.
+ *
+ * Everything that can change lives inside the fork (CPU memory below 0x8000, PPU memory, OAM, registers), in a single
+ * allocation. PRG ROM is shared with the parent rather than copied, so the parent's memory has to outlive its forks.
+ * Forks never have battery RAM; only the original instance writes the save file.
+ *
+ * Step a fork with executeEmulatorCycle(&fork->state, &fork->ppu, ...) and drive its controller through
+ * fork->keyboardInput.
+ */
+struct EmulatorFork
+{
+  struct Computer state;
+  struct PPU ppu;
+  struct PPUClosure ppuClosure;
+  struct KeyboardInput keyboardInput;
+
+  uint8_t memory[FORK_CPU_MEMORY_SIZE];
+  uint8_t ppuMemory[FORK_PPU_MEMORY_SIZE];
+  uint8_t oam[256];
+};
+
+int forkEmulator(struct EmulatorFork **fork, const struct Computer *state, const struct PPU *ppu);
+void reforkEmulator(struct EmulatorFork *fork, const struct Computer *state, const struct PPU *ppu);
+void runAhead(struct EmulatorFork *fork, int numFrames, const struct Computer *state, const struct PPU *ppu, void *videoBuffer, struct Color *palette);
+void freeEmulatorFork(struct EmulatorFork *fork);
+
+#endif /* !FILE_FORK_H_SEEN */
@@ -0,0 +1,365 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "hash.h"
+#include "platform.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define HASH_X86 1
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PCLMUL_TARGET
+#else
+#define PCLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#endif
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/*
+ * CRC-32 (reflected polynomial 0xEDB88320).
+ *
+ * Note that the SSE4.2 crc32 instruction is no good to us here because it computes CRC-32C, which is a different
+ * polynomial than the one every ROM database uses. On x86 we instead fold 64 bytes at a time with carry-less multiplies
+ * (see Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"), on ARMv8 there are real
+ * CRC-32 instructions, and everywhere else we fall back to slicing-by-8 tables.
+ */
+
+static uint32_t crcTable[8][256];
+
+static void buildCrcTable(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+    }
+    crcTable[0][i] = crc;
+  }
+
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int slice = 1; slice < 8; slice++) {
+      crcTable[slice][i] = (crcTable[slice - 1][i] >> 8) ^ crcTable[0][crcTable[slice - 1][i] & 0xFF];
+    }
+  }
+}
+
+// crc is the inverted running value here
+static uint32_t crc32Slicing(uint32_t crc, const uint8_t *data, size_t length)
+{
+  while (length >= 8) {
+    uint32_t low = crc ^ ((uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24));
+    uint32_t high = (uint32_t) data[4] | ((uint32_t) data[5] << 8) | ((uint32_t) data[6] << 16) | ((uint32_t) data[7] << 24);
+
+    crc = crcTable[7][low & 0xFF] ^ crcTable[6][(low >> 8) & 0xFF] ^ crcTable[5][(low >> 16) & 0xFF] ^ crcTable[4][low >> 24] ^
+      crcTable[3][high & 0xFF] ^ crcTable[2][(high >> 8) & 0xFF] ^ crcTable[1][(high >> 16) & 0xFF] ^ crcTable[0][high >> 24];
+
+    data += 8;
+    length -= 8;
+  }
+
+  while (length > 0) {
+    crc = (crc >> 8) ^ crcTable[0][(crc ^ *data) & 0xFF];
+    data++;
+    length--;
+  }
+
+  return crc;
+}
+
+#ifdef HASH_X86
+
+static bool hasPclmul(void)
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 1)) && (info[2] & (1 << 19));
+#else
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+// Folding constants for the reflected CRC-32 polynomial: x^(4*128+32) mod P, x^(4*128-32) mod P, etc.
+static const uint64_t k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t barrettConstants[2] = { 0x01db710641, 0x01f7011641 };
+
+// Needs length >= 64 and a multiple of 16. crc is the inverted running value.
+PCLMUL_TARGET static uint32_t crc32Pclmul(uint32_t crc, const uint8_t *data, size_t length)
+{
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i *) (data + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *) (data + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *) (data + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *) (data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+
+  x0 = _mm_loadu_si128((const __m128i *) k1k2);
+
+  data += 64;
+  length -= 64;
+
+  // fold four 128 bit lanes in parallel
+  while (length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) (data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (data + 0x30)));
+
+    data += 64;
+    length -= 64;
+  }
+
+  // fold the four lanes down into one
+  x0 = _mm_loadu_si128((const __m128i *) k3k4);
+
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while (length >= 16) {
+    x2 = _mm_loadu_si128((const __m128i *) data);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    data += 16;
+    length -= 16;
+  }
+
+  // 128 bits down to 64
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+
+  x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction down to 32 bits
+  x0 = _mm_loadu_si128((const __m128i *) barrettConstants);
+
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+static bool usePclmul;
+
+#endif
+
+#if !defined(__ARM_FEATURE_CRC32)
+
+// ROM scans hash from several threads at once, so the first one in builds the table (and looks for PCLMUL) while any
+// others wait, and everyone else sees it finished through the release/acquire pair on crcReady.
+static volatile int32_t crcSetupClaimed = 0;
+static volatile int32_t crcReady = 0;
+
+static void setUpCrc(void)
+{
+  if (atomicFetchAdd32(&crcSetupClaimed, 1) == 0) {
+    buildCrcTable();
+#ifdef HASH_X86
+    usePclmul = hasPclmul();
+#endif
+    atomicStore32(&crcReady, 1);
+  } else {
+    while (!atomicLoad32(&crcReady)) {
+      sleepNanoseconds(1000);
+    }
+  }
+}
+
+#endif
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length)
+{
+  crc = ~crc;
+
+#if defined(__ARM_FEATURE_CRC32)
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc = __crc32d(crc, word);
+    data += 8;
+    length -= 8;
+  }
+  while (length > 0) {
+    crc = __crc32b(crc, *data);
+    data++;
+    length--;
+  }
+  return ~crc;
+#else
+  if (!atomicLoad32(&crcReady)) {
+    setUpCrc();
+  }
+
+#ifdef HASH_X86
+  if (usePclmul && length >= 64) {
+    size_t foldableLength = length & ~(size_t) 15;
+    crc = crc32Pclmul(crc, data, foldableLength);
+    data += foldableLength;
+    length -= foldableLength;
+  }
+#endif
+
+  return ~crc32Slicing(crc, data, length);
+#endif
+}
+
+/*
+ * SHA-1, as per FIPS 180-4. Only used for identifying ROMs, so it doesn't matter that it's broken for signatures.
+ */
+
+#define ROTATE_LEFT(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+static void sha1Transform(uint32_t state[5], const uint8_t block[64])
+{
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t) block[i*4] << 24) | ((uint32_t) block[i*4 + 1] << 16) | ((uint32_t) block[i*4 + 2] << 8) | block[i*4 + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    uint32_t value = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+    w[i] = ROTATE_LEFT(value, 1);
+  }
+
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+  uint32_t e = state[4];
+
+  for (int i = 0; i < 80; i++) {
+    uint32_t f;
+    uint32_t k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+
+    uint32_t temp = ROTATE_LEFT(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = ROTATE_LEFT(b, 30);
+    b = a;
+    a = temp;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void sha1Init(struct Sha1Context *context)
+{
+  context->state[0] = 0x67452301;
+  context->state[1] = 0xEFCDAB89;
+  context->state[2] = 0x98BADCFE;
+  context->state[3] = 0x10325476;
+  context->state[4] = 0xC3D2E1F0;
+  context->lengthInBytes = 0;
+  context->blockLength = 0;
+}
+
+void sha1Update(struct Sha1Context *context, const uint8_t *data, size_t length)
+{
+  context->lengthInBytes += length;
+
+  if (context->blockLength > 0) {
+    size_t bytesToCopy = 64 - context->blockLength;
+    if (bytesToCopy > length) {
+      bytesToCopy = length;
+    }
+    memcpy(context->block + context->blockLength, data, bytesToCopy);
+    context->blockLength += (int) bytesToCopy;
+    data += bytesToCopy;
+    length -= bytesToCopy;
+
+    if (context->blockLength < 64) {
+      return;
+    }
+    sha1Transform(context->state, context->block);
+    context->blockLength = 0;
+  }
+
+  while (length >= 64) {
+    sha1Transform(context->state, data);
+    data += 64;
+    length -= 64;
+  }
+
+  memcpy(context->block, data, length);
+  context->blockLength = (int) length;
+}
+
+void sha1Final(struct Sha1Context *context, uint8_t digest[SHA1_DIGEST_SIZE])
+{
+  uint64_t lengthInBits = context->lengthInBytes * 8;
+
+  context->block[context->blockLength++] = 0x80;
+  if (context->blockLength > 56) {
+    memset(context->block + context->blockLength, 0, 64 - context->blockLength);
+    sha1Transform(context->state, context->block);
+    context->blockLength = 0;
+  }
+  memset(context->block + context->blockLength, 0, 56 - context->blockLength);
+  for (int i = 0; i < 8; i++) {
+    context->block[56 + i] = (uint8_t) (lengthInBits >> (56 - 8*i));
+  }
+  sha1Transform(context->state, context->block);
+
+  for (int i = 0; i < 5; i++) {
+    digest[i*4] = (uint8_t) (context->state[i] >> 24);
+    digest[i*4 + 1] = (uint8_t) (context->state[i] >> 16);
+    digest[i*4 + 2] = (uint8_t) (context->state[i] >> 8);
+    digest[i*4 + 3] = (uint8_t) context->state[i];
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef FILE_HASH_H_SEEN
+#define FILE_HASH_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_SIZE 20
+
+struct Sha1Context
+{
+  uint32_t state[5];
+  uint64_t lengthInBytes;
+  uint8_t block[64];
+  int blockLength;
+};
+
+// Same CRC-32 that zip and the No-Intro / GoodNES databases use. Start with crc = 0; feed the previous result back in
+// to hash data in pieces.
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length);
+
+void sha1Init(struct Sha1Context *context);
+void sha1Update(struct Sha1Context *context, const uint8_t *data, size_t length);
+void sha1Final(struct Sha1Context *context, uint8_t digest[SHA1_DIGEST_SIZE]);
+
+#endif /* !FILE_HASH_H_SEEN */
@@ -0,0 +1,541 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "apu.h"
+#include "audio.h"
+#include "ppu.h"
+#include "emu.h"
+#include "controller.h"
+#include "cartridge.h"
+#include "movie.h"
+#include "fork.h"
+#include "lockstep.h"
+#include "hash.h"
+#include "platform.h"
+#include "profiler.h"
+#include "cputrace.h"
+#include "timing.h"
+#include "trace.h"
+
+/*
+ * Runs a game without a window, as fast as it will go, for testing and batch jobs.
+ *
+ *   headless <rom> [--frames <number>] [--movie <movie file>] [--hashes <file or ->] [--dump <ppm file>]
+ *                  [--wav <wav file>] [--audio-quality <fast, good or best>] [--lockstep <lanes>]
+ *                  [--profile <folded stacks file>] [--timings <csv or jsonl file>]
+ *                  [--perf-counters <csv or jsonl file>] [--trace <json file>] [--cpu-trace <file>]
+ *
+ * --frames   how many frames to run (defaults to the length of the movie, or 600 without one)
+ * --movie    play back the input from a movie recorded in win_play, starting from where it was recorded
+ * --hashes   write the CRC32 of every frame's picture, one frame per line ("-" for stdout)
+ * --dump     write the last frame's picture as a binary PPM
+ * --wav      write the sound as 16 bit mono at WAV_SAMPLE_RATE (the time spent making it counts as emulation)
+ * --audio-quality
+ *            how sharp a filter to make the sound with (see audio.h); good if not given
+ * --lockstep instead of the normal run, run that many forks of the game in lockstep (see lockstep.h) and then again one
+ *            at a time, check they ended up the same and compare timings. Lane 0 gets the movie's input (if any), the
+ *            others random input that changes every so often. Nothing is drawn, so --hashes and --dump are ignored.
+ * --profile  profile the CPU (see profiler.h): write its call stacks in the folded format flame graph tools read, and
+ *            print the opcodes and addresses that took the most cycles. The profiling counts as emulation time.
+ * --timings  time where each frame goes (see timing.h) and write a line per frame, as JSON if the file name ends in
+ *            .json or .jsonl and CSV otherwise, then print the breakdown for the whole run. Hashing and writing files
+ *            are the present stage. The timing slows emulation down a little, which shows in the frames/sec.
+ * --perf-counters
+ *            --timings with the processor's performance counters (see perfcounters.h, Linux only) for each stage
+ *            added to each line, and each stage's counts per frame printed at the end
+ * --trace    write a timeline of frames, batches of scanlines, OAM DMA, the APU's frames and the hashing and writing
+ *            after each frame, for chrome://tracing or Perfetto (see trace.h)
+ * --cpu-trace
+ *            record every instruction the CPU runs, in binary (see cputrace.h); dump_cpu_trace turns the file into
+ *            nestest style text. The recording counts as emulation time.
+ *
+ * Timing stats go to stdout at the end. Only emulation is timed, not hashing or writing files. Debug output from the
+ * emulator goes to stderr.
+ */
+
+#define DEFAULT_NUM_FRAMES 600
+#define LOCKSTEP_INPUT_PERIOD 30
+#define WAV_SAMPLE_RATE 48000
+#define WAV_FRAME_SAMPLES 4096
+#define PROFILE_NUM_ENTRIES 20
+
+static int writePpm(const char *filename, const uint32_t *videoBuffer)
+{
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    return 1;
+  }
+
+  fprintf(file, "P6\n%d %d\n255\n", VIDEO_BUFFER_WIDTH, VIDEO_BUFFER_HEIGHT);
+  for (int i = 0; i < VIDEO_BUFFER_WIDTH * VIDEO_BUFFER_HEIGHT; i++) {
+    uint8_t rgb[3] = { (uint8_t) (videoBuffer[i] >> 16), (uint8_t) (videoBuffer[i] >> 8), (uint8_t) videoBuffer[i] };
+    fwrite(rgb, 1, 3, file);
+  }
+
+  return fclose(file) != 0 ? 1 : 0;
+}
+
+static void writeLittleEndian(FILE *file, uint32_t value, int numBytes)
+{
+  for (int i = 0; i < numBytes; i++) {
+    fputc((value >> (8 * i)) & 0xFF, file);
+  }
+}
+
+// 16 bit mono PCM; written once with no samples to make room, then again over the top once we know how many there are
+static void writeWavHeader(FILE *file, uint32_t numSamples)
+{
+  uint32_t dataSize = numSamples * 2;
+  fwrite("RIFF", 1, 4, file);
+  writeLittleEndian(file, 36 + dataSize, 4);
+  fwrite("WAVEfmt ", 1, 8, file);
+  writeLittleEndian(file, 16, 4);
+  writeLittleEndian(file, 1, 2);  // PCM
+  writeLittleEndian(file, 1, 2);  // channels
+  writeLittleEndian(file, WAV_SAMPLE_RATE, 4);
+  writeLittleEndian(file, WAV_SAMPLE_RATE * 2, 4);
+  writeLittleEndian(file, 2, 2);
+  writeLittleEndian(file, 16, 2);
+  fwrite("data", 1, 4, file);
+  writeLittleEndian(file, dataSize, 4);
+}
+
+static void printUsage(void)
+{
+  printf("usage: headless <rom> [--frames <number>] [--movie <movie file>] [--hashes <file or ->] [--dump <ppm file>]\n"
+         "                      [--wav <wav file>] [--audio-quality <fast, good or best>] [--lockstep <lanes>]\n"
+         "                      [--profile <folded stacks file>] [--timings <csv or jsonl file>]\n"
+         "                      [--perf-counters <csv or jsonl file>] [--trace <json file>] [--cpu-trace <file>]\n");
+}
+
+static uint8_t lockstepLaneInput(int lane, int frame, struct Movie *movie)
+{
+  if (lane == 0) {
+    struct KeyboardInput keyboardInput = { .up = false };
+    if (movie) {
+      movieInput(movie, frame, &keyboardInput);
+    }
+    return packKeyboardInput(&keyboardInput);
+  }
+
+  uint32_t hash = (uint32_t) lane * 2654435761u ^ (uint32_t) (frame / LOCKSTEP_INPUT_PERIOD) * 40503u;
+  hash ^= hash >> 15;
+  hash *= 2246822519u;
+  hash ^= hash >> 13;
+  return (uint8_t) hash;
+}
+
+static int runLockstepComparison(int numLanes, int numFrames, struct Computer *state, struct PPU *ppu, struct Movie *movie, struct Color *palette)
+{
+  struct EmulatorFork *lanes[LOCKSTEP_MAX_LANES];
+  struct EmulatorFork *soloLanes[LOCKSTEP_MAX_LANES];
+  for (int i = 0; i < numLanes; i++) {
+    if (forkEmulator(&lanes[i], state, ppu) || forkEmulator(&soloLanes[i], state, ppu)) {
+      printf("Could not fork the emulator\n");
+      return 1;
+    }
+  }
+
+  struct LockstepStats stats = { 0 };
+  uint64_t lockstepTime = 0;
+  uint64_t soloTime = 0;
+  for (int frame = 0; frame < numFrames; frame++) {
+    for (int i = 0; i < numLanes; i++) {
+      uint8_t input = lockstepLaneInput(i, frame, movie);
+      unpackKeyboardInput(&lanes[i]->keyboardInput, input);
+      unpackKeyboardInput(&soloLanes[i]->keyboardInput, input);
+    }
+
+    uint64_t startTime = getTimeInNanoseconds();
+    runLockstepFrame(lanes, numLanes, NULL, palette, &stats);
+    lockstepTime += getTimeInNanoseconds() - startTime;
+
+    startTime = getTimeInNanoseconds();
+    for (int i = 0; i < numLanes; i++) {
+      while (!executeEmulatorCycle(&soloLanes[i]->state, &soloLanes[i]->ppu, NULL, palette));
+    }
+    soloTime += getTimeInNanoseconds() - startTime;
+  }
+
+  int numMismatches = 0;
+  for (int i = 0; i < numLanes; i++) {
+    if (memcmp(lanes[i]->memory, soloLanes[i]->memory, FORK_CPU_MEMORY_SIZE) != 0 ||
+        memcmp(lanes[i]->ppuMemory, soloLanes[i]->ppuMemory, FORK_PPU_MEMORY_SIZE) != 0 ||
+        lanes[i]->state.pc != soloLanes[i]->state.pc ||
+        lanes[i]->state.totalCyclesCompleted != soloLanes[i]->state.totalCyclesCompleted) {
+      printf("Lane %d ended up different in lockstep than on its own\n", i);
+      numMismatches++;
+    }
+  }
+
+  double laneFrames = (double) numLanes * numFrames;
+  printf("%d lanes x %d frames: lockstep %.0f ns/lane-frame, one at a time %.0f ns/lane-frame\n", numLanes, numFrames,
+      laneFrames > 0 ? lockstepTime / laneFrames : 0.0, laneFrames > 0 ? soloTime / laneFrames : 0.0);
+  if (stats.dispatches > 0) {
+    printf("%.2f lanes per dispatch, %.1f%% of dispatches shared, %.1f%% with every running lane\n",
+        (double) stats.laneInstructions / stats.dispatches, 100.0 * stats.sharedDispatches / stats.dispatches,
+        100.0 * stats.convergedDispatches / stats.dispatches);
+  }
+
+  for (int i = 0; i < numLanes; i++) {
+    freeEmulatorFork(lanes[i]);
+    freeEmulatorFork(soloLanes[i]);
+  }
+
+  return numMismatches > 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    printUsage();
+    return 1;
+  }
+
+  const char *romFilename = argv[1];
+  int numFrames = -1;
+  const char *movieFilename = NULL;
+  const char *hashesFilename = NULL;
+  const char *dumpFilename = NULL;
+  const char *wavFilename = NULL;
+  int audioQuality = AUDIO_QUALITY_GOOD;
+  int numLockstepLanes = 0;
+  const char *profileFilename = NULL;
+  const char *timingsFilename = NULL;
+  bool countPerfEvents = false;
+  const char *traceFilename = NULL;
+  const char *cpuTraceFilename = NULL;
+
+  for (int i = 2; i < argc; i++) {
+    if (i + 1 >= argc) {
+      printUsage();
+      return 1;
+    }
+    if (strcmp(argv[i], "--frames") == 0) {
+      numFrames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--movie") == 0) {
+      movieFilename = argv[++i];
+    } else if (strcmp(argv[i], "--hashes") == 0) {
+      hashesFilename = argv[++i];
+    } else if (strcmp(argv[i], "--dump") == 0) {
+      dumpFilename = argv[++i];
+    } else if (strcmp(argv[i], "--wav") == 0) {
+      wavFilename = argv[++i];
+    } else if (strcmp(argv[i], "--audio-quality") == 0) {
+      const char *quality = argv[++i];
+      if (strcmp(quality, "fast") == 0) {
+        audioQuality = AUDIO_QUALITY_FAST;
+      } else if (strcmp(quality, "good") == 0) {
+        audioQuality = AUDIO_QUALITY_GOOD;
+      } else if (strcmp(quality, "best") == 0) {
+        audioQuality = AUDIO_QUALITY_BEST;
+      } else {
+        printf("--audio-quality is fast, good or best\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--lockstep") == 0) {
+      numLockstepLanes = atoi(argv[++i]);
+      if (numLockstepLanes < 1 || numLockstepLanes > LOCKSTEP_MAX_LANES) {
+        printf("--lockstep takes 1 to %d lanes\n", LOCKSTEP_MAX_LANES);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profileFilename = argv[++i];
+    } else if (strcmp(argv[i], "--timings") == 0) {
+      timingsFilename = argv[++i];
+    } else if (strcmp(argv[i], "--perf-counters") == 0) {
+      timingsFilename = argv[++i];
+      countPerfEvents = true;
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      traceFilename = argv[++i];
+    } else if (strcmp(argv[i], "--cpu-trace") == 0) {
+      cpuTraceFilename = argv[++i];
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+
+  struct Cartridge *cartridge;
+  int loadCartridgeError = loadCartridge(&cartridge, romFilename);
+  if (loadCartridgeError) {
+    printf("Error loading %s: %d\n", romFilename, loadCartridgeError);
+    return 1;
+  }
+
+  struct PPU *ppu;
+  int createPPUError = createPPU(&ppu, cartridge);
+  if (createPPUError) {
+    printf("Could not create the PPU for %s: %d\n", romFilename, createPPUError);
+    return 1;
+  }
+
+  struct Color palette[64];
+  loadPalette(palette);
+
+  uint32_t *videoBuffer = (uint32_t *) calloc(VIDEO_BUFFER_WIDTH * VIDEO_BUFFER_HEIGHT, sizeof(uint32_t));
+  if (!videoBuffer) {
+    printf("Could not allocate the video buffer\n");
+    return 1;
+  }
+
+  struct KeyboardInput keyboardInput = { .up = false };
+  struct PPUClosure ppuClosure;
+  buildPPUClosure(&ppuClosure, ppu);
+
+  struct Computer state = { .keyboardInput = &keyboardInput, .ppuClosure = &ppuClosure };
+  int powerOnError = powerOnComputer(&state, cartridge);
+  if (powerOnError) {
+    printf("Could not start %s: %d\n", romFilename, powerOnError);
+    return 1;
+  }
+
+  struct Movie *movie = NULL;
+  if (movieFilename) {
+    int readMovieError = readMovie(&movie, movieFilename);
+    if (readMovieError) {
+      printf("Error reading movie %s: %d\n", movieFilename, readMovieError);
+      return 1;
+    }
+    if (movie->romCrc32 != crc32Update(0, cartridge->prgRom, cartridge->sizeOfPrgRomInBytes)) {
+      printf("Warning: movie %s was recorded with a different ROM\n", movieFilename);
+    }
+    int seekMovieError = seekMovie(movie, 0, &state, ppu, videoBuffer, palette);
+    if (seekMovieError) {
+      printf("Error starting movie %s: %d\n", movieFilename, seekMovieError);
+      return 1;
+    }
+  }
+
+  if (numFrames < 0) {
+    numFrames = movie ? movie->numFrames : DEFAULT_NUM_FRAMES;
+  }
+
+  if (numLockstepLanes > 0) {
+    return runLockstepComparison(numLockstepLanes, numFrames, &state, ppu, movie, palette);
+  }
+
+  FILE *hashesFile = NULL;
+  if (hashesFilename) {
+    hashesFile = strcmp(hashesFilename, "-") == 0 ? stdout : fopen(hashesFilename, "w");
+    if (!hashesFile) {
+      printf("Could not open %s\n", hashesFilename);
+      return 1;
+    }
+  }
+
+  FILE *wavFile = NULL;
+  struct AudioBuffer *audioBuffer = NULL;
+  int16_t *samples = NULL;
+  uint32_t numSamples = 0;
+  if (wavFilename) {
+    wavFile = fopen(wavFilename, "wb");
+    samples = (int16_t *) malloc(WAV_FRAME_SAMPLES * sizeof(int16_t));
+    if (!wavFile || !samples || createAudioBuffer(&audioBuffer, WAV_SAMPLE_RATE, APU_CLOCK_RATE, WAV_FRAME_SAMPLES, audioQuality)) {
+      printf("Could not set up writing sound to %s\n", wavFilename);
+      return 1;
+    }
+    writeWavHeader(wavFile, 0);
+    setApuOutput(&state.apu, audioBuffer);
+  }
+
+  struct CpuProfiler *profiler = NULL;
+  if (profileFilename) {
+    if (createCpuProfiler(&profiler, cartridge->sizeOfPrgRomInBytes)) {
+      printf("Could not create the profiler\n");
+      return 1;
+    }
+    state.profiler = profiler;
+  }
+
+  FILE *timingsFile = NULL;
+  int timingsFormat = TIMING_FORMAT_CSV;
+  if (timingsFilename) {
+    const char *extension = strrchr(timingsFilename, '.');
+    if (extension && (strcmp(extension, ".json") == 0 || strcmp(extension, ".jsonl") == 0)) {
+      timingsFormat = TIMING_FORMAT_JSON;
+    }
+    timingsFile = fopen(timingsFilename, "w");
+    if (!timingsFile || createStageTimer(&state.stageTimer)) {
+      printf("Could not set up writing timings to %s\n", timingsFilename);
+      return 1;
+    }
+    if (countPerfEvents) {
+      int perfError = attachPerfCounters(state.stageTimer);
+      if (perfError) {
+        printf("Could not open the perf counters: %d\n", perfError);
+        return 1;
+      }
+    }
+    writeFrameTimingsHeader(state.stageTimer, timingsFile, timingsFormat);
+  }
+  struct StageTimer *timer = state.stageTimer;
+
+  struct Tracer *tracer = NULL;
+  struct TraceBuffer *trace = NULL;
+  if (traceFilename) {
+    if (createTracer(&tracer, traceFilename) || createTraceBuffer(&trace, tracer, "emulation")) {
+      printf("Could not set up writing a trace to %s\n", traceFilename);
+      return 1;
+    }
+    traceEmulator(&state, trace);
+  }
+
+  struct CpuTrace *cpuTrace = NULL;
+  if (cpuTraceFilename) {
+    int cpuTraceError = createCpuTrace(&cpuTrace, cpuTraceFilename);
+    if (cpuTraceError) {
+      printf("Could not set up writing a CPU trace to %s: %d\n", cpuTraceFilename, cpuTraceError);
+      return 1;
+    }
+    state.cpuTrace = cpuTrace;
+  }
+
+  uint64_t emulationTime = 0;
+  for (int frame = 0; frame < numFrames; frame++) {
+    if (movie) {
+      movieInput(movie, frame, &keyboardInput);
+    }
+
+    uint64_t startTime = getTimeInNanoseconds();
+    while (!executeEmulatorCycle(&state, ppu, videoBuffer, palette));
+    int numFrameSamples = 0;
+    if (audioBuffer) {
+      uint64_t traceStart = trace ? getTimeInNanoseconds() : 0;
+      if (timer) {
+        beginStage(timer, TIMING_APU);
+      }
+      endApuFrame(&state.apu, &state);
+      numFrameSamples = readAudioSamples(audioBuffer, samples, WAV_FRAME_SAMPLES);
+      if (timer) {
+        endStage(timer);
+      }
+      if (trace) {
+        addTraceSpanWithArg(trace, "apu frame", traceStart, "samples", numFrameSamples);
+      }
+    }
+    emulationTime += getTimeInNanoseconds() - startTime;
+
+    uint64_t traceStart = trace ? getTimeInNanoseconds() : 0;
+    if (timer) {
+      beginStage(timer, TIMING_PRESENT);
+    }
+
+    if (wavFile) {
+      for (int i = 0; i < numFrameSamples; i++) {
+        writeLittleEndian(wavFile, (uint16_t) samples[i], 2);
+      }
+      numSamples += numFrameSamples;
+    }
+
+    if (hashesFile) {
+      uint32_t hash = crc32Update(0, (const uint8_t *) videoBuffer, VIDEO_BUFFER_WIDTH * VIDEO_BUFFER_HEIGHT * sizeof(uint32_t));
+      fprintf(hashesFile, "%d %08x\n", frame, hash);
+    }
+
+    if (timer) {
+      endStage(timer);
+      endTimedFrame(timer);
+      writeFrameTimings(timer, timingsFile, timingsFormat);
+    }
+    if (trace) {
+      addTraceSpan(trace, "present", traceStart);
+    }
+  }
+
+  if (cpuTrace) {
+    state.cpuTrace = NULL;
+    if (cpuTrace->stalls > 0) {
+      printf("The CPU waited for the disk %llu times while tracing\n", (unsigned long long) cpuTrace->stalls);
+    }
+    if (destroyCpuTrace(cpuTrace)) {
+      printf("Could not write %s\n", cpuTraceFilename);
+      return 1;
+    }
+  }
+
+  if (tracer && destroyTracer(tracer)) {
+    printf("Could not write %s\n", traceFilename);
+    return 1;
+  }
+
+  if (hashesFile && hashesFile != stdout) {
+    fclose(hashesFile);
+  }
+
+  if (wavFile) {
+    fseek(wavFile, 0, SEEK_SET);
+    writeWavHeader(wavFile, numSamples);
+    if (fclose(wavFile) != 0) {
+      printf("Could not write %s\n", wavFilename);
+      return 1;
+    }
+    freeAudioBuffer(audioBuffer);
+    free(samples);
+  }
+
+  if (dumpFilename && writePpm(dumpFilename, videoBuffer)) {
+    printf("Could not write %s\n", dumpFilename);
+    return 1;
+  }
+
+  double seconds = (double) emulationTime / 1000000000.0;
+  printf("%d frames in %.3f s: %.1f frames/sec, %.0f ns/frame\n", numFrames, seconds,
+      seconds > 0 ? numFrames / seconds : 0.0, numFrames > 0 ? (double) emulationTime / numFrames : 0.0);
+
+  if (timer) {
+    char breakdown[256];
+    struct FrameTimings average = timer->runTotal;
+    if (timer->numFrames > 0) {
+      average.total /= timer->numFrames;
+      for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+        average.nanoseconds[i] /= timer->numFrames;
+        for (int j = 0; j < PERF_NUM_COUNTERS; j++) {
+          average.counts[i][j] /= timer->numFrames;
+        }
+      }
+    }
+    formatFrameTimings(breakdown, sizeof(breakdown), &average);
+    printf("average frame %s\n", breakdown);
+    if (timer->perfCounters) {
+      printf("per frame, %s:\n", timer->perfCounters->rdpmc ? "read with rdpmc" : "read with read()");
+      for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+        formatStageCounts(breakdown, sizeof(breakdown), timer, &average, i);
+        printf("  %s\n", breakdown);
+      }
+    }
+    freeStageTimer(timer);
+    if (fclose(timingsFile) != 0) {
+      printf("Could not write %s\n", timingsFilename);
+      return 1;
+    }
+  }
+
+  if (profiler) {
+    printf("\n");
+    printCpuProfile(profiler, stdout, PROFILE_NUM_ENTRIES);
+    int writeError = writeFoldedStacks(profiler, profileFilename);
+    freeCpuProfiler(profiler);
+    if (writeError) {
+      printf("Could not write %s\n", profileFilename);
+      return 1;
+    }
+  }
+
+  if (movie) {
+    freeMovie(movie);
+  }
+  free(state.memory);
+  free(videoBuffer);
+  free(ppu->memory);
+  free(ppu->oam);
+  free(ppu);
+  free(cartridge->prgRom);
+  free(cartridge->chrRom);
+  free(cartridge);
+
+  return 0;
+}
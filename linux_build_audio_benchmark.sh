@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cc -O2 -pthread audio_benchmark.c audio.c platform.c -o audio_benchmark -lm
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cc -O2 -pthread diff_cpu_trace.c cputracetext.c platform.c -o diff_cpu_trace
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cc -O2 dump_cpu_trace.c cputracetext.c -o dump_cpu_trace
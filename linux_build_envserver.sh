@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cc -O2 -pthread envserver.c castleface.c batch.c observation.c cartridge.c cpu.c emu.c apu.c audio.c ppu.c debug.c battery.c platform.c savestate.c compress.c hash.c movie.c ramwatch.c timing.c perfcounters.c trace.c -o envserver -lrt -lm
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cc -O2 -pthread headless.c cartridge.c cpu.c emu.c apu.c audio.c ppu.c debug.c battery.c platform.c savestate.c compress.c hash.c movie.c ramwatch.c fork.c lockstep.c profiler.c timing.c perfcounters.c trace.c cputrace.c -o headless -lm
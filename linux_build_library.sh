@@ -0,0 +1,5 @@
+#!/bin/bash
+
+# builds libcastleface.a; programs using it include castleface.h and link with -lcastleface -pthread -lm
+cc -O2 -c castleface.c batch.c observation.c cartridge.c cpu.c emu.c apu.c audio.c ppu.c debug.c battery.c platform.c savestate.c compress.c hash.c movie.c ramwatch.c timing.c perfcounters.c trace.c
+ar rcs libcastleface.a castleface.o batch.o observation.o cartridge.o cpu.o emu.o apu.o audio.o ppu.o debug.o battery.o platform.o savestate.o compress.o hash.o movie.o ramwatch.o timing.o perfcounters.o trace.o
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cc -O2 -pthread scan_roms.c romscan.c cartridge.c hash.c platform.c debug.c -o scan_roms
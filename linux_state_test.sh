@@ -0,0 +1,4 @@
+#!/bin/bash
+
+cc -pthread state_test.c cartridge.c cpu.c emu.c apu.c audio.c ppu.c debug.c battery.c platform.c savestate.c compress.c rewind.c movie.c ramwatch.c timing.c perfcounters.c trace.c -o state_test.out -lm
+./state_test.out
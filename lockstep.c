@@ -0,0 +1,82 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "emu.h"
+#include "lockstep.h"
+
+/**
+ *
+ * videoBuffers has one buffer per lane, or is null to draw nothing. stats is added to, so it can cover many frames.
+ *
+ * Returns error code:
+ *  1: Too many lanes (more than LOCKSTEP_MAX_LANES).
+ *
+ */
+int runLockstepFrame(struct EmulatorFork **lanes, int numLanes, void **videoBuffers, struct Color *palette, struct LockstepStats *stats)
+{
+  if (numLanes > LOCKSTEP_MAX_LANES) {
+    return 1;
+  }
+
+  bool finished[LOCKSTEP_MAX_LANES] = { false };
+  int numRunning = numLanes;
+
+  uint8_t opcodes[LOCKSTEP_MAX_LANES];
+  uint8_t ppuStatusBefore[LOCKSTEP_MAX_LANES];
+  bool grouped[LOCKSTEP_MAX_LANES];
+  int members[LOCKSTEP_MAX_LANES];
+  struct Computer *states[LOCKSTEP_MAX_LANES];
+  int cycles[LOCKSTEP_MAX_LANES];
+
+  while (numRunning > 0) {
+    // every lane fetches its own opcode, same as executeEmulatorCycle, so reads with side effects still happen per lane
+    for (int i = 0; i < numLanes; i++) {
+      grouped[i] = finished[i];
+      if (!finished[i]) {
+        opcodes[i] = readMemory(lanes[i]->state.pc, &lanes[i]->state);
+      }
+    }
+
+    int numRunningThisStep = numRunning;
+    for (int leader = 0; leader < numLanes; leader++) {
+      if (grouped[leader]) {
+        continue;
+      }
+
+      unsigned int pc = lanes[leader]->state.pc;
+      int numMembers = 0;
+      for (int i = leader; i < numLanes; i++) {
+        if (!grouped[i] && lanes[i]->state.pc == pc && opcodes[i] == opcodes[leader]) {
+          grouped[i] = true;
+          members[numMembers] = i;
+          states[numMembers] = &lanes[i]->state;
+          ppuStatusBefore[numMembers] = lanes[i]->ppu.status;
+          numMembers++;
+        }
+      }
+
+      executeInstructionOnLanes(opcodes[leader], states, numMembers, cycles);
+
+      for (int m = 0; m < numMembers; m++) {
+        int lane = members[m];
+        void *videoBuffer = videoBuffers ? videoBuffers[lane] : NULL;
+        if (runPPUAfterInstruction(&lanes[lane]->state, &lanes[lane]->ppu, cycles[m], ppuStatusBefore[m], videoBuffer, palette)) {
+          finished[lane] = true;
+          numRunning--;
+        }
+      }
+
+      stats->dispatches++;
+      stats->laneInstructions += numMembers;
+      if (numMembers > 1) {
+        stats->sharedDispatches++;
+      }
+      if (numMembers == numRunningThisStep) {
+        stats->convergedDispatches++;
+      }
+    }
+  }
+
+  return 0;
+}
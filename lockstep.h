@@ -0,0 +1,30 @@
+#ifndef FILE_LOCKSTEP_H_SEEN
+#define FILE_LOCKSTEP_H_SEEN
+
+#include <stdint.h>
+#include "fork.h"
+
+#define LOCKSTEP_MAX_LANES 64
+
+/*
+ * Runs a frame on several forks of the same game at once ("lanes"), interleaved an instruction at a time. Lanes that
+ * are at the same pc about to run the same opcode are run as a group: the instruction is looked up once and then run
+ * on each lane in turn, so the indirect call into the instruction's handler goes to the same place every time.
+ * Lanes that have wandered off somewhere else form their own (possibly one lane) groups, and lanes that reach vblank
+ * first wait there for the rest.
+ *
+ * Each lane still has its own registers, memory and PPU, so results are identical to running the forks one after
+ * the other with executeEmulatorCycle. The stats say how often the lanes were actually together, which is what
+ * decides whether this is worth anything for a given game and set of inputs.
+ */
+struct LockstepStats
+{
+  uint64_t dispatches;           // instructions looked up, each run on a group of one or more lanes
+  uint64_t laneInstructions;     // instructions run, counting every lane
+  uint64_t sharedDispatches;     // dispatches whose group had more than one lane
+  uint64_t convergedDispatches;  // dispatches whose group was every lane still running the frame
+};
+
+int runLockstepFrame(struct EmulatorFork **lanes, int numLanes, void **videoBuffers, struct Color *palette, struct LockstepStats *stats);
+
+#endif /* !FILE_LOCKSTEP_H_SEEN */
@@ -0,0 +1,332 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "emu.h"
+#include "controller.h"
+#include "compress.h"
+#include "savestate.h"
+#include "debug.h"
+#include "movie.h"
+
+#define MOVIE_MAGIC "CFMV"
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE 24
+#define MOVIE_KEYFRAME_HEADER_SIZE 8
+
+uint8_t packKeyboardInput(const struct KeyboardInput *keyboardInput)
+{
+  return (uint8_t) (keyboardInput->a | (keyboardInput->b << 1) | (keyboardInput->select << 2) | (keyboardInput->start << 3) |
+    (keyboardInput->up << 4) | (keyboardInput->down << 5) | (keyboardInput->left << 6) | (keyboardInput->right << 7));
+}
+
+void unpackKeyboardInput(struct KeyboardInput *keyboardInput, uint8_t packedInput)
+{
+  keyboardInput->a = packedInput & 0x01;
+  keyboardInput->b = (packedInput >> 1) & 0x01;
+  keyboardInput->select = (packedInput >> 2) & 0x01;
+  keyboardInput->start = (packedInput >> 3) & 0x01;
+  keyboardInput->up = (packedInput >> 4) & 0x01;
+  keyboardInput->down = (packedInput >> 5) & 0x01;
+  keyboardInput->left = (packedInput >> 6) & 0x01;
+  keyboardInput->right = (packedInput >> 7) & 0x01;
+}
+
+static void putUint32(uint8_t *destination, uint32_t value)
+{
+  destination[0] = (uint8_t) value;
+  destination[1] = (uint8_t) (value >> 8);
+  destination[2] = (uint8_t) (value >> 16);
+  destination[3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t getUint32(const uint8_t *source)
+{
+  return (uint32_t) source[0] | ((uint32_t) source[1] << 8) | ((uint32_t) source[2] << 16) | ((uint32_t) source[3] << 24);
+}
+
+static struct Movie *allocateMovie(uint32_t romCrc32, int keyframeInterval)
+{
+  struct Movie *movie = (struct Movie *) calloc(1, sizeof(struct Movie));
+  if (!movie) {
+    return NULL;
+  }
+
+  movie->romCrc32 = romCrc32;
+  movie->keyframeInterval = keyframeInterval > 0 ? keyframeInterval : MOVIE_DEFAULT_KEYFRAME_INTERVAL;
+  movie->compressedBufferSize = lzCompressBound(saveStateSize());
+  movie->stateBuffer = (uint8_t *) malloc(saveStateSize());
+  movie->compressedBuffer = (uint8_t *) malloc(movie->compressedBufferSize);
+  if (!movie->stateBuffer || !movie->compressedBuffer) {
+    freeMovie(movie);
+    return NULL;
+  }
+
+  return movie;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *
+ */
+int createMovie(struct Movie **movie, uint32_t romCrc32, int keyframeInterval)
+{
+  struct Movie *newMovie = allocateMovie(romCrc32, keyframeInterval);
+  if (!newMovie) {
+    return 1;
+  }
+
+  *movie = newMovie;
+  return 0;
+}
+
+/**
+ *
+ * Call at the start of every frame with the input the frame is going to run with.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: Could not save a keyframe.
+ *
+ */
+int recordMovieFrame(struct Movie *movie, const struct Computer *state, const struct PPU *ppu, const struct KeyboardInput *keyboardInput)
+{
+  if (movie->numFrames == movie->maxFrames) {
+    int maxFrames = movie->maxFrames ? movie->maxFrames * 2 : 3600;
+    uint8_t *inputs = (uint8_t *) realloc(movie->inputs, maxFrames);
+    if (!inputs) {
+      return 1;
+    }
+    movie->inputs = inputs;
+    movie->maxFrames = maxFrames;
+  }
+
+  if (movie->numFrames % movie->keyframeInterval == 0) {
+    if (movie->numKeyframes == movie->maxKeyframes) {
+      int maxKeyframes = movie->maxKeyframes ? movie->maxKeyframes * 2 : 16;
+      struct MovieKeyframe *keyframes = (struct MovieKeyframe *) realloc(movie->keyframes, maxKeyframes * sizeof(struct MovieKeyframe));
+      if (!keyframes) {
+        return 1;
+      }
+      movie->keyframes = keyframes;
+      movie->maxKeyframes = maxKeyframes;
+    }
+
+    if (saveState(movie->stateBuffer, saveStateSize(), NULL, state, ppu)) {
+      return 2;
+    }
+    size_t size = lzCompress(movie->stateBuffer, saveStateSize(), movie->compressedBuffer, movie->compressedBufferSize);
+    uint8_t *data = (uint8_t *) malloc(size);
+    if (!data) {
+      return 1;
+    }
+    memcpy(data, movie->compressedBuffer, size);
+
+    struct MovieKeyframe *keyframe = &movie->keyframes[movie->numKeyframes++];
+    keyframe->frame = (uint32_t) movie->numFrames;
+    keyframe->size = (uint32_t) size;
+    keyframe->data = data;
+  }
+
+  movie->inputs[movie->numFrames++] = packKeyboardInput(keyboardInput);
+  return 0;
+}
+
+void movieInput(const struct Movie *movie, int frame, struct KeyboardInput *keyboardInput)
+{
+  unpackKeyboardInput(keyboardInput, frame >= 0 && frame < movie->numFrames ? movie->inputs[frame] : 0);
+}
+
+/**
+ *
+ * Puts the emulator at the start of the given frame (0 to numFrames) by loading the closest keyframe at or before it
+ * and running the frames in between as fast as possible with the recorded input. The frames rendered on the way go
+ * to videoBuffer, and state->keyboardInput is left holding the input of the last one.
+ *
+ * Returns error code:
+ *  1: Frame is not in the movie.
+ *  2: Keyframe is corrupt.
+ *  3: Could not load the keyframe.
+ *
+ */
+int seekMovie(struct Movie *movie, int frame, struct Computer *state, struct PPU *ppu, void *videoBuffer, struct Color *palette)
+{
+  if (frame < 0 || frame > movie->numFrames || movie->numKeyframes == 0) {
+    return 1;
+  }
+
+  int keyframeIndex = movie->numKeyframes - 1;
+  while (keyframeIndex > 0 && movie->keyframes[keyframeIndex].frame > (uint32_t) frame) {
+    keyframeIndex--;
+  }
+  const struct MovieKeyframe *keyframe = &movie->keyframes[keyframeIndex];
+  if (keyframe->frame > (uint32_t) frame) {
+    return 1;
+  }
+
+  if (lzDecompress(keyframe->data, keyframe->size, movie->stateBuffer, saveStateSize())) {
+    return 2;
+  }
+  if (loadState(movie->stateBuffer, saveStateSize(), state, ppu)) {
+    return 3;
+  }
+
+  for (int i = (int) keyframe->frame; i < frame; i++) {
+    movieInput(movie, i, state->keyboardInput);
+    while (!executeEmulatorCycle(state, ppu, videoBuffer, palette));
+  }
+
+  return 0;
+}
+
+/*
+ * Movie file layout (all little endian, except the save states which are in their own format):
+ *
+ *   "CFMV", version (u32), ROM CRC32 (u32), keyframe interval (u32), number of frames (u32), number of keyframes (u32)
+ *   input for every frame, one byte each
+ *   keyframes: frame (u32), compressed size (u32), compressed save state
+ *
+ * Returns error code:
+ *  1: Error opening movie file.
+ *  2: Error writing movie file.
+ *
+ */
+int writeMovie(const struct Movie *movie, const char *filename)
+{
+  FILE *file;
+  if (fopen_s(&file, filename, "wb")) {
+    print("Error opening movie file %s\n", filename);
+    return 1;
+  }
+
+  uint8_t header[MOVIE_HEADER_SIZE];
+  memcpy(header, MOVIE_MAGIC, 4);
+  putUint32(header + 4, MOVIE_VERSION);
+  putUint32(header + 8, movie->romCrc32);
+  putUint32(header + 12, (uint32_t) movie->keyframeInterval);
+  putUint32(header + 16, (uint32_t) movie->numFrames);
+  putUint32(header + 20, (uint32_t) movie->numKeyframes);
+
+  bool writeFailed = fwrite(header, 1, MOVIE_HEADER_SIZE, file) != MOVIE_HEADER_SIZE ||
+    fwrite(movie->inputs, 1, movie->numFrames, file) != (size_t) movie->numFrames;
+
+  for (int i = 0; i < movie->numKeyframes && !writeFailed; i++) {
+    const struct MovieKeyframe *keyframe = &movie->keyframes[i];
+    uint8_t keyframeHeader[MOVIE_KEYFRAME_HEADER_SIZE];
+    putUint32(keyframeHeader, keyframe->frame);
+    putUint32(keyframeHeader + 4, keyframe->size);
+    writeFailed = fwrite(keyframeHeader, 1, MOVIE_KEYFRAME_HEADER_SIZE, file) != MOVIE_KEYFRAME_HEADER_SIZE ||
+      fwrite(keyframe->data, 1, keyframe->size, file) != keyframe->size;
+  }
+
+  if (fclose(file) != 0 || writeFailed) {
+    print("Error writing movie file %s\n", filename);
+    return 2;
+  }
+
+  return 0;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Error opening movie file.
+ *  2: Could not allocate memory.
+ *  3: Not a movie file, or it's from a different version.
+ *  4: Movie file is truncated or corrupt.
+ *
+ */
+int readMovie(struct Movie **movie, const char *filename)
+{
+  FILE *file;
+  if (fopen_s(&file, filename, "rb")) {
+    print("Error opening movie file %s\n", filename);
+    return 1;
+  }
+
+  uint8_t header[MOVIE_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, MOVIE_MAGIC, 4) != 0 || getUint32(header + 4) != MOVIE_VERSION) {
+    fclose(file);
+    return 3;
+  }
+
+  uint32_t numFrames = getUint32(header + 16);
+  uint32_t numKeyframes = getUint32(header + 20);
+  if (numFrames > 0x7FFFFFFF || numKeyframes > numFrames + 1) {
+    fclose(file);
+    return 4;
+  }
+
+  struct Movie *newMovie = allocateMovie(getUint32(header + 8), (int) getUint32(header + 12));
+  if (!newMovie) {
+    fclose(file);
+    return 2;
+  }
+  newMovie->inputs = (uint8_t *) malloc(numFrames + 1);
+  newMovie->keyframes = (struct MovieKeyframe *) calloc(numKeyframes + 1, sizeof(struct MovieKeyframe));
+  if (!newMovie->inputs || !newMovie->keyframes) {
+    freeMovie(newMovie);
+    fclose(file);
+    return 2;
+  }
+  newMovie->maxFrames = (int) numFrames + 1;
+  newMovie->maxKeyframes = (int) numKeyframes + 1;
+
+  int error = 0;
+  if (fread(newMovie->inputs, 1, numFrames, file) != numFrames) {
+    error = 4;
+  }
+  newMovie->numFrames = (int) numFrames;
+
+  for (uint32_t i = 0; i < numKeyframes && !error; i++) {
+    uint8_t keyframeHeader[MOVIE_KEYFRAME_HEADER_SIZE];
+    if (fread(keyframeHeader, sizeof(keyframeHeader), 1, file) != 1) {
+      error = 4;
+      break;
+    }
+
+    struct MovieKeyframe *keyframe = &newMovie->keyframes[i];
+    keyframe->frame = getUint32(keyframeHeader);
+    keyframe->size = getUint32(keyframeHeader + 4);
+    // seekMovie searches backwards for the nearest keyframe, so their frames must be strictly increasing
+    bool outOfOrder = i > 0 && keyframe->frame <= newMovie->keyframes[i - 1].frame;
+    if (outOfOrder || keyframe->frame > numFrames || keyframe->size > newMovie->compressedBufferSize) {
+      error = 4;
+      break;
+    }
+
+    keyframe->data = (uint8_t *) malloc(keyframe->size);
+    newMovie->numKeyframes = (int) i + 1;
+    if (!keyframe->data) {
+      error = 2;
+    } else if (fread(keyframe->data, 1, keyframe->size, file) != keyframe->size) {
+      error = 4;
+    }
+  }
+  fclose(file);
+
+  if (error) {
+    freeMovie(newMovie);
+    return error;
+  }
+
+  *movie = newMovie;
+  return 0;
+}
+
+void freeMovie(struct Movie *movie)
+{
+  for (int i = 0; i < movie->numKeyframes; i++) {
+    free(movie->keyframes[i].data);
+  }
+  free(movie->keyframes);
+  free(movie->inputs);
+  free(movie->stateBuffer);
+  free(movie->compressedBuffer);
+  free(movie);
+}
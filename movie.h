@@ -0,0 +1,58 @@
+#ifndef FILE_MOVIE_H_SEEN
+#define FILE_MOVIE_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Computer;
+struct PPU;
+struct Color;
+struct KeyboardInput;
+
+#define MOVIE_DEFAULT_KEYFRAME_INTERVAL 600
+
+struct MovieKeyframe
+{
+  uint32_t frame;
+  uint32_t size;  // compressed
+  uint8_t *data;  // an LZ compressed save state
+};
+
+/*
+ * A recording of the controller input for every frame, plus a save state every keyframeInterval frames so playback can
+ * jump to any frame without starting from the beginning.
+ *
+ * Input is one byte a frame, laid out like the controller's shift register (A in bit 0 through right in bit 7). A frame
+ * starts where executeEmulatorCycle reports the start of vblank, and its input has to stay the same until the next
+ * one; that's what makes playing it back exact.
+ */
+struct Movie
+{
+  uint32_t romCrc32;  // whatever the caller wants to use to check a movie matches a ROM
+  int keyframeInterval;
+
+  uint8_t *inputs;
+  int numFrames;
+  int maxFrames;
+
+  struct MovieKeyframe *keyframes;
+  int numKeyframes;
+  int maxKeyframes;
+
+  uint8_t *stateBuffer;
+  uint8_t *compressedBuffer;
+  size_t compressedBufferSize;
+};
+
+uint8_t packKeyboardInput(const struct KeyboardInput *keyboardInput);
+void unpackKeyboardInput(struct KeyboardInput *keyboardInput, uint8_t packedInput);
+
+int createMovie(struct Movie **movie, uint32_t romCrc32, int keyframeInterval);
+int recordMovieFrame(struct Movie *movie, const struct Computer *state, const struct PPU *ppu, const struct KeyboardInput *keyboardInput);
+int seekMovie(struct Movie *movie, int frame, struct Computer *state, struct PPU *ppu, void *videoBuffer, struct Color *palette);
+void movieInput(const struct Movie *movie, int frame, struct KeyboardInput *keyboardInput);
+int writeMovie(const struct Movie *movie, const char *filename);
+int readMovie(struct Movie **movie, const char *filename);
+void freeMovie(struct Movie *movie);
+
+#endif /* !FILE_MOVIE_H_SEEN */
@@ -0,0 +1,133 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "observation.h"
+
+/**
+ *
+ * Returns error code:
+ *  1: The format doesn't make sense (bigger than the cropped frame, crop bigger than the frame, or a stack size
+ *     outside 1 to OBSERVATION_MAX_STACK_SIZE).
+ *  2: Could not allocate memory.
+ *
+ */
+int createObservationPipeline(struct ObservationPipeline **pipeline, const struct ObservationFormat *format)
+{
+  int croppedWidth = OBSERVATION_SOURCE_WIDTH - format->cropLeft - format->cropRight;
+  int croppedHeight = OBSERVATION_SOURCE_HEIGHT - format->cropTop - format->cropBottom;
+  if (format->cropTop < 0 || format->cropBottom < 0 || format->cropLeft < 0 || format->cropRight < 0 ||
+      format->width < 1 || format->width > croppedWidth || format->height < 1 || format->height > croppedHeight ||
+      format->stackSize < 1 || format->stackSize > OBSERVATION_MAX_STACK_SIZE) {
+    return 1;
+  }
+
+  struct ObservationPipeline *newPipeline = (struct ObservationPipeline *) calloc(1, sizeof(struct ObservationPipeline));
+  if (!newPipeline) {
+    return 2;
+  }
+
+  newPipeline->format = *format;
+  newPipeline->frameSize = (size_t) format->width * format->height;
+  newPipeline->columnStarts = (uint16_t *) malloc((format->width + 1) * sizeof(uint16_t));
+  newPipeline->rowOf = (uint8_t *) malloc(croppedHeight);
+  newPipeline->reciprocals = (uint32_t *) malloc(newPipeline->frameSize * sizeof(uint32_t));
+  newPipeline->stack = (uint8_t *) calloc(format->stackSize, newPipeline->frameSize);
+  if (!newPipeline->columnStarts || !newPipeline->rowOf || !newPipeline->reciprocals || !newPipeline->stack) {
+    freeObservationPipeline(newPipeline);
+    return 2;
+  }
+
+  // every source pixel inside the crop belongs to exactly one box, and boxes differ in size by at most a pixel
+  int rowCounts[OBSERVATION_SOURCE_HEIGHT] = { 0 };
+  for (int column = 0; column <= format->width; column++) {
+    newPipeline->columnStarts[column] = (uint16_t) ((column * croppedWidth + format->width - 1) / format->width);
+  }
+  for (int y = 0; y < croppedHeight; y++) {
+    newPipeline->rowOf[y] = (uint8_t) (y * format->height / croppedHeight);
+    rowCounts[newPipeline->rowOf[y]]++;
+  }
+  for (int row = 0; row < format->height; row++) {
+    for (int column = 0; column < format->width; column++) {
+      int columnCount = newPipeline->columnStarts[column + 1] - newPipeline->columnStarts[column];
+      newPipeline->reciprocals[row * format->width + column] = 65536 / (columnCount * rowCounts[row]);
+    }
+  }
+
+  *pipeline = newPipeline;
+  return 0;
+}
+
+/*
+ * Feeds in source row y (OBSERVATION_SOURCE_WIDTH 0x00RRGGBB pixels). Rows have to come in order, top to bottom; the
+ * first row inside the crop moves the stack along to make room for the new frame.
+ */
+void observeScanline(struct ObservationPipeline *pipeline, const uint32_t *pixels, int y)
+{
+  const struct ObservationFormat *format = &pipeline->format;
+  int croppedHeight = OBSERVATION_SOURCE_HEIGHT - format->cropTop - format->cropBottom;
+  int croppedY = y - format->cropTop;
+  if (croppedY < 0 || croppedY >= croppedHeight) {
+    return;
+  }
+
+  uint8_t *newest = pipeline->stack + (format->stackSize - 1) * pipeline->frameSize;
+  if (croppedY == 0 && format->stackSize > 1) {
+    memmove(pipeline->stack, pipeline->stack + pipeline->frameSize, (format->stackSize - 1) * pipeline->frameSize);
+  }
+
+  // BT.601 luma in 8 bit fixed point. The whole row is done, crop or not: with a fixed trip count compilers turn this
+  // into SIMD even at -O2.
+  uint16_t *columnSums = pipeline->columnSums;
+  for (int x = 0; x < OBSERVATION_SOURCE_WIDTH; x++) {
+    uint32_t pixel = pixels[x];
+    columnSums[x] += (uint16_t) ((77 * ((pixel >> 16) & 0xFF) + 150 * ((pixel >> 8) & 0xFF) + 29 * (pixel & 0xFF) + 128) >> 8);
+  }
+
+  int row = pipeline->rowOf[croppedY];
+  bool lastRowOfBox = croppedY + 1 == croppedHeight || pipeline->rowOf[croppedY + 1] != row;
+  if (lastRowOfBox) {
+    uint8_t *output = newest + row * format->width;
+    const uint32_t *reciprocals = pipeline->reciprocals + row * format->width;
+    const uint16_t *croppedSums = columnSums + format->cropLeft;
+    for (int column = 0; column < format->width; column++) {
+      uint32_t sum = 0;
+      for (int x = pipeline->columnStarts[column]; x < pipeline->columnStarts[column + 1]; x++) {
+        sum += croppedSums[x];
+      }
+      output[column] = (uint8_t) ((sum * reciprocals[column] + 32768) >> 16);
+    }
+    memset(columnSums, 0, sizeof(pipeline->columnSums));
+  }
+}
+
+// Feeds in a whole frame (OBSERVATION_SOURCE_WIDTH * OBSERVATION_SOURCE_HEIGHT 0x00RRGGBB pixels).
+void observeFrame(struct ObservationPipeline *pipeline, const uint32_t *framebuffer)
+{
+  int lastRow = OBSERVATION_SOURCE_HEIGHT - pipeline->format.cropBottom;
+  for (int y = pipeline->format.cropTop; y < lastRow; y++) {
+    observeScanline(pipeline, framebuffer + y * OBSERVATION_SOURCE_WIDTH, y);
+  }
+}
+
+// In bytes: width * height * stackSize.
+size_t observationSize(const struct ObservationPipeline *pipeline)
+{
+  return pipeline->frameSize * pipeline->format.stackSize;
+}
+
+// Forgets the stacked frames, e.g. when the game restarts.
+void clearObservation(struct ObservationPipeline *pipeline)
+{
+  memset(pipeline->stack, 0, observationSize(pipeline));
+  memset(pipeline->columnSums, 0, sizeof(pipeline->columnSums));
+}
+
+void freeObservationPipeline(struct ObservationPipeline *pipeline)
+{
+  free(pipeline->columnStarts);
+  free(pipeline->rowOf);
+  free(pipeline->reciprocals);
+  free(pipeline->stack);
+  free(pipeline);
+}
@@ -0,0 +1,54 @@
+#ifndef FILE_OBSERVATION_H_SEEN
+#define FILE_OBSERVATION_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OBSERVATION_SOURCE_WIDTH 256
+#define OBSERVATION_SOURCE_HEIGHT 240
+#define OBSERVATION_MAX_STACK_SIZE 16
+
+/*
+ * What an agent sees instead of the full picture: crop the frame, turn it grey, shrink it to width x height by
+ * averaging each box of pixels that lands on an output pixel, and keep the last stackSize of those.
+ */
+struct ObservationFormat
+{
+  int width;
+  int height;
+  int stackSize;
+  int cropTop;
+  int cropBottom;
+  int cropLeft;
+  int cropRight;
+};
+
+/*
+ * Turns frames into observations a scanline at a time, so a frame can be fed in as it's drawn or all at once
+ * afterwards while it's still in cache. The output is stackSize frames of height rows of width bytes, oldest first.
+ *
+ * Each scanline is turned grey and added into a running sum per source column, which is a fixed length loop that
+ * compilers turn into SIMD. Only when the last scanline of a row of boxes has been added are the column sums added up
+ * across each box, so the per-box work happens once per output row rather than once per scanline.
+ */
+struct ObservationPipeline
+{
+  struct ObservationFormat format;
+  size_t frameSize;  // width * height
+
+  uint16_t *columnStarts;    // first source column (inside the crop) of each output column, plus one past the end
+  uint8_t *rowOf;            // output row of each source row inside the crop
+  uint32_t *reciprocals;     // 65536 / the area of the box, per output pixel
+  uint16_t columnSums[OBSERVATION_SOURCE_WIDTH];  // for the output row being built; 240 rows of 255 still fit
+
+  uint8_t *stack;            // the observation: stackSize frames, the newest last
+};
+
+int createObservationPipeline(struct ObservationPipeline **pipeline, const struct ObservationFormat *format);
+void observeScanline(struct ObservationPipeline *pipeline, const uint32_t *pixels, int y);
+void observeFrame(struct ObservationPipeline *pipeline, const uint32_t *framebuffer);
+size_t observationSize(const struct ObservationPipeline *pipeline);
+void clearObservation(struct ObservationPipeline *pipeline);
+void freeObservationPipeline(struct ObservationPipeline *pipeline);
+
+#endif /* !FILE_OBSERVATION_H_SEEN */
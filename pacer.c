@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "pacer.h"
+
+#define MIN_SPIN_NANOSECONDS 250000
+#define MAX_SPIN_NANOSECONDS 3000000
+#define INITIAL_SPIN_NANOSECONDS 2000000
+
+// further behind than this (stopped in a debugger, say) and the pacer starts again from now rather than race to catch up
+#define MAX_LATENESS_NANOSECONDS 100000000
+
+void initFramePacer(struct FramePacer *pacer)
+{
+  memset(pacer, 0, sizeof(struct FramePacer));
+  pacer->mode = PACER_REAL_TIME;
+  pacer->turboMultiplier = 1;
+  pacer->spinNanoseconds = INITIAL_SPIN_NANOSECONDS;
+  pacer->lastFrameTime = getTimeInNanoseconds();
+  pacer->nextFrameTime = pacer->lastFrameTime;
+}
+
+// turboMultiplier only matters for PACER_TURBO
+void setFramePacerMode(struct FramePacer *pacer, int mode, int turboMultiplier)
+{
+  pacer->mode = mode;
+  pacer->turboMultiplier = turboMultiplier > 0 ? turboMultiplier : 1;
+  pacer->nextFrameTime = getTimeInNanoseconds();
+}
+
+static void sleepUntil(struct FramePacer *pacer, uint64_t time)
+{
+  uint64_t now = getTimeInNanoseconds();
+  if (time > now + pacer->spinNanoseconds) {
+    uint64_t sleepTime = time - now - pacer->spinNanoseconds;
+    sleepNanoseconds(sleepTime);
+
+    uint64_t woke = getTimeInNanoseconds();
+    uint64_t late = woke > now + sleepTime ? woke - (now + sleepTime) : 0;
+    if (late > pacer->spinNanoseconds) {
+      pacer->spinNanoseconds += (late - pacer->spinNanoseconds) / 2;
+    } else {
+      pacer->spinNanoseconds -= (pacer->spinNanoseconds - late) / 16;
+    }
+    if (pacer->spinNanoseconds < MIN_SPIN_NANOSECONDS) {
+      pacer->spinNanoseconds = MIN_SPIN_NANOSECONDS;
+    } else if (pacer->spinNanoseconds > MAX_SPIN_NANOSECONDS) {
+      pacer->spinNanoseconds = MAX_SPIN_NANOSECONDS;
+    }
+  }
+
+  while (getTimeInNanoseconds() < time);
+}
+
+// Call once a frame, once it's ready to show. Returns when it's time to show it.
+void waitForNextFrame(struct FramePacer *pacer)
+{
+  if (pacer->mode != PACER_UNTHROTTLED) {
+    uint64_t frameTime = PACER_NTSC_FRAME_NANOSECONDS;
+    if (pacer->mode == PACER_TURBO) {
+      frameTime /= pacer->turboMultiplier;
+    }
+    pacer->nextFrameTime += frameTime;
+
+    uint64_t now = getTimeInNanoseconds();
+    if (now > pacer->nextFrameTime + MAX_LATENESS_NANOSECONDS) {
+      pacer->nextFrameTime = now;
+    } else {
+      sleepUntil(pacer, pacer->nextFrameTime);
+    }
+  }
+
+  recordFrame(pacer);
+}
+
+// For when something else decided when the frame went (see win_play.c's paceOnSound): only keeps the stats.
+void recordFrame(struct FramePacer *pacer)
+{
+  uint64_t now = getTimeInNanoseconds();
+  uint64_t interval = now - pacer->lastFrameTime;
+  pacer->intervals[pacer->nextInterval] = interval > UINT32_MAX ? UINT32_MAX : (uint32_t) interval;
+  pacer->nextInterval = (pacer->nextInterval + 1) & (PACER_HISTORY_FRAMES - 1);
+  if (pacer->numIntervals < PACER_HISTORY_FRAMES) {
+    pacer->numIntervals++;
+  }
+  pacer->lastFrameTime = now;
+
+  if (pacer->mode == PACER_UNTHROTTLED) {
+    pacer->nextFrameTime = now;
+  }
+}
+
+static int compareIntervals(const void *a, const void *b)
+{
+  uint32_t first = *(const uint32_t *) a;
+  uint32_t second = *(const uint32_t *) b;
+  return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+// Over the last PACER_HISTORY_FRAMES frames (or however many there have been).
+void getFramePacerStats(const struct FramePacer *pacer, struct FramePacerStats *stats)
+{
+  memset(stats, 0, sizeof(struct FramePacerStats));
+  stats->numFrames = pacer->numIntervals;
+  if (pacer->numIntervals == 0) {
+    return;
+  }
+
+  uint32_t sorted[PACER_HISTORY_FRAMES];
+  memcpy(sorted, pacer->intervals, pacer->numIntervals * sizeof(uint32_t));
+  qsort(sorted, pacer->numIntervals, sizeof(uint32_t), compareIntervals);
+
+  uint64_t total = 0;
+  for (int i = 0; i < pacer->numIntervals; i++) {
+    total += sorted[i];
+  }
+  stats->framesPerSecond = total > 0 ? pacer->numIntervals * 1000000000.0 / total : 0.0;
+  stats->medianInterval = sorted[pacer->numIntervals / 2];
+  stats->p99Interval = sorted[(pacer->numIntervals * 99) / 100];
+  stats->maxInterval = sorted[pacer->numIntervals - 1];
+}
@@ -0,0 +1,55 @@
+#ifndef FILE_PACER_H_SEEN
+#define FILE_PACER_H_SEEN
+
+#include <stdint.h>
+
+// 1e9 / 60.0988: the NTSC NES draws a frame every 29780.5 CPU cycles at 1.789773 MHz
+#define PACER_NTSC_FRAME_NANOSECONDS 16639267
+
+#define PACER_REAL_TIME 0
+#define PACER_TURBO 1
+#define PACER_UNTHROTTLED 2
+
+#define PACER_HISTORY_FRAMES 1024  // a power of two
+
+/*
+ * Keeps frames coming at a steady rate: real time (PACER_NTSC_FRAME_NANOSECONDS apart), turbo (turboMultiplier times
+ * as fast) or as fast as they can be made.
+ *
+ * Each frame is due a fixed time after the one before was due, not after the one before happened to finish, so late
+ * wake ups don't add up into drift. Sleeping is coarse (see sleepNanoseconds), so the pacer sleeps until
+ * spinNanoseconds before a frame is due and spins on the clock from there. spinNanoseconds follows how late sleeps have
+ * actually been coming back: quickly up when they're later than it allows for, slowly down when they're not, and never
+ * more than a few milliseconds, so one sleep that the scheduler held up doesn't leave it spinning for every frame after.
+ *
+ * The time between frames is kept for the last PACER_HISTORY_FRAMES frames, for getFramePacerStats.
+ */
+struct FramePacer
+{
+  int mode;
+  int turboMultiplier;
+  uint64_t nextFrameTime;
+  uint64_t lastFrameTime;
+  uint64_t spinNanoseconds;
+
+  uint32_t intervals[PACER_HISTORY_FRAMES];  // nanoseconds
+  int numIntervals;
+  int nextInterval;
+};
+
+struct FramePacerStats
+{
+  int numFrames;
+  double framesPerSecond;
+  uint32_t medianInterval;  // nanoseconds
+  uint32_t p99Interval;
+  uint32_t maxInterval;
+};
+
+void initFramePacer(struct FramePacer *pacer);
+void setFramePacerMode(struct FramePacer *pacer, int mode, int turboMultiplier);
+void waitForNextFrame(struct FramePacer *pacer);
+void recordFrame(struct FramePacer *pacer);
+void getFramePacerStats(const struct FramePacer *pacer, struct FramePacerStats *stats);
+
+#endif /* !FILE_PACER_H_SEEN */
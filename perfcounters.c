@@ -0,0 +1,191 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // for syscall
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "perfcounters.h"
+
+static const char *counterNames[PERF_NUM_COUNTERS] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+
+bool perfCounterOpen(const struct PerfCounters *counters, int counter)
+{
+  return counters->fds[counter] >= 0;
+}
+
+const char *perfCounterName(int counter)
+{
+  return counter >= 0 && counter < PERF_NUM_COUNTERS ? counterNames[counter] : "unknown";
+}
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PERF_RDPMC 1
+#include <x86intrin.h>
+#endif
+
+static const struct
+{
+  uint32_t type;
+  uint64_t config;
+} events[PERF_NUM_COUNTERS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+// groupFd is -1 for the leader
+static int openEvent(int counter, int groupFd)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = events[counter].type;
+  attr.config = events[counter].config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: Not supported on this platform.
+ *  3: None of the counters could be opened.
+ *
+ */
+int openPerfCounters(struct PerfCounters **counters)
+{
+  struct PerfCounters *newCounters = (struct PerfCounters *) calloc(1, sizeof(struct PerfCounters));
+  if (!newCounters) {
+    return 1;
+  }
+
+  newCounters->leader = -1;
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    newCounters->fds[i] = openEvent(i, newCounters->leader);
+    if (newCounters->fds[i] < 0) {
+      continue;
+    }
+    if (newCounters->leader < 0) {
+      newCounters->leader = newCounters->fds[i];
+    }
+    newCounters->groupIndex[i] = newCounters->numOpen++;
+  }
+  if (newCounters->numOpen == 0) {
+    free(newCounters);
+    return 3;
+  }
+
+#ifdef PERF_RDPMC
+  long pageSize = sysconf(_SC_PAGESIZE);
+  newCounters->rdpmc = true;
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (newCounters->fds[i] < 0) {
+      continue;
+    }
+    void *page = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, newCounters->fds[i], 0);
+    if (page == MAP_FAILED) {
+      newCounters->rdpmc = false;
+      continue;
+    }
+    newCounters->pages[i] = page;
+    if (!((const struct perf_event_mmap_page *) page)->cap_user_rdpmc) {
+      newCounters->rdpmc = false;
+    }
+  }
+#endif
+
+  *counters = newCounters;
+  return 0;
+}
+
+#ifdef PERF_RDPMC
+// The kernel's recipe (see perf_event_mmap_page in linux/perf_event.h): what it's saved up plus what's in the hardware
+// counter now, tried again if it moved the counter somewhere else in the middle.
+static uint64_t readMappedCounter(const volatile struct perf_event_mmap_page *page)
+{
+  uint32_t sequence;
+  int64_t count;
+  do {
+    sequence = page->lock;
+    __asm__ volatile("" ::: "memory");
+    uint32_t index = page->index;
+    count = page->offset;
+    if (index) {
+      int shift = 64 - page->pmc_width;
+      count += (int64_t) ((uint64_t) __rdpmc(index - 1) << shift) >> shift;
+    }
+    __asm__ volatile("" ::: "memory");
+  } while (page->lock != sequence);
+  return (uint64_t) count;
+}
+#endif
+
+// values gets PERF_NUM_COUNTERS counts since the counters were opened, 0 for the ones that aren't open
+void readPerfCounters(const struct PerfCounters *counters, uint64_t *values)
+{
+#ifdef PERF_RDPMC
+  if (counters->rdpmc) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+      values[i] = counters->pages[i] ? readMappedCounter((const struct perf_event_mmap_page *) counters->pages[i]) : 0;
+    }
+    return;
+  }
+#endif
+
+  uint64_t group[1 + PERF_NUM_COUNTERS];  // how many, then each one's count
+  ssize_t size = read(counters->leader, group, sizeof(group));
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    bool valid = counters->fds[i] >= 0 && size >= (ssize_t) ((2 + counters->groupIndex[i]) * sizeof(uint64_t));
+    values[i] = valid ? group[1 + counters->groupIndex[i]] : 0;
+  }
+}
+
+void closePerfCounters(struct PerfCounters *counters)
+{
+  long pageSize = sysconf(_SC_PAGESIZE);
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    if (counters->pages[i]) {
+      munmap(counters->pages[i], pageSize);
+    }
+    if (counters->fds[i] >= 0) {
+      close(counters->fds[i]);
+    }
+  }
+  free(counters);
+}
+
+#else
+
+int openPerfCounters(struct PerfCounters **counters)
+{
+  (void) counters;
+  return 2;
+}
+
+void readPerfCounters(const struct PerfCounters *counters, uint64_t *values)
+{
+  (void) counters;
+  memset(values, 0, PERF_NUM_COUNTERS * sizeof(uint64_t));
+}
+
+void closePerfCounters(struct PerfCounters *counters)
+{
+  free(counters);
+}
+
+#endif
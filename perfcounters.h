@@ -0,0 +1,44 @@
+#ifndef FILE_PERFCOUNTERS_H_SEEN
+#define FILE_PERFCOUNTERS_H_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_L1D_MISSES 2     // level 1 data cache read misses
+#define PERF_LLC_MISSES 3     // last level cache misses
+#define PERF_BRANCH_MISSES 4  // mispredicted branches
+#define PERF_NUM_COUNTERS 5
+
+/*
+ * The processor's own performance counters, for the thread that opened them, through Linux's perf_event_open. Only
+ * user space is counted, which works with the default perf_event_paranoid of 2 and leaves out the kernel's share of
+ * any system calls.
+ *
+ * They're opened as one group so that they all count over the same stretch. A counter the processor or kernel doesn't
+ * have is left out (virtual machines often have none at all), and openPerfCounters only fails when nothing opens. If
+ * the group needs more counters than the processor has, the kernel takes turns and the counts come up short; nothing
+ * here scales them back up.
+ *
+ * Reading them is rdpmc straight from user space where the kernel allows it (x86, and the default rdpmc setting of 1
+ * once the counters are mapped), which costs a few dozen cycles a counter. Otherwise it's one read() of the whole
+ * group, a system call. Anywhere but Linux, openPerfCounters always fails.
+ */
+struct PerfCounters
+{
+  int fds[PERF_NUM_COUNTERS];         // -1 for the ones that didn't open
+  int groupIndex[PERF_NUM_COUNTERS];  // where each one's value is in a read of the group
+  int leader;                         // the first one that opened
+  int numOpen;
+  void *pages[PERF_NUM_COUNTERS];  // each one's struct perf_event_mmap_page, for rdpmc
+  bool rdpmc;                      // every one that's open can be read with rdpmc
+};
+
+int openPerfCounters(struct PerfCounters **counters);
+bool perfCounterOpen(const struct PerfCounters *counters, int counter);
+void readPerfCounters(const struct PerfCounters *counters, uint64_t *values);
+const char *perfCounterName(int counter);
+void closePerfCounters(struct PerfCounters *counters);
+
+#endif /* !FILE_PERFCOUNTERS_H_SEEN */
@@ -0,0 +1,384 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // for pthread_setaffinity_np
+#endif
+
+#include <stdint.h>
+#include "platform.h"
+
+#ifdef _WIN32
+
+static DWORD WINAPI threadEntry(LPVOID parameter)
+{
+  struct Thread *thread = (struct Thread *) parameter;
+  thread->function(thread->argument);
+  return 0;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not create the thread.
+ *
+ */
+int createThread(struct Thread *thread, void (*function)(void *argument), void *argument)
+{
+  thread->function = function;
+  thread->argument = argument;
+  thread->handle = CreateThread(NULL, 0, threadEntry, thread, 0, NULL);
+  if (!thread->handle) {
+    return 1;
+  }
+  return 0;
+}
+
+void joinThread(struct Thread *thread)
+{
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+}
+
+bool pinThreadToProcessor(struct Thread *thread, int processor)
+{
+  if (processor < 0 || processor >= 64) {
+    return false;
+  }
+  return SetThreadAffinityMask(thread->handle, (DWORD_PTR) 1 << processor) != 0;
+}
+
+int getProcessorCount(void)
+{
+  SYSTEM_INFO systemInfo;
+  GetSystemInfo(&systemInfo);
+  return (int) systemInfo.dwNumberOfProcessors;
+}
+
+uint64_t getTimeInNanoseconds(void)
+{
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER count;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&count);
+  return (uint64_t) ((double) count.QuadPart * 1000000000.0 / (double) frequency.QuadPart);
+}
+
+// Only to the millisecond, and only that fine with timeBeginPeriod(1); it can come back a millisecond or two late.
+void sleepNanoseconds(uint64_t nanoseconds)
+{
+  Sleep((DWORD) (nanoseconds / 1000000));
+}
+
+void initMutex(struct Mutex *mutex)
+{
+  InitializeSRWLock(&mutex->lock);
+}
+
+void destroyMutex(struct Mutex *mutex)
+{
+  // SRW locks don't need to be destroyed
+}
+
+void lockMutex(struct Mutex *mutex)
+{
+  AcquireSRWLockExclusive(&mutex->lock);
+}
+
+bool tryLockMutex(struct Mutex *mutex)
+{
+  return TryAcquireSRWLockExclusive(&mutex->lock) != 0;
+}
+
+void unlockMutex(struct Mutex *mutex)
+{
+  ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+void initConditionVariable(struct ConditionVariable *conditionVariable)
+{
+  InitializeConditionVariable(&conditionVariable->conditionVariable);
+}
+
+void destroyConditionVariable(struct ConditionVariable *conditionVariable)
+{
+  // condition variables don't need to be destroyed either
+}
+
+void waitConditionVariable(struct ConditionVariable *conditionVariable, struct Mutex *mutex)
+{
+  SleepConditionVariableSRW(&conditionVariable->conditionVariable, &mutex->lock, INFINITE, 0);
+}
+
+// returns false if we timed out
+bool waitConditionVariableTimeout(struct ConditionVariable *conditionVariable, struct Mutex *mutex, int milliseconds)
+{
+  return SleepConditionVariableSRW(&conditionVariable->conditionVariable, &mutex->lock, milliseconds, 0) != 0;
+}
+
+void signalConditionVariable(struct ConditionVariable *conditionVariable)
+{
+  WakeConditionVariable(&conditionVariable->conditionVariable);
+}
+
+void broadcastConditionVariable(struct ConditionVariable *conditionVariable)
+{
+  WakeAllConditionVariable(&conditionVariable->conditionVariable);
+}
+
+int32_t atomicLoad32(volatile int32_t *value)
+{
+  return InterlockedCompareExchange((volatile LONG *) value, 0, 0);
+}
+
+void atomicStore32(volatile int32_t *value, int32_t newValue)
+{
+  InterlockedExchange((volatile LONG *) value, newValue);
+}
+
+int32_t atomicFetchAdd32(volatile int32_t *value, int32_t amount)
+{
+  return InterlockedExchangeAdd((volatile LONG *) value, amount);
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not open the file.
+ *  2: Could not map the file.
+ *
+ */
+int mapFile(struct MappedFile *file, const char *filename)
+{
+  file->data = NULL;
+  file->mapping = NULL;
+  file->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  LARGE_INTEGER size;
+  if (file->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file->file, &size)) {
+    if (file->file != INVALID_HANDLE_VALUE) {
+      CloseHandle(file->file);
+    }
+    return 1;
+  }
+  file->size = (size_t) size.QuadPart;
+  if (file->size == 0) {
+    return 0;
+  }
+
+  file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (file->mapping) {
+    file->data = (const uint8_t *) MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+  if (!file->data) {
+    if (file->mapping) {
+      CloseHandle(file->mapping);
+    }
+    CloseHandle(file->file);
+    return 2;
+  }
+  return 0;
+}
+
+void unmapFile(struct MappedFile *file)
+{
+  if (file->data) {
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+  }
+  CloseHandle(file->file);
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static void *threadEntry(void *parameter)
+{
+  struct Thread *thread = (struct Thread *) parameter;
+  thread->function(thread->argument);
+  return 0;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not create the thread.
+ *
+ */
+int createThread(struct Thread *thread, void (*function)(void *argument), void *argument)
+{
+  thread->function = function;
+  thread->argument = argument;
+  if (pthread_create(&thread->handle, NULL, threadEntry, thread) != 0) {
+    return 1;
+  }
+  return 0;
+}
+
+void joinThread(struct Thread *thread)
+{
+  pthread_join(thread->handle, NULL);
+}
+
+// Only does anything on Linux; macOS doesn't let you pin threads.
+bool pinThreadToProcessor(struct Thread *thread, int processor)
+{
+#ifdef __linux__
+  if (processor < 0 || processor >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t processors;
+  CPU_ZERO(&processors);
+  CPU_SET(processor, &processors);
+  return pthread_setaffinity_np(thread->handle, sizeof(processors), &processors) == 0;
+#else
+  (void) thread;
+  (void) processor;
+  return false;
+#endif
+}
+
+int getProcessorCount(void)
+{
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int) count : 1;
+}
+
+uint64_t getTimeInNanoseconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+void sleepNanoseconds(uint64_t nanoseconds)
+{
+  struct timespec duration = { (time_t) (nanoseconds / 1000000000), (long) (nanoseconds % 1000000000) };
+  while (nanosleep(&duration, &duration) != 0 && errno == EINTR);
+}
+
+void initMutex(struct Mutex *mutex)
+{
+  pthread_mutex_init(&mutex->lock, NULL);
+}
+
+void destroyMutex(struct Mutex *mutex)
+{
+  pthread_mutex_destroy(&mutex->lock);
+}
+
+void lockMutex(struct Mutex *mutex)
+{
+  pthread_mutex_lock(&mutex->lock);
+}
+
+bool tryLockMutex(struct Mutex *mutex)
+{
+  return pthread_mutex_trylock(&mutex->lock) == 0;
+}
+
+void unlockMutex(struct Mutex *mutex)
+{
+  pthread_mutex_unlock(&mutex->lock);
+}
+
+void initConditionVariable(struct ConditionVariable *conditionVariable)
+{
+  pthread_cond_init(&conditionVariable->conditionVariable, NULL);
+}
+
+void destroyConditionVariable(struct ConditionVariable *conditionVariable)
+{
+  pthread_cond_destroy(&conditionVariable->conditionVariable);
+}
+
+void waitConditionVariable(struct ConditionVariable *conditionVariable, struct Mutex *mutex)
+{
+  pthread_cond_wait(&conditionVariable->conditionVariable, &mutex->lock);
+}
+
+// returns false if we timed out
+bool waitConditionVariableTimeout(struct ConditionVariable *conditionVariable, struct Mutex *mutex, int milliseconds)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += milliseconds / 1000;
+  deadline.tv_nsec += (long) (milliseconds % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  return pthread_cond_timedwait(&conditionVariable->conditionVariable, &mutex->lock, &deadline) != ETIMEDOUT;
+}
+
+void signalConditionVariable(struct ConditionVariable *conditionVariable)
+{
+  pthread_cond_signal(&conditionVariable->conditionVariable);
+}
+
+void broadcastConditionVariable(struct ConditionVariable *conditionVariable)
+{
+  pthread_cond_broadcast(&conditionVariable->conditionVariable);
+}
+
+int32_t atomicLoad32(volatile int32_t *value)
+{
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+void atomicStore32(volatile int32_t *value, int32_t newValue)
+{
+  __atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+}
+
+int32_t atomicFetchAdd32(volatile int32_t *value, int32_t amount)
+{
+  return __atomic_fetch_add(value, amount, __ATOMIC_ACQ_REL);
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not open the file.
+ *  2: Could not map the file.
+ *
+ */
+int mapFile(struct MappedFile *file, const char *filename)
+{
+  file->data = NULL;
+  int fd = open(filename, O_RDONLY);
+  struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  file->size = (size_t) status.st_size;
+  if (file->size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  // the mapping keeps the file open on its own
+  void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 2;
+  }
+  madvise(data, file->size, MADV_SEQUENTIAL);
+  file->data = (const uint8_t *) data;
+  return 0;
+}
+
+void unmapFile(struct MappedFile *file)
+{
+  if (file->data) {
+    munmap((void *) file->data, file->size);
+  }
+}
+
+#endif
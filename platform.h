@@ -0,0 +1,95 @@
+#ifndef FILE_PLATFORM_H_SEEN
+#define FILE_PLATFORM_H_SEEN
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Thin wrappers over Win32 and pthreads so the non-frontend code can use threads (and map files) without caring which
+// one it's on.
+
+#ifdef _WIN32
+#include <windows.h>
+
+struct Thread
+{
+  HANDLE handle;
+  void (*function)(void *argument);
+  void *argument;
+};
+
+struct Mutex
+{
+  SRWLOCK lock;
+};
+
+struct ConditionVariable
+{
+  CONDITION_VARIABLE conditionVariable;
+};
+
+struct MappedFile
+{
+  const uint8_t *data;  // null for an empty file
+  size_t size;
+  HANDLE file;
+  HANDLE mapping;
+};
+#else
+#include <pthread.h>
+
+struct Thread
+{
+  pthread_t handle;
+  void (*function)(void *argument);
+  void *argument;
+};
+
+struct Mutex
+{
+  pthread_mutex_t lock;
+};
+
+struct ConditionVariable
+{
+  pthread_cond_t conditionVariable;
+};
+
+struct MappedFile
+{
+  const uint8_t *data;  // null for an empty file
+  size_t size;
+};
+#endif
+
+int createThread(struct Thread *thread, void (*function)(void *argument), void *argument);
+void joinThread(struct Thread *thread);
+bool pinThreadToProcessor(struct Thread *thread, int processor);
+int getProcessorCount(void);
+// from a monotonic clock with an arbitrary starting point, so only good for measuring how long things take
+uint64_t getTimeInNanoseconds(void);
+// about this long: on Windows only to the millisecond and often a little over, so don't count on it for anything finer
+void sleepNanoseconds(uint64_t nanoseconds);
+
+void initMutex(struct Mutex *mutex);
+void destroyMutex(struct Mutex *mutex);
+void lockMutex(struct Mutex *mutex);
+bool tryLockMutex(struct Mutex *mutex);
+void unlockMutex(struct Mutex *mutex);
+
+void initConditionVariable(struct ConditionVariable *conditionVariable);
+void destroyConditionVariable(struct ConditionVariable *conditionVariable);
+void waitConditionVariable(struct ConditionVariable *conditionVariable, struct Mutex *mutex);
+bool waitConditionVariableTimeout(struct ConditionVariable *conditionVariable, struct Mutex *mutex, int milliseconds);
+void signalConditionVariable(struct ConditionVariable *conditionVariable);
+void broadcastConditionVariable(struct ConditionVariable *conditionVariable);
+
+int32_t atomicLoad32(volatile int32_t *value);
+void atomicStore32(volatile int32_t *value, int32_t newValue);
+int32_t atomicFetchAdd32(volatile int32_t *value, int32_t amount);
+
+// the whole file, read only, with the OS told it'll be read from start to end
+int mapFile(struct MappedFile *file, const char *filename);
+void unmapFile(struct MappedFile *file);
+
+#endif /* !FILE_PLATFORM_H_SEEN */
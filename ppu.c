@@ -29,9 +29,19 @@ void loadPalette(struct Color *palette) {
  * Errors:
  * 1: Could not allocate PPU memory.
  * 2: Could not allocate OAM memory.
+ * 3: Mapper isn't supported.
+ * 4: CHR ROM is bigger than the pattern tables, and we can't switch CHR banks.
  *
  */
 int createPPU(struct PPU **ppu, struct Cartridge *cartridge) {
+  // checked before anything's allocated, since the CHR ROM is copied straight into PPU memory
+  if (!isMapperSupported(cartridge->mapperNumber)) {
+    return 3;
+  }
+  if (cartridge->sizeOfChrRomInBytes > PPU_PATTERN_TABLES_SIZE) {
+    return 4;
+  }
+
   uint8_t *ppuMemory = (unsigned char *) calloc(1, 0x3FFF);
   if (!ppuMemory) {
     return 1;
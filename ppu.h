@@ -7,6 +7,7 @@
 #define VIDEO_BUFFER_WIDTH 256
 #define VIDEO_BUFFER_HEIGHT 240
 #define STARTING_PIXEL 2
+#define PPU_PATTERN_TABLES_SIZE 0x2000  // $0000-1FFF, where CHR ROM goes
 
 struct Computer;
 struct Cartridge;
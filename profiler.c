@@ -0,0 +1,363 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "profiler.h"
+
+#define PRG_ROM_BANK_SIZE 0x2000
+#define INITIAL_NODE_CAPACITY 1024
+
+#define OPCODE_JSR 0x20
+#define OPCODE_RTS 0x60
+#define OPCODE_RTI 0x40
+#define OPCODE_BRK 0x00
+
+static uint8_t *prgRomBlock(const struct Computer *state, int slot)
+{
+  switch (slot) {
+    case 0: return state->prgRomBlock1;
+    case 1: return state->prgRomBlock2;
+    case 2: return state->prgRomBlock3;
+    default: return state->prgRomBlock4;
+  }
+}
+
+// Where pc's instruction is counted in the histogram, or -1 if it's somewhere the profiler can't place. Notes down
+// which slot its bank was in on the way.
+static long histogramIndex(struct CpuProfiler *profiler, unsigned int pc, const struct Computer *state)
+{
+  if (pc < 0x8000) {
+    return (long) pc;
+  }
+  int slot = (pc - 0x8000) / PRG_ROM_BANK_SIZE;
+  size_t offset = (size_t) (prgRomBlock(state, slot) - state->prgRom) + (pc & (PRG_ROM_BANK_SIZE - 1));
+  if (offset >= profiler->prgRomSize) {
+    return -1;
+  }
+  profiler->bankSlots[offset / PRG_ROM_BANK_SIZE] = (uint8_t) slot;
+  return (long) (0x8000 + offset);
+}
+
+static uint32_t subroutineKey(unsigned int pc, const struct Computer *state, const struct CpuProfiler *profiler)
+{
+  if (pc < 0x8000) {
+    return ((uint32_t) PROFILER_NO_BANK << 16) | pc;
+  }
+  size_t offset = (size_t) (prgRomBlock(state, (pc - 0x8000) / PRG_ROM_BANK_SIZE) - state->prgRom);
+  uint32_t bank = offset < profiler->prgRomSize ? (uint32_t) (offset / PRG_ROM_BANK_SIZE) : PROFILER_NO_BANK;
+  return (bank << 16) | pc;
+}
+
+static uint32_t hashNode(int32_t parent, uint32_t key)
+{
+  uint32_t hash = (uint32_t) parent * 2654435761u ^ key * 2246822519u;
+  return hash ^ (hash >> 15);
+}
+
+static bool growNodeTable(struct CpuProfiler *profiler)
+{
+  int newSize = profiler->nodeTableSize * 2;
+  int32_t *newTable = (int32_t *) malloc(newSize * sizeof(int32_t));
+  if (!newTable) {
+    return false;
+  }
+  memset(newTable, 0xFF, newSize * sizeof(int32_t));
+
+  for (int i = 0; i < profiler->numNodes; i++) {
+    uint32_t slot = hashNode(profiler->nodes[i].parent, profiler->nodes[i].key) & (newSize - 1);
+    while (newTable[slot] >= 0) {
+      slot = (slot + 1) & (newSize - 1);
+    }
+    newTable[slot] = i;
+  }
+
+  free(profiler->nodeTable);
+  profiler->nodeTable = newTable;
+  profiler->nodeTableSize = newSize;
+  return true;
+}
+
+// Returns parent itself if there's no room for another node.
+static int32_t childNode(struct CpuProfiler *profiler, int32_t parent, uint32_t key)
+{
+  uint32_t slot = hashNode(parent, key) & (profiler->nodeTableSize - 1);
+  for (;;) {
+    int32_t node = profiler->nodeTable[slot];
+    if (node < 0) {
+      break;
+    }
+    if (profiler->nodes[node].parent == parent && profiler->nodes[node].key == key) {
+      return node;
+    }
+    slot = (slot + 1) & (profiler->nodeTableSize - 1);
+  }
+
+  if (profiler->numNodes >= PROFILER_MAX_NODES) {
+    return parent;
+  }
+  if (profiler->numNodes == profiler->nodeCapacity) {
+    int newCapacity = profiler->nodeCapacity * 2;
+    struct ProfilerNode *newNodes = (struct ProfilerNode *) realloc(profiler->nodes, newCapacity * sizeof(struct ProfilerNode));
+    if (!newNodes) {
+      return parent;
+    }
+    profiler->nodes = newNodes;
+    profiler->nodeCapacity = newCapacity;
+  }
+
+  int32_t node = profiler->numNodes++;
+  profiler->nodes[node].key = key;
+  profiler->nodes[node].parent = parent;
+  profiler->nodes[node].cycles = 0;
+  profiler->nodeTable[slot] = node;
+
+  // keep the table at most half full
+  if (profiler->numNodes * 2 > profiler->nodeTableSize && !growNodeTable(profiler)) {
+    profiler->numNodes--;
+    profiler->nodeTable[slot] = -1;
+    return parent;
+  }
+  return node;
+}
+
+static int32_t currentNode(const struct CpuProfiler *profiler)
+{
+  return profiler->depth > 0 ? profiler->stack[profiler->depth - 1].node : 0;
+}
+
+// everything called since S was last this high has returned
+static void popFrames(struct CpuProfiler *profiler, uint8_t stackPointer)
+{
+  while (profiler->depth > 0 && profiler->stack[profiler->depth - 1].stackPointer <= stackPointer) {
+    profiler->depth--;
+  }
+}
+
+// stackPointer is what S was before the call; a frame that was called with S no higher has already been left
+static void pushFrame(struct CpuProfiler *profiler, uint32_t key, uint8_t stackPointer)
+{
+  popFrames(profiler, stackPointer);
+  if (profiler->depth == PROFILER_MAX_DEPTH) {
+    return;
+  }
+  int32_t node = childNode(profiler, currentNode(profiler), key);
+  profiler->stack[profiler->depth].node = node;
+  profiler->stack[profiler->depth].stackPointer = stackPointer;
+  profiler->depth++;
+}
+
+static void onInstruction(struct CpuProfiler *profiler, unsigned int pc, uint8_t opcode, int cycles, struct Computer *state)
+{
+  profiler->opcodeCounts[opcode]++;
+  profiler->opcodeCycles[opcode] += cycles;
+
+  long index = histogramIndex(profiler, pc, state);
+  if (index >= 0) {
+    profiler->pcCounts[index]++;
+    profiler->pcCycles[index] += cycles;
+  }
+
+  profiler->nodes[currentNode(profiler)].cycles += cycles;
+
+  switch (opcode) {
+    case OPCODE_JSR:
+      pushFrame(profiler, subroutineKey(state->pc, state, profiler), (uint8_t) (state->stackRegister + 2));
+      break;
+    case OPCODE_BRK:
+      pushFrame(profiler, PROFILER_KEY_BRK, (uint8_t) (state->stackRegister + 3));
+      break;
+    case OPCODE_RTS:
+    case OPCODE_RTI:
+      popFrames(profiler, state->stackRegister);
+      break;
+  }
+}
+
+static void onInterrupt(struct CpuProfiler *profiler, uint32_t key, struct Computer *state)
+{
+  pushFrame(profiler, key, (uint8_t) (state->stackRegister + 3));
+}
+
+/**
+ *
+ * prgRomSize is the cartridge's sizeOfPrgRomInBytes.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *
+ */
+int createCpuProfiler(struct CpuProfiler **profiler, size_t prgRomSize)
+{
+  struct CpuProfiler *newProfiler = (struct CpuProfiler *) calloc(1, sizeof(struct CpuProfiler));
+  if (!newProfiler) {
+    return 1;
+  }
+
+  newProfiler->onInstruction = onInstruction;
+  newProfiler->onInterrupt = onInterrupt;
+  newProfiler->prgRomSize = prgRomSize;
+  newProfiler->pcCounts = (uint64_t *) calloc(0x8000 + prgRomSize, sizeof(uint64_t));
+  newProfiler->pcCycles = (uint64_t *) calloc(0x8000 + prgRomSize, sizeof(uint64_t));
+  newProfiler->bankSlots = (uint8_t *) calloc(prgRomSize / PRG_ROM_BANK_SIZE + 1, 1);
+  newProfiler->nodes = (struct ProfilerNode *) malloc(INITIAL_NODE_CAPACITY * sizeof(struct ProfilerNode));
+  newProfiler->nodeTable = (int32_t *) malloc(2 * INITIAL_NODE_CAPACITY * sizeof(int32_t));
+  if (!newProfiler->pcCounts || !newProfiler->pcCycles || !newProfiler->bankSlots || !newProfiler->nodes ||
+      !newProfiler->nodeTable) {
+    freeCpuProfiler(newProfiler);
+    return 1;
+  }
+  newProfiler->nodeCapacity = INITIAL_NODE_CAPACITY;
+  newProfiler->nodeTableSize = 2 * INITIAL_NODE_CAPACITY;
+  memset(newProfiler->nodeTable, 0xFF, newProfiler->nodeTableSize * sizeof(int32_t));
+
+  // the root, for whatever runs outside of any subroutine, which is never looked up so isn't in the table
+  newProfiler->nodes[0].key = PROFILER_KEY_ROOT;
+  newProfiler->nodes[0].parent = -1;
+  newProfiler->nodes[0].cycles = 0;
+  newProfiler->numNodes = 1;
+
+  *profiler = newProfiler;
+  return 0;
+}
+
+static void formatKey(char *str, size_t size, uint32_t key)
+{
+  switch (key) {
+    case PROFILER_KEY_ROOT: snprintf(str, size, "main"); break;
+    case PROFILER_KEY_NMI: snprintf(str, size, "nmi"); break;
+    case PROFILER_KEY_IRQ: snprintf(str, size, "irq"); break;
+    case PROFILER_KEY_BRK: snprintf(str, size, "brk"); break;
+    default:
+      if ((key >> 16) == PROFILER_NO_BANK) {
+        snprintf(str, size, "$%04X", key & 0xFFFF);
+      } else {
+        snprintf(str, size, "%02X:$%04X", key >> 16, key & 0xFFFF);
+      }
+  }
+}
+
+struct SortEntry
+{
+  uint64_t cycles;
+  long index;
+};
+
+// most cycles first
+static int compareByCycles(const void *a, const void *b)
+{
+  uint64_t first = ((const struct SortEntry *) a)->cycles;
+  uint64_t second = ((const struct SortEntry *) b)->cycles;
+  return first > second ? -1 : (first < second ? 1 : 0);
+}
+
+// The numEntries opcodes and addresses that took the most cycles.
+void printCpuProfile(const struct CpuProfiler *profiler, FILE *file, int numEntries)
+{
+  uint64_t totalCycles = 0;
+  uint64_t totalInstructions = 0;
+  for (int i = 0; i < 256; i++) {
+    totalCycles += profiler->opcodeCycles[i];
+    totalInstructions += profiler->opcodeCounts[i];
+  }
+  if (totalCycles == 0) {
+    fprintf(file, "no instructions profiled\n");
+    return;
+  }
+  fprintf(file, "%llu instructions, %llu cycles\n", (unsigned long long) totalInstructions, (unsigned long long) totalCycles);
+
+  struct SortEntry opcodes[256];
+  for (long i = 0; i < 256; i++) {
+    opcodes[i].cycles = profiler->opcodeCycles[i];
+    opcodes[i].index = i;
+  }
+  qsort(opcodes, 256, sizeof(struct SortEntry), compareByCycles);
+
+  fprintf(file, "\nopcode     cycles      %%       count\n");
+  for (int i = 0; i < numEntries && i < 256 && opcodes[i].cycles > 0; i++) {
+    long opcode = opcodes[i].index;
+    fprintf(file, "    %02lX %10llu  %5.2f%%  %10llu\n", opcode, (unsigned long long) profiler->opcodeCycles[opcode],
+        100.0 * profiler->opcodeCycles[opcode] / totalCycles, (unsigned long long) profiler->opcodeCounts[opcode]);
+  }
+
+  long histogramSize = (long) (0x8000 + profiler->prgRomSize);
+  struct SortEntry *indices = (struct SortEntry *) malloc(histogramSize * sizeof(struct SortEntry));
+  if (!indices) {
+    return;
+  }
+  long numIndices = 0;
+  for (long i = 0; i < histogramSize; i++) {
+    if (profiler->pcCycles[i] > 0) {
+      indices[numIndices].cycles = profiler->pcCycles[i];
+      indices[numIndices].index = i;
+      numIndices++;
+    }
+  }
+  qsort(indices, numIndices, sizeof(struct SortEntry), compareByCycles);
+
+  fprintf(file, "\naddress        cycles      %%       count\n");
+  for (long i = 0; i < numEntries && i < numIndices; i++) {
+    long index = indices[i].index;
+    uint32_t key;
+    if (index < 0x8000) {
+      key = ((uint32_t) PROFILER_NO_BANK << 16) | (uint32_t) index;
+    } else {
+      size_t offset = (size_t) (index - 0x8000);
+      uint32_t bank = (uint32_t) (offset / PRG_ROM_BANK_SIZE);
+      key = (bank << 16) | (0x8000 + profiler->bankSlots[bank] * PRG_ROM_BANK_SIZE + (uint32_t) (offset % PRG_ROM_BANK_SIZE));
+    }
+    char name[16];
+    formatKey(name, sizeof(name), key);
+    fprintf(file, "%-9s %11llu  %5.2f%%  %10llu\n", name, (unsigned long long) profiler->pcCycles[index],
+        100.0 * profiler->pcCycles[index] / totalCycles, (unsigned long long) profiler->pcCounts[index]);
+  }
+
+  free(indices);
+}
+
+/**
+ *
+ * One line per call path that spent any cycles, "main;nmi;03:$C5F2 1234", for flamegraph.pl and friends.
+ *
+ * Returns error code:
+ *  1: Could not write the file.
+ *
+ */
+int writeFoldedStacks(const struct CpuProfiler *profiler, const char *filename)
+{
+  FILE *file = fopen(filename, "w");
+  if (!file) {
+    return 1;
+  }
+
+  for (int i = 0; i < profiler->numNodes; i++) {
+    if (profiler->nodes[i].cycles == 0) {
+      continue;
+    }
+
+    int32_t path[PROFILER_MAX_DEPTH + 1];
+    int length = 0;
+    for (int32_t node = i; node >= 0; node = profiler->nodes[node].parent) {
+      path[length++] = node;
+    }
+
+    for (int j = length - 1; j >= 0; j--) {
+      char name[16];
+      formatKey(name, sizeof(name), profiler->nodes[path[j]].key);
+      fprintf(file, "%s%s", name, j > 0 ? ";" : "");
+    }
+    fprintf(file, " %llu\n", (unsigned long long) profiler->nodes[i].cycles);
+  }
+
+  return fclose(file) != 0 ? 1 : 0;
+}
+
+void freeCpuProfiler(struct CpuProfiler *profiler)
+{
+  free(profiler->pcCounts);
+  free(profiler->pcCycles);
+  free(profiler->bankSlots);
+  free(profiler->nodes);
+  free(profiler->nodeTable);
+  free(profiler);
+}
@@ -0,0 +1,81 @@
+#ifndef FILE_PROFILER_H_SEEN
+#define FILE_PROFILER_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct Computer;
+
+#define PROFILER_MAX_DEPTH 64
+#define PROFILER_MAX_NODES (1 << 20)
+#define PROFILER_NO_BANK 0xFFFF
+
+// call tree node keys that aren't (bank << 16) | address
+#define PROFILER_KEY_ROOT 0xFFFFFFFF
+#define PROFILER_KEY_NMI 0xFFFFFFFE
+#define PROFILER_KEY_IRQ 0xFFFFFFFD
+#define PROFILER_KEY_BRK 0xFFFFFFFC
+
+struct ProfilerNode
+{
+  uint32_t key;    // (bank << 16) | address of the subroutine, or one of the PROFILER_KEY_* values
+  int32_t parent;  // -1 for the root
+  uint64_t cycles;  // spent in this subroutine itself, called this way
+};
+
+struct ProfilerFrame
+{
+  int32_t node;
+  uint8_t stackPointer;  // what S was before the call pushed anything
+};
+
+/*
+ * Where the game's CPU time goes: cycles and counts for each opcode, a histogram of where instructions ran keyed by
+ * (PRG ROM bank, address), and a call tree built from a shadow call stack, which writeFoldedStacks turns into the
+ * "a;b;c cycles" lines that flame graph tools read.
+ *
+ * The CPU calls onInstruction after every instruction and onInterrupt when it takes an NMI or IRQ, through pointers
+ * so that cpu.c still builds on its own for the functional tests. With no profiler attached (state->profiler null)
+ * that's one never-taken branch per instruction.
+ *
+ * Addresses from $8000 up are in whichever 8 kB PRG ROM bank is mapped there when they run; below that there's no
+ * bank (PROFILER_NO_BANK). The histogram is by ROM offset, so the same code run from different places is counted once,
+ * under wherever it last ran from.
+ *
+ * The shadow stack pushes a frame for JSR, BRK and interrupts, remembering S from before the push. RTS and RTI, and
+ * the next call, pop every frame that S has since come back up past. So the call tree keeps up with games that return
+ * with a pushed address (the RTS trick), leave an NMI without an RTI or reset the stack pointer, not just ones that
+ * pair every JSR with an RTS. Calls deeper than
+ * PROFILER_MAX_DEPTH, or beyond PROFILER_MAX_NODES different call paths, are counted as part of their caller.
+ */
+struct CpuProfiler
+{
+  void (*onInstruction)(struct CpuProfiler *profiler, unsigned int pc, uint8_t opcode, int cycles, struct Computer *state);
+  void (*onInterrupt)(struct CpuProfiler *profiler, uint32_t key, struct Computer *state);
+
+  uint64_t opcodeCounts[256];
+  uint64_t opcodeCycles[256];
+
+  // indexed by address below $8000 and by 0x8000 + PRG ROM offset from there up
+  size_t prgRomSize;
+  uint64_t *pcCounts;
+  uint64_t *pcCycles;
+  uint8_t *bankSlots;  // for each 8 kB PRG ROM bank, which of the four 8 kB slots from $8000 it last ran in
+
+  struct ProfilerNode *nodes;
+  int numNodes;
+  int nodeCapacity;
+  int32_t *nodeTable;  // open addressing on (parent, key), -1 for empty
+  int nodeTableSize;
+
+  struct ProfilerFrame stack[PROFILER_MAX_DEPTH];
+  int depth;
+};
+
+int createCpuProfiler(struct CpuProfiler **profiler, size_t prgRomSize);
+void printCpuProfile(const struct CpuProfiler *profiler, FILE *file, int numEntries);
+int writeFoldedStacks(const struct CpuProfiler *profiler, const char *filename);
+void freeCpuProfiler(struct CpuProfiler *profiler);
+
+#endif /* !FILE_PROFILER_H_SEEN */
@@ -0,0 +1,79 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ramwatch.h"
+
+static unsigned int addressOfIndex(int index)
+{
+  return index < RAM_WATCH_RAM_SIZE ? (unsigned int) index : (unsigned int) (index - RAM_WATCH_RAM_SIZE + RAM_WATCH_PRG_RAM_START);
+}
+
+/**
+ *
+ * memory is the CPU's memory as it is now, which the first collection compares against.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *
+ */
+int createRamWatch(struct RamWatch **ramWatch, const uint8_t *memory, bool includePrgRam)
+{
+  struct RamWatch *newRamWatch = (struct RamWatch *) calloc(1, sizeof(struct RamWatch));
+  if (!newRamWatch) {
+    return 1;
+  }
+
+  newRamWatch->includePrgRam = includePrgRam;
+  memcpy(newRamWatch->values, memory, RAM_WATCH_RAM_SIZE);
+  memcpy(newRamWatch->values + RAM_WATCH_RAM_SIZE, memory + RAM_WATCH_PRG_RAM_START, RAM_WATCH_PRG_RAM_SIZE);
+
+  *ramWatch = newRamWatch;
+  return 0;
+}
+
+void markAllRamWritten(struct RamWatch *ramWatch)
+{
+  ramWatch->allWritten = true;
+}
+
+static void collectIndex(struct RamWatch *ramWatch, const uint8_t *memory, int index)
+{
+  unsigned int address = addressOfIndex(index);
+  uint8_t value = memory[address];
+  if (value != ramWatch->values[index]) {
+    ramWatch->changedAddresses[ramWatch->numChanges] = (uint16_t) address;
+    ramWatch->changedValues[ramWatch->numChanges] = value;
+    ramWatch->numChanges++;
+    ramWatch->values[index] = value;
+  }
+}
+
+// Works out what changed since the last call (or since the watch was created), and returns how many bytes did.
+int collectRamChanges(struct RamWatch *ramWatch, const uint8_t *memory)
+{
+  ramWatch->numChanges = 0;
+
+  if (ramWatch->allWritten) {
+    int size = ramWatch->includePrgRam ? RAM_WATCH_SIZE : RAM_WATCH_RAM_SIZE;
+    for (int index = 0; index < size; index++) {
+      collectIndex(ramWatch, memory, index);
+    }
+    memset(ramWatch->written, 0, sizeof(ramWatch->written));
+    ramWatch->allWritten = false;
+  } else {
+    for (int i = 0; i < ramWatch->numWritten; i++) {
+      int index = ramWatch->writtenIndices[i];
+      ramWatch->written[index] = 0;
+      collectIndex(ramWatch, memory, index);
+    }
+  }
+
+  ramWatch->numWritten = 0;
+  return ramWatch->numChanges;
+}
+
+void freeRamWatch(struct RamWatch *ramWatch)
+{
+  free(ramWatch);
+}
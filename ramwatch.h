@@ -0,0 +1,46 @@
+#ifndef FILE_RAMWATCH_H_SEEN
+#define FILE_RAMWATCH_H_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RAM_WATCH_RAM_SIZE 0x800
+#define RAM_WATCH_PRG_RAM_START 0x6000
+#define RAM_WATCH_PRG_RAM_SIZE 0x2000
+#define RAM_WATCH_SIZE (RAM_WATCH_RAM_SIZE + RAM_WATCH_PRG_RAM_SIZE)
+
+/*
+ * Works out which bytes of work RAM ($0000-$07FF) and optionally PRG RAM ($6000-$7FFF) changed since last time,
+ * without comparing all of them.
+ *
+ * The CPU tells the watch about every write to those addresses (markRamWrite in cpu.c, which lives there so the CPU
+ * still builds on its own for the functional tests). The first write to a byte adds it to a list, so
+ * collecting the changes only has to look at bytes that were written, and only lists the ones that ended up with a
+ * different value than last time (a byte written and then put back isn't a change).
+ *
+ * Anything that changes memory behind the CPU's back (loading a state, copying one emulator over another) has to call
+ * markAllRamWritten, which makes the next collection compare everything.
+ */
+struct RamWatch
+{
+  bool includePrgRam;
+  bool allWritten;
+
+  uint8_t written[RAM_WATCH_SIZE];  // by index: RAM first, then PRG RAM
+  uint16_t writtenIndices[RAM_WATCH_SIZE];
+  int numWritten;
+
+  uint8_t values[RAM_WATCH_SIZE];  // as of the last collection
+
+  // the result of the last collection, in no particular order
+  uint16_t changedAddresses[RAM_WATCH_SIZE];
+  uint8_t changedValues[RAM_WATCH_SIZE];
+  int numChanges;
+};
+
+int createRamWatch(struct RamWatch **ramWatch, const uint8_t *memory, bool includePrgRam);
+void markAllRamWritten(struct RamWatch *ramWatch);
+int collectRamChanges(struct RamWatch *ramWatch, const uint8_t *memory);
+void freeRamWatch(struct RamWatch *ramWatch);
+
+#endif /* !FILE_RAMWATCH_H_SEEN */
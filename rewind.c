@@ -0,0 +1,264 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+#include "savestate.h"
+#include "rewind.h"
+
+// rough guess at how big a compressed delta is, used to decide how many entries to make room for
+#define TYPICAL_DELTA_SIZE 256
+
+static int entryIndex(const struct RewindBuffer *rewindBuffer, int n)
+{
+  return (rewindBuffer->firstEntry + n) % rewindBuffer->maxEntries;
+}
+
+static void xorInto(uint8_t *destination, const uint8_t *source, size_t size)
+{
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t a;
+    uint64_t b;
+    memcpy(&a, destination + i, 8);
+    memcpy(&b, source + i, 8);
+    a ^= b;
+    memcpy(destination + i, &a, 8);
+  }
+  for (; i < size; i++) {
+    destination[i] ^= source[i];
+  }
+}
+
+/**
+ *
+ * memoryBudgetInBytes covers everything the rewind buffer allocates, not just the history.
+ *
+ * Returns error code:
+ *  1: Budget is too small to hold even a couple of keyframes.
+ *  2: Could not allocate memory.
+ *
+ */
+int createRewindBuffer(struct RewindBuffer **rewindBuffer, size_t memoryBudgetInBytes, int keyframeInterval)
+{
+  size_t stateSize = saveStateSize();
+  size_t scratchSize = lzCompressBound(stateSize);
+  size_t fixedSize = sizeof(struct RewindBuffer) + 2 * stateSize + scratchSize;
+
+  if (memoryBudgetInBytes < fixedSize + 4 * scratchSize) {
+    return 1;
+  }
+
+  size_t availableSize = memoryBudgetInBytes - fixedSize;
+  int maxEntries = (int) (availableSize / (TYPICAL_DELTA_SIZE + sizeof(struct RewindEntry)));
+  size_t arenaSize = availableSize - maxEntries * sizeof(struct RewindEntry);
+
+  struct RewindBuffer *newRewindBuffer = (struct RewindBuffer *) calloc(1, sizeof(struct RewindBuffer));
+  if (!newRewindBuffer) {
+    return 2;
+  }
+
+  newRewindBuffer->arena = (uint8_t *) malloc(arenaSize);
+  newRewindBuffer->entries = (struct RewindEntry *) malloc(maxEntries * sizeof(struct RewindEntry));
+  newRewindBuffer->keyframeState = (uint8_t *) malloc(stateSize);
+  newRewindBuffer->currentState = (uint8_t *) malloc(stateSize);
+  newRewindBuffer->scratch = (uint8_t *) malloc(scratchSize);
+  if (!newRewindBuffer->arena || !newRewindBuffer->entries || !newRewindBuffer->keyframeState ||
+      !newRewindBuffer->currentState || !newRewindBuffer->scratch) {
+    freeRewindBuffer(newRewindBuffer);
+    return 2;
+  }
+
+  newRewindBuffer->arenaSize = arenaSize;
+  newRewindBuffer->maxEntries = maxEntries;
+  newRewindBuffer->keyframeInterval = keyframeInterval > 0 ? keyframeInterval : REWIND_DEFAULT_KEYFRAME_INTERVAL;
+  newRewindBuffer->stateSize = stateSize;
+  newRewindBuffer->scratchSize = scratchSize;
+
+  *rewindBuffer = newRewindBuffer;
+  return 0;
+}
+
+// Compresses currentState into scratch, either as it is or as a delta against keyframeState.
+static size_t encodeFrame(struct RewindBuffer *rewindBuffer, bool isKeyframe)
+{
+  if (isKeyframe) {
+    memcpy(rewindBuffer->keyframeState, rewindBuffer->currentState, rewindBuffer->stateSize);
+  } else {
+    xorInto(rewindBuffer->currentState, rewindBuffer->keyframeState, rewindBuffer->stateSize);
+  }
+
+  return lzCompress(rewindBuffer->currentState, rewindBuffer->stateSize, rewindBuffer->scratch, rewindBuffer->scratchSize);
+}
+
+// Returns false if that dropped the newest keyframe too (so the buffer is now empty).
+static bool dropOldestGroup(struct RewindBuffer *rewindBuffer)
+{
+  do {
+    rewindBuffer->firstEntry = entryIndex(rewindBuffer, 1);
+    rewindBuffer->numEntries--;
+  } while (rewindBuffer->numEntries > 0 && !rewindBuffer->entries[rewindBuffer->firstEntry].isKeyframe);
+
+  return rewindBuffer->numEntries > 0;
+}
+
+static bool findSpace(struct RewindBuffer *rewindBuffer, size_t size, size_t *offset)
+{
+  if (rewindBuffer->numEntries == 0) {
+    rewindBuffer->nextWriteOffset = 0;
+    *offset = 0;
+    return size <= rewindBuffer->arenaSize;
+  }
+
+  if (rewindBuffer->numEntries == rewindBuffer->maxEntries) {
+    return false;
+  }
+
+  size_t oldestOffset = rewindBuffer->entries[rewindBuffer->firstEntry].offset;
+  size_t nextWriteOffset = rewindBuffer->nextWriteOffset;
+
+  if (nextWriteOffset > oldestOffset) {
+    // free space is after the newest entry and before the oldest one (once we wrap)
+    if (rewindBuffer->arenaSize - nextWriteOffset >= size) {
+      *offset = nextWriteOffset;
+      return true;
+    }
+    if (oldestOffset >= size) {
+      *offset = 0;
+      return true;
+    }
+    return false;
+  }
+
+  if (oldestOffset - nextWriteOffset >= size) {
+    *offset = nextWriteOffset;
+    return true;
+  }
+  return false;
+}
+
+/**
+ *
+ * Call once a frame.
+ *
+ * Returns error code:
+ *  1: Could not save the state.
+ *
+ */
+int pushRewindFrame(struct RewindBuffer *rewindBuffer, const struct Computer *state, const struct PPU *ppu)
+{
+  if (saveState(rewindBuffer->currentState, rewindBuffer->stateSize, NULL, state, ppu)) {
+    return 1;
+  }
+
+  bool isKeyframe = rewindBuffer->framesSinceKeyframe == 0 || rewindBuffer->numEntries == 0;
+  size_t size = encodeFrame(rewindBuffer, isKeyframe);
+
+  size_t offset;
+  while (!findSpace(rewindBuffer, size, &offset)) {
+    if (!dropOldestGroup(rewindBuffer) && !isKeyframe) {
+      // the keyframe this delta is against is gone, so start over with a fresh keyframe
+      xorInto(rewindBuffer->currentState, rewindBuffer->keyframeState, rewindBuffer->stateSize);
+      isKeyframe = true;
+      size = encodeFrame(rewindBuffer, isKeyframe);
+    }
+  }
+
+  memcpy(rewindBuffer->arena + offset, rewindBuffer->scratch, size);
+
+  struct RewindEntry *entry = &rewindBuffer->entries[entryIndex(rewindBuffer, rewindBuffer->numEntries)];
+  entry->offset = offset;
+  entry->size = (uint32_t) size;
+  entry->isKeyframe = isKeyframe;
+  rewindBuffer->numEntries++;
+  rewindBuffer->nextWriteOffset = offset + size;
+
+  if (isKeyframe) {
+    rewindBuffer->framesSinceKeyframe = 0;
+  }
+  rewindBuffer->framesSinceKeyframe = (rewindBuffer->framesSinceKeyframe + 1) % rewindBuffer->keyframeInterval;
+
+  return 0;
+}
+
+/**
+ *
+ * Restores the state from numFrames before the newest one pushed (or the oldest one we still have), and forgets
+ * everything after it so the next push carries on from there.
+ *
+ * Returns error code:
+ *  1: Nothing to rewind to.
+ *  2: History is corrupt.
+ *  3: Could not load the state.
+ *
+ */
+int rewindFrames(struct RewindBuffer *rewindBuffer, int numFrames, struct Computer *state, struct PPU *ppu)
+{
+  if (rewindBuffer->numEntries == 0) {
+    return 1;
+  }
+
+  int target = rewindBuffer->numEntries - 1 - numFrames;
+  if (target < 0) {
+    target = 0;
+  }
+
+  int keyframe = target;
+  while (keyframe > 0 && !rewindBuffer->entries[entryIndex(rewindBuffer, keyframe)].isKeyframe) {
+    keyframe--;
+  }
+
+  // the keyframe goes into scratch (which is bigger than a state) rather than straight into keyframeState, so a state
+  // that won't load leaves the next pushes encoding against the keyframe they actually follow
+  uint8_t *keyframeState = rewindBuffer->scratch;
+  const struct RewindEntry *keyframeEntry = &rewindBuffer->entries[entryIndex(rewindBuffer, keyframe)];
+  if (lzDecompress(rewindBuffer->arena + keyframeEntry->offset, keyframeEntry->size, keyframeState, rewindBuffer->stateSize)) {
+    clearRewindBuffer(rewindBuffer);
+    return 2;
+  }
+
+  const uint8_t *targetState = keyframeState;
+  const struct RewindEntry *targetEntry = &rewindBuffer->entries[entryIndex(rewindBuffer, target)];
+  if (target != keyframe) {
+    if (lzDecompress(rewindBuffer->arena + targetEntry->offset, targetEntry->size, rewindBuffer->currentState, rewindBuffer->stateSize)) {
+      clearRewindBuffer(rewindBuffer);
+      return 2;
+    }
+    xorInto(rewindBuffer->currentState, keyframeState, rewindBuffer->stateSize);
+    targetState = rewindBuffer->currentState;
+  }
+
+  if (loadState(targetState, rewindBuffer->stateSize, state, ppu)) {
+    return 3;
+  }
+  memcpy(rewindBuffer->keyframeState, keyframeState, rewindBuffer->stateSize);
+
+  rewindBuffer->numEntries = target + 1;
+  rewindBuffer->nextWriteOffset = targetEntry->offset + targetEntry->size;
+  rewindBuffer->framesSinceKeyframe = (target - keyframe + 1) % rewindBuffer->keyframeInterval;
+
+  return 0;
+}
+
+int rewindFramesAvailable(const struct RewindBuffer *rewindBuffer)
+{
+  return rewindBuffer->numEntries > 0 ? rewindBuffer->numEntries - 1 : 0;
+}
+
+void clearRewindBuffer(struct RewindBuffer *rewindBuffer)
+{
+  rewindBuffer->firstEntry = 0;
+  rewindBuffer->numEntries = 0;
+  rewindBuffer->nextWriteOffset = 0;
+  rewindBuffer->framesSinceKeyframe = 0;
+}
+
+void freeRewindBuffer(struct RewindBuffer *rewindBuffer)
+{
+  free(rewindBuffer->arena);
+  free(rewindBuffer->entries);
+  free(rewindBuffer->keyframeState);
+  free(rewindBuffer->currentState);
+  free(rewindBuffer->scratch);
+  free(rewindBuffer);
+}
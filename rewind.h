@@ -0,0 +1,55 @@
+#ifndef FILE_REWIND_H_SEEN
+#define FILE_REWIND_H_SEEN
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct Computer;
+struct PPU;
+
+#define REWIND_DEFAULT_KEYFRAME_INTERVAL 60
+
+struct RewindEntry
+{
+  size_t offset;  // into the arena
+  uint32_t size;  // compressed size
+  bool isKeyframe;
+};
+
+/*
+ * A history of save states, one per frame, that fits in a fixed number of bytes.
+ *
+ * Every keyframeInterval frames a full state is stored. The frames in between are stored as the XOR of their state
+ * against that keyframe, which is nearly all zeros, and everything is LZ compressed. Getting any frame back therefore
+ * takes at most two decompressions. When the arena fills up, the oldest keyframe and its deltas are dropped together.
+ */
+struct RewindBuffer
+{
+  uint8_t *arena;
+  size_t arenaSize;
+  size_t nextWriteOffset;
+
+  struct RewindEntry *entries;  // a ring, oldest first
+  int maxEntries;
+  int firstEntry;
+  int numEntries;
+
+  int keyframeInterval;
+  int framesSinceKeyframe;
+
+  size_t stateSize;
+  uint8_t *keyframeState;  // uncompressed copy of the newest keyframe
+  uint8_t *currentState;
+  uint8_t *scratch;
+  size_t scratchSize;
+};
+
+int createRewindBuffer(struct RewindBuffer **rewindBuffer, size_t memoryBudgetInBytes, int keyframeInterval);
+int pushRewindFrame(struct RewindBuffer *rewindBuffer, const struct Computer *state, const struct PPU *ppu);
+int rewindFrames(struct RewindBuffer *rewindBuffer, int numFrames, struct Computer *state, struct PPU *ppu);
+int rewindFramesAvailable(const struct RewindBuffer *rewindBuffer);
+void clearRewindBuffer(struct RewindBuffer *rewindBuffer);
+void freeRewindBuffer(struct RewindBuffer *rewindBuffer);
+
+#endif /* !FILE_REWIND_H_SEEN */
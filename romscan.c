@@ -0,0 +1,513 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "debug.h"
+#include "cartridge.h"
+#include "platform.h"
+#include "romscan.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#define ROM_INDEX_MAGIC "CFRI"
+#define ROM_INDEX_VERSION 1
+#define ROM_INDEX_HEADER_SIZE 16
+#define ROM_INDEX_ENTRY_SIZE 40
+#define SCAN_BUFFER_SIZE (64 * 1024)
+
+struct PathList
+{
+  char **paths;
+  int numPaths;
+  int capacity;
+};
+
+struct ScanResult
+{
+  bool ok;
+  struct RomIndexEntry entry;
+};
+
+struct ScanJob
+{
+  struct PathList *pathList;
+  struct ScanResult *results;
+  volatile int32_t nextPathIndex;
+};
+
+static bool hasNesExtension(const char *filename)
+{
+  size_t length = strlen(filename);
+  if (length < 4) {
+    return false;
+  }
+  const char *extension = filename + length - 4;
+  return extension[0] == '.' && tolower(extension[1]) == 'n' && tolower(extension[2]) == 'e' && tolower(extension[3]) == 's';
+}
+
+static int addPath(struct PathList *pathList, const char *directory, const char *name)
+{
+  if (pathList->numPaths == pathList->capacity) {
+    int newCapacity = pathList->capacity ? pathList->capacity * 2 : 256;
+    char **newPaths = (char **) realloc(pathList->paths, newCapacity * sizeof(char *));
+    if (!newPaths) {
+      return 1;
+    }
+    pathList->paths = newPaths;
+    pathList->capacity = newCapacity;
+  }
+
+  size_t length = strlen(directory) + 1 + strlen(name) + 1;
+  char *path = (char *) malloc(length);
+  if (!path) {
+    return 1;
+  }
+  snprintf(path, length, "%s/%s", directory, name);
+
+  pathList->paths[pathList->numPaths++] = path;
+  return 0;
+}
+
+static void freePathList(struct PathList *pathList)
+{
+  for (int i = 0; i < pathList->numPaths; i++) {
+    free(pathList->paths[i]);
+  }
+  free(pathList->paths);
+}
+
+// Walks the directory (and its subdirectories) collecting every .nes file.
+static int collectRomPaths(struct PathList *pathList, const char *directory)
+{
+#ifdef _WIN32
+  char pattern[MAX_PATH];
+  snprintf(pattern, sizeof(pattern), "%s\\*", directory);
+
+  WIN32_FIND_DATAA findData;
+  HANDLE findHandle = FindFirstFileA(pattern, &findData);
+  if (findHandle == INVALID_HANDLE_VALUE) {
+    return 1;
+  }
+
+  int error = 0;
+  do {
+    const char *name = findData.cFileName;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+
+    if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      char subdirectory[MAX_PATH];
+      snprintf(subdirectory, sizeof(subdirectory), "%s\\%s", directory, name);
+      collectRomPaths(pathList, subdirectory);
+    } else if (hasNesExtension(name)) {
+      error = addPath(pathList, directory, name);
+    }
+  } while (!error && FindNextFileA(findHandle, &findData));
+
+  FindClose(findHandle);
+  return error;
+#else
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    return 1;
+  }
+
+  int error = 0;
+  struct dirent *dirEntry;
+  while (!error && (dirEntry = readdir(dir)) != NULL) {
+    const char *name = dirEntry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    struct stat fileInfo;
+    if (stat(path, &fileInfo) != 0) {
+      continue;
+    }
+
+    if (S_ISDIR(fileInfo.st_mode)) {
+      collectRomPaths(pathList, path);
+    } else if (S_ISREG(fileInfo.st_mode) && hasNesExtension(name)) {
+      error = addPath(pathList, directory, name);
+    }
+  }
+
+  closedir(dir);
+  return error;
+#endif
+}
+
+static bool scanRom(struct RomIndexEntry *entry, const char *path, uint8_t *buffer)
+{
+  FILE *file;
+  if (fopen_s(&file, path, "rb")) {
+    return false;
+  }
+
+  uint8_t header[16];
+  struct CartridgeHeader cartridgeHeader;
+  if (fread(header, sizeof(header), 1, file) != 1 || parseCartridgeHeader(&cartridgeHeader, header)) {
+    fclose(file);
+    return false;
+  }
+
+  if (cartridgeHeader.hasTrainer) {
+    fseek(file, 512, SEEK_CUR);
+  }
+
+  // PRG ROM and CHR ROM sit next to each other in the file, so they can be hashed in one pass
+  size_t bytesRemaining = (size_t) cartridgeHeader.sizeOfPrgRomInBytes + cartridgeHeader.sizeOfChrRomInBytes;
+  uint32_t crc = 0;
+  struct Sha1Context sha1Context;
+  sha1Init(&sha1Context);
+
+  while (bytesRemaining > 0) {
+    size_t bytesToRead = bytesRemaining < SCAN_BUFFER_SIZE ? bytesRemaining : SCAN_BUFFER_SIZE;
+    if (fread(buffer, 1, bytesToRead, file) != bytesToRead) {
+      fclose(file);
+      return false;
+    }
+    crc = crc32Update(crc, buffer, bytesToRead);
+    sha1Update(&sha1Context, buffer, bytesToRead);
+    bytesRemaining -= bytesToRead;
+  }
+  fclose(file);
+
+  sha1Final(&sha1Context, entry->sha1);
+  entry->crc32 = crc;
+  entry->sizeOfPrgRomInBytes = cartridgeHeader.sizeOfPrgRomInBytes;
+  entry->sizeOfChrRomInBytes = cartridgeHeader.sizeOfChrRomInBytes;
+  entry->mapperNumber = (uint16_t) cartridgeHeader.mapperNumber;
+  entry->flags = (cartridgeHeader.verticalMirroring ? ROM_INDEX_VERTICAL_MIRRORING : 0) |
+    (cartridgeHeader.hasBattery ? ROM_INDEX_HAS_BATTERY : 0) |
+    (cartridgeHeader.hasTrainer ? ROM_INDEX_HAS_TRAINER : 0) |
+    (cartridgeHeader.fourScreenVram ? ROM_INDEX_FOUR_SCREEN_VRAM : 0) |
+    (cartridgeHeader.isNes20 ? ROM_INDEX_NES_20 : 0) |
+    (isMapperSupported(cartridgeHeader.mapperNumber) ? ROM_INDEX_MAPPER_SUPPORTED : 0);
+  entry->path = (char *) path;
+
+  return true;
+}
+
+static void scanWorker(void *argument)
+{
+  struct ScanJob *job = (struct ScanJob *) argument;
+
+  uint8_t *buffer = (uint8_t *) malloc(SCAN_BUFFER_SIZE);
+  if (!buffer) {
+    return;
+  }
+
+  // every worker just grabs the next unclaimed file, so one slow file doesn't hold up a whole slice of the list
+  for (;;) {
+    int32_t pathIndex = atomicFetchAdd32(&job->nextPathIndex, 1);
+    if (pathIndex >= job->pathList->numPaths) {
+      break;
+    }
+
+    struct ScanResult *result = &job->results[pathIndex];
+    result->ok = scanRom(&result->entry, job->pathList->paths[pathIndex], buffer);
+  }
+
+  free(buffer);
+}
+
+static int compareEntriesBySha1(const void *a, const void *b)
+{
+  return memcmp(((const struct RomIndexEntry *) a)->sha1, ((const struct RomIndexEntry *) b)->sha1, SHA1_DIGEST_SIZE);
+}
+
+/**
+ *
+ * Scans every .nes file under directory with numThreads workers (0 means one per processor).
+ *
+ * Returns error code:
+ *  1: Could not read the directory.
+ *  2: Could not allocate memory.
+ *
+ */
+int scanRomDirectory(struct RomIndex **romIndex, const char *directory, int numThreads)
+{
+  struct PathList pathList = { 0 };
+  if (collectRomPaths(&pathList, directory)) {
+    freePathList(&pathList);
+    return 1;
+  }
+
+  struct ScanJob job = { .pathList = &pathList, .nextPathIndex = 0 };
+  job.results = (struct ScanResult *) calloc(pathList.numPaths + 1, sizeof(struct ScanResult));
+  if (!job.results) {
+    freePathList(&pathList);
+    return 2;
+  }
+
+  if (numThreads <= 0) {
+    numThreads = getProcessorCount();
+  }
+  if (numThreads > pathList.numPaths) {
+    numThreads = pathList.numPaths > 0 ? pathList.numPaths : 1;
+  }
+
+  struct Thread *threads = (struct Thread *) calloc(numThreads, sizeof(struct Thread));
+  if (!threads) {
+    free(job.results);
+    freePathList(&pathList);
+    return 2;
+  }
+
+  // the calling thread does its share of the scanning too
+  int numThreadsStarted = 0;
+  for (int i = 1; i < numThreads; i++) {
+    if (createThread(&threads[numThreadsStarted], scanWorker, &job) == 0) {
+      numThreadsStarted++;
+    }
+  }
+  scanWorker(&job);
+  for (int i = 0; i < numThreadsStarted; i++) {
+    joinThread(&threads[i]);
+  }
+  free(threads);
+
+  int numEntries = 0;
+  int sizeOfPathsInBytes = 0;
+  for (int i = 0; i < pathList.numPaths; i++) {
+    if (job.results[i].ok) {
+      numEntries++;
+      sizeOfPathsInBytes += (int) strlen(pathList.paths[i]) + 1;
+    }
+  }
+
+  struct RomIndex *index = (struct RomIndex *) calloc(1, sizeof(struct RomIndex));
+  struct RomIndexEntry *entries = (struct RomIndexEntry *) calloc(numEntries + 1, sizeof(struct RomIndexEntry));
+  char *paths = (char *) malloc(sizeOfPathsInBytes + 1);
+  if (!index || !entries || !paths) {
+    free(index);
+    free(entries);
+    free(paths);
+    free(job.results);
+    freePathList(&pathList);
+    return 2;
+  }
+
+  int entryNumber = 0;
+  char *nextPath = paths;
+  for (int i = 0; i < pathList.numPaths; i++) {
+    if (job.results[i].ok) {
+      size_t length = strlen(pathList.paths[i]) + 1;
+      memcpy(nextPath, pathList.paths[i], length);
+      entries[entryNumber] = job.results[i].entry;
+      entries[entryNumber].path = nextPath;
+      nextPath += length;
+      entryNumber++;
+    }
+  }
+
+  qsort(entries, numEntries, sizeof(struct RomIndexEntry), compareEntriesBySha1);
+
+  index->numEntries = numEntries;
+  index->entries = entries;
+  index->paths = paths;
+  index->sizeOfPathsInBytes = sizeOfPathsInBytes;
+  index->numFilesSkipped = pathList.numPaths - numEntries;
+  *romIndex = index;
+
+  free(job.results);
+  freePathList(&pathList);
+  return 0;
+}
+
+static void putUint16(uint8_t *destination, uint16_t value)
+{
+  destination[0] = (uint8_t) value;
+  destination[1] = (uint8_t) (value >> 8);
+}
+
+static void putUint32(uint8_t *destination, uint32_t value)
+{
+  destination[0] = (uint8_t) value;
+  destination[1] = (uint8_t) (value >> 8);
+  destination[2] = (uint8_t) (value >> 16);
+  destination[3] = (uint8_t) (value >> 24);
+}
+
+static uint16_t getUint16(const uint8_t *source)
+{
+  return (uint16_t) (source[0] | (source[1] << 8));
+}
+
+static uint32_t getUint32(const uint8_t *source)
+{
+  return (uint32_t) source[0] | ((uint32_t) source[1] << 8) | ((uint32_t) source[2] << 16) | ((uint32_t) source[3] << 24);
+}
+
+/*
+ * Index file layout (all little endian):
+ *
+ *   "CFRI", version (u32), number of entries (u32), size of path table (u32)
+ *   entries, 40 bytes each, sorted by SHA-1:
+ *     sha1[20], crc32 (u32), PRG size (u32), CHR size (u32), mapper (u16), flags (u8), unused (u8), path offset (u32)
+ *   path table: NUL terminated paths
+ *
+ * Returns error code:
+ *  1: Error opening index file.
+ *  2: Could not allocate memory.
+ *  3: Error writing index file.
+ *
+ */
+int writeRomIndex(const struct RomIndex *romIndex, const char *filename)
+{
+  FILE *file;
+  if (fopen_s(&file, filename, "wb")) {
+    print("Error opening index file %s\n", filename);
+    return 1;
+  }
+
+  size_t sizeOfEntriesInBytes = (size_t) romIndex->numEntries * ROM_INDEX_ENTRY_SIZE;
+  uint8_t *data = (uint8_t *) calloc(1, ROM_INDEX_HEADER_SIZE + sizeOfEntriesInBytes);
+  if (!data) {
+    fclose(file);
+    return 2;
+  }
+
+  memcpy(data, ROM_INDEX_MAGIC, 4);
+  putUint32(data + 4, ROM_INDEX_VERSION);
+  putUint32(data + 8, romIndex->numEntries);
+  putUint32(data + 12, romIndex->sizeOfPathsInBytes);
+
+  uint8_t *record = data + ROM_INDEX_HEADER_SIZE;
+  for (int i = 0; i < romIndex->numEntries; i++) {
+    const struct RomIndexEntry *entry = &romIndex->entries[i];
+    memcpy(record, entry->sha1, SHA1_DIGEST_SIZE);
+    putUint32(record + 20, entry->crc32);
+    putUint32(record + 24, entry->sizeOfPrgRomInBytes);
+    putUint32(record + 28, entry->sizeOfChrRomInBytes);
+    putUint16(record + 32, entry->mapperNumber);
+    record[34] = entry->flags;
+    putUint32(record + 36, (uint32_t) (entry->path - romIndex->paths));
+    record += ROM_INDEX_ENTRY_SIZE;
+  }
+
+  bool writeFailed = fwrite(data, 1, ROM_INDEX_HEADER_SIZE + sizeOfEntriesInBytes, file) != ROM_INDEX_HEADER_SIZE + sizeOfEntriesInBytes ||
+    fwrite(romIndex->paths, 1, romIndex->sizeOfPathsInBytes, file) != (size_t) romIndex->sizeOfPathsInBytes;
+  free(data);
+
+  if (fclose(file) != 0 || writeFailed) {
+    print("Error writing index file %s\n", filename);
+    return 3;
+  }
+
+  return 0;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Error opening index file.
+ *  2: Could not allocate memory.
+ *  3: Not an index file, or it's from a different version.
+ *  4: Index file is truncated or corrupt.
+ *
+ */
+int readRomIndex(struct RomIndex **romIndex, const char *filename)
+{
+  FILE *file;
+  if (fopen_s(&file, filename, "rb")) {
+    print("Error opening index file %s\n", filename);
+    return 1;
+  }
+
+  uint8_t header[ROM_INDEX_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, ROM_INDEX_MAGIC, 4) != 0 || getUint32(header + 4) != ROM_INDEX_VERSION) {
+    fclose(file);
+    return 3;
+  }
+
+  uint32_t numEntries = getUint32(header + 8);
+  uint32_t sizeOfPathsInBytes = getUint32(header + 12);
+  if (numEntries > 0x00FFFFFF || sizeOfPathsInBytes > 0x7FFFFFFF) {
+    fclose(file);
+    return 4;
+  }
+
+  size_t sizeOfEntriesInBytes = (size_t) numEntries * ROM_INDEX_ENTRY_SIZE;
+  uint8_t *records = (uint8_t *) malloc(sizeOfEntriesInBytes + 1);
+  struct RomIndex *index = (struct RomIndex *) calloc(1, sizeof(struct RomIndex));
+  struct RomIndexEntry *entries = (struct RomIndexEntry *) calloc(numEntries + 1, sizeof(struct RomIndexEntry));
+  char *paths = (char *) malloc(sizeOfPathsInBytes + 1);
+  if (!records || !index || !entries || !paths) {
+    free(records);
+    free(index);
+    free(entries);
+    free(paths);
+    fclose(file);
+    return 2;
+  }
+
+  if (fread(records, 1, sizeOfEntriesInBytes, file) != sizeOfEntriesInBytes || fread(paths, 1, sizeOfPathsInBytes, file) != sizeOfPathsInBytes) {
+    free(records);
+    free(index);
+    free(entries);
+    free(paths);
+    fclose(file);
+    return 4;
+  }
+  fclose(file);
+  paths[sizeOfPathsInBytes] = 0;
+
+  const uint8_t *record = records;
+  for (uint32_t i = 0; i < numEntries; i++) {
+    struct RomIndexEntry *entry = &entries[i];
+    memcpy(entry->sha1, record, SHA1_DIGEST_SIZE);
+    entry->crc32 = getUint32(record + 20);
+    entry->sizeOfPrgRomInBytes = getUint32(record + 24);
+    entry->sizeOfChrRomInBytes = getUint32(record + 28);
+    entry->mapperNumber = getUint16(record + 32);
+    entry->flags = record[34];
+
+    uint32_t pathOffset = getUint32(record + 36);
+    entry->path = pathOffset < sizeOfPathsInBytes ? paths + pathOffset : paths + sizeOfPathsInBytes;
+    record += ROM_INDEX_ENTRY_SIZE;
+  }
+  free(records);
+
+  index->numEntries = (int) numEntries;
+  index->entries = entries;
+  index->paths = paths;
+  index->sizeOfPathsInBytes = (int) sizeOfPathsInBytes;
+  *romIndex = index;
+
+  return 0;
+}
+
+const struct RomIndexEntry *findRomBySha1(const struct RomIndex *romIndex, const uint8_t sha1[SHA1_DIGEST_SIZE])
+{
+  struct RomIndexEntry key;
+  memcpy(key.sha1, sha1, SHA1_DIGEST_SIZE);
+  return (const struct RomIndexEntry *) bsearch(&key, romIndex->entries, romIndex->numEntries, sizeof(struct RomIndexEntry), compareEntriesBySha1);
+}
+
+// The index is sorted by SHA-1, so this one is a linear search. CRC32 is mostly useful for matching against databases.
+const struct RomIndexEntry *findRomByCrc32(const struct RomIndex *romIndex, uint32_t crc32)
+{
+  for (int i = 0; i < romIndex->numEntries; i++) {
+    if (romIndex->entries[i].crc32 == crc32) {
+      return &romIndex->entries[i];
+    }
+  }
+  return 0;
+}
+
+void freeRomIndex(struct RomIndex *romIndex)
+{
+  free(romIndex->entries);
+  free(romIndex->paths);
+  free(romIndex);
+}
@@ -0,0 +1,44 @@
+#ifndef FILE_ROMSCAN_H_SEEN
+#define FILE_ROMSCAN_H_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hash.h"
+
+#define ROM_INDEX_VERTICAL_MIRRORING 0x01
+#define ROM_INDEX_HAS_BATTERY 0x02
+#define ROM_INDEX_HAS_TRAINER 0x04
+#define ROM_INDEX_FOUR_SCREEN_VRAM 0x08
+#define ROM_INDEX_NES_20 0x10
+#define ROM_INDEX_MAPPER_SUPPORTED 0x20
+
+// One game in the index. The hashes cover PRG ROM followed by CHR ROM (no header, no trainer), which is what the
+// No-Intro databases hash too.
+struct RomIndexEntry
+{
+  uint8_t sha1[SHA1_DIGEST_SIZE];
+  uint32_t crc32;
+  uint32_t sizeOfPrgRomInBytes;
+  uint32_t sizeOfChrRomInBytes;
+  uint16_t mapperNumber;
+  uint8_t flags;
+  char *path;
+};
+
+struct RomIndex
+{
+  int numEntries;
+  struct RomIndexEntry *entries;  // sorted by sha1
+  char *paths;  // every entry's path lives in here
+  int sizeOfPathsInBytes;
+  int numFilesSkipped;  // files that weren't iNES or couldn't be read
+};
+
+int scanRomDirectory(struct RomIndex **romIndex, const char *directory, int numThreads);
+int writeRomIndex(const struct RomIndex *romIndex, const char *filename);
+int readRomIndex(struct RomIndex **romIndex, const char *filename);
+const struct RomIndexEntry *findRomBySha1(const struct RomIndex *romIndex, const uint8_t sha1[SHA1_DIGEST_SIZE]);
+const struct RomIndexEntry *findRomByCrc32(const struct RomIndex *romIndex, uint32_t crc32);
+void freeRomIndex(struct RomIndex *romIndex);
+
+#endif /* !FILE_ROMSCAN_H_SEEN */
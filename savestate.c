@@ -0,0 +1,476 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "battery.h"
+#include "ramwatch.h"
+#include "trace.h"
+#include "platform.h"
+#include "savestate.h"
+
+/*
+ * A save state is a flat copy of everything that changes while a game runs: CPU registers, the bottom 32 kB of CPU
+ * memory (RAM, PPU register shadows and PRG RAM), PPU memory, OAM, PPU registers, mapper registers and the APU. PRG
+ * ROM isn't included since it can't change, and neither is where the APU's sound goes.
+ *
+ * Pointers are stored as offsets (prgRomBlocks relative to the start of PRG ROM, the PPU sprite buffers as which of
+ * the two buffers they point at) so a state can be loaded into a different Computer/PPU than the one that saved it.
+ *
+ * Fields are copied in native byte order one at a time, which keeps this independent of struct padding and fast enough
+ * to run every frame: the two big memcpys dominate and there's no allocation.
+ */
+
+#define SAVE_STATE_MAGIC "CFST"
+#define SAVE_STATE_HEADER_SIZE 12
+#define CPU_MEMORY_SAVED 0x8000
+#define PPU_MEMORY_SAVED 0x3FFF
+
+struct StateWriter
+{
+  uint8_t *cursor;
+  size_t bytesWritten;
+};
+
+struct StateReader
+{
+  const uint8_t *cursor;
+};
+
+static void writeBytes(struct StateWriter *writer, const void *data, size_t size)
+{
+  if (writer->cursor) {
+    memcpy(writer->cursor, data, size);
+    writer->cursor += size;
+  }
+  writer->bytesWritten += size;
+}
+
+static void readBytes(struct StateReader *reader, void *data, size_t size)
+{
+  memcpy(data, reader->cursor, size);
+  reader->cursor += size;
+}
+
+// A bool is written as its one byte, but anything but 0 or 1 read straight into one is undefined, and the buffer could
+// have anything in it.
+static void readBool(struct StateReader *reader, bool *value)
+{
+  uint8_t byte;
+  readBytes(reader, &byte, 1);
+  *value = byte != 0;
+}
+
+static void skipBytes(struct StateReader *reader, size_t size)
+{
+  reader->cursor += size;
+}
+
+#define WRITE_FIELD(writer, field) writeBytes((writer), &(field), sizeof(field))
+#define READ_FIELD(reader, field) readBytes((reader), &(field), sizeof(field))
+#define READ_BOOL(reader, field) readBool((reader), &(field))
+
+static uint32_t prgRomBlockOffset(const struct Computer *state, const uint8_t *prgRomBlock)
+{
+  return (uint32_t) (prgRomBlock - state->prgRom);
+}
+
+// everything but the output, which belongs to whoever is listening rather than to the game
+static void writeApu(struct StateWriter *writer, const struct APU *apu)
+{
+  for (int i = 0; i < 2; i++) {
+    WRITE_FIELD(writer, apu->pulse[i].enabled);
+    WRITE_FIELD(writer, apu->pulse[i].envelope.start);
+    WRITE_FIELD(writer, apu->pulse[i].envelope.loop);
+    WRITE_FIELD(writer, apu->pulse[i].envelope.constantVolume);
+    WRITE_FIELD(writer, apu->pulse[i].envelope.volume);
+    WRITE_FIELD(writer, apu->pulse[i].envelope.divider);
+    WRITE_FIELD(writer, apu->pulse[i].envelope.decay);
+    WRITE_FIELD(writer, apu->pulse[i].duty);
+    WRITE_FIELD(writer, apu->pulse[i].dutyStep);
+    WRITE_FIELD(writer, apu->pulse[i].timerPeriod);
+    WRITE_FIELD(writer, apu->pulse[i].timer);
+    WRITE_FIELD(writer, apu->pulse[i].lengthCounter);
+    WRITE_FIELD(writer, apu->pulse[i].sweepEnabled);
+    WRITE_FIELD(writer, apu->pulse[i].sweepNegate);
+    WRITE_FIELD(writer, apu->pulse[i].sweepReload);
+    WRITE_FIELD(writer, apu->pulse[i].sweepPeriod);
+    WRITE_FIELD(writer, apu->pulse[i].sweepShift);
+    WRITE_FIELD(writer, apu->pulse[i].sweepDivider);
+  }
+  WRITE_FIELD(writer, apu->triangle.enabled);
+  WRITE_FIELD(writer, apu->triangle.control);
+  WRITE_FIELD(writer, apu->triangle.linearCounterReloadFlag);
+  WRITE_FIELD(writer, apu->triangle.linearCounterReload);
+  WRITE_FIELD(writer, apu->triangle.linearCounter);
+  WRITE_FIELD(writer, apu->triangle.timerPeriod);
+  WRITE_FIELD(writer, apu->triangle.timer);
+  WRITE_FIELD(writer, apu->triangle.step);
+  WRITE_FIELD(writer, apu->triangle.lengthCounter);
+  WRITE_FIELD(writer, apu->noise.enabled);
+  WRITE_FIELD(writer, apu->noise.envelope.start);
+  WRITE_FIELD(writer, apu->noise.envelope.loop);
+  WRITE_FIELD(writer, apu->noise.envelope.constantVolume);
+  WRITE_FIELD(writer, apu->noise.envelope.volume);
+  WRITE_FIELD(writer, apu->noise.envelope.divider);
+  WRITE_FIELD(writer, apu->noise.envelope.decay);
+  WRITE_FIELD(writer, apu->noise.mode);
+  WRITE_FIELD(writer, apu->noise.timerPeriod);
+  WRITE_FIELD(writer, apu->noise.timer);
+  WRITE_FIELD(writer, apu->noise.shiftRegister);
+  WRITE_FIELD(writer, apu->noise.lengthCounter);
+  WRITE_FIELD(writer, apu->dmc.irqEnabled);
+  WRITE_FIELD(writer, apu->dmc.loop);
+  WRITE_FIELD(writer, apu->dmc.timerPeriod);
+  WRITE_FIELD(writer, apu->dmc.timer);
+  WRITE_FIELD(writer, apu->dmc.outputLevel);
+  WRITE_FIELD(writer, apu->dmc.sampleAddress);
+  WRITE_FIELD(writer, apu->dmc.sampleLength);
+  WRITE_FIELD(writer, apu->dmc.currentAddress);
+  WRITE_FIELD(writer, apu->dmc.bytesRemaining);
+  WRITE_FIELD(writer, apu->dmc.sampleBuffer);
+  WRITE_FIELD(writer, apu->dmc.sampleBufferEmpty);
+  WRITE_FIELD(writer, apu->dmc.shiftRegister);
+  WRITE_FIELD(writer, apu->dmc.bitsRemaining);
+  WRITE_FIELD(writer, apu->dmc.silence);
+  WRITE_FIELD(writer, apu->fiveStepMode);
+  WRITE_FIELD(writer, apu->irqInhibit);
+  WRITE_FIELD(writer, apu->frameInterrupt);
+  WRITE_FIELD(writer, apu->dmcInterrupt);
+  WRITE_FIELD(writer, apu->frameStep);
+  WRITE_FIELD(writer, apu->frameSequenceStart);
+  WRITE_FIELD(writer, apu->cycle);
+  WRITE_FIELD(writer, apu->nextEventCycle);
+}
+
+// false if something that indexes a table is out of range
+static bool readApu(struct StateReader *reader, struct APU *apu)
+{
+  for (int i = 0; i < 2; i++) {
+    READ_BOOL(reader, apu->pulse[i].enabled);
+    READ_BOOL(reader, apu->pulse[i].envelope.start);
+    READ_BOOL(reader, apu->pulse[i].envelope.loop);
+    READ_BOOL(reader, apu->pulse[i].envelope.constantVolume);
+    READ_FIELD(reader, apu->pulse[i].envelope.volume);
+    READ_FIELD(reader, apu->pulse[i].envelope.divider);
+    READ_FIELD(reader, apu->pulse[i].envelope.decay);
+    READ_FIELD(reader, apu->pulse[i].duty);
+    READ_FIELD(reader, apu->pulse[i].dutyStep);
+    READ_FIELD(reader, apu->pulse[i].timerPeriod);
+    READ_FIELD(reader, apu->pulse[i].timer);
+    READ_FIELD(reader, apu->pulse[i].lengthCounter);
+    READ_BOOL(reader, apu->pulse[i].sweepEnabled);
+    READ_BOOL(reader, apu->pulse[i].sweepNegate);
+    READ_BOOL(reader, apu->pulse[i].sweepReload);
+    READ_FIELD(reader, apu->pulse[i].sweepPeriod);
+    READ_FIELD(reader, apu->pulse[i].sweepShift);
+    READ_FIELD(reader, apu->pulse[i].sweepDivider);
+  }
+  READ_BOOL(reader, apu->triangle.enabled);
+  READ_BOOL(reader, apu->triangle.control);
+  READ_BOOL(reader, apu->triangle.linearCounterReloadFlag);
+  READ_FIELD(reader, apu->triangle.linearCounterReload);
+  READ_FIELD(reader, apu->triangle.linearCounter);
+  READ_FIELD(reader, apu->triangle.timerPeriod);
+  READ_FIELD(reader, apu->triangle.timer);
+  READ_FIELD(reader, apu->triangle.step);
+  READ_FIELD(reader, apu->triangle.lengthCounter);
+  READ_BOOL(reader, apu->noise.enabled);
+  READ_BOOL(reader, apu->noise.envelope.start);
+  READ_BOOL(reader, apu->noise.envelope.loop);
+  READ_BOOL(reader, apu->noise.envelope.constantVolume);
+  READ_FIELD(reader, apu->noise.envelope.volume);
+  READ_FIELD(reader, apu->noise.envelope.divider);
+  READ_FIELD(reader, apu->noise.envelope.decay);
+  READ_BOOL(reader, apu->noise.mode);
+  READ_FIELD(reader, apu->noise.timerPeriod);
+  READ_FIELD(reader, apu->noise.timer);
+  READ_FIELD(reader, apu->noise.shiftRegister);
+  READ_FIELD(reader, apu->noise.lengthCounter);
+  READ_BOOL(reader, apu->dmc.irqEnabled);
+  READ_BOOL(reader, apu->dmc.loop);
+  READ_FIELD(reader, apu->dmc.timerPeriod);
+  READ_FIELD(reader, apu->dmc.timer);
+  READ_FIELD(reader, apu->dmc.outputLevel);
+  READ_FIELD(reader, apu->dmc.sampleAddress);
+  READ_FIELD(reader, apu->dmc.sampleLength);
+  READ_FIELD(reader, apu->dmc.currentAddress);
+  READ_FIELD(reader, apu->dmc.bytesRemaining);
+  READ_FIELD(reader, apu->dmc.sampleBuffer);
+  READ_BOOL(reader, apu->dmc.sampleBufferEmpty);
+  READ_FIELD(reader, apu->dmc.shiftRegister);
+  READ_FIELD(reader, apu->dmc.bitsRemaining);
+  READ_BOOL(reader, apu->dmc.silence);
+  READ_BOOL(reader, apu->fiveStepMode);
+  READ_BOOL(reader, apu->irqInhibit);
+  READ_BOOL(reader, apu->frameInterrupt);
+  READ_BOOL(reader, apu->dmcInterrupt);
+  READ_FIELD(reader, apu->frameStep);
+  READ_FIELD(reader, apu->frameSequenceStart);
+  READ_FIELD(reader, apu->cycle);
+  READ_FIELD(reader, apu->nextEventCycle);
+
+  for (int i = 0; i < 2; i++) {
+    if (apu->pulse[i].duty > 3 || apu->pulse[i].dutyStep > 7) {
+      return false;
+    }
+  }
+  return apu->triangle.step <= 31 && apu->frameStep < (apu->fiveStepMode ? 5 : 4);
+}
+
+// the writer only counts bytes when it has nowhere to put them, which is how saveStateSize works
+static void writeState(struct StateWriter *writer, uint32_t size, const struct Computer *state, const struct PPU *ppu)
+{
+  uint16_t version = SAVE_STATE_VERSION;
+  uint16_t unused = 0;
+  writeBytes(writer, SAVE_STATE_MAGIC, 4);
+  WRITE_FIELD(writer, version);
+  WRITE_FIELD(writer, unused);
+  WRITE_FIELD(writer, size);
+
+  // CPU
+  WRITE_FIELD(writer, state->pc);
+  WRITE_FIELD(writer, state->acc);
+  WRITE_FIELD(writer, state->xRegister);
+  WRITE_FIELD(writer, state->yRegister);
+  WRITE_FIELD(writer, state->stackRegister);
+  WRITE_FIELD(writer, state->negativeFlag);
+  WRITE_FIELD(writer, state->overflowFlag);
+  WRITE_FIELD(writer, state->decimalFlag);
+  WRITE_FIELD(writer, state->interruptDisable);
+  WRITE_FIELD(writer, state->zeroFlag);
+  WRITE_FIELD(writer, state->carryFlag);
+  WRITE_FIELD(writer, state->irqPending);
+  WRITE_FIELD(writer, state->nmiPending);
+  WRITE_FIELD(writer, state->totalCyclesCompleted);
+
+  // controller
+  WRITE_FIELD(writer, state->pollController);
+  WRITE_FIELD(writer, state->currentButtonBit);
+  WRITE_FIELD(writer, state->buttons);
+
+  // mapper
+  WRITE_FIELD(writer, state->mmc1ShiftRegister);
+  WRITE_FIELD(writer, state->mmc1PrgRomBank);
+  WRITE_FIELD(writer, state->mmc1ShiftCounter);
+  uint32_t prgRomBlockOffsets[4] = {
+    prgRomBlockOffset(state, state->prgRomBlock1), prgRomBlockOffset(state, state->prgRomBlock2),
+    prgRomBlockOffset(state, state->prgRomBlock3), prgRomBlockOffset(state, state->prgRomBlock4)
+  };
+  WRITE_FIELD(writer, prgRomBlockOffsets);
+
+  writeBytes(writer, state->memory, CPU_MEMORY_SAVED);
+
+  writeApu(writer, &state->apu);
+
+  // PPU
+  WRITE_FIELD(writer, ppu->sprites0);
+  WRITE_FIELD(writer, ppu->sprites1);
+  uint8_t spritesAreSprites0 = ppu->sprites == ppu->sprites0;
+  WRITE_FIELD(writer, spritesAreSprites0);
+  WRITE_FIELD(writer, ppu->vRegister);
+  WRITE_FIELD(writer, ppu->tRegister);
+  WRITE_FIELD(writer, ppu->xRegister);
+  WRITE_FIELD(writer, ppu->wRegister);
+  WRITE_FIELD(writer, ppu->patternTableShiftRegisterLow);
+  WRITE_FIELD(writer, ppu->patternTableShiftRegisterHigh);
+  WRITE_FIELD(writer, ppu->paletteNumberFirst);
+  WRITE_FIELD(writer, ppu->paletteNumberSecond);
+  WRITE_FIELD(writer, ppu->nt);
+  WRITE_FIELD(writer, ppu->at);
+  WRITE_FIELD(writer, ppu->ptTileLow);
+  WRITE_FIELD(writer, ppu->ptTileHigh);
+  WRITE_FIELD(writer, ppu->control);
+  WRITE_FIELD(writer, ppu->mask);
+  WRITE_FIELD(writer, ppu->status);
+  WRITE_FIELD(writer, ppu->oamAddr);
+  WRITE_FIELD(writer, ppu->scanlineClockCycle);
+  WRITE_FIELD(writer, ppu->scanline);
+
+  writeBytes(writer, ppu->oam, 256);
+  writeBytes(writer, ppu->memory, PPU_MEMORY_SAVED);
+}
+
+// Counted on every call rather than cached so any thread can call it; it's a few hundred bytes of zeroing and no copying.
+size_t saveStateSize(void)
+{
+  // none of the fields are looked at when counting, so dummy structs are fine
+  struct Computer state = { 0 };
+  struct PPU ppu = { 0 };
+  struct StateWriter writer = { 0 };
+  writeState(&writer, 0, &state, &ppu);
+  return writer.bytesWritten;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Buffer is too small (see saveStateSize).
+ *
+ */
+int saveState(uint8_t *buffer, size_t bufferSize, size_t *bytesWritten, const struct Computer *state, const struct PPU *ppu)
+{
+  if (bufferSize < saveStateSize()) {
+    return 1;
+  }
+
+  uint64_t traceStart = state->trace ? getTimeInNanoseconds() : 0;
+  struct StateWriter writer = { .cursor = buffer, .bytesWritten = 0 };
+  writeState(&writer, (uint32_t) saveStateSize(), state, ppu);
+  if (state->trace) {
+    addTraceSpanWithArg(state->trace, "save state", traceStart, "bytes", (int64_t) writer.bytesWritten);
+  }
+
+  if (bytesWritten) {
+    *bytesWritten = writer.bytesWritten;
+  }
+  return 0;
+}
+
+// Reads everything after the header, or everything but the CPU, PPU and OAM memory when withMemory is false. Returns
+// false as soon as a PRG ROM bank, the PC or a register is out of range, with state and ppu part way through.
+static bool readState(struct StateReader *reader, struct Computer *state, struct PPU *ppu, bool withMemory)
+{
+  // CPU
+  READ_FIELD(reader, state->pc);
+  READ_FIELD(reader, state->acc);
+  READ_FIELD(reader, state->xRegister);
+  READ_FIELD(reader, state->yRegister);
+  READ_FIELD(reader, state->stackRegister);
+  READ_FIELD(reader, state->negativeFlag);
+  READ_FIELD(reader, state->overflowFlag);
+  READ_FIELD(reader, state->decimalFlag);
+  READ_FIELD(reader, state->interruptDisable);
+  READ_FIELD(reader, state->zeroFlag);
+  READ_FIELD(reader, state->carryFlag);
+  READ_BOOL(reader, state->irqPending);
+  READ_BOOL(reader, state->nmiPending);
+  READ_FIELD(reader, state->totalCyclesCompleted);
+
+  // controller
+  READ_BOOL(reader, state->pollController);
+  READ_FIELD(reader, state->currentButtonBit);
+  READ_FIELD(reader, state->buttons);
+
+  // mapper
+  READ_FIELD(reader, state->mmc1ShiftRegister);
+  READ_FIELD(reader, state->mmc1PrgRomBank);
+  READ_FIELD(reader, state->mmc1ShiftCounter);
+  uint32_t prgRomBlockOffsets[4];
+  READ_FIELD(reader, prgRomBlockOffsets);
+  if (state->pc > 0xFFFF) {
+    return false;
+  }
+  for (int i = 0; i < 4; i++) {
+    if ((uint64_t) prgRomBlockOffsets[i] + 0x2000 > state->sizeOfPrgRomInBytes) {
+      return false;
+    }
+  }
+  state->prgRomBlock1 = state->prgRom + prgRomBlockOffsets[0];
+  state->prgRomBlock2 = state->prgRom + prgRomBlockOffsets[1];
+  state->prgRomBlock3 = state->prgRom + prgRomBlockOffsets[2];
+  state->prgRomBlock4 = state->prgRom + prgRomBlockOffsets[3];
+
+  if (withMemory) {
+    readBytes(reader, state->memory, CPU_MEMORY_SAVED);
+  } else {
+    skipBytes(reader, CPU_MEMORY_SAVED);
+  }
+
+  if (!readApu(reader, &state->apu)) {
+    return false;
+  }
+
+  // PPU
+  READ_FIELD(reader, ppu->sprites0);
+  READ_FIELD(reader, ppu->sprites1);
+  uint8_t spritesAreSprites0;
+  READ_FIELD(reader, spritesAreSprites0);
+  READ_FIELD(reader, ppu->vRegister);
+  READ_FIELD(reader, ppu->tRegister);
+  READ_FIELD(reader, ppu->xRegister);
+  READ_BOOL(reader, ppu->wRegister);
+  READ_FIELD(reader, ppu->patternTableShiftRegisterLow);
+  READ_FIELD(reader, ppu->patternTableShiftRegisterHigh);
+  READ_FIELD(reader, ppu->paletteNumberFirst);
+  READ_FIELD(reader, ppu->paletteNumberSecond);
+  READ_FIELD(reader, ppu->nt);
+  READ_FIELD(reader, ppu->at);
+  READ_FIELD(reader, ppu->ptTileLow);
+  READ_FIELD(reader, ppu->ptTileHigh);
+  READ_FIELD(reader, ppu->control);
+  READ_FIELD(reader, ppu->mask);
+  READ_FIELD(reader, ppu->status);
+  READ_FIELD(reader, ppu->oamAddr);
+  READ_FIELD(reader, ppu->scanlineClockCycle);
+  READ_FIELD(reader, ppu->scanline);
+
+  if (ppu->vRegister > 0x7FFF || ppu->tRegister > 0x7FFF || ppu->xRegister > 7 || ppu->paletteNumberFirst > 3
+      || ppu->paletteNumberSecond > 3 || ppu->scanlineClockCycle < 0 || ppu->scanlineClockCycle > 340
+      || ppu->scanline < -1 || ppu->scanline > 260) {
+    return false;
+  }
+  ppu->sprites = spritesAreSprites0 ? ppu->sprites0 : ppu->sprites1;
+  ppu->followingSprites = spritesAreSprites0 ? ppu->sprites1 : ppu->sprites0;
+
+  if (withMemory) {
+    readBytes(reader, ppu->oam, 256);
+    readBytes(reader, ppu->memory, PPU_MEMORY_SAVED);
+  }
+  return true;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Not a save state.
+ *  2: Save state is from a different version.
+ *  3: Save state is truncated.
+ *  4: Save state is corrupt (a PRG ROM bank, the PC or a PPU register is out of range). Nothing is loaded.
+ *
+ */
+int loadState(const uint8_t *buffer, size_t bufferSize, struct Computer *state, struct PPU *ppu)
+{
+  if (bufferSize < SAVE_STATE_HEADER_SIZE || memcmp(buffer, SAVE_STATE_MAGIC, 4) != 0) {
+    return 1;
+  }
+
+  uint64_t traceStart = state->trace ? getTimeInNanoseconds() : 0;
+  struct StateReader reader = { .cursor = buffer + 4 };
+  uint16_t version;
+  uint16_t unused;
+  uint32_t size;
+  READ_FIELD(&reader, version);
+  READ_FIELD(&reader, unused);
+  READ_FIELD(&reader, size);
+
+  if (version != SAVE_STATE_VERSION || size != saveStateSize()) {
+    return 2;
+  }
+  if (bufferSize < size) {
+    return 3;
+  }
+
+  // check everything on copies first so a bad state doesn't leave the game half loaded
+  const uint8_t *body = reader.cursor;
+  struct Computer checkState = *state;
+  struct PPU checkPpu = *ppu;
+  if (!readState(&reader, &checkState, &checkPpu, false)) {
+    return 4;
+  }
+  reader.cursor = body;
+  readState(&reader, state, ppu, true);
+
+  // PRG RAM may have just changed underneath the save file
+  if (state->batteryRam) {
+    state->batteryRam->dirtyPages = 0xFFFFFFFF;
+  }
+  if (state->ramWatch) {
+    markAllRamWritten(state->ramWatch);
+  }
+
+  if (state->trace) {
+    addTraceSpanWithArg(state->trace, "load state", traceStart, "bytes", (int64_t) size);
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef FILE_SAVESTATE_H_SEEN
+#define FILE_SAVESTATE_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Computer;
+struct PPU;
+
+// Bump this whenever the layout written by saveState changes
+#define SAVE_STATE_VERSION 3
+
+size_t saveStateSize(void);
+int saveState(uint8_t *buffer, size_t bufferSize, size_t *bytesWritten, const struct Computer *state, const struct PPU *ppu);
+int loadState(const uint8_t *buffer, size_t bufferSize, struct Computer *state, struct PPU *ppu);
+
+#endif /* !FILE_SAVESTATE_H_SEEN */
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "romscan.h"
+
+/*
+ * Scans a directory of .nes files and writes a binary index of them, so you can find out which games use mappers we
+ * don't support (and pick games by hash) without loading every cartridge.
+ *
+ *   scan_roms <rom directory> <index file> [number of threads]
+ *   scan_roms --lookup <index file> <sha1 or crc32 in hex>
+ *
+ */
+
+static void printEntry(const struct RomIndexEntry *entry)
+{
+  for (int i = 0; i < SHA1_DIGEST_SIZE; i++) {
+    printf("%02x", entry->sha1[i]);
+  }
+  printf(" %08x mapper %3d %s PRG %7u CHR %7u %s%s%s\n", entry->crc32, entry->mapperNumber,
+      (entry->flags & ROM_INDEX_VERTICAL_MIRRORING) ? "V" : "H", entry->sizeOfPrgRomInBytes, entry->sizeOfChrRomInBytes,
+      (entry->flags & ROM_INDEX_HAS_BATTERY) ? "battery " : "", (entry->flags & ROM_INDEX_MAPPER_SUPPORTED) ? "" : "UNSUPPORTED ",
+      entry->path);
+}
+
+static int lookup(const char *indexFilename, const char *hash)
+{
+  struct RomIndex *romIndex;
+  int error = readRomIndex(&romIndex, indexFilename);
+  if (error) {
+    printf("Error reading index %s: %d\n", indexFilename, error);
+    return error;
+  }
+
+  const struct RomIndexEntry *entry = 0;
+  if (strlen(hash) == SHA1_DIGEST_SIZE * 2) {
+    uint8_t sha1[SHA1_DIGEST_SIZE];
+    for (int i = 0; i < SHA1_DIGEST_SIZE; i++) {
+      unsigned int byte;
+      sscanf(hash + i*2, "%2x", &byte);
+      sha1[i] = (uint8_t) byte;
+    }
+    entry = findRomBySha1(romIndex, sha1);
+  } else {
+    entry = findRomByCrc32(romIndex, (uint32_t) strtoul(hash, 0, 16));
+  }
+
+  if (entry) {
+    printEntry(entry);
+  } else {
+    printf("not found\n");
+  }
+
+  freeRomIndex(romIndex);
+  return entry ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc == 4 && strcmp(argv[1], "--lookup") == 0) {
+    return lookup(argv[2], argv[3]);
+  }
+
+  if (argc < 3) {
+    printf("usage: %s <rom directory> <index file> [number of threads]\n", argv[0]);
+    printf("       %s --lookup <index file> <sha1 or crc32>\n", argv[0]);
+    return 1;
+  }
+
+  int numThreads = argc > 3 ? atoi(argv[3]) : 0;
+
+  struct RomIndex *romIndex;
+  int error = scanRomDirectory(&romIndex, argv[1], numThreads);
+  if (error) {
+    printf("Error scanning %s: %d\n", argv[1], error);
+    return error;
+  }
+
+  int numUnsupported = 0;
+  for (int i = 0; i < romIndex->numEntries; i++) {
+    if (!(romIndex->entries[i].flags & ROM_INDEX_MAPPER_SUPPORTED)) {
+      numUnsupported++;
+    }
+    printEntry(&romIndex->entries[i]);
+  }
+  printf("%d games indexed (%d with unsupported mappers), %d files skipped\n", romIndex->numEntries, numUnsupported,
+      romIndex->numFilesSkipped);
+
+  error = writeRomIndex(romIndex, argv[2]);
+  freeRomIndex(romIndex);
+  return error;
+}
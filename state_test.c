@@ -0,0 +1,359 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "emu.h"
+#include "cartridge.h"
+#include "controller.h"
+#include "compress.h"
+#include "savestate.h"
+#include "rewind.h"
+#include "movie.h"
+
+/*
+ * Round trip tests for everything that stores emulator state: LZ compression, save states, rewind and movies. Each
+ * one saves or compresses something, gets it back and checks it's byte for byte what went in.
+ *
+ * Unlike the 6502 functional tests this doesn't need anything downloaded. It runs a tiny NROM game built below, which
+ * turns rendering on and then loops forever reading the controller and adding what it read into RAM, so every frame
+ * changes CPU memory and depends on the input.
+ *
+ * Writes state_test.cfm in the current directory while it runs and removes it afterwards.
+ */
+
+#define PRG_ROM_SIZE 0x4000
+#define CHR_ROM_SIZE 0x2000
+#define NUM_FRAMES 120
+#define MOVIE_FILENAME "state_test.cfm"
+
+static const uint8_t program[] = {
+  0xA9, 0x1E,        // $C000  LDA #$1E
+  0x8D, 0x01, 0x20,  //        STA $2001   show the background and sprites
+  0xA9, 0x01,        // $C005  LDA #$01
+  0x8D, 0x16, 0x40,  //        STA $4016   strobe the controller
+  0xA9, 0x00,        //        LDA #$00
+  0x8D, 0x16, 0x40,  //        STA $4016
+  0xAD, 0x16, 0x40,  //        LDA $4016   read A
+  0x7D, 0x00, 0x03,  //        ADC $0300,X
+  0x9D, 0x00, 0x03,  //        STA $0300,X
+  0xE8,              //        INX
+  0x4C, 0x05, 0xC0   //        JMP $C005
+};
+
+static int failures = 0;
+
+static void check(bool passed, const char *what)
+{
+  printf("%s: %s\n", passed ? "ok" : "FAILED", what);
+  if (!passed) {
+    failures++;
+  }
+}
+
+static uint8_t *buildRom(size_t *romSize)
+{
+  *romSize = 16 + PRG_ROM_SIZE + CHR_ROM_SIZE;
+  uint8_t *rom = (uint8_t *) calloc(*romSize, 1);
+  if (!rom) {
+    return NULL;
+  }
+  memcpy(rom, "NES\x1A", 4);
+  rom[4] = PRG_ROM_SIZE / 0x4000;
+  rom[5] = CHR_ROM_SIZE / 0x2000;
+
+  // 16 kB of PRG ROM shows up at both $8000 and $C000, so the vectors are at the end of it
+  uint8_t *prgRom = rom + 16;
+  memcpy(prgRom, program, sizeof(program));
+  prgRom[0x3FFA] = 0x00;  // NMI (never enabled)
+  prgRom[0x3FFB] = 0xC0;
+  prgRom[0x3FFC] = 0x00;  // reset
+  prgRom[0x3FFD] = 0xC0;
+  prgRom[0x3FFE] = 0x00;  // IRQ
+  prgRom[0x3FFF] = 0xC0;
+  return rom;
+}
+
+// something different most frames, the same every run (the game only reads A)
+static void setInputForFrame(struct KeyboardInput *keyboardInput, int frame)
+{
+  int bits = frame * 37 + (frame >> 3);
+  keyboardInput->a = (bits & 1) != 0;
+  keyboardInput->b = (bits & 2) != 0;
+}
+
+static void runFrame(struct Computer *state, struct PPU *ppu, struct Color *palette)
+{
+  while (!executeEmulatorCycle(state, ppu, NULL, palette));
+}
+
+static void testCompress(const uint8_t *saveStateData, size_t saveStateDataSize)
+{
+  size_t size = 100000;
+  uint8_t *source = (uint8_t *) malloc(size);
+  uint8_t *compressed = (uint8_t *) malloc(lzCompressBound(size));
+  uint8_t *decompressed = (uint8_t *) malloc(size);
+  if (!source || !compressed || !decompressed) {
+    check(false, "allocate compression buffers");
+    free(source);
+    free(compressed);
+    free(decompressed);
+    return;
+  }
+
+  // zeros, text that repeats with a twist, noise, and a real save state
+  for (int kind = 0; kind < 4; kind++) {
+    size_t sourceSize = size;
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < size; i++) {
+      seed = seed * 1103515245 + 12345;
+      source[i] = kind == 0 ? 0 : kind == 1 ? (uint8_t) ("castleface "[i % 11] + (i / 1000) % 3) : (uint8_t) (seed >> 16);
+    }
+    if (kind == 3) {
+      memcpy(source, saveStateData, saveStateDataSize);
+      sourceSize = saveStateDataSize;
+    }
+
+    size_t compressedSize = lzCompress(source, sourceSize, compressed, lzCompressBound(sourceSize));
+    memset(decompressed, 0xCC, size);
+    bool passed = compressedSize > 0 && lzDecompress(compressed, compressedSize, decompressed, sourceSize) == 0
+        && memcmp(source, decompressed, sourceSize) == 0;
+    const char *names[4] = { "compress zeros", "compress repeating text", "compress noise", "compress a save state" };
+    check(passed, names[kind]);
+  }
+
+  free(source);
+  free(compressed);
+  free(decompressed);
+}
+
+static void testSaveState(struct Computer *state, struct PPU *ppu, struct Color *palette, size_t stateSize)
+{
+  uint8_t *before = (uint8_t *) malloc(stateSize);
+  uint8_t *after = (uint8_t *) malloc(stateSize);
+  uint8_t *reloaded = (uint8_t *) malloc(stateSize);
+  uint8_t *rerun = (uint8_t *) malloc(stateSize);
+  if (!before || !after || !reloaded || !rerun) {
+    check(false, "allocate save state buffers");
+    free(before);
+    free(after);
+    free(reloaded);
+    free(rerun);
+    return;
+  }
+
+  check(saveState(before, stateSize, NULL, state, ppu) == 0, "save a state");
+  for (int frame = 0; frame < 30; frame++) {
+    setInputForFrame(state->keyboardInput, frame);
+    runFrame(state, ppu, palette);
+  }
+  saveState(after, stateSize, NULL, state, ppu);
+  check(memcmp(before, after, stateSize) != 0, "running frames changes the state");
+
+  check(loadState(before, stateSize, state, ppu) == 0, "load a state");
+  saveState(reloaded, stateSize, NULL, state, ppu);
+  check(memcmp(before, reloaded, stateSize) == 0, "a loaded state saves the same bytes");
+
+  for (int frame = 0; frame < 30; frame++) {
+    setInputForFrame(state->keyboardInput, frame);
+    runFrame(state, ppu, palette);
+  }
+  saveState(rerun, stateSize, NULL, state, ppu);
+  check(memcmp(after, rerun, stateSize) == 0, "running on from a loaded state gives the same frames");
+
+  uint8_t *corrupt = before;
+  memcpy(corrupt, rerun, stateSize);
+  memcpy(corrupt, "XXXX", 4);
+  check(loadState(corrupt, stateSize, state, ppu) == 1, "refuse something that isn't a state");
+  check(loadState(rerun, stateSize - 1, state, ppu) == 3, "refuse a truncated state");
+
+  // the PC comes straight after the 12 byte header, and one that doesn't fit in 16 bits has to be refused before
+  // anything is loaded
+  memcpy(corrupt, rerun, stateSize);
+  memset(corrupt + 12, 0xFF, sizeof(state->pc));
+  check(loadState(corrupt, stateSize, state, ppu) == 4, "refuse a state with the PC out of range");
+  saveState(reloaded, stateSize, NULL, state, ppu);
+  check(memcmp(reloaded, rerun, stateSize) == 0, "a refused state leaves the emulator as it was");
+
+  free(before);
+  free(after);
+  free(reloaded);
+  free(rerun);
+}
+
+static void testRewind(struct Computer *state, struct PPU *ppu, struct Color *palette, size_t stateSize)
+{
+  struct RewindBuffer *rewindBuffer;
+  uint8_t *states = (uint8_t *) malloc(stateSize * (NUM_FRAMES + 1));
+  if (!states || createRewindBuffer(&rewindBuffer, 4 * 1024 * 1024, 10)) {
+    check(false, "create a rewind buffer");
+    free(states);
+    return;
+  }
+
+  // all but the last frame, which comes after a failed rewind below
+  bool pushed = true;
+  for (int frame = 0; frame < NUM_FRAMES - 1; frame++) {
+    saveState(states + frame * stateSize, stateSize, NULL, state, ppu);
+    pushed = pushed && pushRewindFrame(rewindBuffer, state, ppu) == 0;
+    setInputForFrame(state->keyboardInput, frame);
+    runFrame(state, ppu, palette);
+  }
+  check(pushed, "push rewind frames");
+  check(rewindFramesAvailable(rewindBuffer) == NUM_FRAMES - 2, "every frame pushed can be rewound to");
+
+  // A rewind to a state that won't load (here because PRG ROM looks too small for its banks) has to leave the history
+  // alone, so the next frame pushed, a delta against the newest keyframe, still comes back right.
+  uint8_t *current = states + NUM_FRAMES * stateSize;
+  unsigned int sizeOfPrgRomInBytes = state->sizeOfPrgRomInBytes;
+  state->sizeOfPrgRomInBytes = 0;
+  bool refused = rewindFrames(rewindBuffer, 25, state, ppu) == 3;
+  state->sizeOfPrgRomInBytes = sizeOfPrgRomInBytes;
+  saveState(states + (NUM_FRAMES - 1) * stateSize, stateSize, NULL, state, ppu);
+  bool passed = refused && pushRewindFrame(rewindBuffer, state, ppu) == 0 && rewindFrames(rewindBuffer, 0, state, ppu) == 0;
+  saveState(current, stateSize, NULL, state, ppu);
+  check(passed && memcmp(current, states + (NUM_FRAMES - 1) * stateSize, stateSize) == 0,
+      "a rewind that fails to load leaves the history working");
+
+  // go back to a delta, then a keyframe, then past the start
+  int targets[3] = { NUM_FRAMES - 1 - 25, 40, 0 };
+  int newest = NUM_FRAMES - 1;
+  for (int i = 0; i < 3; i++) {
+    passed = rewindFrames(rewindBuffer, newest - targets[i], state, ppu) == 0;
+    saveState(current, stateSize, NULL, state, ppu);
+    passed = passed && memcmp(current, states + targets[i] * stateSize, stateSize) == 0;
+    const char *names[3] = { "rewind to a delta frame", "rewind to a keyframe", "rewind to the first frame" };
+    check(passed, names[i]);
+    newest = targets[i];
+  }
+  check(rewindFrames(rewindBuffer, 1, state, ppu) == 0 && rewindFramesAvailable(rewindBuffer) == 0,
+      "rewinding past the oldest frame stops there");
+
+  freeRewindBuffer(rewindBuffer);
+  free(states);
+}
+
+static void testMovie(struct Computer *state, struct PPU *ppu, struct Color *palette, size_t stateSize)
+{
+  struct Movie *movie;
+  uint8_t *states = (uint8_t *) malloc(stateSize * (NUM_FRAMES + 1));
+  if (!states || createMovie(&movie, 0xC0FFEE, 30)) {
+    check(false, "create a movie");
+    free(states);
+    return;
+  }
+
+  bool recorded = true;
+  struct KeyboardInput keyboardInput = { .up = false };
+  for (int frame = 0; frame < NUM_FRAMES; frame++) {
+    saveState(states + frame * stateSize, stateSize, NULL, state, ppu);
+    setInputForFrame(&keyboardInput, frame);
+    recorded = recorded && recordMovieFrame(movie, state, ppu, &keyboardInput) == 0;
+    *state->keyboardInput = keyboardInput;
+    runFrame(state, ppu, palette);
+  }
+  saveState(states + NUM_FRAMES * stateSize, stateSize, NULL, state, ppu);
+  check(recorded, "record a movie");
+
+  struct Movie *readBack = NULL;
+  check(writeMovie(movie, MOVIE_FILENAME) == 0, "write a movie");
+  check(readMovie(&readBack, MOVIE_FILENAME) == 0, "read a movie");
+  remove(MOVIE_FILENAME);
+  if (!readBack) {
+    freeMovie(movie);
+    free(states);
+    return;
+  }
+
+  bool same = readBack->romCrc32 == movie->romCrc32 && readBack->numFrames == movie->numFrames
+      && readBack->numKeyframes == movie->numKeyframes && memcmp(readBack->inputs, movie->inputs, movie->numFrames) == 0;
+  for (int i = 0; same && i < movie->numKeyframes; i++) {
+    same = readBack->keyframes[i].frame == movie->keyframes[i].frame && readBack->keyframes[i].size == movie->keyframes[i].size
+        && memcmp(readBack->keyframes[i].data, movie->keyframes[i].data, movie->keyframes[i].size) == 0;
+  }
+  check(same, "a movie reads back the same as it was written");
+
+  struct Movie *outOfOrder = NULL;
+  uint32_t firstFrame = movie->keyframes[0].frame;
+  movie->keyframes[0].frame = movie->keyframes[1].frame;
+  movie->keyframes[1].frame = firstFrame;
+  bool rejected = writeMovie(movie, MOVIE_FILENAME) == 0 && readMovie(&outOfOrder, MOVIE_FILENAME) == 4 && !outOfOrder;
+  remove(MOVIE_FILENAME);
+  movie->keyframes[1].frame = movie->keyframes[0].frame;
+  movie->keyframes[0].frame = firstFrame;
+  check(rejected, "a movie with keyframes out of order is rejected");
+
+  // a keyframe, a frame between keyframes, and the end
+  uint8_t *current = (uint8_t *) malloc(stateSize);
+  int targets[3] = { 60, 75, NUM_FRAMES };
+  for (int i = 0; current && i < 3; i++) {
+    bool passed = seekMovie(readBack, targets[i], state, ppu, NULL, palette) == 0;
+    saveState(current, stateSize, NULL, state, ppu);
+    passed = passed && memcmp(current, states + targets[i] * stateSize, stateSize) == 0;
+    const char *names[3] = { "seek a movie to a keyframe", "seek a movie between keyframes", "seek a movie to the end" };
+    check(passed, names[i]);
+  }
+
+  free(current);
+  freeMovie(readBack);
+  freeMovie(movie);
+  free(states);
+}
+
+int main(void)
+{
+  size_t romSize;
+  uint8_t *rom = buildRom(&romSize);
+  struct Cartridge *cartridge;
+  if (!rom || loadCartridgeFromMemory(&cartridge, rom, romSize)) {
+    printf("Could not load the test game\n");
+    return 1;
+  }
+
+  struct PPU *ppu;
+  if (createPPU(&ppu, cartridge)) {
+    printf("Could not create the PPU\n");
+    return 1;
+  }
+  struct Color palette[64];
+  loadPalette(palette);
+  struct KeyboardInput keyboardInput = { .up = false };
+  struct PPUClosure ppuClosure;
+  buildPPUClosure(&ppuClosure, ppu);
+  struct Computer state = { .keyboardInput = &keyboardInput, .ppuClosure = &ppuClosure };
+  if (powerOnComputer(&state, cartridge)) {
+    printf("Could not power on\n");
+    return 1;
+  }
+
+  size_t stateSize = saveStateSize();
+  uint8_t *firstState = (uint8_t *) malloc(stateSize);
+  if (!firstState) {
+    printf("Could not allocate memory\n");
+    return 1;
+  }
+  for (int frame = 0; frame < 10; frame++) {
+    runFrame(&state, ppu, palette);
+  }
+  saveState(firstState, stateSize, NULL, &state, ppu);
+
+  testCompress(firstState, stateSize);
+  testSaveState(&state, ppu, palette, stateSize);
+  testRewind(&state, ppu, palette, stateSize);
+  testMovie(&state, ppu, palette, stateSize);
+
+  free(firstState);
+  free(state.memory);
+  free(ppu->memory);
+  free(ppu->oam);
+  free(ppu);
+  free(cartridge->prgRom);
+  free(cartridge->chrRom);
+  free(cartridge);
+  free(rom);
+
+  printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+  return failures ? 1 : 0;
+}
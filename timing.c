@@ -0,0 +1,341 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "timing.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#define TIMING_RDTSC 1
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#define TIMING_RDTSC 1
+#include <x86intrin.h>
+#endif
+
+static const char *stageNames[TIMING_NUM_STAGES] = {
+  "cpu", "ppu", "sprite_evaluation", "mapper", "apu", "present", "wait", "other"
+};
+
+static uint64_t readTicks(void)
+{
+#ifdef TIMING_RDTSC
+  return __rdtsc();
+#else
+  return getTimeInNanoseconds();
+#endif
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *
+ */
+int createStageTimer(struct StageTimer **timer)
+{
+  struct StageTimer *newTimer = (struct StageTimer *) calloc(1, sizeof(struct StageTimer));
+  if (!newTimer) {
+    return 1;
+  }
+
+  newTimer->stage = TIMING_OTHER;
+  newTimer->instructionsUntilSample = 1;
+  newTimer->random = 0x2545F491;
+  newTimer->firstNanoseconds = getTimeInNanoseconds();
+  newTimer->firstTicks = readTicks();
+  newTimer->stageStart = newTimer->firstTicks;
+  newTimer->frameStart = newTimer->firstTicks;
+
+  *timer = newTimer;
+  return 0;
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: Not supported on this platform.
+ *  3: None of the counters could be opened.
+ *
+ */
+int attachPerfCounters(struct StageTimer *timer)
+{
+  if (timer->perfCounters) {
+    return 0;
+  }
+
+  int error = openPerfCounters(&timer->perfCounters);
+  if (error) {
+    return error;
+  }
+  readPerfCounters(timer->perfCounters, timer->countsStart);
+  return 0;
+}
+
+static void chargeCounts(struct StageTimer *timer)
+{
+  uint64_t values[PERF_NUM_COUNTERS];
+  readPerfCounters(timer->perfCounters, values);
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    timer->counts[timer->stage][i] += values[i] - timer->countsStart[i];
+    timer->countsStart[i] = values[i];
+  }
+}
+
+// Charges what's gone by to the stage that was running, and returns the time now.
+static uint64_t chargeStage(struct StageTimer *timer)
+{
+  uint64_t now = readTicks();
+  timer->ticks[timer->stage] += now - timer->stageStart;
+  timer->stageStart = now;
+  if (timer->perfCounters) {
+    chargeCounts(timer);
+  }
+  return now;
+}
+
+void beginStage(struct StageTimer *timer, int stage)
+{
+  chargeStage(timer);
+  if (timer->nesting < TIMING_MAX_NESTING) {
+    timer->outerStages[timer->nesting] = timer->stage;
+  }
+  timer->nesting++;
+  timer->stage = stage;
+}
+
+// Moves on to another stage without going back to the one outside first, so it costs one read of the clock, not two.
+void switchStage(struct StageTimer *timer, int stage)
+{
+  chargeStage(timer);
+  timer->stage = stage;
+}
+
+void endStage(struct StageTimer *timer)
+{
+  chargeStage(timer);
+  if (timer->nesting == 0) {
+    return;
+  }
+  timer->nesting--;
+  if (timer->nesting < TIMING_MAX_NESTING) {
+    timer->stage = timer->outerStages[timer->nesting];
+  }
+}
+
+/*
+ * For executeEmulatorCycle, at the start of each instruction: true if this is one to time, in which case the time
+ * from here to the end of the instruction is the CPU's, and it switches to the PPU for the rest of the cycle.
+ */
+bool beginTimedInstruction(struct StageTimer *timer)
+{
+  if (--timer->instructionsUntilSample > 0) {
+    return false;
+  }
+
+  // xorshift
+  timer->random ^= timer->random << 13;
+  timer->random ^= timer->random >> 17;
+  timer->random ^= timer->random << 5;
+  timer->instructionsUntilSample = TIMING_MIN_SAMPLE_PERIOD + (timer->random & TIMING_SAMPLE_PERIOD_MASK);
+
+  switchStage(timer, TIMING_CPU);
+  return true;
+}
+
+// After a timed instruction's PPU cycles, or at the end of a frame. What comes after a frame is the frontend's, until
+// the next frame's first instruction, which is always timed.
+void endTimedInstruction(struct StageTimer *timer, bool frameEnded)
+{
+  switchStage(timer, frameEnded ? TIMING_OTHER : TIMING_UNSPLIT);
+  if (frameEnded) {
+    timer->instructionsUntilSample = 1;
+  }
+}
+
+// The instructions that weren't timed went the same way as the ones that were.
+static void splitUnsplit(uint64_t *cpu, uint64_t *ppu, uint64_t *unsplit)
+{
+  uint64_t sampled = *cpu + *ppu;
+  if (sampled > 0) {
+    uint64_t cpuShare = (uint64_t) ((double) *unsplit * *cpu / sampled);
+    *cpu += cpuShare;
+    *ppu += *unsplit - cpuShare;
+  } else {
+    *cpu += *unsplit;
+  }
+  *unsplit = 0;
+}
+
+// Can be called from inside a stage, which carries on into the next frame.
+void endTimedFrame(struct StageTimer *timer)
+{
+  uint64_t now = chargeStage(timer);
+
+  splitUnsplit(&timer->ticks[TIMING_CPU], &timer->ticks[TIMING_PPU], &timer->ticks[TIMING_UNSPLIT]);
+  for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+    splitUnsplit(&timer->counts[TIMING_CPU][i], &timer->counts[TIMING_PPU][i], &timer->counts[TIMING_UNSPLIT][i]);
+  }
+
+  // what a tick is worth, from everything timed so far
+  uint64_t elapsedTicks = now - timer->firstTicks;
+  double nanosecondsPerTick = elapsedTicks > 0 ? (double) (getTimeInNanoseconds() - timer->firstNanoseconds) / elapsedTicks : 1.0;
+
+  struct FrameTimings *frame = &timer->history[timer->numFrames % TIMING_HISTORY_FRAMES];
+  frame->total = (uint64_t) ((now - timer->frameStart) * nanosecondsPerTick);
+  timer->runTotal.total += frame->total;
+  for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+    frame->nanoseconds[i] = (uint64_t) (timer->ticks[i] * nanosecondsPerTick);
+    timer->runTotal.nanoseconds[i] += frame->nanoseconds[i];
+    timer->ticks[i] = 0;
+    for (int j = 0; j < PERF_NUM_COUNTERS; j++) {
+      frame->counts[i][j] = timer->counts[i][j];
+      timer->runTotal.counts[i][j] += timer->counts[i][j];
+      timer->counts[i][j] = 0;
+    }
+  }
+
+  timer->frameStart = now;
+  timer->numFrames++;
+}
+
+// Averages the last TIMING_HISTORY_FRAMES frames, or as many as there have been. Returns how many that was.
+int getRollingFrameTimings(const struct StageTimer *timer, struct FrameTimings *average)
+{
+  memset(average, 0, sizeof(struct FrameTimings));
+  int numFrames = timer->numFrames < TIMING_HISTORY_FRAMES ? timer->numFrames : TIMING_HISTORY_FRAMES;
+  if (numFrames == 0) {
+    return 0;
+  }
+
+  for (int i = 0; i < numFrames; i++) {
+    average->total += timer->history[i].total;
+    for (int j = 0; j < TIMING_NUM_STAGES; j++) {
+      average->nanoseconds[j] += timer->history[i].nanoseconds[j];
+      for (int k = 0; k < PERF_NUM_COUNTERS; k++) {
+        average->counts[j][k] += timer->history[i].counts[j][k];
+      }
+    }
+  }
+  average->total /= numFrames;
+  for (int j = 0; j < TIMING_NUM_STAGES; j++) {
+    average->nanoseconds[j] /= numFrames;
+    for (int k = 0; k < PERF_NUM_COUNTERS; k++) {
+      average->counts[j][k] /= numFrames;
+    }
+  }
+  return numFrames;
+}
+
+const char *timingStageName(int stage)
+{
+  return stage >= 0 && stage < TIMING_NUM_STAGES ? stageNames[stage] : "unknown";
+}
+
+static bool countsOpen(const struct StageTimer *timer, int counter)
+{
+  return timer->perfCounters && perfCounterOpen(timer->perfCounters, counter);
+}
+
+// JSON lines don't need one. The perf counters that are open come after the times, as "cpu_cycles" and so on.
+void writeFrameTimingsHeader(const struct StageTimer *timer, FILE *file, int format)
+{
+  if (format != TIMING_FORMAT_CSV) {
+    return;
+  }
+
+  fprintf(file, "frame,total_ns");
+  for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+    fprintf(file, ",%s_ns", stageNames[i]);
+  }
+  for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+    for (int j = 0; j < PERF_NUM_COUNTERS; j++) {
+      if (countsOpen(timer, j)) {
+        fprintf(file, ",%s_%s", stageNames[i], perfCounterName(j));
+      }
+    }
+  }
+  fprintf(file, "\n");
+}
+
+// One line for the frame that just ended.
+void writeFrameTimings(const struct StageTimer *timer, FILE *file, int format)
+{
+  if (timer->numFrames == 0) {
+    return;
+  }
+  int frameNumber = timer->numFrames - 1;
+  const struct FrameTimings *frame = &timer->history[frameNumber % TIMING_HISTORY_FRAMES];
+
+  if (format == TIMING_FORMAT_JSON) {
+    fprintf(file, "{\"frame\":%d,\"total_ns\":%llu", frameNumber, (unsigned long long) frame->total);
+    for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+      fprintf(file, ",\"%s_ns\":%llu", stageNames[i], (unsigned long long) frame->nanoseconds[i]);
+    }
+    for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+      for (int j = 0; j < PERF_NUM_COUNTERS; j++) {
+        if (countsOpen(timer, j)) {
+          fprintf(file, ",\"%s_%s\":%llu", stageNames[i], perfCounterName(j), (unsigned long long) frame->counts[i][j]);
+        }
+      }
+    }
+    fprintf(file, "}\n");
+  } else {
+    fprintf(file, "%d,%llu", frameNumber, (unsigned long long) frame->total);
+    for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+      fprintf(file, ",%llu", (unsigned long long) frame->nanoseconds[i]);
+    }
+    for (int i = 0; i < TIMING_NUM_STAGES; i++) {
+      for (int j = 0; j < PERF_NUM_COUNTERS; j++) {
+        if (countsOpen(timer, j)) {
+          fprintf(file, ",%llu", (unsigned long long) frame->counts[i][j]);
+        }
+      }
+    }
+    fprintf(file, "\n");
+  }
+}
+
+// "2.104 ms: cpu 61.2%, ppu 30.1%, ..." for one frame or an average of some
+void formatFrameTimings(char *str, size_t size, const struct FrameTimings *timings)
+{
+  int length = snprintf(str, size, "%.3f ms:", timings->total / 1000000.0);
+  for (int i = 0; i < TIMING_NUM_STAGES && length >= 0 && (size_t) length < size; i++) {
+    double percent = timings->total > 0 ? 100.0 * timings->nanoseconds[i] / timings->total : 0.0;
+    length += snprintf(str + length, size - length, "%s %s %.1f%%", i > 0 ? "," : "", stageNames[i], percent);
+  }
+}
+
+// "cpu: 2400000 cycles, 4100000 instructions (1.71 per cycle), 9000 l1d_misses (2.2 per 1000 instructions), ..." for
+// whichever perf counters are open
+void formatStageCounts(char *str, size_t size, const struct StageTimer *timer, const struct FrameTimings *timings, int stage)
+{
+  const uint64_t *counts = timings->counts[stage];
+  int length = snprintf(str, size, "%s:", timingStageName(stage));
+  bool first = true;
+  for (int i = 0; i < PERF_NUM_COUNTERS && length >= 0 && (size_t) length < size; i++) {
+    if (!countsOpen(timer, i)) {
+      continue;
+    }
+    length += snprintf(str + length, size - length, "%s %llu %s", first ? "" : ",", (unsigned long long) counts[i], perfCounterName(i));
+    first = false;
+    if (length < 0 || (size_t) length >= size) {
+      break;
+    }
+
+    if (i == PERF_INSTRUCTIONS && countsOpen(timer, PERF_CYCLES) && counts[PERF_CYCLES] > 0) {
+      length += snprintf(str + length, size - length, " (%.2f per cycle)", (double) counts[i] / counts[PERF_CYCLES]);
+    } else if (i > PERF_INSTRUCTIONS && countsOpen(timer, PERF_INSTRUCTIONS) && counts[PERF_INSTRUCTIONS] > 0) {
+      length += snprintf(str + length, size - length, " (%.1f per 1000 instructions)", 1000.0 * counts[i] / counts[PERF_INSTRUCTIONS]);
+    }
+  }
+}
+
+void freeStageTimer(struct StageTimer *timer)
+{
+  if (timer->perfCounters) {
+    closePerfCounters(timer->perfCounters);
+  }
+  free(timer);
+}
@@ -0,0 +1,97 @@
+#ifndef FILE_TIMING_H_SEEN
+#define FILE_TIMING_H_SEEN
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "perfcounters.h"
+
+// where a frame's time can go
+#define TIMING_CPU 0
+#define TIMING_PPU 1
+#define TIMING_SPRITE_EVALUATION 2
+#define TIMING_MAPPER 3
+#define TIMING_APU 4
+#define TIMING_PRESENT 5
+#define TIMING_WAIT 6
+#define TIMING_OTHER 7
+#define TIMING_NUM_STAGES 8
+// emulation that hasn't been split into CPU and PPU yet; only ever inside the timer
+#define TIMING_UNSPLIT 8
+
+#define TIMING_MAX_NESTING 8
+#define TIMING_HISTORY_FRAMES 128
+// instructions are timed one in every 8 to 23, picked at random so as not to keep landing on the same part of a loop
+#define TIMING_MIN_SAMPLE_PERIOD 8
+#define TIMING_SAMPLE_PERIOD_MASK 15
+
+#define TIMING_FORMAT_CSV 0
+#define TIMING_FORMAT_JSON 1
+
+struct FrameTimings
+{
+  uint64_t nanoseconds[TIMING_NUM_STAGES];
+  uint64_t total;  // adds up to the stages, give or take rounding
+  uint64_t counts[TIMING_NUM_STAGES][PERF_NUM_COUNTERS];  // all 0 without perf counters
+};
+
+/*
+ * A breakdown of where each frame's time goes. Time is always being charged to exactly one stage: beginStage switches
+ * to another one until the matching endStage, and whatever isn't inside any stage goes to TIMING_OTHER. So stages are
+ * exclusive (sprite evaluation isn't counted in the PPU time it happens in) and a frame's stages add up to all of the
+ * time from the end of one frame (endTimedFrame) to the end of the next.
+ *
+ * The emulator times itself when state->stageTimer is set. The APU catching up, mapper register writes and sprite
+ * evaluation are timed whenever they happen. Instructions are too many and too short to time each one: reading the
+ * clock twice per instruction would slow emulation down by a third. So executeEmulatorCycle times one instruction in
+ * every dozen or so, split into CPU and PPU, and the time in between is split up the same way when the frame ends.
+ * Frontends time what they do themselves, presenting the frame and waiting for the next one, and end each frame.
+ *
+ * The clock is the processor's time stamp counter where there is one (rdtsc on x86) and getTimeInNanoseconds
+ * elsewhere. It's turned into nanoseconds by comparing it with getTimeInNanoseconds over everything timed so far.
+ * With no timer attached, all of this costs a never-taken branch or two per instruction.
+ *
+ * attachPerfCounters adds the processor's performance counters (see perfcounters.h): they're read wherever the clock
+ * is and charged to stages the same way, sampled instructions and all. Each read lands a little of the timer's own
+ * work in whichever stage it ends, which matters most for the CPU and PPU stages of sampled instructions.
+ */
+struct StageTimer
+{
+  int stage;            // what time is going to now
+  uint64_t stageStart;  // in ticks
+  int outerStages[TIMING_MAX_NESTING];
+  int nesting;
+  uint64_t ticks[TIMING_NUM_STAGES + 1];  // this frame so far, TIMING_UNSPLIT last
+  struct PerfCounters *perfCounters;     // null unless attached
+  uint64_t countsStart[PERF_NUM_COUNTERS];
+  uint64_t counts[TIMING_NUM_STAGES + 1][PERF_NUM_COUNTERS];
+  int instructionsUntilSample;
+  uint32_t random;
+
+  uint64_t frameStart;
+  uint64_t firstTicks;
+  uint64_t firstNanoseconds;
+
+  struct FrameTimings history[TIMING_HISTORY_FRAMES];  // the last few frames, oldest overwritten first
+  struct FrameTimings runTotal;                        // every frame since the timer was created
+  int numFrames;
+};
+
+int createStageTimer(struct StageTimer **timer);
+int attachPerfCounters(struct StageTimer *timer);
+void beginStage(struct StageTimer *timer, int stage);
+void switchStage(struct StageTimer *timer, int stage);
+void endStage(struct StageTimer *timer);
+bool beginTimedInstruction(struct StageTimer *timer);
+void endTimedInstruction(struct StageTimer *timer, bool frameEnded);
+void endTimedFrame(struct StageTimer *timer);
+int getRollingFrameTimings(const struct StageTimer *timer, struct FrameTimings *average);
+const char *timingStageName(int stage);
+void writeFrameTimingsHeader(const struct StageTimer *timer, FILE *file, int format);
+void writeFrameTimings(const struct StageTimer *timer, FILE *file, int format);
+void formatFrameTimings(char *str, size_t size, const struct FrameTimings *timings);
+void formatStageCounts(char *str, size_t size, const struct StageTimer *timer, const struct FrameTimings *timings, int stage);
+void freeStageTimer(struct StageTimer *timer);
+
+#endif /* !FILE_TIMING_H_SEEN */
@@ -0,0 +1,221 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "platform.h"
+#include "trace.h"
+
+// timestamps in the file are microseconds from when the tracer was created
+static double traceMicroseconds(const struct Tracer *tracer, uint64_t time)
+{
+  return (double) (int64_t) (time - tracer->startTime) / 1000.0;
+}
+
+static void writeSeparator(struct Tracer *tracer)
+{
+  fprintf(tracer->file, tracer->wroteEvent ? ",\n" : "\n");
+  tracer->wroteEvent = true;
+}
+
+static void writeEvent(struct Tracer *tracer, const struct TraceBuffer *buffer, const struct TraceEvent *event)
+{
+  writeSeparator(tracer);
+  fprintf(tracer->file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", event->name,
+      buffer->threadId, traceMicroseconds(tracer, event->start), event->duration / 1000.0);
+  if (event->argName) {
+    fprintf(tracer->file, ",\"args\":{\"%s\":%lld}", event->argName, (long long) event->arg);
+  }
+  fprintf(tracer->file, "}");
+}
+
+// Takes everything out of one buffer. Only the writer thread calls this.
+static void drainBuffer(struct Tracer *tracer, struct TraceBuffer *buffer)
+{
+  uint32_t read = (uint32_t) buffer->read;
+  uint32_t written = (uint32_t) atomicLoad32(&buffer->written);
+  for (; read != written; read++) {
+    writeEvent(tracer, buffer, &buffer->events[read & (TRACE_BUFFER_EVENTS - 1)]);
+  }
+  atomicStore32(&buffer->read, (int32_t) read);
+
+  int32_t dropped = atomicLoad32(&buffer->dropped);
+  if (dropped != buffer->droppedReported) {
+    writeSeparator(tracer);
+    fprintf(tracer->file, "{\"name\":\"dropped spans\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"spans\":%d}}",
+        buffer->threadId, traceMicroseconds(tracer, getTimeInNanoseconds()), (int) (dropped - buffer->droppedReported));
+    buffer->droppedReported = dropped;
+  }
+}
+
+static void writerThreadMain(void *argument)
+{
+  struct Tracer *tracer = (struct Tracer *) argument;
+  struct TraceBuffer *buffers[TRACE_MAX_THREADS];
+
+  lockMutex(&tracer->mutex);
+  for (;;) {
+    if (!tracer->stopping) {
+      waitConditionVariableTimeout(&tracer->wakeUp, &tracer->mutex, TRACE_FLUSH_INTERVAL_MILLISECONDS);
+    }
+
+    int numBuffers = tracer->numBuffers;
+    for (int i = 0; i < numBuffers; i++) {
+      buffers[i] = tracer->buffers[i];
+    }
+    bool stopping = tracer->stopping;
+
+    // don't hold the lock while we're waiting on the disk; buffers are never taken away, only added
+    unlockMutex(&tracer->mutex);
+    for (; tracer->numBuffersNamed < numBuffers; tracer->numBuffersNamed++) {
+      const struct TraceBuffer *buffer = buffers[tracer->numBuffersNamed];
+      writeSeparator(tracer);
+      fprintf(tracer->file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+          buffer->threadId, buffer->threadName);
+    }
+    for (int i = 0; i < numBuffers; i++) {
+      drainBuffer(tracer, buffers[i]);
+    }
+    if (fflush(tracer->file) != 0) {
+      tracer->failed = true;
+    }
+    lockMutex(&tracer->mutex);
+
+    if (stopping) {
+      break;
+    }
+  }
+  unlockMutex(&tracer->mutex);
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: Could not create the file.
+ *  3: Could not start the writer thread.
+ *
+ */
+int createTracer(struct Tracer **tracer, const char *filename)
+{
+  struct Tracer *newTracer = (struct Tracer *) calloc(1, sizeof(struct Tracer));
+  if (!newTracer) {
+    return 1;
+  }
+
+  newTracer->file = fopen(filename, "w");
+  if (!newTracer->file) {
+    free(newTracer);
+    return 2;
+  }
+  fprintf(newTracer->file, "[");
+
+  newTracer->startTime = getTimeInNanoseconds();
+  newTracer->enabled = 1;
+  initMutex(&newTracer->mutex);
+  initConditionVariable(&newTracer->wakeUp);
+
+  if (createThread(&newTracer->writerThread, writerThreadMain, newTracer)) {
+    destroyConditionVariable(&newTracer->wakeUp);
+    destroyMutex(&newTracer->mutex);
+    fclose(newTracer->file);
+    free(newTracer);
+    return 3;
+  }
+
+  *tracer = newTracer;
+  return 0;
+}
+
+/**
+ *
+ * For one thread, which is then the only one that can add spans to it. threadName is what the viewers show and
+ * isn't copied. The tracer frees the buffer.
+ *
+ * Returns error code:
+ *  1: Could not allocate memory.
+ *  2: There are already TRACE_MAX_THREADS buffers.
+ *
+ */
+int createTraceBuffer(struct TraceBuffer **buffer, struct Tracer *tracer, const char *threadName)
+{
+  struct TraceBuffer *newBuffer = (struct TraceBuffer *) calloc(1, sizeof(struct TraceBuffer));
+  if (!newBuffer) {
+    return 1;
+  }
+  newBuffer->tracer = tracer;
+  newBuffer->threadName = threadName;
+
+  lockMutex(&tracer->mutex);
+  if (tracer->numBuffers == TRACE_MAX_THREADS) {
+    unlockMutex(&tracer->mutex);
+    free(newBuffer);
+    return 2;
+  }
+  newBuffer->threadId = tracer->numBuffers + 1;
+  tracer->buffers[tracer->numBuffers++] = newBuffer;
+  unlockMutex(&tracer->mutex);
+
+  *buffer = newBuffer;
+  return 0;
+}
+
+// Only the buffer's own thread calls these. The span ends now.
+void addTraceSpanWithArg(struct TraceBuffer *buffer, const char *name, uint64_t start, const char *argName, int64_t arg)
+{
+  if (!atomicLoad32(&buffer->tracer->enabled)) {
+    return;
+  }
+
+  uint32_t written = (uint32_t) buffer->written;
+  uint32_t read = (uint32_t) atomicLoad32(&buffer->read);
+  if (written - read >= TRACE_BUFFER_EVENTS) {
+    atomicStore32(&buffer->dropped, buffer->dropped + 1);
+    return;
+  }
+
+  struct TraceEvent *event = &buffer->events[written & (TRACE_BUFFER_EVENTS - 1)];
+  event->name = name;
+  event->argName = argName;
+  event->arg = arg;
+  event->start = start;
+  event->duration = getTimeInNanoseconds() - start;
+  atomicStore32(&buffer->written, (int32_t) (written + 1));
+}
+
+void addTraceSpan(struct TraceBuffer *buffer, const char *name, uint64_t start)
+{
+  addTraceSpanWithArg(buffer, name, start, NULL, 0);
+}
+
+void setTracing(struct Tracer *tracer, bool enabled)
+{
+  atomicStore32(&tracer->enabled, enabled ? 1 : 0);
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not write the file.
+ *
+ */
+int destroyTracer(struct Tracer *tracer)
+{
+  lockMutex(&tracer->mutex);
+  tracer->stopping = true;
+  signalConditionVariable(&tracer->wakeUp);
+  unlockMutex(&tracer->mutex);
+  joinThread(&tracer->writerThread);
+
+  fprintf(tracer->file, "\n]\n");
+  bool failed = tracer->failed || ferror(tracer->file);
+  if (fclose(tracer->file) != 0) {
+    failed = true;
+  }
+
+  for (int i = 0; i < tracer->numBuffers; i++) {
+    free(tracer->buffers[i]);
+  }
+  destroyConditionVariable(&tracer->wakeUp);
+  destroyMutex(&tracer->mutex);
+  free(tracer);
+  return failed ? 1 : 0;
+}
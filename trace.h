@@ -0,0 +1,87 @@
+#ifndef FILE_TRACE_H_SEEN
+#define FILE_TRACE_H_SEEN
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "platform.h"
+
+#define TRACE_BUFFER_EVENTS 4096  // a power of two
+#define TRACE_MAX_THREADS 64
+#define TRACE_FLUSH_INTERVAL_MILLISECONDS 100
+#define TRACE_SCANLINES_PER_SPAN 16
+
+struct Tracer;
+
+struct TraceEvent
+{
+  const char *name;     // not copied, so it has to outlive the tracer: a string literal
+  const char *argName;  // null for none
+  int64_t arg;
+  uint64_t start;  // getTimeInNanoseconds
+  uint64_t duration;
+};
+
+/*
+ * One thread's spans on their way to the file. It's a ring with the same one writer, one reader arrangement as
+ * audioring.h: the thread that created the buffer is the only one that adds to it and the tracer's writer thread is
+ * the only one that takes out. Adding a span never waits: if the ring is full the span is dropped and counted, and the
+ * count shows up in the file.
+ */
+struct TraceBuffer
+{
+  struct TraceEvent events[TRACE_BUFFER_EVENTS];
+  struct Tracer *tracer;
+  const char *threadName;  // not copied either
+  int threadId;
+
+  uint8_t writerLine[64];
+  volatile int32_t written;
+  volatile int32_t dropped;
+  uint8_t readerLine[64];
+  volatile int32_t read;
+  int32_t droppedReported;  // only the writer thread touches this
+  uint8_t endLine[64];
+};
+
+/*
+ * A timeline of what every thread is doing, in the Chrome trace event format: the JSON array of "X" (complete)
+ * events that chrome://tracing, Perfetto and speedscope all load. Each thread that wants to add spans gets a buffer of
+ * its own with createTraceBuffer and from then on adds to it without any locking. A background thread wakes up every
+ * TRACE_FLUSH_INTERVAL_MILLISECONDS, streams whatever is in the buffers out to the file, and names each thread the
+ * first time it sees it.
+ *
+ * A span is added once it's over, with the time it started: take getTimeInNanoseconds at the start and pass it to
+ * addTraceSpan at the end. Spans on one thread should nest properly for the viewers to draw them as a stack.
+ *
+ * setTracing turns adding spans off and back on without closing the file. Threads have to be done adding spans before
+ * destroyTracer, which writes out the last of them, closes the array and frees the buffers along with everything else.
+ * The format doesn't insist on the array being closed, so the file from a server that never exits still loads.
+ */
+struct Tracer
+{
+  FILE *file;
+  uint64_t startTime;
+  volatile int32_t enabled;
+
+  struct Mutex mutex;  // protects everything below
+  struct ConditionVariable wakeUp;
+  struct TraceBuffer *buffers[TRACE_MAX_THREADS];
+  int numBuffers;
+  bool stopping;
+
+  // only the writer thread touches these once it's running
+  struct Thread writerThread;
+  int numBuffersNamed;
+  bool wroteEvent;
+  bool failed;
+};
+
+int createTracer(struct Tracer **tracer, const char *filename);
+int createTraceBuffer(struct TraceBuffer **buffer, struct Tracer *tracer, const char *threadName);
+void addTraceSpan(struct TraceBuffer *buffer, const char *name, uint64_t start);
+void addTraceSpanWithArg(struct TraceBuffer *buffer, const char *name, uint64_t start, const char *argName, int64_t arg);
+void setTracing(struct Tracer *tracer, bool enabled);
+int destroyTracer(struct Tracer *tracer);
+
+#endif /* !FILE_TRACE_H_SEEN */
@@ -1 +1 @@
-cl /Zi /MT /W3 win_play.c cartridge.c cpu.c emu.c ppu.c debug.c /link user32.lib gdi32.lib winmm.lib kernel32.lib
+cl /Zi /MT /W3 win_play.c cartridge.c cpu.c emu.c apu.c audio.c audioring.c pacer.c ppu.c debug.c battery.c platform.c savestate.c compress.c rewind.c fork.c hash.c movie.c ramwatch.c timing.c perfcounters.c trace.c /link user32.lib gdi32.lib winmm.lib kernel32.lib
@@ -0,0 +1 @@
+cl /O2 /W3 audio_benchmark.c audio.c platform.c
@@ -0,0 +1 @@
+cl /O2 /W3 diff_cpu_trace.c cputracetext.c platform.c
@@ -0,0 +1 @@
+cl /O2 /W3 dump_cpu_trace.c cputracetext.c
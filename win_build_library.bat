@@ -0,0 +1,2 @@
+cl /c /O2 /MT /W3 castleface.c batch.c observation.c cartridge.c cpu.c emu.c apu.c audio.c ppu.c debug.c battery.c platform.c savestate.c compress.c hash.c movie.c ramwatch.c timing.c perfcounters.c trace.c
+lib /OUT:castleface.lib castleface.obj batch.obj observation.obj cartridge.obj cpu.obj emu.obj apu.obj audio.obj ppu.obj debug.obj battery.obj platform.obj savestate.obj compress.obj hash.obj movie.obj ramwatch.obj timing.obj perfcounters.obj trace.obj
@@ -0,0 +1 @@
+cl /O2 /W3 scan_roms.c romscan.c cartridge.c hash.c platform.c debug.c
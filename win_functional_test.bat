@@ -1,2 +1,4 @@
 cl functional_test.c cpu.c
 functional_test.exe
+cl /W3 state_test.c cartridge.c cpu.c emu.c apu.c audio.c ppu.c debug.c battery.c platform.c savestate.c compress.c rewind.c movie.c ramwatch.c timing.c perfcounters.c trace.c
+state_test.exe
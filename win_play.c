@@ -6,9 +6,22 @@
 #include "cpu.h"
 #include "ppu.h"
 #include "emu.h"
+#include "apu.h"
+#include "audio.h"
+#include "audioring.h"
+#include "platform.h"
+#include "pacer.h"
+#include "timing.h"
+#include "trace.h"
 #include "debug.h"
 #include "controller.h"
 #include "cartridge.h"
+#include "battery.h"
+#include "savestate.h"
+#include "rewind.h"
+#include "movie.h"
+#include "hash.h"
+#include "fork.h"
 #include <dsound.h>
 
 // helpful: https://docs.microsoft.com/en-us/windows/win32/learnwin32/your-first-windows-program
@@ -41,6 +54,23 @@ typedef HRESULT directSoundCreate(LPCGUID lpcGuidDevice, LPDIRECTSOUND8 *ppDS8,
 
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 
+#define REWIND_MEMORY_BUDGET (64 * 1024 * 1024)
+#define RUN_AHEAD_FRAMES 1
+
+#define SOUND_SAMPLE_RATE 48000
+#define SOUND_BUFFER_SAMPLES SOUND_SAMPLE_RATE
+#define SOUND_DEVICE_LATENCY_SAMPLES (SOUND_SAMPLE_RATE / 30)
+#define SOUND_FRAME_SAMPLES 4096
+#define SOUND_RING_SAMPLES 8192
+#define SOUND_RING_TARGET_SAMPLES (SOUND_SAMPLE_RATE / 20)
+#define SOUND_MAX_RATE_ADJUSTMENT_PPM 5000
+#define SOUND_THREAD_PERIOD_MILLISECONDS 5
+
+// hold tab to run this many times as fast; u switches between real time and as fast as it'll go
+#define TURBO_MULTIPLIER 4
+// how often the frame pacing stats (and the timing breakdown, when p has turned it on) go to the debug output
+#define PACER_REPORT_FRAMES 600
+
 static int running = 1;
 
 static void *videoBuffer;
@@ -112,7 +142,30 @@ static void setKeyboardInput(bool *buttonValue, bool wasDown, bool isDown)
   }
 }
 
-void initDirectSound(HWND windowHandle)
+/*
+ * The emulator puts each frame's sound into a ring (see audioring.h). A thread of its own takes it out again every
+ * few milliseconds and copies it into a looping DirectSound buffer, keeping that SOUND_DEVICE_LATENCY_SAMPLES ahead of
+ * what's playing. If the ring runs dry it writes silence rather than let DirectSound loop round into old sound.
+ *
+ * The sound card's clock is the one the emulator keeps time by: see paceOnSound.
+ */
+struct SoundOutput
+{
+  LPDIRECTSOUNDBUFFER buffer;
+  struct AudioRing *ring;
+  struct Thread thread;
+  volatile int32_t stopping;
+  volatile int32_t underruns;
+  struct Tracer *tracer;  // set before tracing is, and left alone after
+  volatile int32_t tracing;
+
+  // only the sound thread touches these
+  DWORD writePosition;  // in bytes
+  bool started;
+  struct TraceBuffer *trace;
+};
+
+static LPDIRECTSOUNDBUFFER initDirectSound(HWND windowHandle)
 {
   HMODULE directSoundLibrary = LoadLibraryA("dsound.dll");
 
@@ -122,11 +175,9 @@ void initDirectSound(HWND windowHandle)
 
     if (create && create(0, &directSound, 0) == DS_OK) {
       if (IDirectSound_SetCooperativeLevel(directSound, windowHandle, DSSCL_NORMAL) == DS_OK) {
-        print("success!\n");
-
         int nChannels = 1;
-        int nSamplesPerSec = 44100;
-        int wBitsPerSample = 8;
+        int nSamplesPerSec = SOUND_SAMPLE_RATE;
+        int wBitsPerSample = 16;
         int nBlockAlign = (nChannels * wBitsPerSample) / 8;
 
         WAVEFORMATEX waveFormat = {
@@ -141,7 +192,7 @@ void initDirectSound(HWND windowHandle)
         DSBUFFERDESC bufferDescription = {
           .dwSize = sizeof(bufferDescription),
           .dwFlags = DSBCAPS_GETCURRENTPOSITION2,
-          .dwBufferBytes = 3 * nSamplesPerSec * (wBitsPerSample / 8),
+          .dwBufferBytes = SOUND_BUFFER_SAMPLES * sizeof(int16_t),
           .lpwfxFormat = &waveFormat,
           .guid3DAlgorithm = DS3DALG_DEFAULT
         };
@@ -149,63 +200,21 @@ void initDirectSound(HWND windowHandle)
         LPDIRECTSOUNDBUFFER soundBuffer;
         
         if (IDirectSound_CreateSoundBuffer(directSound, &bufferDescription, &soundBuffer, 0) == DS_OK) {
-          print("successfully created a sound buffer\n");
-
-          DWORD audioOffset = 0;
-          DWORD bytesToWrite = 44100 * 2;  // 2 seconds worth of samples (each sample is 1 byte)
+          // start from silence
           LPVOID audioPointer1;
           DWORD numAudioBytes1;
           LPVOID audioPointer2;
           DWORD numAudioBytes2;
-
-          if (IDirectSoundBuffer_Lock(soundBuffer, 
-              audioOffset,
-              bytesToWrite,
-              &audioPointer1,
-              &numAudioBytes1,
-              &audioPointer2,
-              &numAudioBytes2,
-              0) == DS_OK) {
-            print("locked. %d %d\n", numAudioBytes1, numAudioBytes2);
-
-            bool highWave = false;
-
-            // middle C frequency is about 262 Hz
-            // so we want 262 cycles every second
-            // for us, we have 44100 samples in a second
-            // so that's 168.32 samples per cycle
-            // which would be 84.16 for a high square, 84.16 for a low square
-
-            int8_t *ptr = (int8_t *) audioPointer1;
-            for (DWORD i = 0; i < numAudioBytes1; i++) {
-              if (highWave) {
-                *ptr = 105;
-              } else {
-                *ptr = -105;
-              }
-              if (i % 84 == 0) {
-                highWave = !highWave;
-              }
-              ptr++;
-            }
-
-            if (IDirectSoundBuffer_Unlock(soundBuffer,
-                audioPointer1,
-                numAudioBytes1,
-                audioPointer2,
-                0) == DS_OK) {
-              print("unlocked\n");
-            } else {
-              print("could not unlock\n");
-            }
-          } else {
-            print("could not lock\n");
+          if (IDirectSoundBuffer_Lock(soundBuffer, 0, 0, &audioPointer1, &numAudioBytes1, &audioPointer2, &numAudioBytes2,
+              DSBLOCK_ENTIREBUFFER) == DS_OK) {
+            memset(audioPointer1, 0, numAudioBytes1);
+            IDirectSoundBuffer_Unlock(soundBuffer, audioPointer1, numAudioBytes1, audioPointer2, numAudioBytes2);
           }
 
-          if (IDirectSoundBuffer_Play(soundBuffer, 0, 0, DSBPLAY_LOOPING) != DS_OK) {
-            print("Could not play sound.\n");
+          if (IDirectSoundBuffer_Play(soundBuffer, 0, 0, DSBPLAY_LOOPING) == DS_OK) {
+            return soundBuffer;
           }
-
+          print("Could not play sound.\n");
         } else {
           print("Could not create a sound buffer\n");
         }
@@ -218,6 +227,157 @@ void initDirectSound(HWND windowHandle)
   } else {
     print("Could not find DirectSound DLL.\n");
   }
+
+  return NULL;
+}
+
+static void feedSound(struct SoundOutput *sound, int16_t *samples)
+{
+  DWORD playCursor;
+  DWORD writeCursor;
+  if (IDirectSoundBuffer_GetCurrentPosition(sound->buffer, &playCursor, &writeCursor) != DS_OK) {
+    return;
+  }
+
+  const DWORD bufferBytes = SOUND_BUFFER_SAMPLES * sizeof(int16_t);
+  const DWORD latencyBytes = SOUND_DEVICE_LATENCY_SAMPLES * sizeof(int16_t);
+  DWORD ahead = (sound->writePosition + bufferBytes - playCursor) % bufferBytes;
+  DWORD safeAhead = (writeCursor + bufferBytes - playCursor) % bufferBytes;
+
+  // the first time, or if this thread was held up for so long that DirectSound played past everything it was given
+  if (!sound->started || ahead < safeAhead || ahead > bufferBytes / 2) {
+    sound->writePosition = writeCursor;
+    ahead = safeAhead;
+    sound->started = true;
+  }
+  if (ahead >= latencyBytes) {
+    return;
+  }
+
+  int numSamples = (int) ((latencyBytes - ahead) / sizeof(int16_t));
+  int numRead = readAudioRing(sound->ring, samples, numSamples);
+  if (numRead < numSamples) {
+    memset(samples + numRead, 0, (numSamples - numRead) * sizeof(int16_t));
+    atomicFetchAdd32(&sound->underruns, 1);
+  }
+
+  DWORD numBytes = numSamples * sizeof(int16_t);
+  LPVOID audioPointer1;
+  DWORD numAudioBytes1;
+  LPVOID audioPointer2;
+  DWORD numAudioBytes2;
+  if (IDirectSoundBuffer_Lock(sound->buffer, sound->writePosition, numBytes, &audioPointer1, &numAudioBytes1,
+      &audioPointer2, &numAudioBytes2, 0) != DS_OK) {
+    return;
+  }
+  memcpy(audioPointer1, samples, numAudioBytes1);
+  if (audioPointer2) {
+    memcpy(audioPointer2, (const uint8_t *) samples + numAudioBytes1, numAudioBytes2);
+  }
+  IDirectSoundBuffer_Unlock(sound->buffer, audioPointer1, numAudioBytes1, audioPointer2, numAudioBytes2);
+
+  sound->writePosition = (sound->writePosition + numBytes) % bufferBytes;
+}
+
+static void soundThread(void *argument)
+{
+  struct SoundOutput *sound = (struct SoundOutput *) argument;
+  int16_t samples[SOUND_DEVICE_LATENCY_SAMPLES];
+
+  while (!atomicLoad32(&sound->stopping)) {
+    if (!sound->trace && atomicLoad32(&sound->tracing) && createTraceBuffer(&sound->trace, sound->tracer, "sound")) {
+      sound->trace = NULL;
+    }
+
+    uint64_t traceStart = sound->trace ? getTimeInNanoseconds() : 0;
+    feedSound(sound, samples);
+    if (sound->trace) {
+      addTraceSpan(sound->trace, "feed sound", traceStart);
+    }
+    Sleep(SOUND_THREAD_PERIOD_MILLISECONDS);
+  }
+}
+
+/**
+ *
+ * Returns error code:
+ *  1: Could not create the ring (see createAudioRing).
+ *  2: Could not start the sound thread.
+ *
+ */
+static int startSound(struct SoundOutput *sound)
+{
+  if (createAudioRing(&sound->ring, SOUND_RING_SAMPLES)) {
+    return 1;
+  }
+  if (createThread(&sound->thread, soundThread, sound)) {
+    freeAudioRing(sound->ring);
+    sound->ring = NULL;
+    return 2;
+  }
+  return 0;
+}
+
+static void stopSound(struct SoundOutput *sound)
+{
+  atomicStore32(&sound->stopping, 1);
+  joinThread(&sound->thread);
+  freeAudioRing(sound->ring);
+  sound->ring = NULL;
+}
+
+/*
+ * Runs the emulator at whatever speed the sound card plays at, which is never quite NTSC's 60.0988 frames a second
+ * times the sample rate it was asked for. Each frame, once its sound is in the ring, the emulator sleeps off whatever
+ * is queued beyond SOUND_RING_TARGET_SAMPLES, so it's the sound thread draining the ring that lets the next frame go.
+ *
+ * Sleep only goes to the millisecond and the sound thread drains in lumps, so on its own that would leave the ring
+ * wandering about the target and now and then running dry. To stop that, the resampling rate is nudged in proportion
+ * to how far off the target the ring is, by at most SOUND_MAX_RATE_ADJUSTMENT_PPM (half a percent, far too little to
+ * hear): a ring running low gets slightly more samples per frame until it's back where it should be.
+ */
+static void paceOnSound(struct SoundOutput *sound, struct AudioBuffer *audioBuffer, bool debuggingOn)
+{
+  int fill = audioRingFill(sound->ring);
+  if (fill > SOUND_RING_TARGET_SAMPLES) {
+    DWORD sleepTime = (DWORD) ((fill - SOUND_RING_TARGET_SAMPLES) * 1000 / SOUND_SAMPLE_RATE);
+    if (debuggingOn) {
+      print("sleep for %d milliseconds\n", sleepTime);
+    }
+    Sleep(sleepTime);
+    fill = audioRingFill(sound->ring);
+  }
+
+  int adjustment = (SOUND_RING_TARGET_SAMPLES - fill) * SOUND_MAX_RATE_ADJUSTMENT_PPM / SOUND_RING_TARGET_SAMPLES;
+  if (adjustment > SOUND_MAX_RATE_ADJUSTMENT_PPM) {
+    adjustment = SOUND_MAX_RATE_ADJUSTMENT_PPM;
+  } else if (adjustment < -SOUND_MAX_RATE_ADJUSTMENT_PPM) {
+    adjustment = -SOUND_MAX_RATE_ADJUSTMENT_PPM;
+  }
+  setAudioRateAdjustment(audioBuffer, adjustment);
+
+  if (debuggingOn) {
+    print("sound ring: %d samples, rate adjusted by %d ppm, %d underruns\n", fill, adjustment,
+        atomicLoad32(&sound->underruns));
+  }
+}
+
+static void reportFramePacing(const struct FramePacer *pacer)
+{
+  struct FramePacerStats stats;
+  getFramePacerStats(pacer, &stats);
+  print("%d frames: %.3f fps, frame interval p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", stats.numFrames,
+      stats.framesPerSecond, stats.medianInterval / 1000000.0, stats.p99Interval / 1000000.0,
+      stats.maxInterval / 1000000.0);
+}
+
+static void reportFrameTimings(const struct StageTimer *timer)
+{
+  struct FrameTimings average;
+  int numFrames = getRollingFrameTimings(timer, &average);
+  char breakdown[256];
+  formatFrameTimings(breakdown, sizeof(breakdown), &average);
+  print("last %d frames averaged %s\n", numFrames, breakdown);
 }
 
 int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nShowCmd)
@@ -299,57 +459,98 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
     return 0;
   }
 
-  initDirectSound(windowHandle);
+  struct SoundOutput sound = { .buffer = initDirectSound(windowHandle) };
 
   ShowWindow(windowHandle, nShowCmd);
 
   uint32_t loopCount = 0;
 
   struct KeyboardInput keyboardInput = { .up = false  };
+
+  // What the keys are doing right now. It's copied into keyboardInput at the start of each frame so the input never
+  // changes partway through one, which is what lets movies play back exactly.
+  struct KeyboardInput liveKeyboardInput = { .up = false };
   struct PPUClosure ppuClosure;
   buildPPUClosure(&ppuClosure, ppu);
 
-  uint8_t *memory = (uint8_t *) malloc(0x8000 + cartridge->sizeOfPrgRomInBytes);
-  if (!memory) {
+  struct Computer state = { .keyboardInput = &keyboardInput, .ppuClosure = &ppuClosure };
+  int powerOnError = powerOnComputer(&state, cartridge);
+  if (powerOnError == 1) {
     print("Could not initialize main memory block.");
     return 1;
+  } else if (powerOnError) {
+    exit(EXIT_FAILURE);
+  }
+  uint8_t *memory = state.memory;
+
+  if (cartridge->hasBattery) {
+    char saveFilename[MAX_PATH];
+    saveFilenameForRom(saveFilename, sizeof(saveFilename), gameFile);
+    int batteryRamError = createBatteryRam(&state.batteryRam, saveFilename, &memory[PRG_RAM_START]);
+    if (batteryRamError) {
+      print("Error setting up battery-backed PRG RAM: %d\n", batteryRamError);
+    }
   }
 
-  // copy prgRom starting at 0x8000, even if it's bigger than 32 kB. We will intercept reads
-  // from this memory and do the right thing based on MMC.
-  memcpy(&memory[0x8000], cartridge->prgRom, cartridge->sizeOfPrgRomInBytes);
-
-  struct Computer state = { .memory = memory, .keyboardInput = &keyboardInput, .ppuClosure = &ppuClosure };
-
-  if (cartridge->mapperNumber == 0) {
-    state.prgRomBlock1 = &memory[0x8000];
-    state.prgRomBlock2 = &memory[0xA000];
-    if (cartridge->sizeOfPrgRomInBytes == 0x8000) {
-      // NROM-256
-      state.prgRomBlock3 = &memory[0xC000];
-      state.prgRomBlock4 = &memory[0xE000];
+  struct AudioBuffer *audioBuffer = NULL;
+  int16_t *soundSamples = (int16_t *) malloc(SOUND_FRAME_SAMPLES * sizeof(int16_t));
+  if (sound.buffer && soundSamples) {
+    int audioBufferError = createAudioBuffer(&audioBuffer, SOUND_SAMPLE_RATE, APU_CLOCK_RATE, SOUND_FRAME_SAMPLES,
+        AUDIO_QUALITY_GOOD);
+    if (audioBufferError) {
+      print("Error setting up sound: %d\n", audioBufferError);
     } else {
-      // for NROM-128 the second 16 kB is a mirror of the first 16 kB
-      state.prgRomBlock3 = &memory[0x8000];
-      state.prgRomBlock4 = &memory[0xA000];
+      int soundError = startSound(&sound);
+      if (soundError) {
+        print("Error starting sound: %d\n", soundError);
+        freeAudioBuffer(audioBuffer);
+        audioBuffer = NULL;
+      } else {
+        setApuOutput(&state.apu, audioBuffer);
+      }
     }
-  } else if (cartridge->mapperNumber == 1) {
-    // For mapper 1 it seems to be important to start off with the last 16 kB bank in 0xC000 - 0xFFFF
-    state.prgRomBlock1 = &memory[0x8000];
-    state.prgRomBlock2 = &memory[0xA000];
-    int addressOfLastBank = 0x8000 + ((cartridge->numPrgRomUnits - 1) * 0x4000); 
-    state.prgRomBlock3 = &memory[addressOfLastBank];
-    state.prgRomBlock4 = &memory[addressOfLastBank + 0x2000];
-  } else {
-    exit(EXIT_FAILURE);
   }
 
-  int memoryAddressToStartAt = (readMemory(0xFFFD, &state) << 8) | readMemory(0xFFFC, &state);
-  print("memory address to start is: %04x\n", memoryAddressToStartAt);
-  state.pc = memoryAddressToStartAt;
+  print("memory address to start is: %04x\n", state.pc);
 
   int instructionsExecuted = 0;
 
+  // quick save slot
+  uint8_t *savedState = (uint8_t *) malloc(saveStateSize());
+  bool hasSavedState = false;
+
+  // hold r to run backwards through the last minute or so
+  struct RewindBuffer *rewindBuffer = NULL;
+  int rewindError = createRewindBuffer(&rewindBuffer, REWIND_MEMORY_BUDGET, REWIND_DEFAULT_KEYFRAME_INTERVAL);
+  if (rewindError) {
+    print("Error setting up rewind: %d\n", rewindError);
+  }
+  bool rewinding = false;
+
+  // 8 starts and stops recording a movie, 9 plays it back as fast as possible
+  char movieFilename[MAX_PATH];
+  filenameForRom(movieFilename, sizeof(movieFilename), gameFile, ".cfm");
+  uint32_t romCrc32 = crc32Update(0, cartridge->prgRom, cartridge->sizeOfPrgRomInBytes);
+  struct Movie *movie = NULL;
+  bool recordingMovie = false;
+  int movieFrame = 0;
+
+  // 0 toggles run-ahead, which shows the frame after this one instead of this one to hide a frame of input lag
+  struct EmulatorFork *runAheadFork = NULL;
+
+  // t starts writing a timeline of every thread to <rom>.trace.json (see trace.h), then pauses and resumes it
+  char traceFilename[MAX_PATH];
+  filenameForRom(traceFilename, sizeof(traceFilename), gameFile, ".trace.json");
+  struct Tracer *tracer = NULL;
+  struct TraceBuffer *trace = NULL;
+  bool tracing = false;
+
+  struct FramePacer pacer;
+  initFramePacer(&pacer);
+  bool turbo = false;
+  bool unthrottled = false;
+  int framesSinceReport = 0;
+
   LARGE_INTEGER lastPerfCount;
   QueryPerformanceCounter(&lastPerfCount);
 
@@ -367,28 +568,28 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
 
         switch(msg.wParam) {
           case 0x57: // w
-            setKeyboardInput(&keyboardInput.up, wasDown, isDown);
+            setKeyboardInput(&liveKeyboardInput.up, wasDown, isDown);
             break;
           case 0x53: // s
-            setKeyboardInput(&keyboardInput.down, wasDown, isDown);
+            setKeyboardInput(&liveKeyboardInput.down, wasDown, isDown);
             break;
           case 0x44: // d
-            setKeyboardInput(&keyboardInput.right, wasDown, isDown);
+            setKeyboardInput(&liveKeyboardInput.right, wasDown, isDown);
             break;
           case 0x41: // a
-            setKeyboardInput(&keyboardInput.left, wasDown, isDown);
+            setKeyboardInput(&liveKeyboardInput.left, wasDown, isDown);
             break;
           case 0x31: // 1
-            setKeyboardInput(&keyboardInput.select, wasDown, isDown);
+            setKeyboardInput(&liveKeyboardInput.select, wasDown, isDown);
             break;
           case 0x32: // 2
-            setKeyboardInput(&keyboardInput.start, wasDown, isDown);
+            setKeyboardInput(&liveKeyboardInput.start, wasDown, isDown);
             break;
           case 0x4B: // k 
-            setKeyboardInput(&keyboardInput.b, wasDown, isDown);
+            setKeyboardInput(&liveKeyboardInput.b, wasDown, isDown);
             break;
           case 0x4C: // l 
-            setKeyboardInput(&keyboardInput.a, wasDown, isDown);
+            setKeyboardInput(&liveKeyboardInput.a, wasDown, isDown);
             break;
           case 0x33: // 3
             dumpOam(1, ppu->oam);
@@ -401,6 +602,108 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
             state.debuggingOn = false;
             ppu->debuggingOn = false;
             break;
+          case 0x36: // 6
+            if (isDown && !wasDown && savedState) {
+              hasSavedState = saveState(savedState, saveStateSize(), NULL, &state, ppu) == 0;
+            }
+            break;
+          case 0x37: // 7
+            if (isDown && !wasDown && hasSavedState) {
+              loadState(savedState, saveStateSize(), &state, ppu);
+            }
+            break;
+          case 0x38: // 8
+            if (isDown && !wasDown) {
+              if (recordingMovie) {
+                writeMovie(movie, movieFilename);
+                freeMovie(movie);
+                movie = NULL;
+                recordingMovie = false;
+              } else {
+                if (movie) {
+                  freeMovie(movie);
+                  movie = NULL;
+                }
+                recordingMovie = createMovie(&movie, romCrc32, MOVIE_DEFAULT_KEYFRAME_INTERVAL) == 0;
+              }
+            }
+            break;
+          case 0x39: // 9
+            if (isDown && !wasDown && !recordingMovie) {
+              if (movie) {
+                freeMovie(movie);
+                movie = NULL;
+              }
+              if (readMovie(&movie, movieFilename) == 0) {
+                if (movie->romCrc32 != romCrc32 || seekMovie(movie, 0, &state, ppu, videoBuffer, palette) != 0) {
+                  print("Could not play movie %s\n", movieFilename);
+                  freeMovie(movie);
+                  movie = NULL;
+                } else {
+                  // we're at the start of frame 0 now, so its input applies straight away
+                  movieInput(movie, 0, &keyboardInput);
+                  movieFrame = 1;
+                }
+              }
+            }
+            break;
+          case 0x30: // 0
+            if (isDown && !wasDown) {
+              if (runAheadFork) {
+                freeEmulatorFork(runAheadFork);
+                runAheadFork = NULL;
+              } else if (forkEmulator(&runAheadFork, &state, ppu) != 0) {
+                print("Could not turn on run-ahead\n");
+              }
+            }
+            break;
+          case 0x52: // r
+            rewinding = isDown;
+            break;
+          case 0x09: // tab
+            turbo = isDown;
+            break;
+          case 0x55: // u
+            if (isDown && !wasDown) {
+              unthrottled = !unthrottled;
+            }
+            break;
+          case 0x50: // p
+            if (isDown && !wasDown) {
+              if (state.stageTimer) {
+                reportFrameTimings(state.stageTimer);
+                freeStageTimer(state.stageTimer);
+                state.stageTimer = NULL;
+              } else if (createStageTimer(&state.stageTimer) != 0) {
+                print("Could not start timing frames\n");
+              }
+            }
+            break;
+          case 0x54: // t
+            if (isDown && !wasDown) {
+              if (!tracer) {
+                int traceError = createTracer(&tracer, traceFilename);
+                if (!traceError && createTraceBuffer(&trace, tracer, "emulation")) {
+                  traceError = 4;
+                }
+                if (traceError) {
+                  print("Could not start writing a trace to %s: %d\n", traceFilename, traceError);
+                  break;
+                }
+                if (state.batteryRam) {
+                  traceBatteryRam(state.batteryRam, tracer);
+                }
+                sound.tracer = tracer;
+                atomicStore32(&sound.tracing, 1);
+              }
+              tracing = !tracing;
+              setTracing(tracer, tracing);
+              if (tracing) {
+                traceEmulator(&state, trace);
+              }
+              print(tracing ? "Tracing to %s\n" : "Tracing to %s paused\n", traceFilename);
+            }
+            break;
         }
       }
 
@@ -408,30 +711,98 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
       DispatchMessageA(&msg);
     }
 
-    bool vblankStarted = executeEmulatorCycle(&state, ppu, videoBuffer, palette);
+    // with run-ahead on, what's on screen comes from the fork so the real frames don't need drawing
+    bool vblankStarted = executeEmulatorCycle(&state, ppu, runAheadFork ? NULL : videoBuffer, palette);
 
     instructionsExecuted++;
     loopCount++;
 
     if (vblankStarted) {
-      LARGE_INTEGER midPerfCount;
-      QueryPerformanceCounter(&midPerfCount);
-      int64_t midPerfDiff = midPerfCount.QuadPart - lastPerfCount.QuadPart;
-      double millisecondsElapsed = (1000.0f*(double)midPerfDiff) / (double)perfFrequency;
-
-      if (millisecondsElapsed < 16) {
-        DWORD sleepTime = (16 - (DWORD)millisecondsElapsed);
-        if (state.debuggingOn) {
-          print("sleep for %d milliseconds\n", sleepTime);
+      if (rewindBuffer) {
+        if (rewinding) {
+          rewindFrames(rewindBuffer, 1, &state, ppu);
+        } else {
+          pushRewindFrame(rewindBuffer, &state, ppu);
         }
-        Sleep(sleepTime);
+      }
+
+      if (movie && !recordingMovie) {
+        if (movieFrame < movie->numFrames) {
+          movieInput(movie, movieFrame++, &keyboardInput);
+        } else {
+          print("movie finished after %d frames\n", movieFrame);
+          freeMovie(movie);
+          movie = NULL;
+        }
+      }
+      if (!movie || recordingMovie) {
+        keyboardInput = liveKeyboardInput;
+      }
+      if (recordingMovie) {
+        recordMovieFrame(movie, &state, ppu, &keyboardInput);
+      }
+
+      if (runAheadFork) {
+        runAhead(runAheadFork, RUN_AHEAD_FRAMES, &state, ppu, videoBuffer, palette);
+      }
+
+      if (audioBuffer) {
+        uint64_t traceStart = trace ? getTimeInNanoseconds() : 0;
+        if (state.stageTimer) {
+          beginStage(state.stageTimer, TIMING_APU);
+        }
+        endApuFrame(&state.apu, &state);
+        int numSamples = readAudioSamples(audioBuffer, soundSamples, SOUND_FRAME_SAMPLES);
+        writeAudioRing(sound.ring, soundSamples, numSamples);
+        if (state.stageTimer) {
+          endStage(state.stageTimer);
+        }
+        if (trace) {
+          addTraceSpanWithArg(trace, "apu frame", traceStart, "samples", numSamples);
+        }
+      }
+
+      // A movie playing back runs as fast as it can. Only at real time can the sound keep up, so only then does it
+      // set the pace; faster than that, whatever doesn't fit in the ring is dropped.
+      bool playingMovie = movie && !recordingMovie;
+      int pacerMode = (unthrottled || playingMovie) ? PACER_UNTHROTTLED : (turbo ? PACER_TURBO : PACER_REAL_TIME);
+      if (pacerMode != pacer.mode) {
+        setFramePacerMode(&pacer, pacerMode, TURBO_MULTIPLIER);
+      }
+      uint64_t traceStart = trace ? getTimeInNanoseconds() : 0;
+      if (state.stageTimer) {
+        beginStage(state.stageTimer, TIMING_WAIT);
+      }
+      if (audioBuffer && pacerMode == PACER_REAL_TIME) {
+        paceOnSound(&sound, audioBuffer, state.debuggingOn);
+        recordFrame(&pacer);
+      } else {
+        waitForNextFrame(&pacer);
+      }
+      if (trace) {
+        addTraceSpan(trace, "wait", traceStart);
+      }
 
-        // TODO: Consider adding what Casey does in Handmade Hero: a loop to kill time if the sleep isn't
-        // granular enough. I think he also runs that loop if the sleep didn't sleep long enough, although
-        // that seems like an unlikely scenario to me.
+      if (++framesSinceReport == PACER_REPORT_FRAMES) {
+        reportFramePacing(&pacer);
+        if (state.stageTimer) {
+          reportFrameTimings(state.stageTimer);
+        }
+        framesSinceReport = 0;
       }
 
+      if (state.stageTimer) {
+        switchStage(state.stageTimer, TIMING_PRESENT);
+      }
+      traceStart = trace ? getTimeInNanoseconds() : 0;
       displayFrame(videoBuffer, windowHandle, &bitmapInfo);
+      if (state.stageTimer) {
+        endStage(state.stageTimer);
+        endTimedFrame(state.stageTimer);
+      }
+      if (trace) {
+        addTraceSpan(trace, "present", traceStart);
+      }
 
       LARGE_INTEGER endPerfCount;
       QueryPerformanceCounter(&endPerfCount);
@@ -447,6 +818,38 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
 
   }
 
+  if (state.batteryRam) {
+    destroyBatteryRam(state.batteryRam, &memory[PRG_RAM_START]);
+  }
+
+  if (state.stageTimer) {
+    freeStageTimer(state.stageTimer);
+  }
+  if (rewindBuffer) {
+    freeRewindBuffer(rewindBuffer);
+  }
+  if (runAheadFork) {
+    freeEmulatorFork(runAheadFork);
+  }
+  if (movie) {
+    if (recordingMovie) {
+      writeMovie(movie, movieFilename);
+    }
+    freeMovie(movie);
+  }
+  if (audioBuffer) {
+    stopSound(&sound);
+    freeAudioBuffer(audioBuffer);
+  }
+  if (sound.buffer) {
+    IDirectSoundBuffer_Stop(sound.buffer);
+  }
+  // every thread that could be adding to it has stopped by now
+  if (tracer && destroyTracer(tracer)) {
+    print("Could not write %s\n", traceFilename);
+  }
+  free(soundSamples);
+  free(savedState);
   free(videoBuffer);
   free(memory);
   free(ppu->memory);